@@ -0,0 +1,33 @@
+#ifndef VT_AFFINITY_H_INCLUDED
+#define VT_AFFINITY_H_INCLUDED 1
+
+/* system includes */
+#include <pthread.h>
+
+/* valiant includes */
+#include "error.h"
+
+/* Set of processors a thread may run on. Kept apart from cpu_set_t so that
+   users need not define _GNU_SOURCE. An empty set means no placement policy,
+   threads run wherever the scheduler puts them. Sets of NUMA node ids share
+   the type, they are listed in the same format. */
+
+#define VT_AFFINITY_MAX_CPUS (1024)
+#define VT_AFFINITY_BITS (8 * sizeof (unsigned long))
+
+typedef struct _vt_affinity vt_affinity_t;
+
+struct _vt_affinity {
+  unsigned long mask[VT_AFFINITY_MAX_CPUS / VT_AFFINITY_BITS];
+};
+
+int vt_affinity_parse (vt_affinity_t *, const char *, vt_error_t *);
+int vt_affinity_node (vt_affinity_t *, int);
+int vt_affinity_nodes (vt_affinity_t *);
+int vt_affinity_count (const vt_affinity_t *);
+int vt_affinity_nth (const vt_affinity_t *, int);
+void vt_affinity_intersect (vt_affinity_t *, const vt_affinity_t *);
+int vt_affinity_attr (pthread_attr_t *, const vt_affinity_t *, int);
+int vt_affinity_bind (const vt_affinity_t *);
+
+#endif
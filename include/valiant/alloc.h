@@ -0,0 +1,22 @@
+#ifndef VT_ALLOC_H_INCLUDED
+#define VT_ALLOC_H_INCLUDED 1
+
+/* system includes */
+#include <stddef.h>
+
+/* Objects on the request path are recycled rather than freed, memory that
+   must still be allocated there is allocated through these wrappers so that
+   allocations can be counted. A request evaluated on a recycled connection
+   must not change the count.
+
+   NOTE: Only calls through these wrappers are counted. Plain malloc and
+         friends, strdup and memory allocated by libraries, e.g. pcre_compile
+         or getaddrinfo, are not. */
+
+void *vt_malloc (size_t);
+void *vt_calloc (size_t, size_t);
+void *vt_realloc (void *, size_t);
+void *vt_memalign (size_t, size_t);
+unsigned long vt_alloc_count (void);
+
+#endif
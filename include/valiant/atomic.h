@@ -0,0 +1,30 @@
+#ifndef VT_ATOMIC_H_INCLUDED
+#define VT_ATOMIC_H_INCLUDED 1
+
+/* system includes */
+#include <linux/futex.h>
+#include <sched.h>
+#include <time.h>
+
+/* Loads and stores of words shared between threads. Loads acquire and stores
+   release, whatever a thread wrote before it stored a value is visible to
+   threads that load that value. Unlike __sync_fetch_and_add (p, 0), a load
+   does not take the cache line exclusively. Neither orders a store before a
+   later load, threads that publish work and then check for sleepers issue a
+   full fence in between. */
+#define vt_atomic_load(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define vt_atomic_store(p,v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define vt_atomic_fence() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+/* Issued on every iteration of a spin loop. Tells the core to back off so
+   that the thread holding the word is not slowed down, or gives up the
+   processor where there is no such instruction. */
+#if defined(__i386__) || defined(__x86_64__)
+#define vt_atomic_pause() __builtin_ia32_pause ()
+#else
+#define vt_atomic_pause() (void)sched_yield ()
+#endif
+
+int vt_futex (int *, int, int, const struct timespec *);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef VT_BITSET_H_INCLUDED
+#define VT_BITSET_H_INCLUDED 1
+
+/* system includes */
+#include <limits.h>
+
+/* Sets of small integers, e.g. dict positions, stored one bit per member in
+   an array of words. Sets are allocated by the caller with room for
+   VT_BITSET_WORDS(n) words. */
+typedef unsigned long vt_bitset_t;
+
+#define VT_BITSET_BITS (sizeof (vt_bitset_t) * CHAR_BIT)
+#define VT_BITSET_WORDS(n) (((n) + VT_BITSET_BITS - 1) / VT_BITSET_BITS)
+
+#define vt_bitset_set(set,pos) \
+  ((set)[(pos) / VT_BITSET_BITS] |= (1UL << ((pos) % VT_BITSET_BITS)))
+#define vt_bitset_clear(set,pos) \
+  ((set)[(pos) / VT_BITSET_BITS] &= ~(1UL << ((pos) % VT_BITSET_BITS)))
+#define vt_bitset_isset(set,pos) \
+  (((set)[(pos) / VT_BITSET_BITS] >> ((pos) % VT_BITSET_BITS)) & 1UL)
+
+#endif
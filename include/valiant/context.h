@@ -1,9 +1,18 @@
 #ifndef VT_CONTEXT_H_INCLUDED
 #define VT_CONTEXT_H_INCLUDED 1
 
+/* system includes */
+#include <pthread.h>
+
 /* valiant includes */
+#include "affinity.h"
+#include "bitset.h"
 #include "dict.h"
+#include "dns_cache.h"
+#include "executor.h"
+#include "resolver.h"
 #include "slist.h"
+#include "timer.h"
 
 typedef struct _vt_check vt_check_t;
 
@@ -18,10 +27,25 @@ typedef struct _vt_stage vt_stage_t;
 struct _vt_stage {
   vt_check_t **checks;
   int nchecks;
+  int *order; /* check numbers, most decisive per unit of cost first */
   int *depends;
   int ndepends;
+  int *prefetch; /* dicts stage or its checks depend on, without duplicates,
+                    looked up with the last wave of the previous stage */
+  int nprefetch;
   float max_diff; /* maximum weight gained by evaluating */
   float min_diff; /* minimum weight gained by evaluating */
+  float max_left; /* maximum weight gained by this and later stages */
+  float min_left; /* minimum weight gained by this and later stages */
+};
+
+/* Responses are precomputed including the protocol terminator so that every
+   reply is sent with a single system call. */
+typedef struct _vt_response vt_response_t;
+
+struct _vt_response {
+  char *str; /* action=...\n\n */
+  size_t len;
 };
 
 typedef struct _vt_context vt_context_t;
@@ -35,24 +59,54 @@ struct _vt_context {
   char *syslog_ident;
   int syslog_facility;
   int syslog_prio;
-  char *allow_resp;
+  vt_response_t allow_resp;
   int block_threshold;
-  char *block_resp;
+  vt_response_t block_resp;
   int delay_threshold;
-  char *delay_resp;
-  char *error_resp;
+  vt_response_t delay_resp;
+  vt_response_t error_resp;
+  vt_response_t overload_resp; /* sent without evaluating if overloaded */
+  int reuse_conns; /* keep reading requests until EOF or client_timeout */
+  int client_timeout; /* seconds a connection may be idle */
+  int listeners; /* number of SO_REUSEPORT listeners, one event loop each */
+  int listen_backlog;
+  int max_queue_delay; /* milliseconds a request may be queued */
+  int min_threads; /* threads created up front */
   int max_threads;
   int max_idle_threads;
   int max_tasks;
+  int idle_timeout; /* milliseconds before idle threads terminate */
+  int target_queue_delay; /* milliseconds, grow pool if exceeded */
+  int work_stealing; /* workers have queues of their own, idle ones steal */
+  vt_affinity_t cpus; /* processors worker threads are placed on */
+  int numa; /* keep every listener and its workers on a single node */
+  int lookup_threads; /* threads shared by asynchronous dicts */
+  int lookup_min_threads;
+  vt_affinity_t lookup_cpus; /* processors lookup threads are placed on */
+  int request_timeout; /* milliseconds lookups of a request may take */
+  int lookup_timeout; /* milliseconds a single lookup may take by default */
+  float lookup_timeout_weight;
+  int lookup_wave; /* lookups dispatched at once per stage, zero for all */
+  int speculate; /* remote lookups started as soon as a request is parsed */
+
+  vt_executor_t *executor; /* runs lookups of asynchronous dicts */
+  vt_timer_t *timer; /* expires lookups that miss their deadline */
+  vt_resolver_t *resolver; /* sends DNS queries of dnsbl and rhsbl dicts */
 
   vt_dict_t **dicts;
   int ndicts;
 
   vt_stage_t **stages;
   int nstages;
+  int max_checks; /* number of checks in largest stage */
+  pthread_rwlock_t order_lock; /* protects order of checks in stages */
+  unsigned long generation; /* unique per context, addresses are reused */
 };
 
-vt_context_t *vt_context_create (vt_dict_type_t **, cfg_t *, vt_error_t *);
+vt_context_t *vt_context_create (vt_dict_type_t **, cfg_t *,
+  vt_dns_cache_t *, vt_error_t *);
 int vt_context_destroy (vt_context_t *, vt_error_t *);
+void vt_context_order (vt_context_t *, vt_stage_t *, int *);
+int vt_context_reorder (vt_context_t *);
 
 #endif
@@ -6,22 +6,56 @@
 
 /* valiant includes */
 #include "error.h"
+#include "executor.h"
 #include "request.h"
+#include "resolver.h"
 #include "result.h"
 
+#define VT_DICT_MAX_KEY (512) /* including terminating null */
+#define VT_DICT_METERS (64) /* threads that measure without sharing */
+#define VT_DICT_CACHE_LINE (64)
+
+/* Lookups are measured by the thread that did them in a meter of its own,
+   so that threads evaluating the same dict do not write to the same cache
+   line. Meters are shared if there are more threads than meters, in which
+   case concurrent updates may be lost. */
+typedef struct _vt_dict_meter vt_dict_meter_t;
+
+struct _vt_dict_meter {
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long weight; /* absolute points gained, in thousandths */
+  long latency; /* moving average, microseconds times 8 */
+} __attribute__ ((aligned (VT_DICT_CACHE_LINE)));
+
 typedef struct _vt_dict vt_dict_t;
 
 typedef int(*VT_DICT_CHECK_FUNC)(vt_dict_t *, vt_request_t *, vt_result_t *,
   int, vt_error_t *);
+typedef int(*VT_DICT_KEY_FUNC)(vt_dict_t *, vt_request_t *, char *, size_t);
 typedef int(*VT_DICT_DESTROY_FUNC)(vt_dict_t *, vt_error_t *);
 
 struct _vt_dict {
   char *name;
   int async;
+  int nonblocking; /* check_func returns before lookup completes, lookups
+                      are not handed to the executor */
   void *data;
+  vt_resolver_t *resolver; /* shared by dicts that look up DNS records */
   float max_diff; /* maximum weight gained by evaluating */
   float min_diff; /* minimum weight gained by evaluating */
+  int timeout; /* milliseconds a lookup may take, zero for no limit */
+  float timeout_weight; /* weight of lookups that miss their deadline */
+  vt_dict_meter_t *meters; /* VT_DICT_METERS meters */
+  /* meters folded by the stats thread, used to order checks */
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long weight; /* absolute points gained, in thousandths */
+  long latency; /* moving average, microseconds times 8 */
   VT_DICT_CHECK_FUNC check_func;
+  VT_DICT_KEY_FUNC key_func; /* optional, writes what the lookup for a
+                                request depends on, so that identical
+                                lookups in flight are done only once */
   VT_DICT_DESTROY_FUNC destroy_func;
 };
 
@@ -39,7 +73,10 @@ struct _vt_dict_type {
 #define vt_dict_check(dict,req,res,pos,err) \
   ((dict)->check_func ((dict),(req),(res),(pos),(err)))
 
-vt_dict_t *vt_dict_create (vt_dict_type_t *, cfg_t *, cfg_t *, vt_error_t *);
+vt_dict_t *vt_dict_create (vt_dict_type_t *, cfg_t *, cfg_t *,
+  vt_executor_t *, vt_resolver_t *, vt_error_t *);
+void vt_dict_measure (vt_dict_t *, long, float);
+void vt_dict_fold (vt_dict_t *);
 int vt_dict_dynamic_pattern (const char *);
 char *vt_dict_unescape_pattern (const char *);
 
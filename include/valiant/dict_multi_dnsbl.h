@@ -0,0 +1,9 @@
+#ifndef VT_DICT_MULTI_DNSBL_H_INCLUDED
+#define VT_DICT_MULTI_DNSBL_H_INCLUDED 1
+
+/* valiant includes */
+#include "dict.h"
+
+vt_dict_type_t *vt_dict_multi_dnsbl_type (void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef VT_DNS_CACHE_H_INCLUDED
+#define VT_DNS_CACHE_H_INCLUDED 1
+
+/* system includes */
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
+
+/* valiant includes */
+#include "error.h"
+#include "resolver.h"
+
+/* Answers of the stub resolver are cached process-wide, the cache is created
+   once and outlives contexts so that it survives reloads. Entries are keyed
+   by name and type and expire with the TTL of the answer. Names that do not
+   exist, or have no records of the queried type, are cached for as long as
+   the SOA record in the reply allows (RFC 2308). The cache is split into
+   shards that are locked independently. Every shard gets an equal part of
+   the memory budget and evicts entries with the CLOCK algorithm, entries
+   that were used since the hand last passed get a second chance. */
+
+#define VT_DNS_CACHE_SHARDS (16)
+
+typedef struct _vt_dns_cache_entry vt_dns_cache_entry_t;
+
+struct _vt_dns_cache_entry {
+  unsigned long hash;
+  long expires; /* monotonic milliseconds */
+  int used; /* looked up since hand last passed */
+  vt_resolver_type_t type;
+  vt_resolver_status_t status;
+  int naddrs;
+  struct in_addr *addrs;
+  char *txt;
+  size_t size; /* bytes accounted to entry */
+  vt_dns_cache_entry_t *chain; /* next entry in hash bucket */
+  vt_dns_cache_entry_t *prev; /* clock ring */
+  vt_dns_cache_entry_t *next;
+  char name[]; /* lower case */
+};
+
+typedef struct _vt_dns_cache_shard vt_dns_cache_shard_t;
+
+struct _vt_dns_cache_shard {
+  vt_dns_cache_entry_t **buckets;
+  unsigned int mask; /* number of buckets minus one */
+  unsigned int nentries;
+  size_t size; /* bytes used */
+  vt_dns_cache_entry_t *hand; /* clock hand, NULL if shard is empty */
+  unsigned long hits;
+  unsigned long misses;
+  pthread_mutex_t lock;
+} __attribute__ ((aligned (64)));
+
+typedef struct _vt_dns_cache vt_dns_cache_t;
+
+struct _vt_dns_cache {
+  size_t max_size; /* bytes per shard */
+  vt_dns_cache_shard_t shards[VT_DNS_CACHE_SHARDS];
+};
+
+vt_dns_cache_t *vt_dns_cache_create (size_t, vt_error_t *);
+int vt_dns_cache_destroy (vt_dns_cache_t *, vt_error_t *);
+void vt_dns_cache_set_size (vt_dns_cache_t *, size_t);
+int vt_dns_cache_lookup (vt_dns_cache_t *, vt_resolver_query_t *);
+void vt_dns_cache_store (vt_dns_cache_t *, const vt_resolver_query_t *);
+void vt_dns_cache_stats (vt_dns_cache_t *, unsigned long *, unsigned long *,
+  unsigned long *, size_t *);
+
+#endif
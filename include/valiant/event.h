@@ -0,0 +1,79 @@
+#ifndef VT_EVENT_H_INCLUDED
+#define VT_EVENT_H_INCLUDED 1
+
+/* system includes */
+#include <pthread.h>
+#include <time.h>
+
+/* valiant includes */
+#include "affinity.h"
+#include "error.h"
+#include "thread_pool.h"
+
+/* The event loop owns the listening socket and every client connection. It
+   accepts connections and reads request bytes without blocking, and only hands
+   a connection to the worker pool once a complete request is buffered. Slow or
+   idle clients therefore never occupy a worker thread. */
+
+typedef enum _vt_conn_state vt_conn_state_t;
+
+enum _vt_conn_state {
+  VT_CONN_STATE_READ, /* owned by event loop, waiting for request bytes */
+  VT_CONN_STATE_BUSY /* owned by worker, request is being evaluated */
+};
+
+typedef struct _vt_event vt_event_t;
+typedef struct _vt_conn vt_conn_t;
+
+typedef void(*VT_CONN_DATA_FREE_FUNC)(void *);
+
+struct _vt_conn {
+  int fd;
+  vt_conn_state_t state;
+  time_t atime; /* time of last activity */
+  char *buf;
+  size_t len; /* number of bytes in buffer */
+  size_t size; /* number of bytes allocated */
+  size_t scan; /* offset to continue scanning for end of request */
+  size_t end; /* length of complete request, zero if incomplete */
+  vt_event_t *event;
+  vt_thread_pool_t *pool; /* pool connection was last dispatched to */
+  void *data; /* owned by worker, kept while connection is spare */
+  VT_CONN_DATA_FREE_FUNC data_free;
+  vt_conn_t *prev;
+  vt_conn_t *next;
+};
+
+struct _vt_event {
+  int sock; /* listening socket */
+  int epfd;
+  int reuse_conns;
+  int timeout; /* seconds a connection may be idle */
+  time_t sweep; /* time idle connections were last closed */
+  int dead; /* set to stop event loop thread */
+  int running; /* event loop runs in its own thread */
+  pthread_t thread;
+  vt_affinity_t cpus; /* processors event loop thread is placed on */
+  vt_thread_pool_t *pool;
+  const char *overload_resp; /* sent if pool refuses request */
+  size_t overload_len;
+  pthread_rwlock_t pool_lock; /* protects pool and overload_resp */
+  vt_conn_t *conns;
+  unsigned int nconns;
+  vt_conn_t *spare; /* closed connections kept for reuse */
+  unsigned int nspare;
+  pthread_mutex_t lock; /* protects conns, spare and their counts */
+};
+
+vt_event_t *vt_event_create (int, vt_thread_pool_t *, vt_error_t *);
+int vt_event_destroy (vt_event_t *, vt_error_t *);
+void vt_event_set_pool (vt_event_t *, vt_thread_pool_t *);
+void vt_event_set_timeout (vt_event_t *, int, int);
+void vt_event_set_overload (vt_event_t *, const char *, size_t);
+void vt_event_set_affinity (vt_event_t *, const vt_affinity_t *);
+int vt_event_loop (vt_event_t *, int);
+int vt_event_start (vt_event_t *, int, vt_error_t *);
+int vt_event_stop (vt_event_t *, vt_error_t *);
+int vt_event_done (vt_conn_t *, int);
+
+#endif
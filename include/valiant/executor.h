@@ -0,0 +1,57 @@
+#ifndef VT_EXECUTOR_H_INCLUDED
+#define VT_EXECUTOR_H_INCLUDED 1
+
+/* system includes */
+#include <pthread.h>
+
+/* valiant includes */
+#include "error.h"
+#include "thread_pool.h"
+
+/* The executor runs asynchronous lookups for every dict on a single thread
+   pool, so that the number of threads does not grow with the number of
+   dicts. Every dict submits work to a lane of its own. A lane has a quota,
+   the maximum number of its tasks that run at the same time, and a bounded
+   queue. Lanes take turns, a lane runs one task and then goes to the back of
+   the line, so a slow dict cannot starve the others. */
+
+typedef struct _vt_executor_task vt_executor_task_t;
+
+/* Tasks are embedded in the structure describing the work, so that
+   submitting work does not allocate memory. */
+struct _vt_executor_task {
+  vt_executor_task_t *next;
+};
+
+typedef void(*VT_EXECUTOR_FUNC)(vt_executor_task_t *, void *);
+
+typedef struct _vt_executor vt_executor_t;
+
+struct _vt_executor {
+  vt_thread_pool_t *pool;
+};
+
+typedef struct _vt_executor_lane vt_executor_lane_t;
+
+struct _vt_executor_lane {
+  vt_executor_t *executor;
+  VT_EXECUTOR_FUNC function; /* function to execute for every task */
+  void *user_data;
+  int max_running; /* quota, zero means no quota */
+  int running; /* number of turns handed to pool */
+  int max_queued;
+  int queued;
+  vt_executor_task_t *first_task;
+  vt_executor_task_t *last_task;
+  pthread_mutex_t lock;
+};
+
+vt_executor_t *vt_executor_create (unsigned int, vt_error_t *);
+int vt_executor_destroy (vt_executor_t *, vt_error_t *);
+vt_executor_lane_t *vt_executor_lane_create (vt_executor_t *,
+  VT_EXECUTOR_FUNC, void *, unsigned int, unsigned int, vt_error_t *);
+int vt_executor_lane_destroy (vt_executor_lane_t *, vt_error_t *);
+int vt_executor_submit (vt_executor_lane_t *, vt_executor_task_t *,
+  vt_error_t *);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef VT_FLIGHT_H_INCLUDED
+#define VT_FLIGHT_H_INCLUDED 1
+
+/* system includes */
+#include <stddef.h>
+
+/* valiant includes */
+#include "error.h"
+
+/* Lookups that are in flight, keyed by a tag and a string, so that identical
+   lookups issued concurrently are done only once. The first caller leads the
+   lookup, callers that join while it is in flight follow and are handed the
+   answer of the leader once it completes. Nodes are embedded in the structure
+   describing the lookup and the key is not copied, both must stay intact
+   until the leader leaves. Tables are not locked, callers serialize access. */
+
+#define VT_FLIGHT_FLAG_NOCASE (1<<0) /* keys are compared case insensitive */
+
+typedef struct _vt_flight_node vt_flight_node_t;
+
+struct _vt_flight_node {
+  unsigned long hash;
+  unsigned int tag;
+  const char *key;
+  vt_flight_node_t *chain; /* next leader in bucket */
+  vt_flight_node_t *followers; /* most recent first, leaders only */
+  vt_flight_node_t *next; /* next follower */
+};
+
+typedef struct _vt_flight vt_flight_t;
+
+struct _vt_flight {
+  vt_flight_node_t **buckets;
+  unsigned int mask; /* number of buckets minus one */
+  int flags;
+  unsigned long leaders; /* lookups done */
+  unsigned long followers; /* lookups saved */
+};
+
+int vt_flight_init (vt_flight_t *, unsigned int, int, vt_error_t *);
+void vt_flight_deinit (vt_flight_t *);
+int vt_flight_join (vt_flight_t *, unsigned int, const char *,
+  vt_flight_node_t *);
+void vt_flight_leave (vt_flight_t *, vt_flight_node_t *);
+
+#define vt_flight_entry(node,type,member) \
+  ((type *)((char *)(node) - offsetof (type, member)))
+
+#endif
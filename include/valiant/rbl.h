@@ -4,30 +4,47 @@
 /* system includes */
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <spf2/spf.h>
-#include <spf2/spf_dns.h>
 #include <time.h>
 
 /* valiant includes */
+#include "bitset.h"
 #include "dict.h"
-#include "slist.h"
+#include "resolver.h"
 #include "state.h"
 #include "thread_pool.h"
 
+#define VT_RBL_CODES (256) /* return codes in 127.0.0.0/24 */
+
+typedef struct _vt_rbl_prefix vt_rbl_prefix_t;
+
+struct _vt_rbl_prefix {
+  unsigned long network;
+  unsigned long netmask;
+  float weight;
+};
+
+/* Weights are compiled when the blacklist is created. Answers in
+   127.0.0.0/24, which is what blacklists return, are decoded by indexing a
+   table with the last octet. Other answers are matched against the configured
+   networks, heaviest first. Zones that encode lists in the bits of the last
+   octet, like SURBL, have their bits weighed and added up in the table. */
 typedef struct _vt_rbl vt_rbl_t;
 
 struct _vt_rbl {
-  SPF_server_t *spf_server;
   char *zone;
   vt_state_t back_off;
-  vt_slist_t *weights;
+  vt_bitset_t listed[VT_BITSET_WORDS (VT_RBL_CODES)]; /* codes that match */
+  float codes[VT_RBL_CODES];
+  vt_rbl_prefix_t *prefixes; /* ordered by weight, heaviest first */
+  int nprefixes;
 };
 
-vt_rbl_t *vt_rbl_create (cfg_t *sec, vt_error_t *);
+vt_rbl_t *vt_rbl_create (cfg_t *, const char *, vt_error_t *);
 int vt_rbl_destroy (vt_rbl_t *, vt_error_t *);
 int vt_rbl_check (vt_dict_t *, const char *, vt_result_t *, int, vt_error_t *);
+float vt_rbl_points (vt_rbl_t *, const vt_resolver_query_t *);
 //int vt_rbl_skip (vt_rbl_t *);
-int vt_rbl_max_weight (vt_rbl_t *);
-int vt_rbl_min_weight (vt_rbl_t *);
+float vt_rbl_max_weight (vt_rbl_t *);
+float vt_rbl_min_weight (vt_rbl_t *);
 
 #endif
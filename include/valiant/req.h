@@ -1,10 +1,15 @@
 #ifndef VT_REQUEST_H_INCLUDED
 #define VT_REQUEST_H_INCLUDED 1
 
+/* system includes */
+#include <stddef.h>
+
 /* valiant includes */
-#include "buf.h"
 #include "error.h"
 
+/* Every attribute Postfix sends with a policy delegation request, see
+   SMTPD_POLICY_README, and the domains derived from sender and recipient.
+   Every member must have a name in req.c. */
 typedef enum _vt_request_member vt_request_member_t;
 
 enum _vt_request_member {
@@ -16,28 +21,58 @@ enum _vt_request_member {
   VT_REQUEST_MEMBER_RECIPIENT_DOMAIN,
   VT_REQUEST_MEMBER_CLIENT_ADDRESS,
   VT_REQUEST_MEMBER_CLIENT_NAME,
-  VT_REQUEST_MEMBER_REV_CLIENT_NAME
+  VT_REQUEST_MEMBER_REV_CLIENT_NAME,
+  VT_REQUEST_MEMBER_REQUEST,
+  VT_REQUEST_MEMBER_PROTOCOL_STATE,
+  VT_REQUEST_MEMBER_PROTOCOL_NAME,
+  VT_REQUEST_MEMBER_QUEUE_ID,
+  VT_REQUEST_MEMBER_RECIPIENT_COUNT,
+  VT_REQUEST_MEMBER_CLIENT_PORT,
+  VT_REQUEST_MEMBER_INSTANCE,
+  VT_REQUEST_MEMBER_SASL_METHOD,
+  VT_REQUEST_MEMBER_SASL_USERNAME,
+  VT_REQUEST_MEMBER_SASL_SENDER,
+  VT_REQUEST_MEMBER_SIZE,
+  VT_REQUEST_MEMBER_CCERT_SUBJECT,
+  VT_REQUEST_MEMBER_CCERT_ISSUER,
+  VT_REQUEST_MEMBER_CCERT_FINGERPRINT,
+  VT_REQUEST_MEMBER_CCERT_PUBKEY_FINGERPRINT,
+  VT_REQUEST_MEMBER_ENCRYPTION_PROTOCOL,
+  VT_REQUEST_MEMBER_ENCRYPTION_CIPHER,
+  VT_REQUEST_MEMBER_ENCRYPTION_KEYSIZE,
+  VT_REQUEST_MEMBER_ETRN_DOMAIN,
+  VT_REQUEST_MEMBER_STRESS,
+  VT_REQUEST_MEMBER_POLICY_CONTEXT,
+  VT_REQUEST_MEMBER_SERVER_ADDRESS,
+  VT_REQUEST_MEMBER_SERVER_PORT,
+  VT_REQUEST_MEMBER_COMPATIBILITY_LEVEL,
+  VT_REQUEST_MEMBER_MAIL_VERSION,
+  VT_REQUEST_MEMBERS /* number of members, must be last */
+};
+
+/* Attribute values are not copied. The request records where every value is
+   located in the connection buffer and values are terminated in place, so the
+   buffer must not be modified until the request is reset. */
+typedef struct _vt_request_slice vt_request_slice_t;
+
+struct _vt_request_slice {
+  size_t off; /* offset of value in buffer */
+  size_t len; /* length of value, zero if not present */
 };
 
-/* By using vt_buf_t buffers instead of char pointers we hopefully cut down the
-   number of mallocs significantly. */
 typedef struct _vt_request vt_request_t;
 
 struct _vt_request {
-  vt_buf_t helo_name;
-  vt_buf_t sender;
-  vt_buf_t sender_domain;
-  vt_buf_t recipient;
-  vt_buf_t recipient_domain;
-  vt_buf_t client_address;
-  vt_buf_t client_name;
-  vt_buf_t rev_client_name;
+  char *buf;
+  vt_request_slice_t mbrs[VT_REQUEST_MEMBERS];
 };
 
 vt_request_t *vt_request_create (vt_error_t *);
 void vt_request_destroy (vt_request_t *);
-vt_request_t *vt_request_parse (vt_request_t *, int, vt_error_t *);
+void vt_request_reset (vt_request_t *);
+vt_request_t *vt_request_parse (vt_request_t *, char *, size_t, vt_error_t *);
 vt_request_member_t vt_request_mbrtoid (const char *);
+vt_request_member_t vt_request_mbrtoidn (const char *, size_t);
 char *vt_request_mbrbyid (const vt_request_t *, vt_request_member_t);
 char *vt_request_mbrbyname (const vt_request_t *, const char *);
 char *vt_request_mbrbynamen (const vt_request_t *, const char *, size_t);
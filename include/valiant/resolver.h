@@ -0,0 +1,110 @@
+#ifndef VT_RESOLVER_H_INCLUDED
+#define VT_RESOLVER_H_INCLUDED 1
+
+/* system includes */
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* valiant includes */
+#include "error.h"
+#include "flight.h"
+
+/* Stub resolver that multiplexes queries over a few UDP sockets per
+   nameserver. A single thread waits for replies and retransmits queries that
+   are not answered in time, completion is reported through a callback that
+   runs on that thread, or on the thread that submitted the query if the
+   answer was cached. Queries are embedded in the structure describing the
+   lookup, so that an outstanding query costs no more than its own size.
+   Queries for a name and type that is being resolved already are not sent,
+   they are completed with the answer to the query that is outstanding. */
+
+#define VT_RESOLVER_MAX_NAME (256) /* including terminating null */
+#define VT_RESOLVER_MAX_ADDRS (16)
+#define VT_RESOLVER_MAX_TXT (512)
+#define VT_RESOLVER_MAX_SERVERS (8)
+
+typedef enum _vt_resolver_type vt_resolver_type_t;
+
+enum _vt_resolver_type {
+  VT_RESOLVER_TYPE_A = 1,
+  VT_RESOLVER_TYPE_TXT = 16
+};
+
+typedef enum _vt_resolver_status vt_resolver_status_t;
+
+enum _vt_resolver_status {
+  VT_RESOLVER_SUCCESS = 0, /* name exists, answers may be empty */
+  VT_RESOLVER_NXDOMAIN, /* name does not exist */
+  VT_RESOLVER_SERVFAIL, /* nameservers failed or sent garbage */
+  VT_RESOLVER_TIMEOUT, /* no reply after every attempt */
+  VT_RESOLVER_CANCELLED /* resolver was destroyed */
+};
+
+typedef struct _vt_resolver vt_resolver_t;
+typedef struct _vt_resolver_query vt_resolver_query_t;
+
+typedef void(*VT_RESOLVER_FUNC)(vt_resolver_query_t *, void *);
+
+struct _vt_resolver_query {
+  /* filled in by caller */
+  char name[VT_RESOLVER_MAX_NAME];
+  vt_resolver_type_t type;
+  VT_RESOLVER_FUNC func;
+  void *arg;
+  /* filled in by resolver once completed */
+  vt_resolver_status_t status;
+  struct in_addr addrs[VT_RESOLVER_MAX_ADDRS];
+  int naddrs;
+  char txt[VT_RESOLVER_MAX_TXT]; /* character strings of first record */
+  unsigned int ttl; /* seconds answers may be cached */
+  /* private */
+  unsigned short id;
+  int server; /* nameserver current attempt was sent to */
+  int attempt;
+  long deadline; /* monotonic milliseconds current attempt times out */
+  vt_flight_node_t flight; /* identical queries wait for this one, or the
+                              other way around */
+  vt_resolver_query_t *prev;
+  vt_resolver_query_t *next;
+};
+
+typedef struct _vt_resolver_server vt_resolver_server_t;
+
+struct _vt_resolver_server {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int *socks; /* connected to nameserver, replies from others are dropped */
+};
+
+struct _vt_resolver {
+  int dead;
+  int running;
+  pthread_t thread;
+  int epfd;
+  int wakefd; /* eventfd, written if loop must recompute its timeout */
+  vt_resolver_server_t servers[VT_RESOLVER_MAX_SERVERS];
+  int nservers;
+  int nsocks; /* sockets per nameserver */
+  unsigned int next; /* round-robin position */
+  int timeout; /* milliseconds an attempt may take */
+  int attempts;
+  struct _vt_dns_cache *cache; /* answers shared by all resolvers, optional */
+  /* outstanding queries are hashed by id, open addressing */
+  vt_resolver_query_t **table;
+  unsigned int mask; /* number of buckets minus one */
+  unsigned int nqueries;
+  unsigned int max_queries;
+  unsigned long seed; /* query ids are random */
+  vt_resolver_query_t *first; /* outstanding queries ordered by deadline */
+  vt_resolver_query_t *last;
+  vt_flight_t flights; /* outstanding queries by name and type */
+  pthread_mutex_t lock; /* protects table, flights, list and seed */
+};
+
+vt_resolver_t *vt_resolver_create (const char **, int, int, int, int,
+  unsigned int, struct _vt_dns_cache *, vt_error_t *);
+int vt_resolver_destroy (vt_resolver_t *, vt_error_t *);
+int vt_resolver_submit (vt_resolver_t *, vt_resolver_query_t *, vt_error_t *);
+
+#endif
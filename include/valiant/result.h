@@ -7,29 +7,71 @@
 /* valiant includes */
 #include "error.h"
 
+#define VT_RESULT_CACHE_LINE (64)
+
+typedef enum _vt_dict_result_state vt_dict_result_state_t;
+
+enum _vt_dict_result_state {
+  VT_DICT_RESULT_EMPTY = 0,
+  VT_DICT_RESULT_PENDING, /* lookup was dispatched */
+  VT_DICT_RESULT_SPECULATIVE, /* lookup was dispatched, nobody waits for it */
+  VT_DICT_RESULT_BUSY, /* points are being written */
+  VT_DICT_RESULT_READY, /* points are published */
+  VT_DICT_RESULT_TIMEOUT /* lookup missed its deadline, fallback is used */
+};
+
+/* Every slot occupies a cache line of its own so that lookups completing
+   concurrently do not contend for the same line. Points are written before
+   the state is set to ready, readers must check the state first. A lookup
+   and the timer race to resolve a pending slot, whoever moves it to busy
+   first writes the points. Speculative slots do not count as pending until
+   they are claimed. */
 typedef struct _vt_dict_result vt_dict_result_t;
 
 struct _vt_dict_result {
-  int ready;
+  int state;
   float points;
-};
+  void *data; /* scratch memory of dict, reused for every request */
+  long deadline; /* monotonic milliseconds, zero if lookup may take forever */
+  float fallback; /* points used if deadline passes */
+} __attribute__ ((aligned (VT_RESULT_CACHE_LINE)));
+
+typedef void(*VT_RESULT_NOTIFY_FUNC)(void *);
 
 typedef struct _vt_result vt_result_t;
 
+/* Evaluation is resumed once no slot is pending anymore. Lookups that missed
+   their deadline may still be running however, they hold a reference to the
+   result and the request it was dispatched for until they return. */
 struct _vt_result {
-  vt_dict_result_t **results;
+  vt_dict_result_t *results; /* one slot per dict, cache line aligned */
   unsigned int nresults;
-  unsigned int writers;
-  pthread_mutex_t lock;
-  pthread_cond_t signal;
+  int pending; /* unresolved slots, plus one while dispatching */
+  int refs; /* lookups still running */
+  int draining; /* set while waiting for refs to drop to zero */
+  int futex; /* bumped when last pending slot is resolved */
+  int waiters; /* threads sleeping on futex */
+  VT_RESULT_NOTIFY_FUNC notify_func; /* called once nothing is pending */
+  void *notify_arg;
 };
 
 vt_result_t *vt_result_create (unsigned int, vt_error_t *);
 int vt_result_destroy (vt_result_t *, vt_error_t *);
 void vt_result_lock (vt_result_t *);
-void vt_result_unlock (vt_result_t *);
+int vt_result_unlock (vt_result_t *);
 void vt_result_wait (vt_result_t *);
-void vt_result_update (vt_result_t *, unsigned int, float);
+void vt_result_hold (vt_result_t *);
+int vt_result_release (vt_result_t *);
+int vt_result_drain (vt_result_t *);
+void vt_result_set_notify (vt_result_t *, VT_RESULT_NOTIFY_FUNC, void *);
+void vt_result_notify (vt_result_t *);
+int vt_result_claim (vt_result_t *, unsigned int, long, float);
+int vt_result_speculate (vt_result_t *, unsigned int, long, float);
+int vt_result_ready (vt_result_t *, unsigned int);
+int vt_result_timeout (vt_result_t *, unsigned int);
+float vt_result_points (vt_result_t *, unsigned int);
+int vt_result_update (vt_result_t *, unsigned int, float);
+long vt_result_expire (vt_result_t *, long);
 void vt_result_reset (vt_result_t *);
 
 #endif
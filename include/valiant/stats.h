@@ -6,7 +6,9 @@
 #include <time.h>
 
 /* valiant includes */
+#include "context.h"
 #include "dict.h"
+#include "dns_cache.h"
 #include "error.h"
 #include "result.h"
 
@@ -16,6 +18,9 @@ struct vt_stats_cntr_struct {
   char *name;
   size_t len;
   unsigned long hits;
+  unsigned long timeouts; /* lookups that missed their deadline */
+  vt_dict_t *dict;
+  unsigned long lookups; /* lookups done by dict at start of interval */
 };
 
 typedef struct vt_stats_struct vt_stats_t;
@@ -27,6 +32,11 @@ struct vt_stats_struct {
   time_t mtime; /* modification time */
   time_t cycle;
   unsigned long nreqs;
+  unsigned long nallocs; /* allocation count at start of interval */
+  vt_context_t *context; /* optional, not owned, checks are reordered */
+  vt_dns_cache_t *dns_cache; /* optional, not owned */
+  unsigned long dns_hits; /* cache counters at start of interval */
+  unsigned long dns_misses;
   vt_stats_cntr_t *cntrs;
   unsigned int ncntrs;
   pthread_mutex_t lock;
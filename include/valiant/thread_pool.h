@@ -2,47 +2,121 @@
 #define VT_THREAD_POOL_H_INCLUDED
 
 /* system includes */
+#include <pthread.h>
+#include <stddef.h>
 #include <time.h>
 
 /* valiant includes */
-#include "slist.h"
+#include "affinity.h"
+#include "error.h"
 
+#define VT_THREAD_POOL_CACHE_LINE (64)
+
+typedef void (*start_routine)(void *, void *);
+typedef struct vt_thread_pool_struct vt_thread_pool_t;
+
+/* Tasks are queued in a bounded ring of slots. Every slot carries a sequence
+   number that tells producers and consumers whose turn it is, so that tasks
+   can be pushed and shifted without a lock (Dmitry Vyukov's bounded MPMC
+   queue). */
+typedef struct vt_thread_pool_slot_struct vt_thread_pool_slot_t;
+
+struct vt_thread_pool_slot_struct {
+  size_t seq;
+  void *arg;
+  struct timespec queued; /* time task was queued, monotonic */
+};
+
+typedef struct vt_thread_pool_ring_struct vt_thread_pool_ring_t;
+
+struct vt_thread_pool_ring_struct {
+  vt_thread_pool_slot_t *slots;
+  size_t mask; /* number of slots minus one */
+  /* producers and consumers update different positions, keep them on
+     separate cache lines to avoid false sharing */
+  char pad1[VT_THREAD_POOL_CACHE_LINE];
+  size_t enqueue_pos;
+  char pad2[VT_THREAD_POOL_CACHE_LINE];
+  size_t dequeue_pos;
+  char pad3[VT_THREAD_POOL_CACHE_LINE];
+};
+
+/* Resumed tasks must never be refused, if the ring is full they're kept in a
+   list protected by the pool lock until there's room. */
 typedef struct vt_thread_pool_task_struct vt_thread_pool_task_t;
 
 struct vt_thread_pool_task_struct {
   void *arg;
+  struct timespec queued; /* time task was queued, monotonic */
   vt_thread_pool_task_t *next;
 };
 
-typedef void (*start_routine)(void *, void *);
-typedef struct vt_thread_pool_struct vt_thread_pool_t;
+typedef struct vt_thread_pool_worker_struct vt_thread_pool_worker_t;
+
+struct vt_thread_pool_worker_struct {
+  vt_thread_pool_t *pool;
+  int num; /* position in pool */
+  int running; /* thread was started */
+  int idle; /* thread sleeps on futex */
+  int futex; /* bumped to wake this worker only */
+  vt_thread_pool_ring_t inbox; /* requests handed out by pushers */
+};
 
 struct vt_thread_pool_struct {
   void *user_data;
   int dead;
+  int min_threads; /* threads kept around even if idle */
   int max_threads;
   int num_threads;
+  int want_threads; /* number of threads controller aims for */
   int max_idle_threads;
   int num_idle_threads;
   int max_tasks;
-  int num_tasks;
+  int num_held; /* tasks put aside that will be resumed */
+  int num_overflow; /* resumed tasks that did not fit in the ring */
+  int max_delay; /* milliseconds a task may wait before pushes are refused */
+  int futex; /* bumped on every push, idle threads sleep on it */
 
-  struct timespec wait;
-  pthread_mutex_t lock;
-  pthread_cond_t signal;
+  struct timespec wait; /* time idle threads wait before terminating */
 
-  vt_slist_t *first_task;
-  vt_slist_t *last_task;
+  /* controller sizes pool so that tasks are not queued longer than
+     target_delay milliseconds on average */
+  int target_delay;
+  long avg_delay; /* moving average of queue delay, milliseconds times 8 */
+  int ctl_running;
+  int ctl_futex;
+  pthread_mutex_t lock; /* protects overflow list and ring size */
+
+  vt_thread_pool_task_t *first_task;
+  vt_thread_pool_task_t *last_task;
+
+  vt_affinity_t cpus; /* processors threads are placed on */
+
+  /* work-stealing mode, every worker has a queue of its own */
+  vt_thread_pool_worker_t *workers;
+  int nworkers;
+  unsigned int next_worker; /* round-robin position */
 
   start_routine function; /* function to execute for every task */
+
+  vt_thread_pool_ring_t ring;
 };
 
 vt_thread_pool_t *vt_thread_pool_create (void *, unsigned int, void *,
   vt_error_t *);
 int vt_thread_pool_destroy (vt_thread_pool_t *, vt_error_t *);
 int vt_thread_pool_push (vt_thread_pool_t *, void *, vt_error_t *);
+void vt_thread_pool_hold (vt_thread_pool_t *);
+void vt_thread_pool_release (vt_thread_pool_t *);
+int vt_thread_pool_resume (vt_thread_pool_t *, void *, vt_error_t *);
 void vt_thread_pool_set_max_threads (vt_thread_pool_t *, unsigned int);
 void vt_thread_pool_set_max_idle_threads (vt_thread_pool_t *, unsigned int);
 void vt_thread_pool_set_max_queued (vt_thread_pool_t *, unsigned int);
+void vt_thread_pool_set_max_delay (vt_thread_pool_t *, unsigned int);
+void vt_thread_pool_set_work_stealing (vt_thread_pool_t *, int);
+void vt_thread_pool_set_idle_timeout (vt_thread_pool_t *, unsigned int);
+void vt_thread_pool_set_min_threads (vt_thread_pool_t *, unsigned int);
+void vt_thread_pool_set_target_delay (vt_thread_pool_t *, unsigned int);
+void vt_thread_pool_set_affinity (vt_thread_pool_t *, const vt_affinity_t *);
 
 #endif
@@ -0,0 +1,64 @@
+#ifndef VT_TIMER_H_INCLUDED
+#define VT_TIMER_H_INCLUDED 1
+
+/* system includes */
+#include <pthread.h>
+
+/* valiant includes */
+#include "error.h"
+
+/* A single thread runs callbacks once their deadline passes. Entries are
+   embedded in the object they belong to, so arming a timer never allocates
+   memory. Deadlines are monotonic milliseconds as returned by vt_timer_now.
+   Entries are hashed on a wheel of slots by deadline, every slot has its own
+   lock so that threads arming and cancelling entries rarely contend and both
+   take constant time. The thread visits a slot every tick, entries fire at
+   most a tick late. Deadlines further away than the wheel spans stay in
+   their slot for another round. */
+
+#define VT_TIMER_TICK (4) /* milliseconds */
+#define VT_TIMER_SLOTS (1024)
+
+typedef void(*VT_TIMER_FUNC)(void *);
+
+typedef struct _vt_timer vt_timer_t;
+typedef struct _vt_timer_slot vt_timer_slot_t;
+typedef struct _vt_timer_entry vt_timer_entry_t;
+
+struct _vt_timer_entry {
+  long when; /* deadline */
+  VT_TIMER_FUNC func;
+  void *arg;
+  vt_timer_slot_t *slot; /* slot entry is queued in, NULL if not armed */
+  vt_timer_t *timer; /* timer entry was last added to */
+  vt_timer_entry_t *prev;
+  vt_timer_entry_t *next;
+};
+
+struct _vt_timer_slot {
+  vt_timer_entry_t *first;
+  pthread_mutex_t lock;
+} __attribute__ ((aligned (64)));
+
+struct _vt_timer {
+  int dead;
+  int running;
+  pthread_t thread;
+  long tick; /* tick whose slot was visited last, later ones are pending */
+  int armed; /* number of entries queued, thread sleeps if there are none */
+  int futex; /* bumped to wake the thread */
+  vt_timer_entry_t *current; /* entry whose callback is running */
+  pthread_mutex_t lock; /* protects waiting for callbacks only */
+  pthread_cond_t done; /* callback returned */
+  vt_timer_slot_t slots[VT_TIMER_SLOTS];
+};
+
+long vt_timer_now (void);
+long vt_timer_usecs (void);
+vt_timer_t *vt_timer_create (vt_error_t *);
+int vt_timer_destroy (vt_timer_t *, vt_error_t *);
+void vt_timer_entry_init (vt_timer_entry_t *, VT_TIMER_FUNC, void *);
+void vt_timer_add (vt_timer_t *, vt_timer_entry_t *, long);
+void vt_timer_cancel (vt_timer_entry_t *);
+
+#endif
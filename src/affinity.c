@@ -0,0 +1,248 @@
+#define _GNU_SOURCE 1
+
+/* system includes */
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* valiant includes */
+#include "affinity.h"
+#include "error.h"
+
+#define VT_AFFINITY_NODE_PATH "/sys/devices/system/node/node%d/cpulist"
+#define VT_AFFINITY_ONLINE_PATH "/sys/devices/system/node/online"
+#define VT_AFFINITY_SET(a,n) \
+  ((a)->mask[(n) / VT_AFFINITY_BITS] |= (1UL << ((n) % VT_AFFINITY_BITS)))
+#define VT_AFFINITY_CLEAR(a,n) \
+  ((a)->mask[(n) / VT_AFFINITY_BITS] &= ~(1UL << ((n) % VT_AFFINITY_BITS)))
+#define VT_AFFINITY_ISSET(a,n) \
+  ((a)->mask[(n) / VT_AFFINITY_BITS] & (1UL << ((n) % VT_AFFINITY_BITS)))
+
+/* prototypes */
+int vt_affinity_read (vt_affinity_t *, const char *);
+int vt_affinity_cpuset (cpu_set_t *, const vt_affinity_t *, int);
+
+/* Parses list of processors in the format used by the kernel, e.g.
+   "0-3,8,10-11". An empty list clears the set. */
+int
+vt_affinity_parse (vt_affinity_t *aff, const char *str, vt_error_t *err)
+{
+  char *end;
+  const char *ptr;
+  long cpu, first, last;
+
+  memset (aff, 0, sizeof (vt_affinity_t));
+
+  if (! str)
+    return 0;
+
+  for (ptr = str; *ptr; ) {
+    while (isspace (*ptr))
+      ptr++;
+    if (! *ptr)
+      break;
+
+    errno = 0;
+    first = last = strtol (ptr, &end, 10);
+    if (end == ptr || errno)
+      goto failure;
+    if (*end == '-') {
+      ptr = end + 1;
+      last = strtol (ptr, &end, 10);
+      if (end == ptr || errno)
+        goto failure;
+    }
+    if (first < 0 || last < first || last >= VT_AFFINITY_MAX_CPUS)
+      goto failure;
+
+    for (cpu = first; cpu <= last; cpu++)
+      VT_AFFINITY_SET (aff, cpu);
+
+    for (ptr = end; isspace (*ptr); ptr++)
+      ;
+    if (*ptr == ',')
+      ptr++;
+    else if (*ptr)
+      goto failure;
+  }
+
+  return 0;
+failure:
+  vt_set_error (err, VT_ERR_BADCFG);
+  vt_error ("%s: invalid list of processors: %s", __func__, str);
+  return -1;
+}
+
+/* reads list in the format of vt_affinity_parse from path */
+int
+vt_affinity_read (vt_affinity_t *aff, const char *path)
+{
+  char buf[1024];
+  FILE *fp;
+
+  if (! (fp = fopen (path, "r")))
+    return -1;
+  if (! fgets (buf, sizeof (buf), fp))
+    buf[0] = '\0';
+  (void)fclose (fp);
+
+  buf[strcspn (buf, "\n")] = '\0';
+  return vt_affinity_parse (aff, buf, NULL);
+}
+
+/* Sets aff to the processors of NUMA node. Returns -1 if there is no such
+   node. */
+int
+vt_affinity_node (vt_affinity_t *aff, int node)
+{
+  char path[64];
+
+  (void)snprintf (path, sizeof (path), VT_AFFINITY_NODE_PATH, node);
+
+  if (vt_affinity_read (aff, path) != 0)
+    return -1;
+  if (! vt_affinity_count (aff))
+    return -1; /* memory only node */
+  return 0;
+}
+
+/* Sets nodes to the ids of the NUMA nodes that have processors, ids need not
+   be contiguous, e.g. "0,2-3". Returns their number, 0 if the system is not
+   NUMA. */
+int
+vt_affinity_nodes (vt_affinity_t *nodes)
+{
+  int node;
+  vt_affinity_t aff;
+
+  if (vt_affinity_read (nodes, VT_AFFINITY_ONLINE_PATH) != 0) {
+    memset (nodes, 0, sizeof (vt_affinity_t));
+    return 0;
+  }
+
+  for (node = 0; node < VT_AFFINITY_MAX_CPUS; node++) {
+    if (VT_AFFINITY_ISSET (nodes, node) && vt_affinity_node (&aff, node) != 0)
+      VT_AFFINITY_CLEAR (nodes, node);
+  }
+
+  return vt_affinity_count (nodes);
+}
+
+int
+vt_affinity_count (const vt_affinity_t *aff)
+{
+  int cnt, i;
+
+  for (cnt = 0, i = 0; i < VT_AFFINITY_MAX_CPUS; i++) {
+    if (VT_AFFINITY_ISSET (aff, i))
+      cnt++;
+  }
+
+  return cnt;
+}
+
+/* Returns nth processor in set, n wraps around. Returns -1 if set is
+   empty. */
+int
+vt_affinity_nth (const vt_affinity_t *aff, int n)
+{
+  int cnt, i;
+
+  if (! (cnt = vt_affinity_count (aff)))
+    return -1;
+
+  n %= cnt;
+  for (i = 0; i < VT_AFFINITY_MAX_CPUS; i++) {
+    if (VT_AFFINITY_ISSET (aff, i) && n-- == 0)
+      break;
+  }
+
+  return i;
+}
+
+/* Limits aff to processors also in other. If the sets do not overlap aff is
+   left alone, a placement that cannot be honored is worse than none. */
+void
+vt_affinity_intersect (vt_affinity_t *aff, const vt_affinity_t *other)
+{
+  size_t i;
+  vt_affinity_t res;
+
+  for (i = 0; i < (VT_AFFINITY_MAX_CPUS / VT_AFFINITY_BITS); i++)
+    res.mask[i] = aff->mask[i] & other->mask[i];
+
+  if (vt_affinity_count (&res))
+    memcpy (aff, &res, sizeof (vt_affinity_t));
+}
+
+/* Converts set to cpu_set_t. If cpu is not negative only the nth processor
+   of the set is included. Returns 0 if the set is empty. */
+int
+vt_affinity_cpuset (cpu_set_t *set, const vt_affinity_t *aff, int cpu)
+{
+  int cnt, i;
+
+  CPU_ZERO (set);
+
+  if (cpu >= 0) {
+    if ((cpu = vt_affinity_nth (aff, cpu)) < 0)
+      return 0;
+    CPU_SET (cpu, set);
+    return 1;
+  }
+
+  for (cnt = 0, i = 0; i < VT_AFFINITY_MAX_CPUS && i < CPU_SETSIZE; i++) {
+    if (VT_AFFINITY_ISSET (aff, i)) {
+      CPU_SET (i, set);
+      cnt++;
+    }
+  }
+
+  return cnt;
+}
+
+/* Places threads created with attr on processors in set, or on the nth
+   processor of the set if n is not negative. */
+int
+vt_affinity_attr (pthread_attr_t *attr, const vt_affinity_t *aff, int n)
+{
+  int ret;
+  cpu_set_t set;
+
+  if (! aff || ! vt_affinity_cpuset (&set, aff, n))
+    return 0;
+  if ((ret = pthread_attr_setaffinity_np (attr, sizeof (set), &set)) != 0) {
+    vt_error ("%s: pthread_attr_setaffinity_np: %s", __func__, strerror (ret));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* places calling thread, threads it creates inherit the placement */
+int
+vt_affinity_bind (const vt_affinity_t *aff)
+{
+  int ret;
+  cpu_set_t set;
+
+  if (! aff || ! vt_affinity_cpuset (&set, aff, -1))
+    return 0;
+  if ((ret = pthread_setaffinity_np (pthread_self (), sizeof (set), &set)) != 0) {
+    vt_error ("%s: pthread_setaffinity_np: %s", __func__, strerror (ret));
+    return -1;
+  }
+
+  return 0;
+}
+
+#undef VT_AFFINITY_NODE_PATH
+#undef VT_AFFINITY_ONLINE_PATH
+#undef VT_AFFINITY_SET
+#undef VT_AFFINITY_CLEAR
+#undef VT_AFFINITY_ISSET
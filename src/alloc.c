@@ -0,0 +1,52 @@
+/* system includes */
+#include <errno.h>
+#include <stdlib.h>
+
+/* valiant includes */
+#include "alloc.h"
+#include "atomic.h"
+
+static unsigned long vt_allocs = 0;
+
+void *
+vt_malloc (size_t size)
+{
+  (void)__sync_add_and_fetch (&vt_allocs, 1);
+  return malloc (size);
+}
+
+void *
+vt_calloc (size_t nmemb, size_t size)
+{
+  (void)__sync_add_and_fetch (&vt_allocs, 1);
+  return calloc (nmemb, size);
+}
+
+void *
+vt_realloc (void *ptr, size_t size)
+{
+  (void)__sync_add_and_fetch (&vt_allocs, 1);
+  return realloc (ptr, size);
+}
+
+/* returns memory aligned to alignment bytes, or NULL with errno set */
+void *
+vt_memalign (size_t alignment, size_t size)
+{
+  int ret;
+  void *ptr;
+
+  (void)__sync_add_and_fetch (&vt_allocs, 1);
+  if ((ret = posix_memalign (&ptr, alignment, size)) != 0) {
+    errno = ret;
+    return NULL;
+  }
+  return ptr;
+}
+
+/* number of allocations made through the wrappers since startup */
+unsigned long
+vt_alloc_count (void)
+{
+  return vt_atomic_load (&vt_allocs);
+}
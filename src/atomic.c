@@ -0,0 +1,12 @@
+/* system includes */
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* valiant includes */
+#include "atomic.h"
+
+int
+vt_futex (int *uaddr, int op, int val, const struct timespec *timeout)
+{
+  return syscall (SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
@@ -1,6 +1,9 @@
 /* system includes */
 #include <confuse.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -10,6 +13,58 @@
 
 /* prototypes */
 int vt_context_get_dict_pos (vt_context_t *, const char *);
+int vt_context_isset (cfg_t *, const char *);
+int vt_stage_compile (vt_context_t *, vt_stage_t *, vt_bitset_t *,
+  vt_error_t *);
+float vt_context_priority (vt_dict_t *);
+int vt_response_init (vt_response_t *, const char *);
+void vt_response_deinit (vt_response_t *);
+
+static unsigned long vt_context_generation = 0;
+
+#define VT_RESPONSE_PREFIX "action="
+#define VT_OVERLOAD_RESPONSE "DUNNO"
+
+/* Builds the complete reply for a configured response. The action= prefix is
+   added unless configured, trailing line terminators are replaced by the
+   empty line that ends a reply. */
+int
+vt_response_init (vt_response_t *resp, const char *str)
+{
+  size_t len, pfx;
+
+  if (! str) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (len = strlen (str); len && (str[len-1] == '\n' || str[len-1] == '\r'); len--)
+    ;
+
+  pfx = sizeof (VT_RESPONSE_PREFIX) - 1;
+  if (len >= pfx && strncmp (str, VT_RESPONSE_PREFIX, pfx) == 0)
+    pfx = 0;
+
+  if (! (resp->str = malloc (pfx + len + 3)))
+    return -1;
+
+  memcpy (resp->str, VT_RESPONSE_PREFIX, pfx);
+  memcpy (resp->str + pfx, str, len);
+  memcpy (resp->str + pfx + len, "\n\n", 3);
+  resp->len = pfx + len + 2;
+  return 0;
+}
+
+#undef VT_RESPONSE_PREFIX
+
+void
+vt_response_deinit (vt_response_t *resp)
+{
+  if (resp->str)
+    free (resp->str);
+  resp->str = NULL;
+  resp->len = 0;
+}
 
 int
 vt_context_get_dict_pos (vt_context_t *ctx, const char *dict)
@@ -23,6 +78,87 @@ vt_context_get_dict_pos (vt_context_t *ctx, const char *dict)
   return -1;
 }
 
+/* returns 1 if option was set in section, 0 if it has its default value */
+int
+vt_context_isset (cfg_t *sec, const char *name)
+{
+  cfg_opt_t *opt;
+
+  opt = cfg_getopt (sec, name);
+  return (opt && opt->nvalues && ! (opt->flags & CFGF_RESET)) ? 1 : 0;
+}
+
+#define VT_LOOKUP_THREADS (32)
+
+/* Lookups of all asynchronous dicts share a single pool, so that the number
+   of threads does not depend on the number of dicts configured. */
+int
+vt_context_executor_init (vt_context_t *ctx, vt_error_t *err)
+{
+  vt_thread_pool_t *pool;
+
+  if (! (ctx->executor = vt_executor_create (ctx->lookup_threads ?
+           ctx->lookup_threads : VT_LOOKUP_THREADS, err)))
+    return -1;
+
+  pool = ctx->executor->pool;
+  /* lanes queue lookups, the pool only queues turns */
+  vt_thread_pool_set_max_queued (pool, 0);
+  if (ctx->idle_timeout)
+    vt_thread_pool_set_idle_timeout (pool, ctx->idle_timeout);
+  vt_thread_pool_set_affinity (pool, &ctx->lookup_cpus);
+  vt_thread_pool_set_min_threads (pool, ctx->lookup_min_threads);
+  vt_thread_pool_set_target_delay (pool, ctx->target_queue_delay);
+
+  return 0;
+}
+
+#undef VT_LOOKUP_THREADS
+
+#define VT_RESOLVER_SOCKETS (4)
+#define VT_RESOLVER_TIMEOUT (1000)
+#define VT_RESOLVER_ATTEMPTS (2)
+#define VT_RESOLVER_QUERIES (4096)
+
+/* DNS lookups of all dicts share a single stub resolver. Nameservers are
+   read from resolv.conf unless configured. Answers go to the process-wide
+   cache, which outlives the context. */
+int
+vt_context_resolver_init (vt_context_t *ctx,
+                          cfg_t *cfg,
+                          vt_dns_cache_t *cache,
+                          vt_error_t *err)
+{
+  const char *servers[VT_RESOLVER_MAX_SERVERS];
+  int i, n, nsocks, timeout, attempts, queries;
+
+  n = cfg_size (cfg, "nameservers");
+  if (n > VT_RESOLVER_MAX_SERVERS)
+    n = VT_RESOLVER_MAX_SERVERS;
+  for (i = 0; i < n; i++)
+    servers[i] = cfg_getnstr (cfg, "nameservers", i);
+
+  if ((nsocks = cfg_getint (cfg, "resolver_sockets")) < 1)
+    nsocks = VT_RESOLVER_SOCKETS;
+  if ((timeout = cfg_getint (cfg, "resolver_timeout")) < 1)
+    timeout = VT_RESOLVER_TIMEOUT;
+  if ((attempts = cfg_getint (cfg, "resolver_attempts")) < 1)
+    attempts = VT_RESOLVER_ATTEMPTS;
+  if ((queries = cfg_getint (cfg, "resolver_queries")) < 1)
+    queries = VT_RESOLVER_QUERIES;
+
+  if (! (ctx->resolver = vt_resolver_create (servers, n, nsocks, timeout,
+           attempts, queries, cache, err)))
+    return -1;
+
+  return 0;
+}
+
+#undef VT_RESOLVER_SOCKETS
+#undef VT_RESOLVER_TIMEOUT
+#undef VT_RESOLVER_ATTEMPTS
+#undef VT_RESOLVER_QUERIES
+
 int
 vt_context_dicts_init (vt_context_t *ctx,
                        vt_dict_type_t **types,
@@ -76,9 +212,32 @@ vt_context_dicts_init (vt_context_t *ctx,
         vt_panic ("%s: unknown type %s for dict %s",
           __func__, dict_type, title);
 
-      if (! (dict = vt_dict_create (*type, type_sec, dict_sec, err)))
+      if (! (dict = vt_dict_create (*type, type_sec, dict_sec, ctx->executor,
+               ctx->resolver, err)))
         goto failure;
 
+      /* budgets are taken from dict, type and global section in that order
+         and only apply to lookups that run asynchronously */
+      if (dict->async) {
+        if (! (dict->timeout = cfg_getint (dict_sec, "timeout")) && type_sec)
+          dict->timeout = cfg_getint (type_sec, "timeout");
+        if (! dict->timeout)
+          dict->timeout = ctx->lookup_timeout;
+
+        if (vt_context_isset (dict_sec, "timeout_weight"))
+          dict->timeout_weight = cfg_getfloat (dict_sec, "timeout_weight");
+        else if (type_sec && vt_context_isset (type_sec, "timeout_weight"))
+          dict->timeout_weight = cfg_getfloat (type_sec, "timeout_weight");
+        else
+          dict->timeout_weight = ctx->lookup_timeout_weight;
+
+        /* lookups that time out weigh in too */
+        if (dict->max_diff < dict->timeout_weight)
+          dict->max_diff = dict->timeout_weight;
+        if (dict->min_diff > dict->timeout_weight)
+          dict->min_diff = dict->timeout_weight;
+      }
+
       vt_debug ("%s: dict: %s, pos: %d", __func__, title, dict_pos);
       *(dicts + dict_pos) = dict;
     }
@@ -161,6 +320,7 @@ vt_stage_create (vt_context_t *ctx, cfg_t *cfg, vt_error_t *err)
 {
   cfg_t *sec;
   char *dict;
+  float diff;
   int i, n;
   int invert, use_depends;
   vt_stage_t *stage;
@@ -179,10 +339,23 @@ vt_stage_create (vt_context_t *ctx, cfg_t *cfg, vt_error_t *err)
     goto failure;
   }
 
+  /* checks run in configured order until measured */
+  if (! (stage->order = calloc (stage->nchecks + 1, sizeof (int)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    goto failure;
+  }
+
   for (i = 0; i < stage->nchecks; i++) {
+    stage->order[i] = i;
     if ((sec = cfg_getnsec (cfg, "check", i))) {
       if (! (stage->checks[i] = vt_check_create (ctx, sec, err)))
         goto failure;
+      /* checks that are not evaluated add nothing */
+      diff = ctx->dicts[stage->checks[i]->dict]->max_diff;
+      stage->max_diff += (diff > 0.0) ? diff : 0.0;
+      diff = ctx->dicts[stage->checks[i]->dict]->min_diff;
+      stage->min_diff += (diff < 0.0) ? diff : 0.0;
     }
   }
 
@@ -229,15 +402,58 @@ vt_stage_destroy (vt_stage_t *stage, vt_error_t *err)
     }
     if (stage->depends)
       free (stage->depends);
+    if (stage->order)
+      free (stage->order);
+    if (stage->prefetch)
+      free (stage->prefetch);
     free (stage);
   }
   return 0;
 }
 
+/* Collects the dicts that must be ready before stage is evaluated so that
+   workers need not look for duplicates on every request. seen must be empty
+   and is left empty. */
+int
+vt_stage_compile (vt_context_t *ctx,
+                  vt_stage_t *stage,
+                  vt_bitset_t *seen,
+                  vt_error_t *err)
+{
+  int i, j, n, pos;
+
+  n = stage->ndepends;
+  for (i = 0; i < stage->nchecks; i++)
+    n += stage->checks[i]->ndepends;
+
+  if (! (stage->prefetch = calloc (n + 1, sizeof (int)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return -1;
+  }
+
+  for (i = -1; i < stage->nchecks; i++) {
+    n = (i < 0) ? stage->ndepends : stage->checks[i]->ndepends;
+    for (j = 0; j < n; j++) {
+      pos = (i < 0) ? stage->depends[j] : stage->checks[i]->depends[j];
+      if (! vt_bitset_isset (seen, pos)) {
+        vt_bitset_set (seen, pos);
+        stage->prefetch[stage->nprefetch++] = pos;
+      }
+    }
+  }
+
+  for (i = 0; i < stage->nprefetch; i++)
+    vt_bitset_clear (seen, stage->prefetch[i]);
+
+  return 0;
+}
+
 int
 vt_context_stages_init (vt_context_t *ctx, cfg_t *cfg, vt_error_t *err)
 {
   cfg_t *sec;
+  vt_bitset_t *seen;
   vt_stage_t **stages;
   int i, n;
   int use_stages;
@@ -258,6 +474,14 @@ vt_context_stages_init (vt_context_t *ctx, cfg_t *cfg, vt_error_t *err)
     vt_error ("%s: calloc: %s", __func__, strerror (errno));
     return -1;
   }
+  if (! (seen = calloc (VT_BITSET_WORDS (ctx->ndicts) + 1,
+                        sizeof (vt_bitset_t))))
+  {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    free (stages);
+    return -1;
+  }
 
   if (use_stages) {
     for (i = 0; i < n; i++) {
@@ -270,6 +494,22 @@ vt_context_stages_init (vt_context_t *ctx, cfg_t *cfg, vt_error_t *err)
       goto failure;
   }
 
+  /* bounds of remaining stages allow evaluation to stop once the verdict
+     can no longer change */
+  for (i = n - 1; i >= 0; i--) {
+    if (vt_stage_compile (ctx, stages[i], seen, err) != 0)
+      goto failure;
+    if (ctx->max_checks < stages[i]->nchecks)
+      ctx->max_checks = stages[i]->nchecks;
+    stages[i]->max_left = stages[i]->max_diff;
+    stages[i]->min_left = stages[i]->min_diff;
+    if (i < (n - 1)) {
+      stages[i]->max_left += stages[i + 1]->max_left;
+      stages[i]->min_left += stages[i + 1]->min_left;
+    }
+  }
+
+  free (seen);
   ctx->stages = stages;
   ctx->nstages = n;
   return 0;
@@ -279,14 +519,18 @@ failure:
       (void)vt_stage_destroy (stages[i], NULL);
   }
   free (stages);
+  free (seen);
   return -1;
 }
 
 vt_context_t *
-vt_context_create (vt_dict_type_t **types, cfg_t *cfg, vt_error_t *err)
+vt_context_create (vt_dict_type_t **types,
+                   cfg_t *cfg,
+                   vt_dns_cache_t *cache,
+                   vt_error_t *err)
 {
   char *str;
-  int i, n;
+  int i, n, ret;
   vt_context_t *ctx = NULL;
 
   if (! (ctx = calloc (1, sizeof (vt_context_t)))) {
@@ -294,15 +538,25 @@ vt_context_create (vt_dict_type_t **types, cfg_t *cfg, vt_error_t *err)
     vt_error ("%s (%d): calloc: %s", __func__, __LINE__, strerror (errno));
     goto failure;
   }
+  if ((ret = pthread_rwlock_init (&ctx->order_lock, NULL)) != 0)
+    vt_fatal ("%s: pthread_rwlock_init: %s", __func__, strerror (ret));
+  ctx->generation = __sync_add_and_fetch (&vt_context_generation, 1);
 
   if (! (ctx->port = vt_cfg_getstr_dup (cfg, "port")) ||
       ! (ctx->bind_address = vt_cfg_getstr_dup (cfg, "bind_address")) ||
       ! (ctx->pid_file = vt_cfg_getstr_dup (cfg, "pid_file")) ||
       ! (ctx->syslog_ident = vt_cfg_getstr_dup (cfg, "syslog_identity")) ||
-      ! (ctx->allow_resp = vt_cfg_getstr_dup (cfg, "allow_response")) ||
-      ! (ctx->block_resp = vt_cfg_getstr_dup (cfg, "block_response")) ||
-      ! (ctx->delay_resp = vt_cfg_getstr_dup (cfg, "delay_response")) ||
-      ! (ctx->error_resp = vt_cfg_getstr_dup (cfg, "error_response")))
+        vt_response_init (&ctx->allow_resp,
+          cfg_getstr (cfg, "allow_response")) != 0 ||
+        vt_response_init (&ctx->block_resp,
+          cfg_getstr (cfg, "block_response")) != 0 ||
+        vt_response_init (&ctx->delay_resp,
+          cfg_getstr (cfg, "delay_response")) != 0 ||
+        vt_response_init (&ctx->error_resp,
+          cfg_getstr (cfg, "error_response")) != 0 ||
+        vt_response_init (&ctx->overload_resp,
+          (str = cfg_getstr (cfg, "overload_response")) ?
+            str : VT_OVERLOAD_RESPONSE) != 0)
   {
     if (errno == EINVAL)
       vt_set_error (err, VT_ERR_BADCFG);
@@ -316,8 +570,37 @@ vt_context_create (vt_dict_type_t **types, cfg_t *cfg, vt_error_t *err)
   ctx->syslog_prio = vt_syslog_priority (cfg_getstr (cfg, "syslog_priority"));
   ctx->block_threshold = cfg_getfloat (cfg, "block_threshold");
   ctx->delay_threshold = cfg_getfloat (cfg, "delay_threshold");
+  ctx->reuse_conns = cfg_getbool (cfg, "reuse_connections") ? 1 : 0;
+  ctx->client_timeout = cfg_getint (cfg, "client_timeout");
+  ctx->listeners = cfg_getint (cfg, "listeners");
+  ctx->listen_backlog = cfg_getint (cfg, "listen_backlog");
+  ctx->min_threads = cfg_getint (cfg, "min_threads");
+  ctx->max_tasks = cfg_getint (cfg, "max_queued");
+  ctx->idle_timeout = cfg_getint (cfg, "idle_timeout");
+  ctx->target_queue_delay = cfg_getint (cfg, "target_queue_delay");
+  ctx->max_queue_delay = cfg_getint (cfg, "max_queue_delay");
+  ctx->work_stealing = cfg_getbool (cfg, "work_stealing") ? 1 : 0;
+  ctx->numa = cfg_getbool (cfg, "numa") ? 1 : 0;
+
+  ctx->lookup_threads = cfg_getint (cfg, "lookup_threads");
+  ctx->lookup_min_threads = cfg_getint (cfg, "lookup_min_threads");
+  ctx->request_timeout = cfg_getint (cfg, "request_timeout");
+  ctx->lookup_timeout = cfg_getint (cfg, "lookup_timeout");
+  ctx->lookup_timeout_weight = cfg_getfloat (cfg, "lookup_timeout_weight");
+  ctx->lookup_wave = cfg_getint (cfg, "lookup_wave");
+  ctx->speculate = cfg_getint (cfg, "speculate");
+
+  if (vt_affinity_parse (&ctx->cpus, cfg_getstr (cfg, "cpus"), err) != 0 ||
+      vt_affinity_parse (&ctx->lookup_cpus,
+        cfg_getstr (cfg, "lookup_cpus"), err) != 0)
+    goto failure;
 
-  if (vt_context_dicts_init (ctx, types, cfg, err) != 0 ||
+  if (! (ctx->timer = vt_timer_create (err)))
+    goto failure;
+
+  if (vt_context_executor_init (ctx, err) != 0 ||
+      vt_context_resolver_init (ctx, cfg, cache, err) != 0 ||
+      vt_context_dicts_init (ctx, types, cfg, err) != 0 ||
       vt_context_stages_init (ctx, cfg, err) != 0)
     goto failure;
 
@@ -342,12 +625,11 @@ vt_context_destroy (vt_context_t *ctx, vt_error_t *err)
       free (ctx->pid_file);
     if (ctx->syslog_ident)
       free (ctx->syslog_ident);
-    if (ctx->block_resp)
-      free (ctx->block_resp);
-    if (ctx->delay_resp)
-      free (ctx->delay_resp);
-    if (ctx->error_resp)
-      free (ctx->error_resp);
+    vt_response_deinit (&ctx->allow_resp);
+    vt_response_deinit (&ctx->block_resp);
+    vt_response_deinit (&ctx->delay_resp);
+    vt_response_deinit (&ctx->error_resp);
+    vt_response_deinit (&ctx->overload_resp);
 
     if (ctx->stages) {
       for (i = 0; i < ctx->nstages; i++) {
@@ -357,6 +639,11 @@ vt_context_destroy (vt_context_t *ctx, vt_error_t *err)
       free (ctx->stages);
     }
 
+    /* outstanding queries complete before the dicts they were sent for
+       are destroyed */
+    if (ctx->resolver)
+      (void)vt_resolver_destroy (ctx->resolver, NULL);
+
     if (ctx->dicts) {
       for (i = 0; i < ctx->ndicts; i++) {
         if (ctx->dicts[i])
@@ -365,8 +652,100 @@ vt_context_destroy (vt_context_t *ctx, vt_error_t *err)
       free (ctx->dicts);
     }
 
+    /* dicts wait for their lookups to finish, executor goes last */
+    if (ctx->executor)
+      (void)vt_executor_destroy (ctx->executor, NULL);
+    if (ctx->timer)
+      (void)vt_timer_destroy (ctx->timer, NULL);
+    (void)pthread_rwlock_destroy (&ctx->order_lock);
+
     memset (ctx, 0, sizeof (vt_context_t));
     return 0;
   }
   return EINVAL;
 }
+
+/* Expected absolute weight gained per microsecond spent on a lookup. Until
+   measured a dict is assumed to hit with its largest weight, remote lookups
+   are assumed to take a millisecond and local ones a microsecond. */
+float
+vt_context_priority (vt_dict_t *dict)
+{
+  float cost, prior, weight;
+
+  prior = (dict->max_diff > -dict->min_diff) ? dict->max_diff : -dict->min_diff;
+  if (isinf (prior))
+    prior = 1.0;
+
+  weight = ((dict->weight / 1000.0) + prior) / (dict->lookups + 1);
+  if (dict->latency)
+    cost = dict->latency / 8.0;
+  else
+    cost = dict->async ? 1000.0 : 1.0;
+
+  return weight / (cost + 1.0);
+}
+
+/* Checks within a stage are independent, dependencies only refer to dicts
+   evaluated in earlier stages, so they can run in any order. Checks most
+   likely to decide the verdict per unit of cost go first. Called by the stats
+   thread once measurements are folded, which is the only thread that writes
+   the order. Returns 1 if the order of any stage changed. */
+int
+vt_context_reorder (vt_context_t *ctx)
+{
+  float prio;
+  int changed, i, j, num, pos, ret, stageno;
+  int *order;
+  vt_stage_t *stage;
+
+  if (! (order = calloc (ctx->max_checks + 1, sizeof (int)))) {
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return 0;
+  }
+
+  changed = 0;
+  for (stageno = 0; stageno < ctx->nstages; stageno++) {
+    stage = ctx->stages[stageno];
+    memcpy (order, stage->order, stage->nchecks * sizeof (int));
+
+    /* insertion sort keeps checks of equal priority in place, priorities
+       are computed without holding the lock */
+    for (i = 1; i < stage->nchecks; i++) {
+      num = order[i];
+      prio = vt_context_priority (ctx->dicts[stage->checks[num]->dict]);
+      for (j = i; j > 0; j--) {
+        pos = stage->checks[order[j - 1]]->dict;
+        if (vt_context_priority (ctx->dicts[pos]) >= prio)
+          break;
+        order[j] = order[j - 1];
+      }
+      order[j] = num;
+    }
+
+    if (memcmp (order, stage->order, stage->nchecks * sizeof (int)) == 0)
+      continue;
+    changed = 1;
+    if ((ret = pthread_rwlock_wrlock (&ctx->order_lock)) != 0)
+      vt_panic ("%s: pthread_rwlock_wrlock: %s", __func__, strerror (ret));
+    memcpy (stage->order, order, stage->nchecks * sizeof (int));
+    if ((ret = pthread_rwlock_unlock (&ctx->order_lock)) != 0)
+      vt_panic ("%s: pthread_rwlock_unlock: %s", __func__, strerror (ret));
+  }
+
+  free (order);
+  return changed;
+}
+
+/* copies order in which checks of stage are to be evaluated */
+void
+vt_context_order (vt_context_t *ctx, vt_stage_t *stage, int *order)
+{
+  int ret;
+
+  if ((ret = pthread_rwlock_rdlock (&ctx->order_lock)) != 0)
+    vt_panic ("%s: pthread_rwlock_rdlock: %s", __func__, strerror (ret));
+  memcpy (order, stage->order, stage->nchecks * sizeof (int));
+  if ((ret = pthread_rwlock_unlock (&ctx->order_lock)) != 0)
+    vt_panic ("%s: pthread_rwlock_unlock: %s", __func__, strerror (ret));
+}
@@ -1,45 +1,71 @@
 /* system includes */
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* valiant includes */
+#include "alloc.h"
 #include "dict.h"
 #include "dict_priv.h"
 #include "error.h"
+#include "executor.h"
+#include "flight.h"
+#include "timer.h"
+
+typedef struct _vt_async_dict vt_async_dict_t;
+
+struct _vt_async_dict {
+  vt_executor_lane_t *lane;
+  int coalesce; /* dict has a key function, flights is initialized */
+  vt_flight_t flights;
+  pthread_mutex_t lock; /* protects flights */
+};
 
 typedef struct _vt_async_dict_arg vt_async_dict_arg_t;
 
 struct _vt_async_dict_arg {
+  vt_executor_task_t task; /* must be first */
+  vt_dict_t *dict; /* dict lookup is accounted to */
   vt_request_t *request;
   vt_result_t *result;
   int pos;
+  int leader; /* lookup is in flight, others may have joined */
+  vt_flight_node_t flight;
+  char key[VT_DICT_MAX_KEY];
 };
 
 /* prototypes */
 vt_dict_t *vt_async_dict_create (vt_dict_t *, vt_dict_type_t *, cfg_t *,
-  cfg_t *, vt_error_t *);
+  cfg_t *, vt_executor_t *, vt_error_t *);
 int vt_async_dict_check (vt_dict_t *, vt_request_t *, vt_result_t *, int,
   vt_error_t *);
-void vt_async_dict_worker (void *, void *);
+void vt_async_dict_worker (vt_executor_task_t *, void *);
+void vt_async_dict_finish (vt_async_dict_t *, vt_async_dict_arg_t *, float);
 int vt_async_dict_destroy (vt_dict_t *, vt_error_t *);
 
 vt_dict_t *
 vt_dict_create (vt_dict_type_t *type,
                 cfg_t *type_sec,
                 cfg_t *dict_sec,
+                vt_executor_t *executor,
+                vt_resolver_t *resolver,
                 vt_error_t *err)
 {
   vt_dict_t *async_dict, *dict;
 
   assert (type);
   assert (dict_sec);
+  assert (executor);
 
   if (! (dict = type->create_func (type, type_sec, dict_sec, err)))
     goto failure;
-  if (dict->async) {
-    if (! (async_dict = vt_async_dict_create (dict, type, type_sec, dict_sec, err)))
+  dict->resolver = resolver;
+  if (dict->async && ! dict->nonblocking) {
+    if (! (async_dict = vt_async_dict_create (dict, type, type_sec, dict_sec,
+             executor, err)))
       goto failure;
     dict = async_dict;
   }
@@ -50,6 +76,73 @@ failure:
   return NULL;
 }
 
+/* meter of calling thread, assigned when it measures its first lookup */
+static __thread int vt_dict_meter = -1;
+static int vt_dict_nmeters = 0;
+
+#define ADD(p,v) \
+  __atomic_store_n ((p), __atomic_load_n ((p), __ATOMIC_RELAXED) + (v), \
+    __ATOMIC_RELAXED)
+
+/* Accounts a lookup that took usecs microseconds and yielded points. Called
+   by every thread evaluating the dict, each updates a meter of its own. */
+void
+vt_dict_measure (vt_dict_t *dict, long usecs, float points)
+{
+  long avg;
+  vt_dict_meter_t *meter;
+
+  assert (dict);
+
+  if (vt_dict_meter < 0)
+    vt_dict_meter =
+      __sync_fetch_and_add (&vt_dict_nmeters, 1) % VT_DICT_METERS;
+  meter = &dict->meters[vt_dict_meter];
+
+  /* plain load and store, the stats thread reads meters while they are
+     updated */
+  ADD (&meter->lookups, 1);
+  if (points) {
+    ADD (&meter->hits, 1);
+    ADD (&meter->weight, (unsigned long)(fabsf (points) * 1000.0));
+  }
+
+  avg = __atomic_load_n (&meter->latency, __ATOMIC_RELAXED);
+  avg = avg ? (avg - (avg >> 3)) + usecs : (usecs << 3);
+  __atomic_store_n (&meter->latency, avg, __ATOMIC_RELAXED);
+}
+
+#undef ADD
+
+/* Sums meters of every thread. Latency is averaged over meters weighed by
+   the number of lookups they measured. Must only be called by the stats
+   thread. */
+void
+vt_dict_fold (vt_dict_t *dict)
+{
+  double latency;
+  int i;
+  unsigned long hits, lookups, num, weight;
+
+  assert (dict);
+
+  hits = lookups = weight = 0;
+  latency = 0.0;
+  for (i = 0; i < VT_DICT_METERS; i++) {
+    num = __atomic_load_n (&dict->meters[i].lookups, __ATOMIC_RELAXED);
+    lookups += num;
+    hits += __atomic_load_n (&dict->meters[i].hits, __ATOMIC_RELAXED);
+    weight += __atomic_load_n (&dict->meters[i].weight, __ATOMIC_RELAXED);
+    latency += (double)num *
+      __atomic_load_n (&dict->meters[i].latency, __ATOMIC_RELAXED);
+  }
+
+  dict->lookups = lookups;
+  dict->hits = hits;
+  dict->weight = weight;
+  dict->latency = lookups ? (long)(latency / lookups) : 0;
+}
+
 vt_dict_t *
 vt_dict_create_common (cfg_t *sec, vt_error_t *err)
 {
@@ -64,6 +157,15 @@ vt_dict_create_common (cfg_t *sec, vt_error_t *err)
     goto failure;
   }
 
+  if (! (dict->meters = vt_memalign (VT_DICT_CACHE_LINE,
+                                     VT_DICT_METERS * sizeof (vt_dict_meter_t))))
+  {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: posix_memalign: %s", __func__, strerror (errno));
+    goto failure;
+  }
+  memset (dict->meters, 0, VT_DICT_METERS * sizeof (vt_dict_meter_t));
+
   title = (char *)cfg_title (sec);
 
   if (! (dict->name = strdup (title))) {
@@ -82,6 +184,8 @@ int
 vt_dict_destroy_common (vt_dict_t *dict, vt_error_t *err)
 {
   if (dict) {
+    if (dict->meters)
+      free (dict->meters);
     if (dict->name)
       free (dict->name);
     free (dict);
@@ -89,48 +193,71 @@ vt_dict_destroy_common (vt_dict_t *dict, vt_error_t *err)
   return 0;
 }
 
+/* Lookups of asynchronous dicts run on the executor shared by all dicts,
+   max_threads limits how many lookups of this dict run at the same time and
+   max_queued how many may wait. Requests that need a lookup identical to one
+   that is queued or running wait for it instead, if the dict can tell. */
 vt_dict_t *
 vt_async_dict_create (vt_dict_t *dict,
                       vt_dict_type_t *type,
                       cfg_t *type_sec,
                       cfg_t *dict_sec,
+                      vt_executor_t *executor,
                       vt_error_t *err)
 {
   int nthreads;
-  int nidle_threads;
   int ntasks;
+  int ret;
+  vt_async_dict_t *async;
   vt_dict_t *async_dict;
-  vt_thread_pool_t *pool;
 
   assert (dict);
   assert (type);
   assert (dict_sec);
+  assert (executor);
 
   if (! (async_dict = vt_dict_create_common (dict_sec, err)))
     goto failure;
+  if (! (async = calloc (1, sizeof (vt_async_dict_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    goto failure;
+  }
+  async_dict->data = (void *)async;
   async_dict->async = 1;
+  async_dict->max_diff = dict->max_diff;
+  async_dict->min_diff = dict->min_diff;
   async_dict->check_func = &vt_async_dict_check;
   async_dict->destroy_func = &vt_async_dict_destroy;
 
   nthreads = cfg_getint (dict_sec, "max_threads");
   if (! nthreads)
     nthreads = cfg_getint (type_sec, "max_threads");
-  nidle_threads = cfg_getint (dict_sec, "max_idle_threads");
-  if (! nidle_threads)
-    nidle_threads = cfg_getint (type_sec, "max_idle_threads)");
   ntasks = cfg_getint (dict_sec, "max_queued");
   if (! ntasks)
     ntasks = cfg_getint (type_sec, "max_queued");
 
-  if (! (pool = vt_thread_pool_create ((void *)dict, nthreads, &vt_async_dict_worker, err)))
-    goto failure;
+  /* no more lookups are in flight than the lane runs and queues */
+  if (dict->key_func) {
+    if (vt_flight_init (&async->flights, nthreads + ntasks, 0, err) != 0)
+      goto failure;
+    if ((ret = pthread_mutex_init (&async->lock, NULL)) != 0)
+      vt_fatal ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
+    async->coalesce = 1;
+  }
 
-  vt_thread_pool_set_max_idle_threads (pool, nidle_threads);
-  vt_thread_pool_set_max_queued (pool, ntasks);
+  if (! (async->lane = vt_executor_lane_create (executor,
+           &vt_async_dict_worker, (void *)dict, nthreads, ntasks, err)))
+    goto failure;
 
-  async_dict->data = (void *)pool;
   return async_dict;
 failure:
+  if (async_dict && (async = (vt_async_dict_t *)async_dict->data)) {
+    if (async->coalesce)
+      (void)pthread_mutex_destroy (&async->lock);
+    vt_flight_deinit (&async->flights);
+    free (async);
+  }
   (void)vt_dict_destroy_common (async_dict, NULL);
   return NULL;
 }
@@ -142,75 +269,155 @@ vt_async_dict_check (vt_dict_t *async_dict,
                      int pos,
                      vt_error_t *err)
 {
-  vt_dict_t *dict;
+  int ret;
   vt_async_dict_arg_t *data;
-  vt_thread_pool_t *pool;
+  vt_async_dict_t *async;
+  vt_dict_t *dict;
 
   assert (async_dict);
   assert (req);
   assert (res);
-  pool = (vt_thread_pool_t *)async_dict->data;
-  assert (pool);
-
-  if (! (data = calloc (1, sizeof (vt_async_dict_arg_t)))) {
-    vt_set_error (err, VT_ERR_NOMEM);
-    vt_error ("%s: calloc: %s", __func__, strerror (errno));
-    return -1;
+  async = (vt_async_dict_t *)async_dict->data;
+  assert (async);
+
+  /* argument is kept with the result slot, which is only ever checked by
+     this dict, and reused for every request evaluated by the job */
+  if (! (data = (vt_async_dict_arg_t *)res->results[pos].data)) {
+    if (! (data = vt_calloc (1, sizeof (vt_async_dict_arg_t)))) {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    res->results[pos].data = (void *)data;
   }
 
+  data->dict = async_dict;
   data->request = req;
   data->result = res;
   data->pos = pos;
+  data->leader = 0;
+
+  /* lookup may outlive its deadline, request and result must stay intact
+     until it returns */
+  vt_result_hold (res);
+
+  dict = (vt_dict_t *)async->lane->user_data;
+  if (async->coalesce &&
+      dict->key_func (dict, req, data->key, sizeof (data->key)) == 0)
+  {
+    if ((ret = pthread_mutex_lock (&async->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    data->leader = vt_flight_join (&async->flights, 0, data->key,
+      &data->flight);
+    if ((ret = pthread_mutex_unlock (&async->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    /* slot is updated by whoever does the lookup */
+    if (! data->leader)
+      return 0;
+  }
 
-  vt_result_lock (res);
-vt_debug ("%s:%d: ", __func__, __LINE__);
-  if (vt_thread_pool_push (pool, (void *)data, err) != 0) {
-    free (data);
+  if (vt_executor_submit (async->lane, &data->task, err) != 0) {
+    /* caller is dispatching, so this is never the last pending slot */
+    vt_async_dict_finish (async, data, 0.0);
+    (void)vt_result_release (res);
     return -1;
   }
-vt_debug ("%s:%d: ", __func__, __LINE__);
+
   return 0;
 }
 
+/* Takes lookup out of flight and hands points to the requests that joined it,
+   then to the request that issued it. */
 void
-vt_async_dict_worker (void *data, void *user_data)
+vt_async_dict_finish (vt_async_dict_t *async, vt_async_dict_arg_t *arg,
+  float points)
 {
+  int ret;
+  vt_async_dict_arg_t *follower;
+  vt_flight_node_t *node, *next;
+
+  if (arg->leader) {
+    if ((ret = pthread_mutex_lock (&async->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    vt_flight_leave (&async->flights, &arg->flight);
+    if ((ret = pthread_mutex_unlock (&async->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+    /* followers are reused once released, so the next one is saved first */
+    for (node = arg->flight.followers; node; node = next) {
+      next = node->next;
+      follower = vt_flight_entry (node, vt_async_dict_arg_t, flight);
+      (void)vt_result_update (follower->result, follower->pos, points);
+      if (vt_result_release (follower->result))
+        vt_result_notify (follower->result);
+    }
+    arg->flight.followers = NULL;
+  }
+
+  (void)vt_result_update (arg->result, arg->pos, points);
+}
+
+void
+vt_async_dict_worker (vt_executor_task_t *task, void *user_data)
+{
+  float points;
+  long start;
+  vt_async_dict_arg_t *arg;
   vt_dict_t *dict;
-  vt_request_t *req;
+  vt_dict_result_t slot;
+  vt_result_t scratch;
   vt_result_t *res;
-  int pos;
 
-  assert (data);
+  assert (task);
   assert (user_data);
 
   dict = (vt_dict_t *)user_data;
-  req = ((vt_async_dict_arg_t *)data)->request;
-  res = ((vt_async_dict_arg_t *)data)->result;
-  pos = ((vt_async_dict_arg_t *)data)->pos;
-  free (data); /* cleanup */
-vt_debug ("%s:%d: ", __func__, __LINE__);
-  (void)dict->check_func (dict, req, res, pos, NULL);
-vt_debug ("%s:%d: ", __func__, __LINE__);
-  vt_result_unlock (res);
+  arg = (vt_async_dict_arg_t *)task;
+  res = arg->result;
+
+  /* lookup writes its points to a slot of its own, requests that joined it
+     get them even if the deadline of this request passed already */
+  memset (&slot, 0, sizeof (slot));
+  memset (&scratch, 0, sizeof (scratch));
+  scratch.results = &slot;
+  scratch.nresults = 1;
+
+  /* failed lookups count as no match, results that come in after the
+     deadline are dropped */
+  start = vt_timer_usecs ();
+  if (dict->check_func (dict, arg->request, &scratch, 0, NULL) == 0 &&
+      vt_result_ready (&scratch, 0))
+    points = vt_result_points (&scratch, 0);
+  else
+    points = 0.0;
+  vt_async_dict_finish ((vt_async_dict_t *)arg->dict->data, arg, points);
+  vt_dict_measure (arg->dict, vt_timer_usecs () - start,
+    vt_result_timeout (res, arg->pos) ? 0.0 : points);
+  if (vt_result_release (res))
+    vt_result_notify (res);
 }
 
 int
 vt_async_dict_destroy (vt_dict_t *async_dict, vt_error_t *err)
 {
+  vt_async_dict_t *async;
   vt_dict_t *dict;
-  vt_thread_pool_t *pool;
 
   assert (async_dict);
-  pool = (vt_thread_pool_t *)async_dict->data;
-  assert (pool);
+  async = (vt_async_dict_t *)async_dict->data;
+  assert (async);
 
-  dict = pool->user_data;
-  if (! vt_thread_pool_destroy (pool, err)) /* blocking */
+  dict = (vt_dict_t *)async->lane->user_data;
+  if (vt_executor_lane_destroy (async->lane, err) != 0) /* blocking */
     return -1;
-  if (! dict->destroy_func (dict, err))
+  if (dict->destroy_func (dict, err) != 0)
     return -1;
+  if (async->coalesce)
+    (void)pthread_mutex_destroy (&async->lock);
+  vt_flight_deinit (&async->flights);
+  free (async);
 
-  return 0;
+  return vt_dict_destroy_common (async_dict, err);
 }
 
 int
@@ -1,6 +1,8 @@
 /* system includes */
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -41,10 +43,12 @@ vt_dict_dnsbl_create (vt_dict_type_t *type,
   assert (dict_sec);
 
   if (! (dict = vt_dict_create_common (dict_sec, err)) ||
-      ! (rbl = vt_rbl_create (dict_sec, err)))
+      ! (rbl = vt_rbl_create (dict_sec, cfg_getstr (dict_sec, "zone"),
+               err)))
     goto failure;
 
   dict->async = 1;
+  dict->nonblocking = 1;
   dict->data = (void *)rbl;
   dict->max_diff = vt_rbl_max_weight (rbl);
   dict->min_diff = vt_rbl_min_weight (rbl);
@@ -77,7 +81,7 @@ vt_dict_dnsbl_check (vt_dict_t *dict,
                      vt_error_t *err)
 {
   char *client_address;
-  char query[HOST_NAME_MAX], reverse[INET_ADDRSTRLEN];
+  char query[VT_RESOLVER_MAX_NAME], reverse[INET_ADDRSTRLEN];
   int len;
   vt_rbl_t *rbl;
 
@@ -87,17 +91,18 @@ vt_dict_dnsbl_check (vt_dict_t *dict,
   rbl = (vt_rbl_t *)dict->data;
   assert (rbl);
 
-  client_address = vt_buf_str (&req->client_address);
+  client_address = vt_request_mbrbyid (req, VT_REQUEST_MEMBER_CLIENT_ADDRESS);
 
-  if (client_address) {
-    if (reverse_inet_addr (client_address, reverse, INET_ADDRSTRLEN) < 0)
-      vt_panic ("%s: reverse_inet_addr: %s", __func__, strerror (errno));
-    len = snprintf (query, HOST_NAME_MAX, "%s.%s", reverse, rbl->zone);
-    if (len >= HOST_NAME_MAX)
-      vt_panic ("%s: dnsbl query exceeded maximum hostname length", __func__);
-    return vt_rbl_check (dict, query, res, pos, err);
-  } else {
-    vt_result_update (res, pos, 0.0);
+  /* only IPv4 addresses are listed, others count as not listed */
+  if (client_address &&
+      reverse_inet_addr (client_address, reverse, INET_ADDRSTRLEN) == 0)
+  {
+    len = snprintf (query, VT_RESOLVER_MAX_NAME, "%s.%s", reverse, rbl->zone);
+    /* names too long to query cannot be listed */
+    if (len < VT_RESOLVER_MAX_NAME)
+      return vt_rbl_check (dict, query, res, pos, err);
   }
+
+  vt_result_update (res, pos, 0.0);
   return 0;
 }
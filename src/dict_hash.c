@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <db.h>
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -111,9 +112,14 @@ vt_dict_hash_create (vt_dict_type_t *type,
       data->weight = cfg_opt_getnfloat (opt, 0);
   }
 
-  // FIXME: implement "infinity"
-  //dict->max_diff =
-  //dict->min_diff =
+  /* weight is read from the database unless configured */
+  if (data->weight) {
+    dict->max_diff = (data->weight > 0.0) ? data->weight : 0.0;
+    dict->min_diff = (data->weight < 0.0) ? data->weight : 0.0;
+  } else {
+    dict->max_diff = INFINITY;
+    dict->min_diff = -INFINITY;
+  }
   dict->check_func = &vt_dict_hash_check;
   dict->destroy_func = &vt_dict_hash_destroy;
 
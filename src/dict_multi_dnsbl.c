@@ -0,0 +1,273 @@
+/* system includes */
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* valiant includes */
+#include "alloc.h"
+#include "dict_priv.h"
+#include "dict_multi_dnsbl.h"
+#include "rbl.h"
+#include "timer.h"
+#include "utils.h"
+
+/* Looks up the client address in every configured zone at once. The address
+   is reversed once, queries are submitted together so that their round trips
+   overlap, and the points of every zone add up to the points of the dict. A
+   zone is configured like a dnsbl dict, in sections titled by the zone name,
+   so that composite zones can weigh every return code differently. */
+typedef struct _vt_dict_multi_dnsbl vt_dict_multi_dnsbl_t;
+
+struct _vt_dict_multi_dnsbl {
+  vt_rbl_t **zones;
+  int nzones;
+};
+
+typedef struct _vt_multi_dnsbl_lookup vt_multi_dnsbl_lookup_t;
+typedef struct _vt_multi_dnsbl_query vt_multi_dnsbl_query_t;
+
+struct _vt_multi_dnsbl_query {
+  vt_resolver_query_t query; /* must be first */
+  vt_multi_dnsbl_lookup_t *lookup;
+  int zone;
+  float points; /* points of zone, valid once lookup completes */
+};
+
+/* Lookups are kept with the result slot of the dict, which is reused for
+   every request evaluated by the job. */
+struct _vt_multi_dnsbl_lookup {
+  vt_dict_t *dict;
+  vt_result_t *result;
+  int pos;
+  int pending; /* outstanding queries, plus one while submitting */
+  long start; /* microseconds, first query was submitted */
+  vt_multi_dnsbl_query_t queries[]; /* one per zone */
+};
+
+/* prototypes */
+vt_dict_t *vt_dict_multi_dnsbl_create (vt_dict_type_t *, cfg_t *, cfg_t *,
+  vt_error_t *);
+int vt_dict_multi_dnsbl_destroy (vt_dict_t *, vt_error_t *);
+int vt_dict_multi_dnsbl_check (vt_dict_t *, vt_request_t *, vt_result_t *,
+  int, vt_error_t *);
+void vt_dict_multi_dnsbl_done (vt_resolver_query_t *, void *);
+void vt_dict_multi_dnsbl_finish (vt_multi_dnsbl_lookup_t *);
+
+vt_dict_type_t _vt_dict_multi_dnsbl_type = {
+  .name = "multi_dnsbl",
+  .create_func = &vt_dict_multi_dnsbl_create
+};
+
+vt_dict_type_t *
+vt_dict_multi_dnsbl_type (void)
+{
+  return &_vt_dict_multi_dnsbl_type;
+}
+
+vt_dict_t *
+vt_dict_multi_dnsbl_create (vt_dict_type_t *type,
+                            cfg_t *type_sec,
+                            cfg_t *dict_sec,
+                            vt_error_t *err)
+{
+  cfg_t *zone_sec;
+  int i;
+  vt_dict_t *dict;
+  vt_dict_multi_dnsbl_t *data;
+
+  assert (type);
+  assert (dict_sec);
+
+  data = NULL;
+
+  if (! (dict = vt_dict_create_common (dict_sec, err)))
+    goto failure;
+  if (! (data = calloc (1, sizeof (vt_dict_multi_dnsbl_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    goto failure;
+  }
+  dict->data = (void *)data;
+
+  if (! (data->nzones = cfg_size (dict_sec, "zone"))) {
+    vt_set_error (err, VT_ERR_BADCFG);
+    vt_error ("%s: dict %s has no zones", __func__, dict->name);
+    goto failure;
+  }
+  if (! (data->zones = calloc (data->nzones, sizeof (vt_rbl_t *)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    goto failure;
+  }
+
+  for (i = 0; i < data->nzones; i++) {
+    zone_sec = cfg_getnsec (dict_sec, "zone", i);
+    if (! (data->zones[i] = vt_rbl_create (zone_sec, cfg_title (zone_sec),
+             err)))
+      goto failure;
+    dict->max_diff += vt_rbl_max_weight (data->zones[i]);
+    dict->min_diff += vt_rbl_min_weight (data->zones[i]);
+  }
+
+  dict->async = 1;
+  dict->nonblocking = 1;
+  dict->check_func = &vt_dict_multi_dnsbl_check;
+  dict->destroy_func = &vt_dict_multi_dnsbl_destroy;
+
+  return dict;
+failure:
+  (void)vt_dict_multi_dnsbl_destroy (dict, NULL);
+  return NULL;
+}
+
+int
+vt_dict_multi_dnsbl_destroy (vt_dict_t *dict, vt_error_t *err)
+{
+  int i;
+  vt_dict_multi_dnsbl_t *data;
+
+  if (dict) {
+    if ((data = (vt_dict_multi_dnsbl_t *)dict->data)) {
+      if (data->zones) {
+        for (i = 0; i < data->nzones; i++) {
+          if (data->zones[i])
+            (void)vt_rbl_destroy (data->zones[i], NULL);
+        }
+        free (data->zones);
+      }
+      free (data);
+    }
+    if (vt_dict_destroy_common (dict, err) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Submits a query for every zone to the shared resolver, the result is
+   updated once the last reply comes in. Zones that cannot be queried count
+   as not listed. The lookup holds a reference to the result until then. */
+int
+vt_dict_multi_dnsbl_check (vt_dict_t *dict,
+                           vt_request_t *req,
+                           vt_result_t *res,
+                           int pos,
+                           vt_error_t *err)
+{
+  char *client_address;
+  char reverse[INET_ADDRSTRLEN];
+  int i, len;
+  vt_dict_multi_dnsbl_t *data;
+  vt_multi_dnsbl_lookup_t *lookup;
+  vt_multi_dnsbl_query_t *query;
+
+  assert (dict);
+  assert (dict->resolver);
+  assert (req);
+  assert (res);
+  data = (vt_dict_multi_dnsbl_t *)dict->data;
+  assert (data);
+
+  client_address = vt_request_mbrbyid (req, VT_REQUEST_MEMBER_CLIENT_ADDRESS);
+
+  /* only IPv4 addresses are listed, others count as not listed */
+  if (! client_address ||
+      reverse_inet_addr (client_address, reverse, INET_ADDRSTRLEN) < 0)
+  {
+    vt_result_update (res, pos, 0.0);
+    return 0;
+  }
+
+  if (! (lookup = (vt_multi_dnsbl_lookup_t *)res->results[pos].data)) {
+    if (! (lookup = vt_calloc (1, sizeof (vt_multi_dnsbl_lookup_t) +
+                                  data->nzones *
+                                    sizeof (vt_multi_dnsbl_query_t))))
+    {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    res->results[pos].data = (void *)lookup;
+  }
+
+  lookup->dict = dict;
+  lookup->result = res;
+  lookup->pos = pos;
+  lookup->pending = data->nzones + 1;
+  lookup->start = vt_timer_usecs ();
+
+  vt_result_hold (res);
+  for (i = 0; i < data->nzones; i++) {
+    query = &lookup->queries[i];
+    query->lookup = lookup;
+    query->zone = i;
+    query->points = 0.0;
+    query->query.type = VT_RESOLVER_TYPE_A;
+    query->query.func = &vt_dict_multi_dnsbl_done;
+    query->query.arg = (void *)query;
+
+    len = snprintf (query->query.name, VT_RESOLVER_MAX_NAME, "%s.%s",
+      reverse, data->zones[i]->zone);
+    /* never the last query, submitting holds a count of its own. answers
+       that are cached complete the query right away. */
+    if (len >= VT_RESOLVER_MAX_NAME ||
+        vt_resolver_submit (dict->resolver, &query->query, NULL) != 0)
+      (void)__sync_sub_and_fetch (&lookup->pending, 1);
+  }
+
+  /* caller is dispatching, so this is never the last pending slot */
+  if (__sync_sub_and_fetch (&lookup->pending, 1) == 0)
+    vt_dict_multi_dnsbl_finish (lookup);
+
+  return 0;
+}
+
+void
+vt_dict_multi_dnsbl_done (vt_resolver_query_t *resolver_query, void *arg)
+{
+  vt_dict_multi_dnsbl_t *data;
+  vt_multi_dnsbl_lookup_t *lookup;
+  vt_multi_dnsbl_query_t *query;
+
+  query = (vt_multi_dnsbl_query_t *)arg;
+  lookup = query->lookup;
+  data = (vt_dict_multi_dnsbl_t *)lookup->dict->data;
+
+  query->points = vt_rbl_points (data->zones[query->zone], resolver_query);
+  /* full barrier, points are visible to whoever finishes the lookup */
+  if (__sync_sub_and_fetch (&lookup->pending, 1) == 0)
+    vt_dict_multi_dnsbl_finish (lookup);
+}
+
+/* Called once for every lookup, by whoever completes the last query. Results
+   that come in after the deadline are dropped. */
+void
+vt_dict_multi_dnsbl_finish (vt_multi_dnsbl_lookup_t *lookup)
+{
+  float points;
+  int i;
+  vt_dict_multi_dnsbl_t *data;
+  vt_result_t *result;
+
+  data = (vt_dict_multi_dnsbl_t *)lookup->dict->data;
+  result = lookup->result;
+
+  /* zones that listed the client are logged so that it's known which zone
+     contributed what */
+  points = 0.0;
+  for (i = 0; i < data->nzones; i++) {
+    if (lookup->queries[i].points) {
+      vt_info ("check %s: %s listed, weight: %f", lookup->dict->name,
+        lookup->queries[i].query.name, lookup->queries[i].points);
+      points += lookup->queries[i].points;
+    }
+  }
+
+  (void)vt_result_update (result, lookup->pos, points);
+  vt_dict_measure (lookup->dict, vt_timer_usecs () - lookup->start,
+    vt_result_timeout (result, lookup->pos) ? 0.0 : points);
+  if (vt_result_release (result))
+    vt_result_notify (result);
+}
@@ -4,19 +4,23 @@
 #include <fcntl.h>
 #include <pcre.h>
 #include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 
 /* valiant includes */
+#include "alloc.h"
 #include "dict_priv.h"
 #include "dict_pcre.h"
 #include "request.h"
+#include "slist.h"
 #include "state.h"
 
 // FIXME: increase interval, it's set to 60 for debugging purposes
 #define VT_DICT_PCRE_TIME_DIFF (60)
+#define VT_DICT_DYN_PCRE_BUF (512) /* patterns that fit are built on stack */
 
 typedef struct _vt_pcre vt_pcre_t;
 
@@ -312,9 +316,9 @@ vt_dict_multi_pcre_create (vt_dict_type_t *type,
   }
 
   dict->async = 1;
-  // FIXME: implement "infinity"
-  //dict->max_diff =
-  //dict->min_diff =
+  /* weights are read from file and may change on every reload */
+  dict->max_diff = INFINITY;
+  dict->min_diff = -INFINITY;
   dict->check_func = &vt_dict_multi_pcre_check;
   dict->destroy_func = &vt_dict_multi_pcre_destroy;
 
@@ -528,6 +532,7 @@ vt_dict_dyn_pcre_check (vt_dict_t *dict,
 {
   char *member;
   char *buf, *str1, *str2, *ptr1, *ptr2, *ptr3;
+  char stack_buf[VT_DICT_DYN_PCRE_BUF];
   const char *errptr;
   float weight;
   int erroffset;
@@ -567,7 +572,9 @@ vt_dict_dyn_pcre_check (vt_dict_t *dict,
     }
   }
 
-  if (! (buf = calloc (1, len1))) {
+  if (len1 <= sizeof (stack_buf)) {
+    buf = stack_buf;
+  } else if (! (buf = vt_calloc (1, len1))) {
     vt_set_error (err, VT_ERR_NOMEM);
     vt_error ("%s: calloc: %s", __func__, strerror (errno));
     return -1;
@@ -596,7 +603,8 @@ vt_dict_dyn_pcre_check (vt_dict_t *dict,
 
   /* compile and execute newly created pattern */
   re = pcre_compile (buf, (data->options | PCRE_UTF8), &errptr, &erroffset, NULL);
-  free (buf);
+  if (buf != stack_buf)
+    free (buf);
   if (! re) {
     vt_panic ("%s: pcre_compile: compilation failed at offset %d: %s",
       __func__, erroffset, errptr);
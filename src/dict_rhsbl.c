@@ -1,6 +1,8 @@
 /* system includes */
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -40,10 +42,12 @@ vt_dict_rhsbl_create (vt_dict_type_t *type,
   assert (dict_sec);
 
   if (! (dict = vt_dict_create_common (dict_sec, err)) ||
-      ! (rbl = vt_rbl_create (dict_sec, err)))
+      ! (rbl = vt_rbl_create (dict_sec, cfg_getstr (dict_sec, "zone"),
+               err)))
     goto failure;
 
   dict->async = 1;
+  dict->nonblocking = 1;
   dict->data = (void *)rbl;
   dict->max_diff = vt_rbl_max_weight (rbl);
   dict->min_diff = vt_rbl_min_weight (rbl);
@@ -76,7 +80,7 @@ vt_dict_rhsbl_check (vt_dict_t *dict,
                      vt_error_t *err)
 {
   char *sender_domain;
-  char query[HOST_NAME_MAX];
+  char query[VT_RESOLVER_MAX_NAME];
   int len;
   vt_rbl_t *rbl;
 
@@ -86,15 +90,16 @@ vt_dict_rhsbl_check (vt_dict_t *dict,
   rbl = (vt_rbl_t *)dict->data;
   assert (rbl);
 
-  sender_domain = vt_buf_str (&req->sender_domain);
+  sender_domain = vt_request_mbrbyid (req, VT_REQUEST_MEMBER_SENDER_DOMAIN);
 
   if (sender_domain) {
-    len = snprintf (query, HOST_NAME_MAX, "%s.%s", sender_domain, rbl->zone);
-    if (len >= HOST_NAME_MAX)
-      vt_panic ("%s: rhsbl query exceeded maximum hostname length", __func__);
-    return vt_rbl_check (dict, query, res, pos, err);
-  } else {
-    vt_result_update (res, pos, 0.0);
+    len = snprintf (query, VT_RESOLVER_MAX_NAME, "%s.%s",
+      sender_domain, rbl->zone);
+    /* names too long to query cannot be listed */
+    if (len < VT_RESOLVER_MAX_NAME)
+      return vt_rbl_check (dict, query, res, pos, err);
   }
+
+  vt_result_update (res, pos, 0.0);
   return 0;
 }
@@ -2,9 +2,12 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <spf2/spf.h>
 #include <spf2/spf_dns.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* valiant includes */
 #include "dict_priv.h"
@@ -31,12 +34,22 @@ struct _vt_dict_spf_result {
   float *weight;
 };
 
+/* every spf dict, in every context, shares one server so that the records
+   cached by its resolver layer survive reloads and are not fetched once per
+   dict. the server is created by the first dict and freed with the last. */
+static SPF_server_t *vt_spf_server = NULL;
+static unsigned int vt_spf_server_refs = 0;
+static pthread_mutex_t vt_spf_server_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* prototypes */
+SPF_server_t *vt_spf_server_get (vt_error_t *);
+void vt_spf_server_put (SPF_server_t *);
 vt_dict_t *vt_dict_spf_create (vt_dict_type_t *, cfg_t *, cfg_t *,
   vt_error_t *);
 int vt_dict_spf_destroy (vt_dict_t *, vt_error_t *);
 int vt_dict_spf_check (vt_dict_t *, vt_request_t *, vt_result_t *, int,
   vt_error_t *);
+int vt_dict_spf_key (vt_dict_t *, vt_request_t *, char *, size_t);
 float vt_dict_spf_max_diff (vt_dict_t *);
 float vt_dict_spf_min_diff (vt_dict_t *);
 
@@ -51,6 +64,46 @@ vt_dict_spf_type (void)
   return &_vt_dict_spf_type;
 }
 
+SPF_server_t *
+vt_spf_server_get (vt_error_t *err)
+{
+  int ret;
+  SPF_server_t *server;
+
+  if ((ret = pthread_mutex_lock (&vt_spf_server_lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if (! vt_spf_server &&
+      ! (vt_spf_server = SPF_server_new (SPF_DNS_CACHE, 0)))
+  {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: SPF_server_new: %s", __func__, strerror (errno));
+  }
+  if ((server = vt_spf_server))
+    vt_spf_server_refs++;
+  if ((ret = pthread_mutex_unlock (&vt_spf_server_lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  return server;
+}
+
+void
+vt_spf_server_put (SPF_server_t *server)
+{
+  int ret;
+
+  assert (server);
+
+  if ((ret = pthread_mutex_lock (&vt_spf_server_lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  assert (server == vt_spf_server && vt_spf_server_refs > 0);
+  if (--vt_spf_server_refs == 0) {
+    SPF_server_free (vt_spf_server);
+    vt_spf_server = NULL;
+  }
+  if ((ret = pthread_mutex_unlock (&vt_spf_server_lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+}
+
 vt_dict_t *
 vt_dict_spf_create (vt_dict_type_t *type,
                     cfg_t *type_sec,
@@ -74,11 +127,8 @@ vt_dict_spf_create (vt_dict_type_t *type,
     vt_error ("%s: calloc: %s", __func__, strerror (errno));
     goto failure;
   }
-  if (! (data->spf_server = SPF_server_new (SPF_DNS_CACHE, 0))) {
-    vt_set_error (err, VT_ERR_NOMEM);
-    vt_error ("%s: SPF_server_new: %s", __func__, strerror (errno));
+  if (! (data->spf_server = vt_spf_server_get (err)))
     goto failure;
-  }
 
   /* only used to make it easier to loop through sections */
   vt_dict_spf_result_t rslts[] = {
@@ -113,6 +163,7 @@ vt_dict_spf_create (vt_dict_type_t *type,
   dict->max_diff = vt_dict_spf_max_diff (dict);
   dict->min_diff = vt_dict_spf_min_diff (dict);
   dict->check_func = &vt_dict_spf_check;
+  dict->key_func = &vt_dict_spf_key;
   dict->destroy_func = &vt_dict_spf_destroy;
 
   return dict;
@@ -130,7 +181,7 @@ vt_dict_spf_destroy (vt_dict_t *dict, vt_error_t *err)
     data = (vt_dict_spf_t *)dict->data;
     if (data) {
       if (data->spf_server)
-        SPF_server_free (data->spf_server);
+        vt_spf_server_put (data->spf_server);
       free (data);
     }
     return vt_dict_destroy_common (dict, err);
@@ -138,6 +189,33 @@ vt_dict_spf_destroy (vt_dict_t *dict, vt_error_t *err)
   return 0;
 }
 
+/* the outcome depends on client address, helo name and sender only, so every
+   recipient of a message shares the evaluation. attribute values cannot
+   contain newlines, which makes for an unambiguous separator. */
+int
+vt_dict_spf_key (vt_dict_t *dict, vt_request_t *req, char *key, size_t size)
+{
+  char *client_address, *helo_name, *sender;
+  int len;
+
+  assert (dict);
+  assert (req);
+  assert (key);
+
+  client_address = vt_request_mbrbyid (req, VT_REQUEST_MEMBER_CLIENT_ADDRESS);
+  helo_name = vt_request_mbrbyid (req, VT_REQUEST_MEMBER_HELO_NAME);
+  sender = vt_request_mbrbyid (req, VT_REQUEST_MEMBER_SENDER);
+
+  if (! client_address || ! helo_name || ! sender)
+    return -1;
+
+  len = snprintf (key, size, "%s\n%s\n%s", client_address, helo_name, sender);
+  if (len < 0 || (size_t)len >= size)
+    return -1;
+
+  return 0;
+}
+
 int
 vt_dict_spf_check (vt_dict_t *dict,
                    vt_request_t *req,
@@ -0,0 +1,391 @@
+/* system includes */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* valiant includes */
+#include "alloc.h"
+#include "atomic.h"
+#include "dns_cache.h"
+#include "timer.h"
+
+#define VT_DNS_CACHE_SIZE (16 * 1024) /* kilobytes */
+#define VT_DNS_CACHE_BUCKETS (256) /* initial number of buckets per shard */
+#define VT_DNS_CACHE_MAX_TTL (86400) /* seconds */
+
+/* prototypes */
+unsigned long vt_dns_cache_hash (const char *, vt_resolver_type_t);
+vt_dns_cache_entry_t **vt_dns_cache_find (vt_dns_cache_shard_t *,
+  unsigned long, const char *, vt_resolver_type_t);
+void vt_dns_cache_unlink (vt_dns_cache_shard_t *, vt_dns_cache_entry_t *);
+void vt_dns_cache_grow (vt_dns_cache_shard_t *);
+void vt_dns_cache_evict (vt_dns_cache_shard_t *, size_t, size_t, long);
+
+/* Creates cache that uses at most size kilobytes, or the default if size is
+   zero. */
+vt_dns_cache_t *
+vt_dns_cache_create (size_t size, vt_error_t *err)
+{
+  int i, ret;
+  vt_dns_cache_t *cache;
+  vt_dns_cache_shard_t *shard;
+
+  if (! (cache = vt_memalign (64, sizeof (vt_dns_cache_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: posix_memalign: %s", __func__, strerror (errno));
+    return NULL;
+  }
+
+  memset (cache, 0, sizeof (vt_dns_cache_t));
+  vt_dns_cache_set_size (cache, size);
+
+  for (i = 0; i < VT_DNS_CACHE_SHARDS; i++) {
+    shard = &cache->shards[i];
+    if ((ret = pthread_mutex_init (&shard->lock, NULL)) != 0)
+      vt_fatal ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
+    if (! (shard->buckets = calloc (VT_DNS_CACHE_BUCKETS,
+                                    sizeof (vt_dns_cache_entry_t *))))
+    {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      for (i++; i < VT_DNS_CACHE_SHARDS; i++)
+        (void)pthread_mutex_init (&cache->shards[i].lock, NULL);
+      (void)vt_dns_cache_destroy (cache, NULL);
+      return NULL;
+    }
+    shard->mask = VT_DNS_CACHE_BUCKETS - 1;
+  }
+
+  return cache;
+}
+
+/* NOTE: Resolvers that use the cache must be destroyed first. */
+int
+vt_dns_cache_destroy (vt_dns_cache_t *cache, vt_error_t *err)
+{
+  int i;
+  vt_dns_cache_entry_t *entry;
+  vt_dns_cache_shard_t *shard;
+
+  if (cache) {
+    for (i = 0; i < VT_DNS_CACHE_SHARDS; i++) {
+      shard = &cache->shards[i];
+      while ((entry = shard->hand)) {
+        vt_dns_cache_unlink (shard, entry);
+        free (entry);
+      }
+      if (shard->buckets)
+        free (shard->buckets);
+      (void)pthread_mutex_destroy (&shard->lock);
+    }
+    free (cache);
+  }
+
+  return 0;
+}
+
+/* Sets memory budget in kilobytes, shards shrink as entries are added. */
+void
+vt_dns_cache_set_size (vt_dns_cache_t *cache, size_t size)
+{
+  assert (cache);
+
+  if (! size)
+    size = VT_DNS_CACHE_SIZE;
+  (void)__sync_lock_test_and_set (&cache->max_size,
+    (size * 1024) / VT_DNS_CACHE_SHARDS);
+}
+
+/* FNV-1a of lower case name and type */
+unsigned long
+vt_dns_cache_hash (const char *name, vt_resolver_type_t type)
+{
+  const unsigned char *p;
+  unsigned long hash;
+
+  hash = 2166136261UL;
+  for (p = (const unsigned char *)name; *p; p++) {
+    hash ^= tolower (*p);
+    hash *= 16777619UL;
+  }
+  hash ^= type;
+  hash *= 16777619UL;
+
+  return hash;
+}
+
+vt_dns_cache_entry_t **
+vt_dns_cache_find (vt_dns_cache_shard_t *shard,
+                   unsigned long hash,
+                   const char *name,
+                   vt_resolver_type_t type)
+{
+  vt_dns_cache_entry_t **entry;
+
+  for (entry = &shard->buckets[(hash / VT_DNS_CACHE_SHARDS) & shard->mask];
+       *entry;
+       entry = &(*entry)->chain)
+  {
+    if ((*entry)->hash == hash &&
+        (*entry)->type == type &&
+        strcasecmp ((*entry)->name, name) == 0)
+      break;
+  }
+
+  return entry;
+}
+
+/* removes entry from its bucket and the clock ring */
+void
+vt_dns_cache_unlink (vt_dns_cache_shard_t *shard, vt_dns_cache_entry_t *entry)
+{
+  vt_dns_cache_entry_t **bucket;
+
+  for (bucket = &shard->buckets[(entry->hash / VT_DNS_CACHE_SHARDS) &
+                                shard->mask];
+       *bucket != entry;
+       bucket = &(*bucket)->chain)
+    ;
+  *bucket = entry->chain;
+
+  if (entry->next == entry) {
+    shard->hand = NULL;
+  } else {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    if (shard->hand == entry)
+      shard->hand = entry->next;
+  }
+
+  shard->nentries--;
+  shard->size -= entry->size;
+}
+
+/* doubles the number of buckets, the shard stays usable if memory is short */
+void
+vt_dns_cache_grow (vt_dns_cache_shard_t *shard)
+{
+  unsigned int i, mask, pos;
+  vt_dns_cache_entry_t **buckets, *entry, *next;
+
+  mask = (shard->mask << 1) | 1;
+  if (! (buckets = calloc (mask + 1, sizeof (vt_dns_cache_entry_t *))))
+    return;
+
+  for (i = 0; i <= shard->mask; i++) {
+    for (entry = shard->buckets[i]; entry; entry = next) {
+      next = entry->chain;
+      pos = (entry->hash / VT_DNS_CACHE_SHARDS) & mask;
+      entry->chain = buckets[pos];
+      buckets[pos] = entry;
+    }
+  }
+
+  free (shard->buckets);
+  shard->buckets = buckets;
+  shard->mask = mask;
+}
+
+/* Advances the clock hand until size more bytes fit in max_size. Expired
+   entries are evicted regardless, used ones get a second chance. */
+void
+vt_dns_cache_evict (vt_dns_cache_shard_t *shard,
+                    size_t max_size,
+                    size_t size,
+                    long now)
+{
+  vt_dns_cache_entry_t *entry;
+
+  while ((entry = shard->hand) && (shard->size + size) > max_size) {
+    if (entry->used && entry->expires > now) {
+      entry->used = 0;
+      shard->hand = entry->next;
+    } else {
+      /* hand moves on to next entry */
+      vt_dns_cache_unlink (shard, entry);
+      free (entry);
+    }
+  }
+}
+
+/* Fills in answers if name and type are cached, returns 1 on a hit. */
+int
+vt_dns_cache_lookup (vt_dns_cache_t *cache, vt_resolver_query_t *query)
+{
+  int hit, ret;
+  long now;
+  unsigned long hash;
+  vt_dns_cache_entry_t **found, *entry;
+  vt_dns_cache_shard_t *shard;
+
+  assert (cache);
+  assert (query);
+
+  hash = vt_dns_cache_hash (query->name, query->type);
+  shard = &cache->shards[(hash % VT_DNS_CACHE_SHARDS)];
+  now = vt_timer_now ();
+  hit = 0;
+
+  if ((ret = pthread_mutex_lock (&shard->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+
+  found = vt_dns_cache_find (shard, hash, query->name, query->type);
+  if ((entry = *found) && entry->expires <= now) {
+    vt_dns_cache_unlink (shard, entry);
+    free (entry);
+    entry = NULL;
+  }
+
+  if (entry) {
+    hit = 1;
+    shard->hits++;
+    entry->used = 1;
+    query->status = entry->status;
+    query->naddrs = entry->naddrs;
+    if (entry->naddrs)
+      memcpy (query->addrs, entry->addrs,
+        entry->naddrs * sizeof (struct in_addr));
+    if (entry->txt)
+      strcpy (query->txt, entry->txt);
+    else
+      query->txt[0] = '\0';
+    query->ttl = (entry->expires - now) / 1000;
+  } else {
+    shard->misses++;
+  }
+
+  if ((ret = pthread_mutex_unlock (&shard->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  return hit;
+}
+
+/* Caches answers of completed query. Failures are never cached, neither are
+   negative answers without SOA record. */
+void
+vt_dns_cache_store (vt_dns_cache_t *cache, const vt_resolver_query_t *query)
+{
+  char *p;
+  int ret;
+  long now;
+  size_t len, namelen, size, txtlen;
+  unsigned int ttl;
+  unsigned long hash;
+  vt_dns_cache_entry_t **found, *entry;
+  vt_dns_cache_shard_t *shard;
+
+  assert (cache);
+  assert (query);
+
+  if (query->status != VT_RESOLVER_SUCCESS &&
+      query->status != VT_RESOLVER_NXDOMAIN)
+    return;
+  if (! (ttl = query->ttl))
+    return;
+  if (ttl > VT_DNS_CACHE_MAX_TTL)
+    ttl = VT_DNS_CACHE_MAX_TTL;
+
+  len = strlen (query->name);
+  txtlen = query->txt[0] ? strlen (query->txt) + 1 : 0;
+  /* addresses that follow the name must be aligned */
+  namelen = (len + sizeof (struct in_addr)) & ~(sizeof (struct in_addr) - 1);
+  size = sizeof (vt_dns_cache_entry_t) + namelen +
+         (query->naddrs * sizeof (struct in_addr)) + txtlen;
+
+  if (! (entry = vt_malloc (size)))
+    return;
+
+  memset (entry, 0, sizeof (vt_dns_cache_entry_t));
+  for (p = entry->name; len--; p++)
+    *p = tolower (query->name[(p - entry->name)]);
+  *p = '\0';
+  p = entry->name + namelen;
+  if (query->naddrs) {
+    entry->addrs = (struct in_addr *)p;
+    memcpy (p, query->addrs, query->naddrs * sizeof (struct in_addr));
+    p += query->naddrs * sizeof (struct in_addr);
+  }
+  if (txtlen) {
+    entry->txt = p;
+    memcpy (p, query->txt, txtlen);
+  }
+
+  hash = vt_dns_cache_hash (query->name, query->type);
+  shard = &cache->shards[(hash % VT_DNS_CACHE_SHARDS)];
+  now = vt_timer_now ();
+  entry->hash = hash;
+  entry->expires = now + (ttl * 1000L);
+  entry->type = query->type;
+  entry->status = query->status;
+  entry->naddrs = query->naddrs;
+  entry->size = size;
+
+  if ((ret = pthread_mutex_lock (&shard->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+
+  /* answer replaces the one cached by a concurrent query */
+  found = vt_dns_cache_find (shard, hash, entry->name, entry->type);
+  if (*found) {
+    p = (char *)*found;
+    vt_dns_cache_unlink (shard, *found);
+    free (p);
+  }
+
+  vt_dns_cache_evict (shard, vt_atomic_load (&cache->max_size), size, now);
+  if (shard->nentries >= (shard->mask + 1))
+    vt_dns_cache_grow (shard);
+
+  entry->chain = shard->buckets[(hash / VT_DNS_CACHE_SHARDS) & shard->mask];
+  shard->buckets[(hash / VT_DNS_CACHE_SHARDS) & shard->mask] = entry;
+  /* new entries go right behind the hand, so they are looked at last */
+  if (shard->hand) {
+    entry->next = shard->hand;
+    entry->prev = shard->hand->prev;
+    entry->prev->next = entry;
+    shard->hand->prev = entry;
+  } else {
+    entry->next = entry;
+    entry->prev = entry;
+    shard->hand = entry;
+  }
+  shard->nentries++;
+  shard->size += size;
+
+  if ((ret = pthread_mutex_unlock (&shard->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+}
+
+void
+vt_dns_cache_stats (vt_dns_cache_t *cache,
+                    unsigned long *hits,
+                    unsigned long *misses,
+                    unsigned long *nentries,
+                    size_t *size)
+{
+  int i, ret;
+  vt_dns_cache_shard_t *shard;
+
+  assert (cache);
+
+  *hits = *misses = *nentries = 0;
+  *size = 0;
+
+  for (i = 0; i < VT_DNS_CACHE_SHARDS; i++) {
+    shard = &cache->shards[i];
+    if ((ret = pthread_mutex_lock (&shard->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    *hits += shard->hits;
+    *misses += shard->misses;
+    *nentries += shard->nentries;
+    *size += shard->size;
+    if ((ret = pthread_mutex_unlock (&shard->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+  }
+}
+
+#undef VT_DNS_CACHE_SIZE
+#undef VT_DNS_CACHE_BUCKETS
+#undef VT_DNS_CACHE_MAX_TTL
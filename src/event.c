@@ -0,0 +1,704 @@
+/* accept4 is a GNU extension */
+#define _GNU_SOURCE 1
+
+/* system includes */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* valiant includes */
+#include "affinity.h"
+#include "alloc.h"
+#include "error.h"
+#include "event.h"
+
+#define VT_EVENT_MAX_EVENTS (64)
+#define VT_CONN_MIN_BUF (1024)
+#define VT_CONN_MAX_BUF (65536)
+#define VT_CONN_SPARE_BUF (4096) /* larger buffers are not kept */
+#define VT_EVENT_MAX_SPARE (128)
+
+/* prototypes */
+vt_conn_t *vt_conn_create (vt_event_t *, int, vt_error_t *);
+void vt_conn_close (vt_conn_t *);
+void vt_conn_free (vt_conn_t *);
+void vt_conn_destroy (vt_conn_t *);
+int vt_conn_arm (vt_conn_t *, int);
+int vt_conn_read (vt_conn_t *);
+int vt_conn_scan (vt_conn_t *);
+void vt_event_accept (vt_event_t *);
+void vt_event_dispatch (vt_event_t *, vt_conn_t *);
+int vt_event_shed (vt_event_t *, vt_conn_t *);
+void vt_event_sweep (vt_event_t *);
+void *vt_event_worker (void *);
+
+typedef struct _vt_event_worker_arg vt_event_worker_arg_t;
+
+struct _vt_event_worker_arg {
+  vt_event_t *event;
+  int msecs;
+};
+
+vt_event_t *
+vt_event_create (int sock, vt_thread_pool_t *pool, vt_error_t *err)
+{
+  char *fmt;
+  int flags, ret;
+  struct epoll_event ev;
+  vt_event_t *event;
+
+  assert (pool);
+
+  if (! (event = calloc (1, sizeof (vt_event_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return NULL;
+  }
+
+  if ((ret = pthread_mutex_init (&event->lock, NULL)) != 0) {
+    fmt = "%s: pthread_mutex_init: %s";
+    if (ret != ENOMEM)
+      vt_fatal (fmt, __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (ret));
+    free (event);
+    return NULL;
+  }
+
+  if ((ret = pthread_rwlock_init (&event->pool_lock, NULL)) != 0) {
+    fmt = "%s: pthread_rwlock_init: %s";
+    if (ret != ENOMEM && ret != EAGAIN)
+      vt_fatal (fmt, __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (ret));
+    (void)pthread_mutex_destroy (&event->lock);
+    free (event);
+    return NULL;
+  }
+
+  event->sock = sock;
+  event->epfd = -1;
+  event->sweep = time (NULL);
+  event->pool = pool;
+
+  if ((flags = fcntl (sock, F_GETFL, 0)) < 0 ||
+       fcntl (sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    vt_fatal ("%s: fcntl: %s", __func__, strerror (errno));
+
+  if ((event->epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+    fmt = "%s: epoll_create1: %s";
+    if (errno != ENOMEM && errno != EMFILE && errno != ENFILE)
+      vt_fatal (fmt, __func__, strerror (errno));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (errno));
+    goto failure;
+  }
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL; /* listening socket */
+
+  if (epoll_ctl (event->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+    fmt = "%s: epoll_ctl: %s";
+    if (errno != ENOMEM && errno != ENOSPC)
+      vt_fatal (fmt, __func__, strerror (errno));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (errno));
+    goto failure;
+  }
+
+  return event;
+failure:
+  (void)vt_event_destroy (event, NULL);
+  return NULL;
+}
+
+/* NOTE: Connections that are being evaluated are owned by the worker pool.
+   Destroy the pool before the event loop to make sure there are none. */
+int
+vt_event_destroy (vt_event_t *event, vt_error_t *err)
+{
+  int ret;
+  vt_conn_t *conn;
+
+  if (event) {
+    (void)vt_event_stop (event, NULL);
+    while (event->conns)
+      vt_conn_close (event->conns);
+    while ((conn = event->spare)) {
+      event->spare = conn->next;
+      vt_conn_destroy (conn);
+    }
+    if (event->epfd >= 0)
+      (void)close (event->epfd);
+    if ((ret = pthread_rwlock_destroy (&event->pool_lock)) != 0)
+      vt_panic ("%s: pthread_rwlock_destroy: %s", __func__, strerror (ret));
+    if ((ret = pthread_mutex_destroy (&event->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_destroy: %s", __func__, strerror (ret));
+    free (event);
+  }
+  return 0;
+}
+
+/* NOTE: Once vt_event_set_pool returns no more requests are dispatched to the
+   previous pool, so it is safe to destroy it. */
+void
+vt_event_set_pool (vt_event_t *event, vt_thread_pool_t *pool)
+{
+  int ret;
+
+  assert (event);
+  assert (pool);
+
+  if ((ret = pthread_rwlock_wrlock (&event->pool_lock)) != 0)
+    vt_panic ("%s: pthread_rwlock_wrlock: %s", __func__, strerror (ret));
+  event->pool = pool;
+  if ((ret = pthread_rwlock_unlock (&event->pool_lock)) != 0)
+    vt_panic ("%s: pthread_rwlock_unlock: %s", __func__, strerror (ret));
+}
+
+void
+vt_event_set_timeout (vt_event_t *event, int reuse_conns, int timeout)
+{
+  assert (event);
+  event->reuse_conns = reuse_conns;
+  event->timeout = timeout;
+}
+
+/* NOTE: Response must include the empty line that terminates it and remain
+   valid until it's replaced. */
+void
+vt_event_set_overload (vt_event_t *event, const char *resp, size_t len)
+{
+  int ret;
+
+  assert (event);
+
+  if ((ret = pthread_rwlock_wrlock (&event->pool_lock)) != 0)
+    vt_panic ("%s: pthread_rwlock_wrlock: %s", __func__, strerror (ret));
+  event->overload_resp = resp;
+  event->overload_len = len;
+  if ((ret = pthread_rwlock_unlock (&event->pool_lock)) != 0)
+    vt_panic ("%s: pthread_rwlock_unlock: %s", __func__, strerror (ret));
+}
+
+/* NOTE: Only applies if event loop is started afterwards. Connection buffers
+   are allocated by the event loop thread and thus end up in memory local to
+   the processors it is placed on. */
+void
+vt_event_set_affinity (vt_event_t *event, const vt_affinity_t *aff)
+{
+  assert (event);
+  assert (aff);
+  memcpy (&event->cpus, aff, sizeof (vt_affinity_t));
+}
+
+/* Closed connections are kept on a list of spares together with their buffer
+   and the job the worker attached, so that accepting a connection does not
+   allocate memory once the daemon is warmed up. */
+vt_conn_t *
+vt_conn_create (vt_event_t *event, int fd, vt_error_t *err)
+{
+  int ret;
+  vt_conn_t *conn;
+
+  if ((ret = pthread_mutex_lock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if ((conn = event->spare)) {
+    event->spare = conn->next;
+    event->nspare--;
+  }
+  if ((ret = pthread_mutex_unlock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  if (! conn) {
+    if (! (conn = vt_calloc (1, sizeof (vt_conn_t))) ||
+        ! (conn->buf = vt_malloc (VT_CONN_MIN_BUF)))
+    {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      if (conn)
+        free (conn);
+      return NULL;
+    }
+    conn->size = VT_CONN_MIN_BUF;
+  }
+
+  conn->fd = fd;
+  conn->state = VT_CONN_STATE_READ;
+  conn->atime = time (NULL);
+  conn->len = 0;
+  conn->scan = 0;
+  conn->end = 0;
+  conn->event = event;
+  conn->pool = NULL;
+  conn->prev = NULL;
+
+  if ((ret = pthread_mutex_lock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if ((conn->next = event->conns))
+    conn->next->prev = conn;
+  event->conns = conn;
+  event->nconns++;
+  if ((ret = pthread_mutex_unlock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  return conn;
+}
+
+void
+vt_conn_close (vt_conn_t *conn)
+{
+  int ret;
+  vt_event_t *event;
+
+  assert (conn);
+  event = conn->event;
+
+  if ((ret = pthread_mutex_lock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    event->conns = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  event->nconns--;
+  if ((ret = pthread_mutex_unlock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  vt_conn_free (conn);
+}
+
+void
+vt_conn_free (vt_conn_t *conn)
+{
+  int ret;
+  vt_event_t *event;
+
+  event = conn->event;
+  /* closing the descriptor removes it from the epoll set */
+  (void)close (conn->fd);
+  conn->fd = -1;
+
+  if (conn->size <= VT_CONN_SPARE_BUF) {
+    if ((ret = pthread_mutex_lock (&event->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    if (event->nspare < VT_EVENT_MAX_SPARE) {
+      conn->prev = NULL;
+      conn->next = event->spare;
+      event->spare = conn;
+      event->nspare++;
+      conn = NULL;
+    }
+    if ((ret = pthread_mutex_unlock (&event->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+  }
+
+  if (conn)
+    vt_conn_destroy (conn);
+}
+
+void
+vt_conn_destroy (vt_conn_t *conn)
+{
+  if (conn->data && conn->data_free)
+    conn->data_free (conn->data);
+  free (conn->buf);
+  free (conn);
+}
+
+/* Connections are registered edge-triggered and one-shot. Once an event is
+   reported the connection is disabled until it is armed again, which is what
+   allows workers to hand connections back without further locking. */
+int
+vt_conn_arm (vt_conn_t *conn, int op)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+  ev.data.ptr = (void *)conn;
+
+  if (epoll_ctl (conn->event->epfd, op, conn->fd, &ev) < 0) {
+    vt_error ("%s: epoll_ctl: %s", __func__, strerror (errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Postfix terminates every attribute with a newline and the request itself
+   with an empty line. Scanning resumes at the start of the last incomplete
+   line so that every byte is looked at once. */
+int
+vt_conn_scan (vt_conn_t *conn)
+{
+  char *ptr;
+  size_t pos;
+
+  for (pos = conn->scan; pos < conn->len; pos = conn->scan) {
+    if (! (ptr = memchr (conn->buf + pos, '\n', conn->len - pos)))
+      break;
+
+    conn->scan = (ptr - conn->buf) + 1;
+
+    if ((ptr - conn->buf) == pos ||
+       ((ptr - conn->buf) == (pos + 1) && conn->buf[pos] == '\r'))
+    {
+      conn->end = conn->scan;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* returns 1 if a complete request is buffered, 0 if more data is needed and
+   -1 if the connection must be closed */
+int
+vt_conn_read (vt_conn_t *conn)
+{
+  char *buf;
+  ssize_t nrd;
+
+  for (;;) {
+    if (conn->len == conn->size) {
+      if (conn->size >= VT_CONN_MAX_BUF) {
+        vt_error ("%s: request exceeds %d bytes", __func__, VT_CONN_MAX_BUF);
+        return -1;
+      }
+      if (! (buf = vt_realloc (conn->buf, conn->size * 2))) {
+        vt_error ("%s: realloc: %s", __func__, strerror (errno));
+        return -1;
+      }
+      conn->buf = buf;
+      conn->size *= 2;
+    }
+
+    nrd = read (conn->fd, conn->buf + conn->len, conn->size - conn->len);
+
+    if (nrd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno != ECONNRESET)
+        vt_error ("%s: read: %s", __func__, strerror (errno));
+      return -1;
+    } else if (nrd == 0) {
+      return -1; /* end of file */
+    }
+
+    conn->len += nrd;
+    conn->atime = time (NULL);
+
+    if (vt_conn_scan (conn))
+      return 1;
+  }
+
+  return 0;
+}
+
+void
+vt_event_accept (vt_event_t *event)
+{
+  int fd;
+  vt_conn_t *conn;
+  vt_error_t err;
+
+  /* listening socket is edge-triggered, accept until the queue is drained */
+  for (;;) {
+    fd = accept4 (event->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+          continue;
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+          return;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+          vt_error ("%s: accept4: %s", __func__, strerror (errno));
+          return;
+        default:
+          vt_fatal ("%s: accept4: %s", __func__, strerror (errno));
+      }
+    }
+
+    err = 0;
+    if (! (conn = vt_conn_create (event, fd, &err))) {
+      (void)close (fd);
+      continue;
+    }
+    if (vt_conn_arm (conn, EPOLL_CTL_ADD) < 0)
+      vt_conn_close (conn);
+  }
+}
+
+void
+vt_event_dispatch (vt_event_t *event, vt_conn_t *conn)
+{
+  int ret, res;
+  vt_error_t err;
+
+  do {
+    /* connection belongs to the worker from here on */
+    conn->state = VT_CONN_STATE_BUSY;
+
+    err = 0;
+    if ((ret = pthread_rwlock_rdlock (&event->pool_lock)) != 0)
+      vt_panic ("%s: pthread_rwlock_rdlock: %s", __func__, strerror (ret));
+    conn->pool = event->pool;
+    if ((res = vt_thread_pool_push (event->pool, (void *)conn, &err)) != 0)
+      res = vt_event_shed (event, conn);
+    if ((ret = pthread_rwlock_unlock (&event->pool_lock)) != 0)
+      vt_panic ("%s: pthread_rwlock_unlock: %s", __func__, strerror (ret));
+
+    if (res < 0) {
+      vt_error ("%s: cannot queue request, closing connection", __func__);
+      vt_conn_close (conn);
+      return;
+    }
+    /* request was answered, dispatch next request if already buffered */
+  } while (res > 0 && vt_event_done (conn, 1));
+}
+
+/* Answers request with the overload response if the pool refused it, so that
+   the client is not kept waiting. Returns 1 if answered and -1 if the
+   connection must be closed. Called with pool_lock held. */
+int
+vt_event_shed (vt_event_t *event, vt_conn_t *conn)
+{
+  ssize_t nwn;
+
+  if (! event->overload_resp)
+    return -1;
+
+  /* response is small, if it doesn't fit in the send buffer the client is
+     not reading and the connection is not worth keeping */
+  do {
+    nwn = send (conn->fd, event->overload_resp, event->overload_len,
+      MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (nwn < 0 && errno == EINTR);
+
+  if (nwn < 0 || (size_t)nwn != event->overload_len)
+    return -1;
+  return 1;
+}
+
+void
+vt_event_sweep (vt_event_t *event)
+{
+  int ret;
+  time_t now;
+  vt_conn_t *conn, *next, *idle;
+
+  now = time (NULL);
+  if (event->timeout <= 0 || now == event->sweep)
+    return;
+
+  event->sweep = now;
+  idle = NULL;
+
+  if ((ret = pthread_mutex_lock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  for (conn = event->conns; conn; conn = next) {
+    next = conn->next;
+    if (conn->state == VT_CONN_STATE_READ &&
+       (conn->atime + event->timeout) < now)
+    {
+      /* move to list of idle connections */
+      if (conn->prev)
+        conn->prev->next = conn->next;
+      else
+        event->conns = conn->next;
+      if (conn->next)
+        conn->next->prev = conn->prev;
+      event->nconns--;
+      conn->next = idle;
+      idle = conn;
+    }
+  }
+  if ((ret = pthread_mutex_unlock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  for (conn = idle; conn; conn = next) {
+    next = conn->next;
+    vt_debug ("%s: closing idle connection", __func__);
+    vt_conn_free (conn);
+  }
+}
+
+/* wait at most msecs milliseconds for events and process them, returns the
+   number of events processed */
+int
+vt_event_loop (vt_event_t *event, int msecs)
+{
+  int i, n;
+  struct epoll_event events[VT_EVENT_MAX_EVENTS];
+  vt_conn_t *conn;
+
+  assert (event);
+
+  n = epoll_wait (event->epfd, events, VT_EVENT_MAX_EVENTS, msecs);
+  if (n < 0) {
+    if (errno != EINTR)
+      vt_fatal ("%s: epoll_wait: %s", __func__, strerror (errno));
+    n = 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (! (conn = (vt_conn_t *)events[i].data.ptr)) {
+      vt_event_accept (event);
+      continue;
+    }
+
+    switch (vt_conn_read (conn)) {
+      case 1:
+        vt_event_dispatch (event, conn);
+        break;
+      case 0:
+        if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ||
+            vt_conn_arm (conn, EPOLL_CTL_MOD) < 0)
+          vt_conn_close (conn);
+        break;
+      default:
+        vt_conn_close (conn);
+        break;
+    }
+  }
+
+  vt_event_sweep (event);
+
+  return n;
+}
+
+void *
+vt_event_worker (void *arg)
+{
+  int msecs;
+  vt_event_t *event;
+
+  assert (arg);
+  event = ((vt_event_worker_arg_t *)arg)->event;
+  msecs = ((vt_event_worker_arg_t *)arg)->msecs;
+  free (arg);
+
+  while (! __sync_fetch_and_add (&event->dead, 0))
+    (void)vt_event_loop (event, msecs);
+
+  return NULL;
+}
+
+/* Run event loop in a thread of its own. The loop checks if it must stop at
+   least once every msecs milliseconds. */
+int
+vt_event_start (vt_event_t *event, int msecs, vt_error_t *err)
+{
+  int ret;
+  pthread_attr_t attr;
+  vt_event_worker_arg_t *arg;
+
+  assert (event);
+  assert (! event->running);
+
+  if (! (arg = calloc (1, sizeof (vt_event_worker_arg_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return -1;
+  }
+
+  arg->event = event;
+  arg->msecs = msecs;
+  event->dead = 0;
+
+  if ((ret = pthread_attr_init (&attr)) != 0)
+    vt_fatal ("%s: pthread_attr_init: %s", __func__, strerror (ret));
+  (void)vt_affinity_attr (&attr, &event->cpus, -1);
+
+  ret = pthread_create (&event->thread, &attr, &vt_event_worker, arg);
+  (void)pthread_attr_destroy (&attr);
+
+  if (ret != 0) {
+    if (ret != EAGAIN)
+      vt_fatal ("%s: pthread_create: %s", __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: pthread_create: %s", __func__, strerror (ret));
+    free (arg);
+    return -1;
+  }
+
+  event->running = 1;
+  return 0;
+}
+
+int
+vt_event_stop (vt_event_t *event, vt_error_t *err)
+{
+  int ret;
+
+  assert (event);
+
+  if (event->running) {
+    (void)__sync_lock_test_and_set (&event->dead, 1);
+    if ((ret = pthread_join (event->thread, NULL)) != 0)
+      vt_panic ("%s: pthread_join: %s", __func__, strerror (ret));
+    event->running = 0;
+  }
+
+  return 0;
+}
+
+/* Called by the worker once the response is written. Returns 1 if another
+   complete request is already buffered, in which case the worker keeps the
+   connection and evaluates that request too. */
+int
+vt_event_done (vt_conn_t *conn, int keep)
+{
+  int ret;
+  vt_event_t *event;
+
+  assert (conn);
+  event = conn->event;
+
+  if (! keep || ! event->reuse_conns) {
+    vt_conn_close (conn);
+    return 0;
+  }
+
+  /* discard evaluated request, keep whatever followed it */
+  if (conn->len > conn->end)
+    memmove (conn->buf, conn->buf + conn->end, conn->len - conn->end);
+  conn->len -= conn->end;
+  conn->end = 0;
+  conn->scan = 0;
+  conn->atime = time (NULL);
+
+  if (vt_conn_scan (conn))
+    return 1;
+
+  if ((ret = pthread_mutex_lock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  conn->state = VT_CONN_STATE_READ;
+  if ((ret = pthread_mutex_unlock (&event->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  if (vt_conn_arm (conn, EPOLL_CTL_MOD) < 0)
+    vt_conn_close (conn);
+  return 0;
+}
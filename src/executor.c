@@ -0,0 +1,208 @@
+/* system includes */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* valiant includes */
+#include "error.h"
+#include "executor.h"
+#include "thread_pool.h"
+
+/* prototypes */
+void vt_executor_worker (void *, void *);
+
+vt_executor_t *
+vt_executor_create (unsigned int threads, vt_error_t *err)
+{
+  vt_executor_t *executor;
+
+  if (! (executor = calloc (1, sizeof (vt_executor_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return NULL;
+  }
+
+  if (! (executor->pool = vt_thread_pool_create ((void *)executor, threads,
+           &vt_executor_worker, err)))
+  {
+    free (executor);
+    return NULL;
+  }
+
+  return executor;
+}
+
+/* NOTE: Lanes must be destroyed first. */
+int
+vt_executor_destroy (vt_executor_t *executor, vt_error_t *err)
+{
+  if (executor) {
+    if (executor->pool)
+      (void)vt_thread_pool_destroy (executor->pool, err);
+    free (executor);
+  }
+  return 0;
+}
+
+vt_executor_lane_t *
+vt_executor_lane_create (vt_executor_t *executor,
+                         VT_EXECUTOR_FUNC func,
+                         void *user_data,
+                         unsigned int max_running,
+                         unsigned int max_queued,
+                         vt_error_t *err)
+{
+  char *fmt;
+  int ret;
+  vt_executor_lane_t *lane;
+
+  assert (executor);
+  assert (func);
+
+  if (! (lane = calloc (1, sizeof (vt_executor_lane_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return NULL;
+  }
+  if ((ret = pthread_mutex_init (&lane->lock, NULL)) != 0) {
+    fmt = "%s: pthread_mutex_init: %s";
+    if (ret != ENOMEM)
+      vt_fatal (fmt, __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (ret));
+    free (lane);
+    return NULL;
+  }
+
+  lane->executor = executor;
+  lane->function = func;
+  lane->user_data = user_data;
+  lane->max_running = max_running;
+  lane->max_queued = max_queued;
+
+  return lane;
+}
+
+#define DESTROY_INTERVAL (10000000) /* nanoseconds */
+
+/* waits for queued and running tasks to finish, new tasks must not be
+   submitted */
+int
+vt_executor_lane_destroy (vt_executor_lane_t *lane, vt_error_t *err)
+{
+  int busy, ret;
+  struct timespec wait;
+
+  if (lane) {
+    for (;;) {
+      if ((ret = pthread_mutex_lock (&lane->lock)) != 0)
+        vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+      busy = (lane->running || lane->queued);
+      if ((ret = pthread_mutex_unlock (&lane->lock)) != 0)
+        vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+      if (! busy)
+        break;
+
+      wait.tv_sec = 0;
+      wait.tv_nsec = DESTROY_INTERVAL;
+      (void)nanosleep (&wait, NULL);
+    }
+
+    if ((ret = pthread_mutex_destroy (&lane->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_destroy: %s", __func__, strerror (ret));
+    free (lane);
+  }
+
+  return 0;
+}
+
+#undef DESTROY_INTERVAL
+
+/* Queues task on lane. The lane is handed a turn on the pool if it has not
+   used up its quota. */
+int
+vt_executor_submit (vt_executor_lane_t *lane,
+                    vt_executor_task_t *task,
+                    vt_error_t *err)
+{
+  int ret, turn;
+
+  assert (lane);
+  assert (task);
+
+  task->next = NULL;
+
+  if ((ret = pthread_mutex_lock (&lane->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+
+  if (lane->max_queued && lane->queued >= lane->max_queued) {
+    if ((ret = pthread_mutex_unlock (&lane->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_QFULL);
+    vt_error ("%s: queue full", __func__);
+    return -1;
+  }
+
+  if (lane->last_task)
+    lane->last_task->next = task;
+  else
+    lane->first_task = task;
+  lane->last_task = task;
+  lane->queued++;
+
+  turn = (! lane->max_running || lane->running < lane->max_running);
+  if (turn)
+    lane->running++;
+
+  if ((ret = pthread_mutex_unlock (&lane->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  /* turns are never refused, the number of turns is bounded by quotas and
+     tasks were accepted already */
+  if (turn && vt_thread_pool_resume (lane->executor->pool, lane, err) != 0)
+    vt_panic ("%s: cannot hand turn to pool", __func__);
+
+  return 0;
+}
+
+/* Runs one task of lane and sends lane to the back of the line if more
+   tasks are waiting. */
+void
+vt_executor_worker (void *arg, void *user_data)
+{
+  int ret, turn;
+  vt_executor_lane_t *lane;
+  vt_executor_task_t *task;
+
+  assert (arg);
+  lane = (vt_executor_lane_t *)arg;
+
+  if ((ret = pthread_mutex_lock (&lane->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if ((task = lane->first_task)) {
+    if (! (lane->first_task = task->next))
+      lane->last_task = NULL;
+    lane->queued--;
+  }
+  if ((ret = pthread_mutex_unlock (&lane->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  if (task)
+    lane->function (task, lane->user_data);
+
+  if ((ret = pthread_mutex_lock (&lane->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  /* keep turn if tasks are waiting that no other turn will pick up */
+  turn = (lane->queued >= lane->running);
+  if (! turn)
+    lane->running--;
+  if ((ret = pthread_mutex_unlock (&lane->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  if (turn && vt_thread_pool_resume (lane->executor->pool, lane, NULL) != 0)
+    vt_panic ("%s: cannot hand turn to pool", __func__);
+}
@@ -0,0 +1,134 @@
+/* system includes */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* valiant includes */
+#include "flight.h"
+
+#define VT_FLIGHT_MIN_BUCKETS (16)
+
+/* prototypes */
+unsigned long vt_flight_hash (vt_flight_t *, unsigned int, const char *);
+
+/* Initializes table with room for about size lookups. The table does not
+   grow, the number of lookups in flight is bounded by whoever issues them. */
+int
+vt_flight_init (vt_flight_t *flight, unsigned int size, int flags,
+  vt_error_t *err)
+{
+  unsigned int n;
+
+  assert (flight);
+
+  memset (flight, 0, sizeof (vt_flight_t));
+  for (n = VT_FLIGHT_MIN_BUCKETS; n < size; n <<= 1)
+    ;
+
+  if (! (flight->buckets = calloc (n, sizeof (vt_flight_node_t *)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return -1;
+  }
+
+  flight->mask = n - 1;
+  flight->flags = flags;
+  return 0;
+}
+
+/* NOTE: Lookups must no longer be in flight. */
+void
+vt_flight_deinit (vt_flight_t *flight)
+{
+  if (flight && flight->buckets) {
+    free (flight->buckets);
+    flight->buckets = NULL;
+  }
+}
+
+/* FNV-1a */
+unsigned long
+vt_flight_hash (vt_flight_t *flight, unsigned int tag, const char *key)
+{
+  const unsigned char *p;
+  unsigned long hash;
+
+  hash = 2166136261UL;
+  if (flight->flags & VT_FLIGHT_FLAG_NOCASE) {
+    for (p = (const unsigned char *)key; *p; p++) {
+      hash ^= tolower (*p);
+      hash *= 16777619UL;
+    }
+  } else {
+    for (p = (const unsigned char *)key; *p; p++) {
+      hash ^= *p;
+      hash *= 16777619UL;
+    }
+  }
+  hash ^= tag;
+  hash *= 16777619UL;
+
+  return hash;
+}
+
+/* Returns 1 if node leads the lookup and the caller must do it, 0 if node
+   follows a lookup that is in flight already. */
+int
+vt_flight_join (vt_flight_t *flight, unsigned int tag, const char *key,
+  vt_flight_node_t *node)
+{
+  unsigned long hash;
+  vt_flight_node_t **bucket, *leader;
+
+  assert (flight);
+  assert (key);
+  assert (node);
+
+  hash = vt_flight_hash (flight, tag, key);
+  bucket = &flight->buckets[hash & flight->mask];
+  for (leader = *bucket; leader; leader = leader->chain) {
+    if (leader->hash == hash && leader->tag == tag &&
+        ((flight->flags & VT_FLIGHT_FLAG_NOCASE) ?
+          strcasecmp (leader->key, key) : strcmp (leader->key, key)) == 0)
+    {
+      node->followers = NULL;
+      node->next = leader->followers;
+      leader->followers = node;
+      flight->followers++;
+      return 0;
+    }
+  }
+
+  node->hash = hash;
+  node->tag = tag;
+  node->key = key;
+  node->followers = NULL;
+  node->next = NULL;
+  node->chain = *bucket;
+  *bucket = node;
+  flight->leaders++;
+  return 1;
+}
+
+/* Takes lookup led by node out of flight, nobody can join it afterwards.
+   Followers remain linked to node, the caller hands them the answer. */
+void
+vt_flight_leave (vt_flight_t *flight, vt_flight_node_t *node)
+{
+  vt_flight_node_t **bucket;
+
+  assert (flight);
+  assert (node);
+
+  for (bucket = &flight->buckets[node->hash & flight->mask];
+       *bucket != node;
+       bucket = &(*bucket)->chain)
+    assert (*bucket);
+
+  *bucket = node->chain;
+  node->chain = NULL;
+}
+
+#undef VT_FLIGHT_MIN_BUCKETS
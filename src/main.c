@@ -10,29 +10,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /* valiant includes */
+#include "affinity.h"
 #include "conf.h"
 #include "context.h"
 #include "dict_dnsbl.h"
 #include "dict_hash.h"
+#include "dict_multi_dnsbl.h"
 #include "dict_pcre.h"
 #include "dict_rhsbl.h"
 #include "dict_spf.h"
 #include "dict_str.h"
+#include "event.h"
 #include "stats.h"
 #include "thread_pool.h"
 #include "watchdog.h"
 #include "worker.h"
 
-#define VT_SELECT_TIMEOUT_SECONDS (2)
-#define VT_SELECT_TIMEOUT_MICROSECONDS (0)
+#define VT_EVENT_TIMEOUT_MILLISECONDS (2000)
+#define VT_LISTEN_BACKLOG (10)
 
 typedef struct _vt_cleanup_arg vt_cleanup_arg_t;
 
 struct _vt_cleanup_arg {
-  vt_context_t *context;
-  vt_thread_pool_t *workers;
+  vt_worker_arg_t *warg; /* context and stats of workers, owned */
+  vt_thread_pool_t **workers;
+  int nworkers;
 };
 
 /* prototypes */
@@ -41,7 +46,11 @@ void usage (const char *);
 void version (const char *);
 
 void *vt_cleanup_worker (void *);
-void vt_cleanup (vt_thread_pool_t *, vt_context_t *, int);
+void vt_cleanup (vt_thread_pool_t **, int, vt_worker_arg_t *, int);
+int vt_listen (vt_context_t *, int);
+vt_affinity_t *vt_places_create (vt_context_t *, int);
+vt_thread_pool_t **vt_pools_create (vt_context_t *, vt_worker_arg_t *, int,
+  const vt_affinity_t *, vt_error_t *);
 
 void
 help (const char *prog)
@@ -85,53 +94,185 @@ version (const char *prog)
 void *
 vt_cleanup_worker (void *arg)
 {
-  vt_context_t *context;
-  vt_thread_pool_t *workers;
+  int i, nworkers;
+  vt_worker_arg_t *warg;
+  vt_thread_pool_t **workers;
 
   assert (arg);
 
-  context = ((vt_cleanup_arg_t *)arg)->context;
+  warg = ((vt_cleanup_arg_t *)arg)->warg;
   workers = ((vt_cleanup_arg_t *)arg)->workers;
+  nworkers = ((vt_cleanup_arg_t *)arg)->nworkers;
 vt_error ("%s:%d: ", __func__, __LINE__);
   free (arg);
 vt_error ("%s:%d: ", __func__, __LINE__);
-  (void)vt_thread_pool_destroy (workers, NULL);
+  for (i = 0; i < nworkers; i++) {
+    if (workers[i])
+      (void)vt_thread_pool_destroy (workers[i], NULL);
+  }
+  free (workers);
 vt_error ("%s:%d: ", __func__, __LINE__);
-  (void)vt_context_destroy (context, NULL);
+  /* requests that were put aside write to stats until pools are drained */
+  (void)vt_stats_destroy (warg->stats, NULL);
+  (void)vt_context_destroy (warg->context, NULL);
+  free (warg);
 vt_error ("%s:%d: ", __func__, __LINE__);
   return NULL;
 }
 
 void
-vt_cleanup (vt_thread_pool_t *workers, vt_context_t *context, int async)
+vt_cleanup (vt_thread_pool_t **workers, int nworkers, vt_worker_arg_t *warg,
+  int async)
 {
   int ret;
   pthread_t thread;
   vt_cleanup_arg_t *arg;
 
-  arg = NULL;
-  if (! async)
-    goto failure;
   if (! (arg = calloc (1, sizeof (vt_cleanup_arg_t)))) {
     vt_error ("%s: calloc: %s", __func__, strerror (errno));
-    goto failure;
-    
+    return;
   }
 
-  arg->context = context;
+  arg->warg = warg;
   arg->workers = workers;
+  arg->nworkers = nworkers;
 
-  if ((ret = pthread_create (&thread, NULL, vt_cleanup_worker, (void *)arg)) < 0) {
+  if (! async)
+    goto failure;
+
+  if ((ret = pthread_create (&thread, NULL, vt_cleanup_worker, (void *)arg)) != 0) {
     vt_error ("%s: pthread_create: %s", __func__, strerror (ret));
     goto failure;
   }
 
+  (void)pthread_detach (thread);
   return;
 failure:
-  if (arg)
-    free (arg);
-  // fine... need to do it ourselves
-  // handle errors
+  /* fine... need to do it ourselves */
+  (void)vt_cleanup_worker ((void *)arg);
+}
+
+/* open socket that we will listen on, with reuse_port set multiple sockets
+   can be bound to the same address and the kernel spreads incoming
+   connections across them */
+int
+vt_listen (vt_context_t *ctx, int reuse_port)
+{
+  int backlog, on, ret, sock;
+  struct addrinfo hints, *res;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if ((ret = getaddrinfo (NULL, ctx->port, &hints, &res)) != 0) {
+    vt_error ("%s: getaddrinfo: %s", __func__, gai_strerror (ret));
+    return -1;
+  }
+
+  backlog = ctx->listen_backlog > 0 ? ctx->listen_backlog : VT_LISTEN_BACKLOG;
+
+  on = 1;
+  if ((sock = socket (res->ai_family, res->ai_socktype, res->ai_protocol)) < 0)
+    vt_error ("%s: socket: %s", __func__, strerror (errno));
+  else if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) < 0)
+    vt_error ("%s: setsockopt: %s", __func__, strerror (errno));
+  else if (reuse_port &&
+           setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0)
+    vt_error ("%s: setsockopt: %s", __func__, strerror (errno));
+  else if (bind (sock, res->ai_addr, res->ai_addrlen) < 0)
+    vt_error ("%s: bind: %s", __func__, strerror (errno));
+  else if (listen (sock, backlog) < 0)
+    vt_error ("%s: listen: %s", __func__, strerror (errno));
+  else
+    goto success;
+
+  if (sock >= 0)
+    (void)close (sock);
+  sock = -1;
+success:
+  freeaddrinfo (res);
+  return sock;
+}
+
+/* Decides which processors every listener and its workers are placed on.
+   With numa enabled listeners are spread over the nodes, so that requests
+   are accepted, buffered and evaluated by processors that share memory. Per
+   thread data is allocated by the thread that uses it and thus ends up in
+   memory local to its node. Placement is fixed at startup, like the number
+   of listeners. */
+vt_affinity_t *
+vt_places_create (vt_context_t *ctx, int nplaces)
+{
+  int i, nnodes;
+  vt_affinity_t nodes, *places;
+
+  if (! (places = calloc (nplaces, sizeof (vt_affinity_t))))
+    vt_fatal ("%s: calloc: %s", __func__, strerror (errno));
+
+  nnodes = ctx->numa ? vt_affinity_nodes (&nodes) : 0;
+
+  /* node ids need not be contiguous, nth wraps around */
+  for (i = 0; i < nplaces; i++) {
+    if (nnodes > 1 &&
+        vt_affinity_node (&places[i], vt_affinity_nth (&nodes, i)) == 0)
+    {
+      if (vt_affinity_count (&ctx->cpus))
+        vt_affinity_intersect (&places[i], &ctx->cpus);
+    } else {
+      memcpy (&places[i], &ctx->cpus, sizeof (vt_affinity_t));
+    }
+  }
+
+  return places;
+}
+
+/* every listener gets a worker pool of its own so that listeners do not
+   contend for a single queue, limits are divided evenly */
+vt_thread_pool_t **
+vt_pools_create (vt_context_t *ctx, vt_worker_arg_t *warg, int npools,
+  const vt_affinity_t *places, vt_error_t *err)
+{
+  int i, min_threads, max_threads, max_idle_threads, max_tasks;
+  vt_thread_pool_t **pools;
+
+  if (! (pools = calloc (npools, sizeof (vt_thread_pool_t *)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return NULL;
+  }
+
+#define VT_SHARE(n) ((n) > 0 && (n) < npools ? 1 : (n) / npools)
+  min_threads = VT_SHARE (ctx->min_threads);
+  max_threads = VT_SHARE (ctx->max_threads);
+  max_idle_threads = VT_SHARE (ctx->max_idle_threads);
+  max_tasks = VT_SHARE (ctx->max_tasks);
+#undef VT_SHARE
+
+  for (i = 0; i < npools; i++) {
+    pools[i] = vt_thread_pool_create ((void *)warg, max_threads, &vt_worker, err);
+    if (! pools[i])
+      goto failure;
+    vt_thread_pool_set_max_idle_threads (pools[i], max_idle_threads);
+    vt_thread_pool_set_max_queued (pools[i], max_tasks);
+    vt_thread_pool_set_max_delay (pools[i], ctx->max_queue_delay);
+    vt_thread_pool_set_work_stealing (pools[i], ctx->work_stealing);
+    vt_thread_pool_set_affinity (pools[i], &places[i]);
+    if (ctx->idle_timeout)
+      vt_thread_pool_set_idle_timeout (pools[i], ctx->idle_timeout);
+    vt_thread_pool_set_min_threads (pools[i], min_threads);
+    vt_thread_pool_set_target_delay (pools[i], ctx->target_queue_delay);
+  }
+
+  return pools;
+failure:
+  for (i = 0; i < npools; i++) {
+    if (pools[i])
+      (void)vt_thread_pool_destroy (pools[i], NULL);
+  }
+  free (pools);
+  return NULL;
 }
 
 int
@@ -141,10 +282,12 @@ main (int argc, char *argv[])
   char *prog;
   char *config_file = "/etc/valiant/valiant.conf";
   vt_context_t *ctx;
-  vt_dict_type_t *types[7];
+  vt_dict_type_t *types[8];
+  vt_dns_cache_t *dns_cache;
   vt_error_t err;
-  vt_thread_pool_t *pool;
+  vt_thread_pool_t **pools;
   vt_stats_t *stats, *new_stats;
+  vt_worker_arg_t *warg, *new_warg;
 
   if ((prog = strrchr (argv[0], '/')))
     prog++;
@@ -198,13 +341,22 @@ main (int argc, char *argv[])
   types[3] = vt_dict_rhsbl_type ();
   types[4] = vt_dict_spf_type ();
   types[5] = vt_dict_str_type ();
-  types[6] = NULL;
+  types[6] = vt_dict_multi_dnsbl_type ();
+  types[7] = NULL;
+
+  /* answers are cached for the lifetime of the process, not the context */
+  if (! (dns_cache = vt_dns_cache_create (cfg_getint (cfg, "dns_cache_size"),
+           &err)))
+    vt_fatal ("cannot create dns cache: %d", err);
 
-  if (! (ctx = vt_context_create (types, cfg, &err)))
+  if (! (ctx = vt_context_create (types, cfg, dns_cache, &err)))
     vt_fatal ("cannot create context: %d", err);
 
   cfg_free (cfg);
 
+  /* helper threads created from here on inherit placement of main thread */
+  (void)vt_affinity_bind (&ctx->cpus);
+
 
   // drop priveleges
   // fprintf (stderr, "%s (%d)\n", __func__, __LINE__);
@@ -212,50 +364,63 @@ main (int argc, char *argv[])
 
   // create stats printer
   stats = vt_stats_create (ctx->dicts, ctx->ndicts, &err);
+  stats->context = ctx;
+  stats->dns_cache = dns_cache;
   vt_stats_thread (stats);
 
-  vt_worker_arg_t warg;
-  warg.context = ctx;
-  warg.stats = stats;
+  /* every generation of pools has an argument of its own, it's read by the
+     old pools until they're drained */
+  if (! (warg = calloc (1, sizeof (vt_worker_arg_t))))
+    vt_fatal ("%s: calloc: %s", __func__, strerror (errno));
+  warg->context = ctx;
+  warg->stats = stats;
 
-  if (! (pool = vt_thread_pool_create ((void *)&warg, ctx->max_threads, &vt_worker, &err)))
-    return EXIT_FAILURE;
-  vt_thread_pool_set_max_idle_threads (pool, ctx->max_idle_threads);
-  vt_thread_pool_set_max_queued (pool, ctx->max_tasks);
-  vt_debug ("created thread pool");
-  /* open socket that we will listen on */
-  struct sockaddr_storage their_addr;
-  socklen_t addr_size;
-  struct addrinfo hints, *res;
-  int sock, conn;
-  //vt_worker_arg_t *arg;
-  int *task;
+  /* number of listeners is fixed at startup, sockets are not reopened on
+     reload */
+  int i, nlisteners;
+  int *socks;
+  vt_affinity_t *places;
+  vt_event_t **events;
 
-  memset (&hints, 0, sizeof (hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
+  nlisteners = ctx->listeners > 1 ? ctx->listeners : 1;
+  places = vt_places_create (ctx, nlisteners);
+
+  if (! (pools = vt_pools_create (ctx, warg, nlisteners, places, &err)))
+    return EXIT_FAILURE;
+  vt_debug ("created thread pools");
+
+  if (! (socks = calloc (nlisteners, sizeof (int))) ||
+      ! (events = calloc (nlisteners, sizeof (vt_event_t *))))
+    vt_fatal ("%s: calloc: %s", __func__, strerror (errno));
+
+  for (i = 0; i < nlisteners; i++) {
+    if ((socks[i] = vt_listen (ctx, nlisteners > 1)) < 0)
+      return EXIT_FAILURE;
+    if (! (events[i] = vt_event_create (socks[i], pools[i], &err)))
+      return EXIT_FAILURE;
+    vt_event_set_timeout (events[i], ctx->reuse_conns, ctx->client_timeout);
+    vt_event_set_overload (events[i], ctx->overload_resp.str,
+      ctx->overload_resp.len);
+    vt_event_set_affinity (events[i], &places[i]);
+  }
 
-  getaddrinfo (NULL, ctx->port, &hints, &res);
+  /* first listener is served by the main thread, which also handles signals,
+     the others each get a thread of their own */
+  for (i = 1; i < nlisteners; i++) {
+    if (vt_event_start (events[i], VT_EVENT_TIMEOUT_MILLISECONDS, &err) != 0)
+      return EXIT_FAILURE;
+  }
 
-  sock = socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-  bind(sock, res->ai_addr, res->ai_addrlen);
-  listen(sock, 10);
+  (void)vt_affinity_bind (&places[0]);
 
-  fd_set fds;
-  struct timeval tv;
-  int dead, ret;
+  int dead;
   cfg_t *new_cfg;
   vt_context_t *new_ctx;
-  vt_thread_pool_t *new_pool;
-  tv.tv_sec = VT_SELECT_TIMEOUT_SECONDS;
-  tv.tv_usec = VT_SELECT_TIMEOUT_MICROSECONDS;
+  vt_thread_pool_t **new_pools;
 
   for (dead = 0; ! dead; ) {
-    FD_ZERO (&fds);
-    FD_SET (sock, &fds);
-
-    ret = select (sock+1, &fds, NULL, NULL, &tv);
+    /* accepts connections and dispatches complete requests to workers */
+    (void)vt_event_loop (events[0], VT_EVENT_TIMEOUT_MILLISECONDS);
 
     /* always check if we received a signal or not */
     switch (vt_watchdog_signal ()) {
@@ -265,7 +430,9 @@ main (int argc, char *argv[])
       case SIGHUP: /* reload */
         new_cfg = NULL;
         new_ctx = NULL;
-        new_pool = NULL;
+        new_stats = NULL;
+        new_warg = NULL;
+        new_pools = NULL;
 vt_debug ("%s:%d", __func__, __LINE__);
         if (! (new_cfg = vt_cfg_parse (config_file))) {
           vt_error ("%s: could not parse %s: reload aborted",
@@ -273,66 +440,87 @@ vt_debug ("%s:%d", __func__, __LINE__);
           goto failure_reload;
         }
 vt_debug ("%s:%d", __func__, __LINE__);
-        if (! (new_ctx = vt_context_create (types, new_cfg, &err))) {
+        if (! (new_ctx = vt_context_create (types, new_cfg, dns_cache, &err))) {
           vt_error ("%s: could not create context: reload aborted", __func__);
           goto failure_reload;
         }
 vt_debug ("%s:%d", __func__, __LINE__);
+        vt_dns_cache_set_size (dns_cache,
+          cfg_getint (new_cfg, "dns_cache_size"));
         cfg_free (new_cfg);
         new_cfg = NULL;
 
-        new_stats = vt_stats_create (new_ctx->dicts, new_ctx->ndicts, &err);
-        vt_stats_thread (stats);
+        if (! (new_stats = vt_stats_create (new_ctx->dicts, new_ctx->ndicts,
+                                            &err)))
+        {
+          vt_error ("%s: could not create stats: reload aborted", __func__);
+          goto failure_reload;
+        }
+        new_stats->context = new_ctx;
+        new_stats->dns_cache = dns_cache;
+        vt_stats_thread (new_stats);
 
-        warg.context = new_ctx;
-        warg.stats = new_stats;
+        if (! (new_warg = calloc (1, sizeof (vt_worker_arg_t)))) {
+          vt_error ("%s: calloc: %s", __func__, strerror (errno));
+          goto failure_reload;
+        }
+        new_warg->context = new_ctx;
+        new_warg->stats = new_stats;
 
-        new_pool = vt_thread_pool_create ((void *)&warg,
-          new_ctx->max_threads, &vt_worker, &err);
+        new_pools = vt_pools_create (new_ctx, new_warg, nlisteners, places,
+          &err);
 vt_debug ("%s:%d", __func__, __LINE__);
-        if (! new_pool) {
+        if (! new_pools) {
           vt_error ("%s: could not create workers: reload aborted", __func__);
           goto failure_reload;
         }
-        vt_thread_pool_set_max_idle_threads (new_pool, new_ctx->max_idle_threads);
-        vt_thread_pool_set_max_queued (new_pool, new_ctx->max_tasks);
 vt_debug ("%s:%d", __func__, __LINE__);
-        vt_stats_destroy (stats, NULL);
-        vt_cleanup (pool, ctx, 1);
+        for (i = 0; i < nlisteners; i++) {
+          vt_event_set_pool (events[i], new_pools[i]);
+          vt_event_set_timeout (events[i], new_ctx->reuse_conns,
+            new_ctx->client_timeout);
+          vt_event_set_overload (events[i], new_ctx->overload_resp.str,
+            new_ctx->overload_resp.len);
+        }
+        /* stats and context are destroyed once old pools are drained */
+        vt_cleanup (pools, nlisteners, warg, 1);
         ctx = new_ctx;
-        pool = new_pool;
+        pools = new_pools;
         stats = new_stats;
+        warg = new_warg;
         break;
 failure_reload:
 vt_error ("%s:%d", __func__, __LINE__);
         if (new_cfg)
           cfg_free (new_cfg);
+        if (new_pools) {
+          for (i = 0; i < nlisteners; i++)
+            (void)vt_thread_pool_destroy (new_pools[i], NULL);
+          free (new_pools);
+        }
+        if (new_warg)
+          free (new_warg);
+        if (new_stats)
+          (void)vt_stats_destroy (new_stats, NULL);
         if (new_ctx)
           (void)vt_context_destroy (new_ctx, NULL);
-        if (new_pool)
-          (void)vt_thread_pool_destroy (new_pool, NULL);
         break;
     }
-
-    if (ret < 0) {
-      if (errno != EINTR)
-        vt_fatal ("%s: select: %s", __func__, strerror (errno));
-      /* ignore */
-    } else if (ret > 0) {
-      if ((conn = accept (sock, (struct sockaddr *)&their_addr, &addr_size)) < 0)
-        vt_fatal ("%s: accept: %s", __func__, strerror (errno));
-      if (! (task = calloc (1, sizeof (int))))
-        vt_fatal ("%s: calloc: %s", __func__, strerror (errno));
-      *task = conn;
-      vt_thread_pool_push (pool, (void *)task, &err);
-      // FIXME: handle more errors etc!
-    }
   }
 
   // terminate
-  (void)close (sock); // probably needs to be done differently!
+  for (i = 1; i < nlisteners; i++)
+    (void)vt_event_stop (events[i], NULL);
+  for (i = 0; i < nlisteners; i++)
+    (void)close (socks[i]); // probably needs to be done differently!
   //
-  vt_cleanup (pool, ctx, 0);
+  vt_cleanup (pools, nlisteners, warg, 0);
+  for (i = 0; i < nlisteners; i++)
+    (void)vt_event_destroy (events[i], NULL);
+  (void)vt_dns_cache_destroy (dns_cache, NULL);
+  free (events);
+  free (socks);
+  free (places);
   // 0. close socket
   //    if there is one... etc!
   // 1. kill work force
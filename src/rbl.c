@@ -1,4 +1,5 @@
 /* system includes */
+#include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -6,38 +7,37 @@
 #include <sys/types.h>
 
 /* valiant includes */
+#include "alloc.h"
 #include "rbl.h"
-#include "slist.h"
 #include "state.h"
-
-typedef struct _vt_rbl_weight vt_rbl_weight_t;
-
-struct _vt_rbl_weight {
-  unsigned long network;
-  unsigned long netmask;
-  float weight;
+#include "timer.h"
+
+/* Queries are kept with the result slot of the dict, which is reused for
+   every request evaluated by the job. */
+typedef struct _vt_rbl_query vt_rbl_query_t;
+
+struct _vt_rbl_query {
+  vt_resolver_query_t query; /* must be first */
+  vt_dict_t *dict;
+  vt_result_t *result;
+  int pos;
+  long start; /* microseconds, query was submitted */
 };
 
 /* prototypes */
 void vt_rbl_error (vt_rbl_t *);
-vt_rbl_weight_t *vt_rbl_weight_create (const char *, float, vt_error_t *);
-int vt_rbl_weight_destroy (void *);
-int vt_rbl_weight_sort (void *, void *);
-int vt_rbl_weight (vt_rbl_t *, int);
+void vt_rbl_done (vt_resolver_query_t *, void *);
+int vt_rbl_prefix_init (vt_rbl_prefix_t *, const char *, float, vt_error_t *);
+int vt_rbl_prefix_sort (const void *, const void *);
+int vt_rbl_compile (vt_rbl_t *, cfg_t *, vt_error_t *);
 
+/* Creates blacklist for zone, weights are read from sec. */
 vt_rbl_t *
-vt_rbl_create (cfg_t *sec, vt_error_t *err)
+vt_rbl_create (cfg_t *sec, const char *zone, vt_error_t *err)
 {
   cfg_t *in;
+  int i;
   vt_rbl_t *rbl;
-  vt_rbl_weight_t *weight;
-  vt_slist_t *root, *next;
-  char *fmt, *network, *type, *zone;
-  float points;
-  int i, n;
-  int ret;
-
-  root = NULL;
 
   if (! (rbl = calloc (1, sizeof (vt_rbl_t)))) {
     vt_set_error (err, VT_ERR_NOMEM);
@@ -47,18 +47,6 @@ vt_rbl_create (cfg_t *sec, vt_error_t *err)
   if (vt_state_init (&rbl->back_off, 1, err)) {
     goto failure;
   }
-  /* specifying debug value larger than one changes the behaviour of
-     SPF_server, don't do that */
-  if (! (rbl->spf_server = SPF_server_new (SPF_DNS_CACHE, 0))) {
-    fmt = "%s: SPF_server_new: %s";
-    if (errno != ENOMEM)
-      vt_panic (fmt, __func__, strerror (errno));
-    vt_set_error (err, VT_ERR_NOMEM);
-    vt_error (fmt, __func__, strerror (errno));
-    goto failure;
-  }
-
-  zone = cfg_getstr (sec, "zone");
 
   if (! (rbl->zone = strdup (zone))) {
     vt_set_error (err, VT_ERR_NOMEM);
@@ -66,226 +54,319 @@ vt_rbl_create (cfg_t *sec, vt_error_t *err)
     goto failure;
   }
 
-  network = "127.0.0.0/8";
-  points = cfg_getfloat (sec, "weight");
-  i = 0;
-  n = cfg_size (sec, "in");
-
-  do {
-    if (! (weight = vt_rbl_weight_create (network, points, err)))
-      goto failure;
-
-    if ((next = vt_slist_append (root, weight)) == NULL) {
-      vt_rbl_weight_destroy (weight);
-      vt_set_error (err, VT_ERR_NOMEM);
-      vt_error ("%s: slist_append: %s", __func__, strerror (errno));
+  /* every answer in 127.0.0.0/8 matches weight of zone */
+  rbl->nprefixes = 1 + cfg_size (sec, "in");
+  if (! (rbl->prefixes = calloc (rbl->nprefixes, sizeof (vt_rbl_prefix_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    goto failure;
+  }
+  if (vt_rbl_prefix_init (&rbl->prefixes[0], "127.0.0.0/8",
+        cfg_getfloat (sec, "weight"), err) != 0)
+    goto failure;
+  for (i = 1; i < rbl->nprefixes; i++) {
+    in = cfg_getnsec (sec, "in", i - 1);
+    if (vt_rbl_prefix_init (&rbl->prefixes[i], cfg_title (in),
+          cfg_getfloat (in, "weight"), err) != 0)
       goto failure;
-    }
-
-    if (root == NULL)
-      root = next;
-    if (i >= n)
-      break;
-
-    in = cfg_getnsec (sec, "in", i++);
-    network = (char *)cfg_title (in);
-    points = cfg_getfloat (in, "weight");
-  } while (in);
+  }
 
-  rbl->weights = vt_slist_sort (root, &vt_rbl_weight_sort);
+  qsort (rbl->prefixes, rbl->nprefixes, sizeof (vt_rbl_prefix_t),
+    &vt_rbl_prefix_sort);
+  if (vt_rbl_compile (rbl, sec, err) != 0)
+    goto failure;
 
   return rbl;
 failure:
   (void)vt_rbl_destroy (rbl, NULL);
-  vt_slist_free (root, &vt_rbl_weight_destroy, 0);
   return NULL;
 }
 
 int
 vt_rbl_destroy (vt_rbl_t *rbl, vt_error_t *err)
 {
-  int ret;
-
   if (rbl) {
-    if (rbl->spf_server)
-      SPF_server_free (rbl->spf_server);
-
     (void)vt_state_deinit (&rbl->back_off, NULL);
 
     if (rbl->zone)
       free (rbl->zone);
-    if (rbl->weights)
-      vt_slist_free (rbl->weights, &vt_rbl_weight_destroy, 0);
+    if (rbl->prefixes)
+      free (rbl->prefixes);
     free (rbl);
   }
 
   return (0);
 }
 
+/* Fills code table. A code takes the weight of the heaviest network it is
+   in, unless bit sections are configured and one of them is set in the code,
+   in which case it takes the sum of the weights of the bits that are set.
+   Bits that weigh nothing still count as configured. */
 int
-vt_rbl_check (vt_dict_t *dict, const char *query, vt_result_t *result, int pos,
-  vt_error_t *err)
+vt_rbl_compile (vt_rbl_t *rbl, cfg_t *sec, vt_error_t *err)
 {
-  int i;
-  vt_rbl_t *rbl;
-  vt_rbl_weight_t *weight, *heaviest;
-  vt_slist_t *cur;
-  SPF_dns_rr_t *dns_rr;
-  unsigned long address;
+  cfg_t *bit;
+  char *end;
+  const char *title;
+  float bits[CHAR_BIT], sum;
+  int i, j, n;
+  unsigned long address, configured, mask;
+
+  n = cfg_size (sec, "bit");
+  configured = 0;
+  for (i = 0; i < CHAR_BIT; i++)
+    bits[i] = 0.0;
+  for (i = 0; i < n; i++) {
+    bit = cfg_getnsec (sec, "bit", i);
+    title = cfg_title (bit);
+    errno = 0;
+    mask = strtoul (title, &end, 0);
+    /* exactly one bit of the last octet */
+    if (errno || *end != '\0' || ! mask || mask > 0x80 || (mask & (mask - 1)))
+    {
+      vt_set_error (err, VT_ERR_BADCFG);
+      vt_error ("%s: bad bit %s for zone %s", __func__, title, rbl->zone);
+      return -1;
+    }
+    for (j = 0; ! (mask & (1UL << j)); j++)
+      ;
+    bits[j] = cfg_getfloat (bit, "weight");
+    configured |= mask;
+  }
 
-  rbl = (vt_rbl_t *)dict->data;
-  dns_rr = SPF_dns_lookup (rbl->spf_server->resolver, query, ns_t_a, 0);
-
-  switch (dns_rr->herrno) {
-    case NO_DATA:
-      /* This ugly hack is necessary because of what I think is a bug in
-         SPF_dns_lookup_resolve. Correction: not a bug, this situation occurs
-         when debug is more than 1. */
-      for (i=0; i < dns_rr->rr_buf_num && dns_rr->rr[i]; i++)
-        ;
-
-      if (i)
-        dns_rr->num_rr = i;
-
-      /* fall through */
-    case NETDB_SUCCESS:
-      heaviest = NULL;
-      for (i=0; i < dns_rr->num_rr && dns_rr->rr[i]; i++) {
-        address = ntohl (dns_rr->rr[i]->a.s_addr);
-
-        for (cur=rbl->weights; cur; cur=cur->next) {
-          weight = (vt_rbl_weight_t *)cur->data;
-
-          // FIXME: must be done differently
-          if ((address & weight->netmask) == (weight->network & weight->netmask)) {
-            if (heaviest == NULL || heaviest->weight < weight->weight)
-              heaviest = weight;
-          }
-        }
+  for (i = 0; i < VT_RBL_CODES; i++) {
+    vt_bitset_clear (rbl->listed, i);
+    rbl->codes[i] = 0.0;
+
+    if (i & configured) {
+      for (j = 0, sum = 0.0; j < CHAR_BIT; j++) {
+        if (i & configured & (1UL << j))
+          sum += bits[j];
       }
+      vt_bitset_set (rbl->listed, i);
+      rbl->codes[i] = sum;
+      continue;
+    }
 
-      if (heaviest) {
-        vt_error ("%s:%d: query: %s, weight: %f", __func__, __LINE__, query, heaviest->weight);
-        vt_result_update (result, pos, heaviest->weight);
+    address = 0x7f000000UL | i;
+    for (j = 0; j < rbl->nprefixes; j++) {
+      if ((address & rbl->prefixes[j].netmask) == rbl->prefixes[j].network) {
+        vt_bitset_set (rbl->listed, i);
+        rbl->codes[i] = rbl->prefixes[j].weight;
+        break;
       }
-      break;
-    case TRY_AGAIN: // SERVFAIL
-      vt_state_error (&rbl->back_off);
-      break;
+    }
   }
 
-  SPF_dns_rr_free (dns_rr);
-
-  return;
+  return 0;
 }
 
-vt_rbl_weight_t *
-vt_rbl_weight_create (const char *cidr, float points, vt_error_t *err)
+/* Submits query to the shared resolver, the result is updated once the reply
+   comes in. The lookup holds a reference to the result until then. */
+int
+vt_rbl_check (vt_dict_t *dict, const char *query, vt_result_t *result, int pos,
+  vt_error_t *err)
 {
-  char buf[INET_ADDRSTRLEN];
-  char *p1, *p2;
-  int i;
-  long bits;
-  struct in_addr network;
-  unsigned long netmask;
-  vt_rbl_weight_t *weight;
+  vt_rbl_query_t *data;
 
-  /* copy network part from cidr notation */
-  for (p1=(char*)cidr, p2=buf;
-      *p1 != '\0' && *p1 != '/' && p2 < (buf+INET_ADDRSTRLEN);
-      *p2++ = *p1++)
-    ;
+  assert (dict);
+  assert (dict->resolver);
 
-  *p2 = '\0';
-
-  /* copy number of masked bits from cidr notation */
-  if (*p1 == '/')
-    bits = strtol ((++p1), NULL, 10);
+  if (! (data = (vt_rbl_query_t *)result->results[pos].data)) {
+    if (! (data = vt_calloc (1, sizeof (vt_rbl_query_t)))) {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    result->results[pos].data = (void *)data;
+  }
 
-  if (*p1 == '\0' || bits < 0 || bits > 32 || (bits == 0 && errno == EINVAL)) {
-    vt_set_error (err, VT_ERR_BADCFG);
-    vt_error ("%s: bad presentation of network/bitmask: %s", __func__, cidr);
-    return NULL;
+  if (strlen (query) >= VT_RESOLVER_MAX_NAME) {
+    vt_set_error (err, VT_ERR_BADREQUEST);
+    vt_error ("%s: query %s too long", __func__, query);
+    return -1;
   }
 
-  switch (inet_pton (AF_INET, buf, &network)) {
-    case 0:
-      vt_set_error (err, VT_ERR_BADCFG);
-      vt_error ("%s: bad presentation of network/bitmask: %s", __func__, cidr);
-      return NULL;
-    case -1:
-      vt_error ("%s: inet_pton: %s", __func__, strerror (errno));
-      return NULL;
+  strcpy (data->query.name, query);
+  data->query.type = VT_RESOLVER_TYPE_A;
+  data->query.func = &vt_rbl_done;
+  data->query.arg = (void *)data;
+  data->dict = dict;
+  data->result = result;
+  data->pos = pos;
+  data->start = vt_timer_usecs ();
+
+  vt_result_hold (result);
+  if (vt_resolver_submit (dict->resolver, &data->query, err) != 0) {
+    /* caller is dispatching, so this is never the last pending slot */
+    (void)vt_result_update (result, pos, 0.0);
+    (void)vt_result_release (result);
+    return -1;
   }
 
-  for (netmask=0, i=0; i < bits; i++)
-    netmask |= 1 << (31 - i);
+  return 0;
+}
 
-  if (! (weight = calloc (1, sizeof (vt_rbl_weight_t)))) {
-    vt_set_error (err, VT_ERR_NOMEM);
-    vt_error ("%s: calloc: %s", __func__, strerror (errno));
-    return NULL;
+/* Returns the points the answer to query is worth. Addresses in the reply are
+   matched against the configured networks, the heaviest match wins. Failures
+   are recorded. */
+float
+vt_rbl_points (vt_rbl_t *rbl, const vt_resolver_query_t *query)
+{
+  float points, weight;
+  int i, j, listed;
+  unsigned long address;
+
+  assert (rbl);
+  assert (query);
+
+  listed = 0;
+  points = 0.0;
+  switch (query->status) {
+    case VT_RESOLVER_SUCCESS:
+      for (i = 0; i < query->naddrs; i++) {
+        address = ntohl (query->addrs[i].s_addr);
+
+        if ((address & 0xffffff00UL) == 0x7f000000UL) {
+          if (! vt_bitset_isset (rbl->listed, address & 0xff))
+            continue;
+          weight = rbl->codes[address & 0xff];
+        } else {
+          for (j = 0; j < rbl->nprefixes &&
+                      (address & rbl->prefixes[j].netmask) !=
+                        rbl->prefixes[j].network; j++)
+            ;
+          if (j == rbl->nprefixes)
+            continue;
+          weight = rbl->prefixes[j].weight;
+        }
+
+        if (! listed || points < weight)
+          points = weight;
+        listed = 1;
+      }
+      break;
+    case VT_RESOLVER_SERVFAIL:
+    case VT_RESOLVER_TIMEOUT:
+      vt_state_error (&rbl->back_off);
+      break;
+    default:
+      break;
   }
 
-  weight->network = ntohl (network.s_addr);
-  weight->netmask = netmask;
-  weight->weight = (int)points;
+  return points;
+}
+
+/* Called by the resolver thread once the query completes, or by the thread
+   that submitted it if the answer was cached. Results that come in after the
+   deadline are dropped. */
+void
+vt_rbl_done (vt_resolver_query_t *query, void *arg)
+{
+  float points;
+  vt_rbl_query_t *data;
+  vt_result_t *result;
+
+  data = (vt_rbl_query_t *)arg;
+  result = data->result;
 
-  return weight;
+  points = vt_rbl_points ((vt_rbl_t *)data->dict->data, query);
+  if (points)
+    vt_debug ("%s: query: %s, weight: %f", __func__, query->name, points);
+
+  (void)vt_result_update (result, data->pos, points);
+  vt_dict_measure (data->dict, vt_timer_usecs () - data->start,
+    vt_result_timeout (result, data->pos) ? 0.0 : points);
+  if (vt_result_release (result))
+    vt_result_notify (result);
 }
 
+/* parses network in cidr notation */
 int
-vt_rbl_weight_destroy (void *weight)
+vt_rbl_prefix_init (vt_rbl_prefix_t *prefix, const char *cidr, float weight,
+  vt_error_t *err)
 {
-  if (weight != NULL)
-    free (weight);
+  char buf[INET_ADDRSTRLEN];
+  char *end;
+  const char *slash;
+  long bits;
+  struct in_addr network;
+
+  assert (prefix);
+  assert (cidr);
 
-  return VT_SUCCESS;
+  if (! (slash = strchr (cidr, '/')) || (slash - cidr) >= INET_ADDRSTRLEN)
+    goto bad;
+  memcpy (buf, cidr, slash - cidr);
+  buf[slash - cidr] = '\0';
+
+  errno = 0;
+  bits = strtol (slash + 1, &end, 10);
+  if (errno || end == (slash + 1) || *end != '\0' || bits < 0 || bits > 32)
+    goto bad;
+  if (inet_pton (AF_INET, buf, &network) != 1)
+    goto bad;
+
+  prefix->netmask = bits ? (0xffffffffUL << (32 - bits)) & 0xffffffffUL : 0;
+  prefix->network = ntohl (network.s_addr) & prefix->netmask;
+  prefix->weight = weight;
+  return 0;
+bad:
+  vt_set_error (err, VT_ERR_BADCFG);
+  vt_error ("%s: bad presentation of network/bitmask: %s", __func__, cidr);
+  return -1;
 }
 
+/* heaviest first, so that the first match is the one that counts */
 int
-vt_rbl_weight_sort (void *p1, void *p2)
+vt_rbl_prefix_sort (const void *p1, const void *p2)
 {
-  vt_rbl_weight_t *w1, *w2;
+  const vt_rbl_prefix_t *w1, *w2;
 
-  w1 = (vt_rbl_weight_t *)p1;
-  w2 = (vt_rbl_weight_t *)p2;
+  w1 = (const vt_rbl_prefix_t *)p1;
+  w2 = (const vt_rbl_prefix_t *)p2;
 
-  if (w1->netmask > w2->netmask)
+  if (w1->weight > w2->weight)
     return -1;
-  if (w1->netmask < w2->netmask)
+  if (w1->weight < w2->weight)
     return  1;
 
   return 0;
 }
 
-int
+/* maximum weight an answer can have, zero if answers can only subtract */
+float
 vt_rbl_max_weight (vt_rbl_t *rbl)
 {
-  int n = 0.0;
-  vt_slist_t *p;
-  vt_rbl_weight_t *q;
-
-  for (p = rbl->weights; p; p = p->next) {
-    q = (vt_rbl_weight_t *)p->data;
-    if (q->weight > n)
-      n = q->weight;
+  float n = 0.0;
+  int i;
+
+  for (i = 0; i < VT_RBL_CODES; i++) {
+    if (vt_bitset_isset (rbl->listed, i) && rbl->codes[i] > n)
+      n = rbl->codes[i];
+  }
+  for (i = 0; i < rbl->nprefixes; i++) {
+    if (rbl->prefixes[i].weight > n)
+      n = rbl->prefixes[i].weight;
   }
 
   return n;
 }
 
-int
+/* minimum weight an answer can have, zero if answers can only add */
+float
 vt_rbl_min_weight (vt_rbl_t *rbl)
 {
-  int n = 0.0;
-  vt_slist_t *p;
-  vt_rbl_weight_t *q;
-
-  for (p = rbl->weights; p; p = p->next) {
-    q = (vt_rbl_weight_t *)p->data;
-    if (q->weight < n)
-      n = q->weight;
+  float n = 0.0;
+  int i;
+
+  for (i = 0; i < VT_RBL_CODES; i++) {
+    if (vt_bitset_isset (rbl->listed, i) && rbl->codes[i] < n)
+      n = rbl->codes[i];
+  }
+  for (i = 0; i < rbl->nprefixes; i++) {
+    if (rbl->prefixes[i].weight < n)
+      n = rbl->prefixes[i].weight;
   }
 
   return n;
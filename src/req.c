@@ -1,159 +1,203 @@
 /* system includes */
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* prefix includes */
-#include "buf.h"
+#include "alloc.h"
 #include "error.h"
 #include "request.h"
 
-vt_request_t *
-vt_request_parse_line (vt_request_t *req, const char *str, size_t len,
-  vt_error_t *err)
+#define VT_REQUEST_NAME(s) { s, sizeof (s) - 1 }
+
+typedef struct _vt_request_name vt_request_name_t;
+
+struct _vt_request_name {
+  const char *str;
+  size_t len;
+};
+
+/* indexed by vt_request_member_t, members without a name are caught when
+   the hash table is built */
+static const vt_request_name_t vt_request_names[VT_REQUEST_MEMBERS] = {
+  [VT_REQUEST_MEMBER_HELO_NAME] = VT_REQUEST_NAME ("helo_name"),
+  [VT_REQUEST_MEMBER_SENDER] = VT_REQUEST_NAME ("sender"),
+  [VT_REQUEST_MEMBER_SENDER_DOMAIN] = VT_REQUEST_NAME ("sender_domain"),
+  [VT_REQUEST_MEMBER_RECIPIENT] = VT_REQUEST_NAME ("recipient"),
+  [VT_REQUEST_MEMBER_RECIPIENT_DOMAIN] = VT_REQUEST_NAME ("recipient_domain"),
+  [VT_REQUEST_MEMBER_CLIENT_ADDRESS] = VT_REQUEST_NAME ("client_address"),
+  [VT_REQUEST_MEMBER_CLIENT_NAME] = VT_REQUEST_NAME ("client_name"),
+  [VT_REQUEST_MEMBER_REV_CLIENT_NAME] =
+    VT_REQUEST_NAME ("reverse_client_name"),
+  [VT_REQUEST_MEMBER_REQUEST] = VT_REQUEST_NAME ("request"),
+  [VT_REQUEST_MEMBER_PROTOCOL_STATE] = VT_REQUEST_NAME ("protocol_state"),
+  [VT_REQUEST_MEMBER_PROTOCOL_NAME] = VT_REQUEST_NAME ("protocol_name"),
+  [VT_REQUEST_MEMBER_QUEUE_ID] = VT_REQUEST_NAME ("queue_id"),
+  [VT_REQUEST_MEMBER_RECIPIENT_COUNT] = VT_REQUEST_NAME ("recipient_count"),
+  [VT_REQUEST_MEMBER_CLIENT_PORT] = VT_REQUEST_NAME ("client_port"),
+  [VT_REQUEST_MEMBER_INSTANCE] = VT_REQUEST_NAME ("instance"),
+  [VT_REQUEST_MEMBER_SASL_METHOD] = VT_REQUEST_NAME ("sasl_method"),
+  [VT_REQUEST_MEMBER_SASL_USERNAME] = VT_REQUEST_NAME ("sasl_username"),
+  [VT_REQUEST_MEMBER_SASL_SENDER] = VT_REQUEST_NAME ("sasl_sender"),
+  [VT_REQUEST_MEMBER_SIZE] = VT_REQUEST_NAME ("size"),
+  [VT_REQUEST_MEMBER_CCERT_SUBJECT] = VT_REQUEST_NAME ("ccert_subject"),
+  [VT_REQUEST_MEMBER_CCERT_ISSUER] = VT_REQUEST_NAME ("ccert_issuer"),
+  [VT_REQUEST_MEMBER_CCERT_FINGERPRINT] =
+    VT_REQUEST_NAME ("ccert_fingerprint"),
+  [VT_REQUEST_MEMBER_CCERT_PUBKEY_FINGERPRINT] =
+    VT_REQUEST_NAME ("ccert_pubkey_fingerprint"),
+  [VT_REQUEST_MEMBER_ENCRYPTION_PROTOCOL] =
+    VT_REQUEST_NAME ("encryption_protocol"),
+  [VT_REQUEST_MEMBER_ENCRYPTION_CIPHER] =
+    VT_REQUEST_NAME ("encryption_cipher"),
+  [VT_REQUEST_MEMBER_ENCRYPTION_KEYSIZE] =
+    VT_REQUEST_NAME ("encryption_keysize"),
+  [VT_REQUEST_MEMBER_ETRN_DOMAIN] = VT_REQUEST_NAME ("etrn_domain"),
+  [VT_REQUEST_MEMBER_STRESS] = VT_REQUEST_NAME ("stress"),
+  [VT_REQUEST_MEMBER_POLICY_CONTEXT] = VT_REQUEST_NAME ("policy_context"),
+  [VT_REQUEST_MEMBER_SERVER_ADDRESS] = VT_REQUEST_NAME ("server_address"),
+  [VT_REQUEST_MEMBER_SERVER_PORT] = VT_REQUEST_NAME ("server_port"),
+  [VT_REQUEST_MEMBER_COMPATIBILITY_LEVEL] =
+    VT_REQUEST_NAME ("compatibility_level"),
+  [VT_REQUEST_MEMBER_MAIL_VERSION] = VT_REQUEST_NAME ("mail_version")
+};
+
+#undef VT_REQUEST_NAME
+
+/* Hash of attribute names. The hash combines the length with the first,
+   middle and last character of a name, which tells every name listed above
+   apart without looking at the rest of it. Collisions are resolved by linear
+   probing, the multipliers only affect how many names end up in the slot
+   they hash to. The table is built from vt_request_names the first time a
+   name is looked up. */
+#define VT_REQUEST_HASH_SIZE (64)
+#define VT_REQUEST_HASH(s,n) \
+  (((n) + (unsigned char)(s)[0] * 10 + (unsigned char)(s)[(n)-1] * 8 + \
+   (unsigned char)(s)[(n)/2] * 7) & (VT_REQUEST_HASH_SIZE - 1))
+
+static vt_request_member_t vt_request_hash[VT_REQUEST_HASH_SIZE];
+static pthread_once_t vt_request_hash_once = PTHREAD_ONCE_INIT;
+
+/* prototypes */
+void vt_request_hash_init (void);
+void vt_request_parse_line (vt_request_t *, size_t, size_t);
+
+void
+vt_request_hash_init (void)
 {
-  vt_buf_t *mbr;
   size_t pos;
+  vt_request_member_t mbrid;
 
-  if (len > 10 && strncmp (str, "helo_name=", 10) == 0) {
-    pos = 10;
-    mbr = &(req->helo_name);
-  } else if (len > 7 && strncmp (str, "sender=", 7) == 0) {
-    pos = 7;
-    mbr = &(req->sender);
-  } else if (len > 10 && strncmp (str, "recipient=", 10) == 0) {
-    pos = 10;
-    mbr = &(req->recipient);
-  } else if (len > 15 && strncmp (str, "client_address=", 15) == 0) {
-    pos = 15;
-    mbr = &(req->client_address);
-  } else if (len > 12 && strncmp (str, "client_name=", 12) == 0) {
-    pos = 12;
-    mbr = &(req->client_name);
-  } else if (len > 20 && strncmp (str, "reverse_client_name=", 20) == 0) {
-    pos = 20;
-    mbr = &(req->rev_client_name);
-  } else {
-    mbr = NULL;
-  }
+  for (mbrid = VT_REQUEST_MEMBER_NONE + 1; mbrid < VT_REQUEST_MEMBERS; mbrid++)
+  {
+    if (! vt_request_names[mbrid].str)
+      vt_panic ("%s: no name for member %d", __func__, mbrid);
 
-  if (mbr) {
-    if (! vt_buf_ncpy (mbr, str+pos, len-pos)) {
-      vt_set_error (err, VT_ERR_NOMEM);
-      vt_error ("%s: %s", __func__, strerror (ENOMEM));
-      return NULL;
-    }
-
-    if (mbr == &(req->sender)) {
-      mbr = &(req->sender_domain);
-    } else if (mbr == &(req->recipient)) {
-      mbr = &(req->recipient_domain);
-    } else {
-      mbr = NULL;
-    }
-
-    if (mbr) {
-      for (; pos < len && *(str+pos) != '@'; pos++)
-        ;
-      if (*(str+pos) == '@' && ++pos < len) {
-        if (! vt_buf_ncpy (mbr, str+pos, len-pos)) {
-          vt_set_error (err, VT_ERR_NOMEM);
-          vt_error ("%s: %s", __func__, strerror (ENOMEM));
-          return NULL;
-        }
-      }
-    }
+    pos = VT_REQUEST_HASH (vt_request_names[mbrid].str,
+                           vt_request_names[mbrid].len);
+    while (vt_request_hash[pos] != VT_REQUEST_MEMBER_NONE)
+      pos = (pos + 1) & (VT_REQUEST_HASH_SIZE - 1);
+    vt_request_hash[pos] = mbrid;
   }
-
-  return req;
 }
 
-#define BUFLEN (1024)
-#define isterm(c) ((c) == '\n' || (c) == '\r')
+/* Records the value of a single name=value line located at off in the request
+   buffer. The value is terminated in place by the caller. Attributes that are
+   not known are ignored so that newer Postfix versions can be served. */
+void
+vt_request_parse_line (vt_request_t *req, size_t off, size_t len)
+{
+  char *str, *sep;
+  size_t pos;
+  vt_request_member_t mbrid;
+  vt_request_slice_t *mbr;
+
+  str = req->buf + off;
+  if (! (sep = memchr (str, '=', len)))
+    return;
+
+  pos = (sep - str) + 1;
+  mbrid = vt_request_mbrtoidn (str, pos - 1);
+  if (mbrid == VT_REQUEST_MEMBER_NONE ||
+      mbrid == VT_REQUEST_MEMBER_SENDER_DOMAIN ||
+      mbrid == VT_REQUEST_MEMBER_RECIPIENT_DOMAIN)
+    return;
 
+  mbr = &req->mbrs[mbrid];
+  mbr->off = off + pos;
+  mbr->len = len - pos;
+
+  if (mbrid == VT_REQUEST_MEMBER_SENDER)
+    mbr = &req->mbrs[VT_REQUEST_MEMBER_SENDER_DOMAIN];
+  else if (mbrid == VT_REQUEST_MEMBER_RECIPIENT)
+    mbr = &req->mbrs[VT_REQUEST_MEMBER_RECIPIENT_DOMAIN];
+  else
+    return;
+
+  /* domain is the part of the address after the at sign, because the address
+     is terminated in place the domain is terminated too */
+  if ((sep = memchr (str + pos, '@', len - pos)) && ++sep < str + len) {
+    mbr->off = off + (sep - str);
+    mbr->len = len - (sep - str);
+  } else {
+    mbr->off = 0;
+    mbr->len = 0;
+  }
+}
+
+/* Parses a complete request as buffered by the event loop. Postfix terminates
+   every attribute with a newline and the request itself with an empty line.
+   Line terminators are overwritten so that values can be used as strings. */
 vt_request_t *
-vt_request_parse (vt_request_t *req, int fildes, vt_error_t *err)
+vt_request_parse (vt_request_t *req, char *buf, size_t len, vt_error_t *err)
 {
-  char buf[BUFLEN+1];
-  size_t i, j, n, nlft;
-  ssize_t nrd;
-
-  for (n = 0;;) {
-    if ((nlft = BUFLEN - n) == 0) {
-      vt_set_error (err, VT_ERR_NOBUFS);
-      vt_error ("%s: not enough space in line buffer", __func__);
-      return NULL;
-    }
-again:
-    nrd = read (fildes, buf+n, nlft);
-    if (nrd < 0) {
-      if (errno == EINTR)
-        goto again;
-
-      vt_set_error (err, VT_ERR_NORETRY);
-      vt_error ("%s: read: %s", __func__, strerror (errno));
-      return NULL;
-
-    } else if (nrd > 0) {
-      n += nrd;
-
-      for (i=0; i < n; ) {
-        for (j=i; j < n && !isterm (*(buf+j)); j++)
-          ; /* find line terminator */
-
-        if (j < n) {
-          if (! vt_request_parse_line (req, buf+i, (j-i), err))
-            return NULL;
-
-          for (i=j; i < n &&  isterm (*(buf+i)); i++)
-            ; /* forget about line terminator(s) */
-        } else {
-          break; /* no line terminator(s) */
-        }
-      }
-
-      if (i) {
-        if ((n - i)) {
-          memmove (buf, buf+i, (n - 1));
-          n -= i;
-        } else if (n < BUFLEN) {
-          goto done; /* end of request */
-        }
-      }
-    } else {
-      break; /* end of file */
-    }
+  char *ptr;
+  size_t i, j, n;
+
+  req->buf = buf;
+
+  for (i = 0; i < len; i = j + 1) {
+    if (! (ptr = memchr (buf + i, '\n', len - i)))
+      break; /* no line terminator */
+
+    j = ptr - buf;
+    n = j - i;
+    if (n && buf[i+n-1] == '\r')
+      n--;
+
+    if (! n)
+      break; /* end of request */
+
+    buf[i+n] = '\0';
+    vt_request_parse_line (req, i, n);
   }
-done:
+
   return req;
 }
 
-#undef isterm
-#undef BUFLEN
-
 vt_request_t *
 vt_request_create (vt_error_t *err)
 {
   vt_request_t *req;
 
-  if (! (req = calloc (1, sizeof (vt_request_t)))) {
+  if (! (req = vt_calloc (1, sizeof (vt_request_t)))) {
     vt_set_error (err, VT_ERR_NOMEM);
     vt_error ("%s: calloc: %s", __func__, strerror (errno));
   }
   return req;
 }
 
+void
+vt_request_reset (vt_request_t *req)
+{
+  req->buf = NULL;
+  memset (req->mbrs, 0, sizeof (req->mbrs));
+}
+
 void
 vt_request_destroy (vt_request_t *req)
 {
-  vt_buf_deinit (&req->helo_name);
-  vt_buf_deinit (&req->sender);
-  vt_buf_deinit (&req->sender_domain);
-  vt_buf_deinit (&req->recipient);
-  vt_buf_deinit (&req->recipient_domain);
-  vt_buf_deinit (&req->client_address);
-  vt_buf_deinit (&req->client_name);
-  vt_buf_deinit (&req->rev_client_name);
   free (req);
 }
 
@@ -162,91 +206,51 @@ vt_request_mbrtoid (const char *mbr)
 {
   if (! mbr)
     return VT_REQUEST_MEMBER_NONE;
-  else if (strncmp (mbr, "helo_name", 9) == 0)
-    return VT_REQUEST_MEMBER_HELO_NAME;
-  else if (strncmp (mbr, "sender", 6) == 0)
-    return VT_REQUEST_MEMBER_SENDER;
-  else if (strncmp (mbr, "sender_domain", 13) == 0)
-    return VT_REQUEST_MEMBER_SENDER_DOMAIN;
-  else if (strncmp (mbr, "recipient", 9) == 0)
-    return VT_REQUEST_MEMBER_RECIPIENT;
-  else if (strncmp (mbr, "recipient_domain", 16) == 0)
-    return VT_REQUEST_MEMBER_RECIPIENT_DOMAIN;
-  else if (strncmp (mbr, "client_address", 14) == 0)
-    return VT_REQUEST_MEMBER_CLIENT_ADDRESS;
-  else if (strncmp (mbr, "client_name", 11) == 0)
-    return VT_REQUEST_MEMBER_CLIENT_NAME;
-  else if (strncmp (mbr, "reverse_client_name", 19) == 0)
-    return VT_REQUEST_MEMBER_REV_CLIENT_NAME;
+  return vt_request_mbrtoidn (mbr, strlen (mbr));
+}
+
+/* maps name to member, usually with a single compare, see vt_request_hash */
+vt_request_member_t
+vt_request_mbrtoidn (const char *mbr, size_t len)
+{
+  size_t pos;
+  vt_request_member_t mbrid;
+
+  if (! len)
+    return VT_REQUEST_MEMBER_NONE;
+
+  (void)pthread_once (&vt_request_hash_once, &vt_request_hash_init);
+
+  pos = VT_REQUEST_HASH (mbr, len);
+  while ((mbrid = vt_request_hash[pos]) != VT_REQUEST_MEMBER_NONE) {
+    if (vt_request_names[mbrid].len == len &&
+        memcmp (vt_request_names[mbrid].str, mbr, len) == 0)
+      return mbrid;
+    pos = (pos + 1) & (VT_REQUEST_HASH_SIZE - 1);
+  }
 
   return VT_REQUEST_MEMBER_NONE;
 }
 
+/* returns NULL if the attribute was not present or empty */
 char *
 vt_request_mbrbyid (const vt_request_t *req, vt_request_member_t mbrid)
 {
-  if (mbrid == VT_REQUEST_MEMBER_HELO_NAME)
-    return vt_buf_str (&(req->helo_name));
-  else if (mbrid == VT_REQUEST_MEMBER_SENDER)
-    return vt_buf_str (&(req->sender));
-  else if (mbrid == VT_REQUEST_MEMBER_SENDER_DOMAIN)
-    return vt_buf_str (&(req->sender_domain));
-  else if (mbrid == VT_REQUEST_MEMBER_RECIPIENT)
-    return vt_buf_str (&(req->recipient));
-  else if (mbrid == VT_REQUEST_MEMBER_RECIPIENT_DOMAIN)
-    return vt_buf_str (&(req->recipient_domain));
-  else if (mbrid == VT_REQUEST_MEMBER_CLIENT_ADDRESS)
-    return vt_buf_str (&(req->client_address));
-  else if (mbrid == VT_REQUEST_MEMBER_CLIENT_NAME)
-    return vt_buf_str (&(req->client_name));
-  else if (mbrid == VT_REQUEST_MEMBER_REV_CLIENT_NAME)
-    return vt_buf_str (&(req->rev_client_name));
-
-  return NULL;
+  if (mbrid <= VT_REQUEST_MEMBER_NONE || mbrid >= VT_REQUEST_MEMBERS ||
+      ! req->mbrs[mbrid].len)
+    return NULL;
+
+  return req->buf + req->mbrs[mbrid].off;
 }
 
 char *
 vt_request_mbrbyname (const vt_request_t *req, const char *str)
 {
-  if (strncmp (str, "helo_name", 9) == 0)
-    return vt_buf_str (&(req->helo_name));
-  else if (strncmp (str, "sender", 6) == 0)
-    return vt_buf_str (&(req->sender));
-  else if (strncmp (str, "sender_domain", 13) == 0)
-    return vt_buf_str (&(req->sender_domain));
-  else if (strncmp (str, "recipient", 9) == 0)
-    return vt_buf_str (&(req->recipient));
-  else if (strncmp (str, "recipient_domain", 16) == 0)
-    return vt_buf_str (&(req->recipient_domain));
-  else if (strncmp (str, "client_address", 14) == 0)
-    return vt_buf_str (&(req->client_address));
-  else if (strncmp (str, "client_name", 11) == 0)
-    return vt_buf_str (&(req->client_name));
-  else if (strncmp (str, "reverse_client_name", 19) == 0)
-    return vt_buf_str (&(req->rev_client_name));
-
-  return NULL;
+  return vt_request_mbrbyid (req, vt_request_mbrtoid (str));
 }
 
 char *
 vt_request_mbrbynamen (const vt_request_t *req, const char *str, size_t len)
 {
-  if (len == 9  && ! strncmp ("helo_name", str, len))
-    return vt_buf_str (&(req->helo_name));
-  else if (len == 6  && ! strncmp ("sender", str, len))
-    return vt_buf_str (&(req->sender));
-  else if (len == 13 && ! strncmp ("sender_domain", str, len))
-    return vt_buf_str (&(req->sender_domain));
-  else if (len == 9  && ! strncmp ("recipient", str, len))
-    return vt_buf_str (&(req->recipient));
-  else if (len == 16 && ! strncmp ("recipient_domain", str, len))
-    return vt_buf_str (&(req->recipient_domain));
-  else if (len == 14 && ! strncmp ("client_address", str, len))
-    return vt_buf_str (&(req->client_address));
-  else if (len == 11 && ! strncmp ("client_name", str, len))
-    return vt_buf_str (&(req->client_name));
-  else if (len == 19 && ! strncmp ("reverse_client_name", str, len))
-    return vt_buf_str (&(req->rev_client_name));
-
-  return NULL;
+  return vt_request_mbrbyid (req, vt_request_mbrtoidn (str, len));
 }
@@ -0,0 +1,942 @@
+/* system includes */
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* valiant includes */
+#include "alloc.h"
+#include "atomic.h"
+#include "dns_cache.h"
+#include "resolver.h"
+#include "timer.h"
+
+#define VT_RESOLVER_CONF "/etc/resolv.conf"
+#define VT_RESOLVER_PORT (53)
+#define VT_RESOLVER_BUFLEN (4096)
+#define VT_RESOLVER_MAX_EVENTS (32)
+#define VT_RESOLVER_WAKE (~0ULL) /* epoll data of eventfd */
+
+#define VT_RESOLVER_CLASS_IN (1)
+#define VT_RESOLVER_TYPE_SOA (6)
+#define VT_RESOLVER_RCODE_NXDOMAIN (3)
+
+/* prototypes */
+int vt_resolver_server_parse (vt_resolver_server_t *, const char *);
+int vt_resolver_server_add (vt_resolver_t *, const char *, vt_error_t *);
+int vt_resolver_conf (vt_resolver_t *, vt_error_t *);
+int vt_resolver_socks_init (vt_resolver_t *, vt_error_t *);
+unsigned short vt_resolver_random (vt_resolver_t *);
+vt_resolver_query_t **vt_resolver_bucket (vt_resolver_t *, unsigned short);
+int vt_resolver_insert (vt_resolver_t *, vt_resolver_query_t *);
+vt_resolver_query_t *vt_resolver_find (vt_resolver_t *, unsigned short);
+void vt_resolver_remove (vt_resolver_t *, vt_resolver_query_t *);
+void vt_resolver_append (vt_resolver_t *, vt_resolver_query_t *);
+void vt_resolver_unlink (vt_resolver_t *, vt_resolver_query_t *);
+int vt_resolver_encode (vt_resolver_query_t *, unsigned char *, size_t);
+void vt_resolver_send (vt_resolver_t *, vt_resolver_query_t *);
+int vt_resolver_skip_name (const unsigned char *, int, int);
+int vt_resolver_match_name (const unsigned char *, int, int, const char *);
+vt_resolver_query_t *vt_resolver_reply (vt_resolver_t *,
+  const unsigned char *, int, int);
+void vt_resolver_decode (vt_resolver_query_t *, const unsigned char *, int);
+void vt_resolver_expire (vt_resolver_t *);
+void vt_resolver_finish (vt_resolver_query_t *);
+void vt_resolver_complete (vt_resolver_query_t *, vt_resolver_status_t);
+void *vt_resolver_worker (void *);
+
+#define GET16(p) ((unsigned int)(((p)[0] << 8) | (p)[1]))
+#define GET32(p) \
+  ((((unsigned long)(p)[0]) << 24) | (((unsigned long)(p)[1]) << 16) | \
+   (((unsigned long)(p)[2]) << 8) | ((unsigned long)(p)[3]))
+
+/* Creates resolver that sends queries to servers, or to the nameservers in
+   resolv.conf if none are given. Every attempt may take timeout milliseconds,
+   and every query is sent at most attempts times, to the next nameserver every
+   time. */
+vt_resolver_t *
+vt_resolver_create (const char **servers,
+                    int nservers,
+                    int nsocks,
+                    int timeout,
+                    int attempts,
+                    unsigned int max_queries,
+                    vt_dns_cache_t *cache,
+                    vt_error_t *err)
+{
+  char *fmt;
+  int i, ret;
+  unsigned int size;
+  struct epoll_event ev;
+  struct timespec now;
+  vt_resolver_t *res;
+
+  assert (nsocks > 0);
+  assert (timeout > 0);
+  assert (attempts > 0);
+  assert (max_queries > 0);
+
+  if (! (res = calloc (1, sizeof (vt_resolver_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return NULL;
+  }
+
+  res->epfd = -1;
+  res->wakefd = -1;
+  res->nsocks = nsocks;
+  res->timeout = timeout;
+  res->attempts = attempts;
+  res->max_queries = max_queries;
+  res->cache = cache;
+
+  if ((ret = pthread_mutex_init (&res->lock, NULL)) != 0)
+    vt_fatal ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
+
+  /* at most half of the buckets are used, so that probe sequences stay
+     short */
+  for (size = 1; size < (max_queries * 2); size <<= 1)
+    ;
+  if (! (res->table = calloc (size, sizeof (vt_resolver_query_t *)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    goto failure;
+  }
+  res->mask = size - 1;
+  /* domain names are case insensitive */
+  if (vt_flight_init (&res->flights, max_queries, VT_FLIGHT_FLAG_NOCASE,
+                      err) != 0)
+    goto failure;
+
+  (void)clock_gettime (CLOCK_REALTIME, &now);
+  res->seed = ((unsigned long)now.tv_nsec << 32) ^ now.tv_sec ^ getpid ();
+  if (! res->seed)
+    res->seed = 1;
+
+  if (nservers > 0) {
+    for (i = 0; i < nservers; i++) {
+      if (vt_resolver_server_add (res, servers[i], err) != 0)
+        goto failure;
+    }
+  } else if (vt_resolver_conf (res, err) != 0) {
+    goto failure;
+  }
+
+  if ((res->epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0 ||
+      (res->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    fmt = (res->epfd < 0) ? "%s: epoll_create1: %s" : "%s: eventfd: %s";
+    if (errno != ENOMEM && errno != EMFILE && errno != ENFILE)
+      vt_fatal (fmt, __func__, strerror (errno));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (errno));
+    goto failure;
+  }
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = VT_RESOLVER_WAKE;
+  if (epoll_ctl (res->epfd, EPOLL_CTL_ADD, res->wakefd, &ev) < 0) {
+    fmt = "%s: epoll_ctl: %s";
+    if (errno != ENOMEM && errno != ENOSPC)
+      vt_fatal (fmt, __func__, strerror (errno));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error (fmt, __func__, strerror (errno));
+    goto failure;
+  }
+
+  if (vt_resolver_socks_init (res, err) != 0)
+    goto failure;
+
+  if ((ret = pthread_create (&res->thread, NULL, &vt_resolver_worker,
+                             (void *)res)) != 0)
+  {
+    if (ret != EAGAIN)
+      vt_fatal ("%s: pthread_create: %s", __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: pthread_create: %s", __func__, strerror (ret));
+    goto failure;
+  }
+
+  res->running = 1;
+  return res;
+failure:
+  (void)vt_resolver_destroy (res, NULL);
+  return NULL;
+}
+
+/* Stops the resolver, queries that are still outstanding are completed as
+   cancelled. */
+int
+vt_resolver_destroy (vt_resolver_t *res, vt_error_t *err)
+{
+  int i, j;
+  uint64_t one;
+  vt_resolver_query_t *query;
+
+  if (res) {
+    if (res->running) {
+      (void)__sync_lock_test_and_set (&res->dead, 1);
+      one = 1;
+      if (write (res->wakefd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        vt_panic ("%s: write: %s", __func__, strerror (errno));
+      if ((i = pthread_join (res->thread, NULL)) != 0)
+        vt_panic ("%s: pthread_join: %s", __func__, strerror (i));
+    }
+
+    /* thread is gone, no need to lock */
+    while ((query = res->first)) {
+      vt_resolver_unlink (res, query);
+      vt_resolver_remove (res, query);
+      vt_flight_leave (&res->flights, &query->flight);
+      vt_resolver_complete (query, VT_RESOLVER_CANCELLED);
+    }
+
+    for (i = 0; i < res->nservers; i++) {
+      if (res->servers[i].socks) {
+        for (j = 0; j < res->nsocks; j++) {
+          if (res->servers[i].socks[j] >= 0)
+            (void)close (res->servers[i].socks[j]);
+        }
+        free (res->servers[i].socks);
+      }
+    }
+    if (res->wakefd >= 0)
+      (void)close (res->wakefd);
+    if (res->epfd >= 0)
+      (void)close (res->epfd);
+    if (res->table)
+      free (res->table);
+    vt_flight_deinit (&res->flights);
+    (void)pthread_mutex_destroy (&res->lock);
+    free (res);
+  }
+
+  return 0;
+}
+
+/* reads numeric address, IPv6 addresses may carry a scope, e.g.
+   fe80::1%eth0, returns -1 if str is not an address */
+#define BUFLEN (INET6_ADDRSTRLEN + IF_NAMESIZE)
+int
+vt_resolver_server_parse (vt_resolver_server_t *server, const char *str)
+{
+  char buf[BUFLEN], *end, *scope;
+  unsigned long idx;
+  struct sockaddr_in *sin;
+  struct sockaddr_in6 *sin6;
+
+  memset (&server->addr, 0, sizeof (server->addr));
+  sin = (struct sockaddr_in *)&server->addr;
+  sin6 = (struct sockaddr_in6 *)&server->addr;
+
+  if (inet_pton (AF_INET, str, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons (VT_RESOLVER_PORT);
+    server->addrlen = sizeof (struct sockaddr_in);
+    return 0;
+  }
+
+  if (strlen (str) >= BUFLEN)
+    return -1;
+  strcpy (buf, str);
+  if ((scope = strchr (buf, '%')))
+    *scope++ = '\0';
+  if (inet_pton (AF_INET6, buf, &sin6->sin6_addr) != 1)
+    return -1;
+  if (scope) {
+    errno = 0;
+    idx = strtoul (scope, &end, 10);
+    if (! *scope || *end || errno || idx > UINT32_MAX)
+      idx = if_nametoindex (scope);
+    if (! idx)
+      return -1;
+    sin6->sin6_scope_id = (uint32_t)idx;
+  }
+  sin6->sin6_family = AF_INET6;
+  sin6->sin6_port = htons (VT_RESOLVER_PORT);
+  server->addrlen = sizeof (struct sockaddr_in6);
+  return 0;
+}
+#undef BUFLEN
+
+int
+vt_resolver_server_add (vt_resolver_t *res, const char *str, vt_error_t *err)
+{
+  if (res->nservers >= VT_RESOLVER_MAX_SERVERS) {
+    vt_warning ("%s: ignoring nameserver %s, at most %d are used",
+      __func__, str, VT_RESOLVER_MAX_SERVERS);
+    return 0;
+  }
+
+  if (vt_resolver_server_parse (&res->servers[res->nservers], str) != 0) {
+    vt_set_error (err, VT_ERR_BADCFG);
+    vt_error ("%s: bad nameserver address: %s", __func__, str);
+    return -1;
+  }
+
+  res->nservers++;
+  return 0;
+}
+
+/* nameservers the resolver cannot use, e.g. host names, are skipped, other
+   resolvers on the system may read resolv.conf differently */
+#define BUFLEN (256)
+int
+vt_resolver_conf (vt_resolver_t *res, vt_error_t *err)
+{
+  char buf[BUFLEN], *addr, *p;
+  FILE *fh;
+
+  if (! (fh = fopen (VT_RESOLVER_CONF, "r"))) {
+    vt_set_error (err, VT_ERR_BADCFG);
+    vt_error ("%s: fopen: %s: %s", __func__, VT_RESOLVER_CONF, strerror (errno));
+    return -1;
+  }
+
+  while (fgets (buf, BUFLEN, fh)) {
+    if (strncmp (buf, "nameserver", 10) != 0 || ! isspace (buf[10]))
+      continue;
+    for (addr = buf + 10; isspace (*addr); addr++)
+      ;
+    for (p = addr; *p && ! isspace (*p); p++)
+      ;
+    *p = '\0';
+    if (! *addr)
+      continue;
+    if (res->nservers >= VT_RESOLVER_MAX_SERVERS) {
+      vt_warning ("%s: ignoring nameserver %s, at most %d are used",
+        __func__, addr, VT_RESOLVER_MAX_SERVERS);
+    } else if (vt_resolver_server_parse (&res->servers[res->nservers],
+                                         addr) != 0)
+    {
+      vt_warning ("%s: ignoring bad nameserver address in %s: %s",
+        __func__, VT_RESOLVER_CONF, addr);
+    } else {
+      res->nservers++;
+    }
+  }
+
+  (void)fclose (fh);
+
+  if (! res->nservers) {
+    vt_set_error (err, VT_ERR_BADCFG);
+    vt_error ("%s: no nameservers in %s", __func__, VT_RESOLVER_CONF);
+    return -1;
+  }
+
+  return 0;
+}
+#undef BUFLEN
+
+int
+vt_resolver_socks_init (vt_resolver_t *res, vt_error_t *err)
+{
+  char *fmt;
+  int i, j, sock;
+  struct epoll_event ev;
+  vt_resolver_server_t *server;
+
+  for (i = 0; i < res->nservers; i++) {
+    server = &res->servers[i];
+    if (! (server->socks = calloc (res->nsocks, sizeof (int)))) {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    for (j = 0; j < res->nsocks; j++)
+      server->socks[j] = -1;
+
+    for (j = 0; j < res->nsocks; j++) {
+      sock = socket (server->addr.ss_family,
+        SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (sock < 0) {
+        fmt = "%s: socket: %s";
+        goto failure;
+      }
+      server->socks[j] = sock;
+      if (connect (sock, (struct sockaddr *)&server->addr,
+                   server->addrlen) < 0)
+      {
+        fmt = "%s: connect: %s";
+        goto failure;
+      }
+
+      memset (&ev, 0, sizeof (ev));
+      ev.events = EPOLLIN;
+      ev.data.u64 = ((uint64_t)i << 32) | (uint32_t)sock;
+      if (epoll_ctl (res->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        fmt = "%s: epoll_ctl: %s";
+        goto failure;
+      }
+    }
+  }
+
+  return 0;
+failure:
+  if (errno != ENOMEM && errno != ENOSPC && errno != EMFILE &&
+      errno != ENFILE && errno != ENETUNREACH && errno != EAFNOSUPPORT)
+    vt_fatal (fmt, __func__, strerror (errno));
+  vt_set_error (err, (errno == ENETUNREACH || errno == EAFNOSUPPORT) ?
+    VT_ERR_BADCFG : VT_ERR_NOMEM);
+  vt_error (fmt, __func__, strerror (errno));
+  return -1;
+}
+
+/* xorshift64*, ids need not be cryptographically strong, only hard to guess
+   for hosts that do not see the queries */
+unsigned short
+vt_resolver_random (vt_resolver_t *res)
+{
+  res->seed ^= res->seed >> 12;
+  res->seed ^= res->seed << 25;
+  res->seed ^= res->seed >> 27;
+  return (unsigned short)((res->seed * 2685821657736338717ULL) >> 48);
+}
+
+vt_resolver_query_t **
+vt_resolver_bucket (vt_resolver_t *res, unsigned short id)
+{
+  unsigned int pos;
+
+  for (pos = (id * 40503U) & res->mask;
+       res->table[pos] && res->table[pos]->id != id;
+       pos = (pos + 1) & res->mask)
+    ;
+
+  return &res->table[pos];
+}
+
+/* assigns a random id that is not in use */
+int
+vt_resolver_insert (vt_resolver_t *res, vt_resolver_query_t *query)
+{
+  vt_resolver_query_t **bucket;
+
+  if (res->nqueries >= res->max_queries)
+    return -1;
+
+  do {
+    query->id = vt_resolver_random (res);
+  } while (*(bucket = vt_resolver_bucket (res, query->id)));
+
+  *bucket = query;
+  res->nqueries++;
+  return 0;
+}
+
+vt_resolver_query_t *
+vt_resolver_find (vt_resolver_t *res, unsigned short id)
+{
+  return *vt_resolver_bucket (res, id);
+}
+
+/* removes query and moves entries that follow it in the probe sequence into
+   the hole, so that lookups never stop short */
+void
+vt_resolver_remove (vt_resolver_t *res, vt_resolver_query_t *query)
+{
+  unsigned int hole, home, pos;
+  vt_resolver_query_t **bucket;
+
+  bucket = vt_resolver_bucket (res, query->id);
+  assert (*bucket == query);
+  hole = bucket - res->table;
+  res->table[hole] = NULL;
+  res->nqueries--;
+
+  for (pos = (hole + 1) & res->mask; res->table[pos];
+       pos = (pos + 1) & res->mask)
+  {
+    home = (res->table[pos]->id * 40503U) & res->mask;
+    /* entry may move if its home is not between hole and pos */
+    if (((pos - home) & res->mask) >= ((pos - hole) & res->mask)) {
+      res->table[hole] = res->table[pos];
+      res->table[pos] = NULL;
+      hole = pos;
+    }
+  }
+}
+
+/* every attempt takes equally long, so appending keeps the list ordered */
+void
+vt_resolver_append (vt_resolver_t *res, vt_resolver_query_t *query)
+{
+  query->next = NULL;
+  query->prev = res->last;
+  if (res->last)
+    res->last->next = query;
+  else
+    res->first = query;
+  res->last = query;
+}
+
+void
+vt_resolver_unlink (vt_resolver_t *res, vt_resolver_query_t *query)
+{
+  if (query->prev)
+    query->prev->next = query->next;
+  else
+    res->first = query->next;
+  if (query->next)
+    query->next->prev = query->prev;
+  else
+    res->last = query->prev;
+  query->prev = NULL;
+  query->next = NULL;
+}
+
+/* writes query in wire format, returns its length or -1 if the name is not
+   a valid domain name */
+int
+vt_resolver_encode (vt_resolver_query_t *query, unsigned char *buf,
+  size_t size)
+{
+  const char *label, *p;
+  size_t len, pos;
+
+  if (size < 12)
+    return -1;
+
+  memset (buf, 0, 12);
+  buf[0] = query->id >> 8;
+  buf[1] = query->id & 0xff;
+  buf[2] = 0x01; /* recursion desired */
+  buf[5] = 1; /* one question */
+
+  pos = 12;
+  for (label = query->name; *label; label = *p ? p + 1 : p) {
+    for (p = label; *p && *p != '.'; p++)
+      ;
+    len = p - label;
+    if (! len && ! *p) /* trailing dot */
+      break;
+    if (! len || len > 63 || (pos + 1 + len + 5) > size)
+      return -1;
+    buf[pos++] = len;
+    memcpy (buf + pos, label, len);
+    pos += len;
+  }
+
+  if ((pos - 12) > 254)
+    return -1;
+  buf[pos++] = 0;
+  buf[pos++] = 0;
+  buf[pos++] = query->type;
+  buf[pos++] = 0;
+  buf[pos++] = VT_RESOLVER_CLASS_IN;
+  return pos;
+}
+
+/* NOTE: Must be called with the resolver locked. Failures are not reported,
+   the query is sent again once the attempt times out. */
+void
+vt_resolver_send (vt_resolver_t *res, vt_resolver_query_t *query)
+{
+  unsigned char buf[VT_RESOLVER_BUFLEN];
+  int len, sock;
+  vt_resolver_server_t *server;
+
+  if ((len = vt_resolver_encode (query, buf, sizeof (buf))) < 0)
+    return;
+
+  server = &res->servers[query->server];
+  sock = server->socks[(res->next++ % res->nsocks)];
+  if (send (sock, buf, len, 0) < 0)
+    vt_debug ("%s: send: %s", __func__, strerror (errno));
+}
+
+/* Submits query, func is called with arg once it completes. Returns -1 if too
+   many queries are outstanding or name is not a valid domain name. */
+int
+vt_resolver_submit (vt_resolver_t *res, vt_resolver_query_t *query,
+  vt_error_t *err)
+{
+  int ret, wake;
+  uint64_t one;
+  unsigned char buf[VT_RESOLVER_BUFLEN];
+
+  assert (res);
+  assert (query);
+  assert (query->func);
+
+  if (vt_resolver_encode (query, buf, sizeof (buf)) < 0) {
+    vt_set_error (err, VT_ERR_BADREQUEST);
+    vt_error ("%s: bad domain name %s", __func__, query->name);
+    return -1;
+  }
+
+  query->naddrs = 0;
+  query->txt[0] = '\0';
+  query->ttl = 0;
+  query->attempt = 0;
+
+  /* cached answers complete the query right away */
+  if (res->cache && vt_dns_cache_lookup (res->cache, query)) {
+    query->func (query, query->arg);
+    return 0;
+  }
+
+  if ((ret = pthread_mutex_lock (&res->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+
+  /* completed once the query that is outstanding already completes */
+  if (! vt_flight_join (&res->flights, query->type, query->name,
+          &query->flight))
+  {
+    if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    return 0;
+  }
+
+  if (vt_resolver_insert (res, query) != 0) {
+    /* nobody could join while the resolver was locked */
+    vt_flight_leave (&res->flights, &query->flight);
+    if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_QFULL);
+    vt_error ("%s: too many outstanding queries", __func__);
+    return -1;
+  }
+
+  query->server = res->next % res->nservers;
+  query->deadline = vt_timer_now () + res->timeout;
+  /* loop only waits longer than it should if there was nothing to wait for */
+  wake = res->first ? 0 : 1;
+  vt_resolver_append (res, query);
+  vt_resolver_send (res, query);
+
+  if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  one = 1;
+  if (wake && write (res->wakefd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+    vt_panic ("%s: write: %s", __func__, strerror (errno));
+
+  return 0;
+}
+
+/* returns offset past name at off, or -1 if it runs past the message */
+int
+vt_resolver_skip_name (const unsigned char *msg, int len, int off)
+{
+  while (off < len) {
+    if ((msg[off] & 0xc0) == 0xc0)
+      return (off + 2 <= len) ? off + 2 : -1;
+    if (! msg[off])
+      return off + 1;
+    off += msg[off] + 1;
+  }
+
+  return -1;
+}
+
+/* compares name at off with name, case insensitive and following compression
+   pointers, returns offset past name at off or -1 if they differ */
+int
+vt_resolver_match_name (const unsigned char *msg, int len, int off,
+  const char *name)
+{
+  int end, hops, n, pos;
+  const char *p;
+
+  end = -1;
+  p = name;
+  for (pos = off, hops = 0; pos < len; ) {
+    if ((msg[pos] & 0xc0) == 0xc0) {
+      if ((pos + 2) > len || ++hops > 16)
+        return -1;
+      if (end < 0)
+        end = pos + 2;
+      pos = ((msg[pos] & 0x3f) << 8) | msg[pos + 1];
+      continue;
+    }
+    if (! (n = msg[pos++])) {
+      if (*p == '.' && ! *(p + 1))
+        p++;
+      if (*p)
+        return -1;
+      return (end < 0) ? pos : end;
+    }
+    if (p != name && *p++ != '.')
+      return -1;
+    if ((pos + n) > len || strncasecmp ((const char *)msg + pos, p, n) != 0)
+      return -1;
+    p += n;
+    pos += n;
+  }
+
+  return -1;
+}
+
+/* NOTE: Must be called with the resolver locked. Returns the query reply
+   answers, which is no longer outstanding, or NULL if the reply is not
+   expected. */
+vt_resolver_query_t *
+vt_resolver_reply (vt_resolver_t *res, const unsigned char *msg, int len,
+  int server)
+{
+  int off;
+  vt_resolver_query_t *query;
+
+  if (len < 12 || ! (msg[2] & 0x80) || GET16 (msg + 4) != 1)
+    return NULL;
+  if (! (query = vt_resolver_find (res, GET16 (msg))))
+    return NULL;
+
+  /* replies must come from a nameserver the query was sent to, sockets are
+     connected so the kernel checked the address */
+  if (server != query->server && query->attempt == 0)
+    return NULL;
+  if ((off = vt_resolver_match_name (msg, len, 12, query->name)) < 0 ||
+      (off + 4) > len ||
+      GET16 (msg + off) != query->type ||
+      GET16 (msg + off + 2) != VT_RESOLVER_CLASS_IN)
+    return NULL;
+
+  vt_resolver_unlink (res, query);
+  vt_resolver_remove (res, query);
+  vt_flight_leave (&res->flights, &query->flight);
+  return query;
+}
+
+/* Reads answers of the queried type. Truncated replies count as failures,
+   blacklist answers fit in a datagram and there is no fallback to TCP, as do
+   replies with records that run past the end of the message. */
+void
+vt_resolver_decode (vt_resolver_query_t *query, const unsigned char *msg,
+  int len)
+{
+  int an, i, n, ns, off, rdlen, type;
+  unsigned long minimum, ttl;
+  size_t txtlen;
+
+  if (msg[2] & 0x02) {
+    query->status = VT_RESOLVER_SERVFAIL;
+    return;
+  }
+
+  switch (msg[3] & 0x0f) {
+    case 0:
+      query->status = VT_RESOLVER_SUCCESS;
+      break;
+    case VT_RESOLVER_RCODE_NXDOMAIN:
+      query->status = VT_RESOLVER_NXDOMAIN;
+      break;
+    default:
+      query->status = VT_RESOLVER_SERVFAIL;
+      return;
+  }
+
+  an = GET16 (msg + 6);
+  ns = GET16 (msg + 8);
+  txtlen = 0;
+  query->ttl = 0;
+  if ((off = vt_resolver_skip_name (msg, len, 12)) < 0)
+    goto malformed;
+  off += 4;
+
+  for (i = 0; i < (an + ns); i++) {
+    if ((off = vt_resolver_skip_name (msg, len, off)) < 0 || (off + 10) > len)
+      goto malformed;
+    type = GET16 (msg + off);
+    ttl = GET32 (msg + off + 4);
+    rdlen = GET16 (msg + off + 8);
+    off += 10;
+    if ((off + rdlen) > len)
+      goto malformed;
+
+    if (GET16 (msg + off - 8) != VT_RESOLVER_CLASS_IN) {
+      ;
+    } else if (i < an && type == query->type) {
+      if (! query->ttl || ttl < query->ttl)
+        query->ttl = ttl;
+      if (type == VT_RESOLVER_TYPE_A && rdlen == 4 &&
+          query->naddrs < VT_RESOLVER_MAX_ADDRS)
+      {
+        memcpy (&query->addrs[query->naddrs++], msg + off, 4);
+      } else if (type == VT_RESOLVER_TYPE_TXT && ! txtlen) {
+        /* character strings of first record are concatenated */
+        for (n = 0; n < rdlen; n += msg[off + n] + 1) {
+          if ((n + 1 + msg[off + n]) > rdlen ||
+              (txtlen + msg[off + n]) >= VT_RESOLVER_MAX_TXT)
+            break;
+          memcpy (query->txt + txtlen, msg + off + n + 1, msg[off + n]);
+          txtlen += msg[off + n];
+        }
+        query->txt[txtlen] = '\0';
+      }
+    } else if (i >= an && type == VT_RESOLVER_TYPE_SOA && ! query->naddrs &&
+               ! txtlen && rdlen > 20)
+    {
+      /* negative answers may be cached for as long as the SOA says */
+      minimum = GET32 (msg + off + rdlen - 4);
+      query->ttl = (minimum < ttl) ? minimum : ttl;
+    }
+
+    off += rdlen;
+  }
+
+  return;
+malformed:
+  /* records that run past the message are not trusted, nor is the rest */
+  query->status = VT_RESOLVER_SERVFAIL;
+  query->naddrs = 0;
+  query->txt[0] = '\0';
+  query->ttl = 0;
+}
+
+/* Hands the answer to the queries that waited for query, then completes query
+   itself. Callbacks may reuse their query, so the next one is saved first. */
+void
+vt_resolver_finish (vt_resolver_query_t *query)
+{
+  vt_flight_node_t *node, *next;
+  vt_resolver_query_t *follower;
+
+  for (node = query->flight.followers; node; node = next) {
+    next = node->next;
+    follower = vt_flight_entry (node, vt_resolver_query_t, flight);
+    follower->status = query->status;
+    memcpy (follower->addrs, query->addrs,
+      query->naddrs * sizeof (struct in_addr));
+    follower->naddrs = query->naddrs;
+    strcpy (follower->txt, query->txt);
+    follower->ttl = query->ttl;
+    follower->func (follower, follower->arg);
+  }
+
+  query->flight.followers = NULL;
+  query->func (query, query->arg);
+}
+
+void
+vt_resolver_complete (vt_resolver_query_t *query, vt_resolver_status_t status)
+{
+  query->status = status;
+  vt_resolver_finish (query);
+}
+
+/* retransmits queries whose attempt timed out, or gives up on them */
+void
+vt_resolver_expire (vt_resolver_t *res)
+{
+  int ret;
+  long now;
+  vt_resolver_query_t *done, *query;
+
+  done = NULL;
+  now = vt_timer_now ();
+
+  if ((ret = pthread_mutex_lock (&res->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+
+  while ((query = res->first) && query->deadline <= now) {
+    vt_resolver_unlink (res, query);
+    if (++query->attempt < res->attempts) {
+      query->server = (query->server + 1) % res->nservers;
+      query->deadline = now + res->timeout;
+      vt_resolver_append (res, query);
+      vt_resolver_send (res, query);
+    } else {
+      vt_resolver_remove (res, query);
+      vt_flight_leave (&res->flights, &query->flight);
+      query->next = done;
+      done = query;
+    }
+  }
+
+  if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+  /* callbacks may reuse the query, so the next one is saved first */
+  for (; (query = done); ) {
+    done = query->next;
+    query->next = NULL;
+    vt_resolver_complete (query, VT_RESOLVER_TIMEOUT);
+  }
+}
+
+void *
+vt_resolver_worker (void *arg)
+{
+  unsigned char buf[VT_RESOLVER_BUFLEN];
+  int i, len, msecs, n, ret, server, sock;
+  long now;
+  uint64_t val;
+  struct epoll_event events[VT_RESOLVER_MAX_EVENTS];
+  vt_resolver_t *res;
+  vt_resolver_query_t *query;
+
+  assert (arg);
+  res = (vt_resolver_t *)arg;
+
+  while (! vt_atomic_load (&res->dead)) {
+    if ((ret = pthread_mutex_lock (&res->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    msecs = -1;
+    if (res->first) {
+      now = vt_timer_now ();
+      msecs = (res->first->deadline > now) ? res->first->deadline - now : 0;
+    }
+    if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+    n = epoll_wait (res->epfd, events, VT_RESOLVER_MAX_EVENTS, msecs);
+    if (n < 0) {
+      if (errno != EINTR)
+        vt_fatal ("%s: epoll_wait: %s", __func__, strerror (errno));
+      n = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u64 == VT_RESOLVER_WAKE) {
+        (void)read (res->wakefd, &val, sizeof (val));
+        continue;
+      }
+
+      server = (int)(events[i].data.u64 >> 32);
+      sock = (int)(events[i].data.u64 & 0xffffffff);
+
+      while ((len = recv (sock, buf, sizeof (buf), 0)) >= 0) {
+        if ((ret = pthread_mutex_lock (&res->lock)) != 0)
+          vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+        query = vt_resolver_reply (res, buf, len, server);
+        if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
+          vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+        if (query) {
+          vt_resolver_decode (query, buf, len);
+          if (res->cache)
+            vt_dns_cache_store (res->cache, query);
+          vt_resolver_finish (query);
+        }
+      }
+
+      /* ICMP errors are reported on connected sockets, the attempt simply
+         times out */
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+        vt_error ("%s: recv: %s", __func__, strerror (errno));
+    }
+
+    vt_resolver_expire (res);
+  }
+
+  return NULL;
+}
+
+#undef GET16
+#undef GET32
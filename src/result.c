@@ -1,179 +1,350 @@
 /* system includes */
 #include <assert.h>
 #include <errno.h>
-#include <pthread.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* valiant includes */
+#include "alloc.h"
+#include "atomic.h"
 #include "result.h"
 
+/* prototypes */
+void vt_result_wake (vt_result_t *);
+int vt_result_settle (vt_result_t *, unsigned int, float, int);
+
 vt_result_t *
 vt_result_create (unsigned int num, vt_error_t *err)
 {
-  int i;
-  int ret;
   vt_result_t *res;
 
-  if (! (res = calloc (1, sizeof (vt_result_t)))) {
+  if (! (res = vt_calloc (1, sizeof (vt_result_t)))) {
     vt_set_error (err, VT_ERR_NOMEM);
     vt_error ("%s: calloc: %s", __func__, strerror (errno));
-    goto failure_mutex;
+    goto failure;
   }
 
   res->nresults = num;
-  if (! (res->results = calloc (num + 1, sizeof (vt_dict_result_t *)))) {
+  if (! (res->results = vt_memalign (VT_RESULT_CACHE_LINE,
+                                    (num + 1) * sizeof (vt_dict_result_t))))
+  {
     vt_set_error (err, VT_ERR_NOMEM);
-    vt_error ("%s: calloc: %s", __func__, strerror (errno));
-    goto failure_mutex;
-  }
-
-  for (i = 0; i < num; i++) {
-    if (! (res->results[i] = calloc (1, sizeof (vt_dict_result_t)))) {
-      vt_set_error (err, VT_ERR_NOMEM);
-      vt_error ("%s: calloc: %s", __func__, strerror (errno));
-      goto failure_mutex;
-    }
-  }
-
-  switch ((ret = pthread_mutex_init (&res->lock, NULL))) {
-    case 0:
-      break;
-    case ENOMEM:
-      vt_set_error (err, VT_ERR_NOMEM);
-      vt_error ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
-      goto failure_mutex;
-    default:
-      vt_fatal ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
-  }
-
-  switch ((ret = pthread_cond_init (&res->signal, NULL))) {
-    case 0:
-      break;
-    case ENOMEM:
-      vt_set_error (err, VT_ERR_NOMEM);
-      vt_error ("%s: pthread_cond_init: %s", __func__, strerror (ret));
-      goto failure_cond;
-    default:
-      vt_fatal ("%s: pthread_cond_init: %s", __func__, strerror (ret));
+    vt_error ("%s: posix_memalign: %s", __func__, strerror (errno));
+    goto failure;
   }
 
+  memset (res->results, 0, (num + 1) * sizeof (vt_dict_result_t));
   return res;
-failure_cond:
-  pthread_mutex_destroy (&res->lock);
-failure_mutex:
-  if (res) {
-    if (res->results) {
-      for (i = 0; i < num; i++)
-        free (res->results[i]);
-      free (res->results);
-    }
+failure:
+  if (res)
     free (res);
-  }
   return NULL;
 }
 
 int
 vt_result_destroy (vt_result_t *res, vt_error_t *err)
 {
-  int i, ret;
+  int i;
 
   if (res) {
     if (res->results) {
       for (i = 0; i < res->nresults; i++) {
-        if (res->results[i])
-          free (res->results[i]);
+        if (res->results[i].data)
+          free (res->results[i].data);
       }
       free (res->results);
     }
-
-    if ((ret = pthread_mutex_destroy (&res->lock)) != 0)
-      vt_fatal ("%s: pthread_mutex_destroy: %s", __func__, strerror (ret));
-    if ((ret = pthread_cond_destroy (&res->signal)) != 0)
-      vt_fatal ("%s: pthread_cond_destroy: %s", __func__, strerror (ret));
     free (res);
   }
 
   return 0;
 }
 
+void
+vt_result_wake (vt_result_t *res)
+{
+  (void)__sync_add_and_fetch (&res->futex, 1);
+  if (vt_atomic_load (&res->waiters))
+    (void)vt_futex (&res->futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+/* held while dispatching lookups so that lookups completing in the meantime
+   do not resume evaluation */
 void
 vt_result_lock (vt_result_t *res)
 {
-  int ret;
+  assert (res);
+  (void)__sync_add_and_fetch (&res->pending, 1);
+}
 
+/* returns 1 if nothing is pending anymore, in which case the caller resumes
+   evaluation itself */
+int
+vt_result_unlock (vt_result_t *res)
+{
   assert (res);
 
-  if ((ret = pthread_mutex_lock (&res->lock)) != 0)
-    vt_fatal ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if (__sync_sub_and_fetch (&res->pending, 1) > 0)
+    return 0;
 
-  res->writers++;
+  vt_result_wake (res);
+  return 1;
+}
 
-  if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
-    vt_fatal ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+/* taken by lookups that run asynchronously, the request and result must not
+   be reused until every reference is released */
+void
+vt_result_hold (vt_result_t *res)
+{
+  assert (res);
+  (void)__sync_add_and_fetch (&res->refs, 1);
 }
 
+/* returns 1 if the last reference was released while the result was being
+   drained, in which case the caller must notify */
+int
+vt_result_release (vt_result_t *res)
+{
+  assert (res);
+
+  if (__sync_sub_and_fetch (&res->refs, 1) > 0)
+    return 0;
 
-void
-vt_result_unlock (vt_result_t *res)
+  return __sync_bool_compare_and_swap (&res->draining, 1, 0);
+}
+
+/* returns 1 if no lookup holds a reference, 0 if the last lookup to release
+   its reference notifies */
+int
+vt_result_drain (vt_result_t *res)
 {
-  int ret, signal = 0;
+  assert (res);
 
-  if ((ret = pthread_mutex_lock (&res->lock)) != 0)
-    vt_fatal ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  (void)__sync_lock_test_and_set (&res->draining, 1);
+  if (vt_atomic_load (&res->refs) > 0)
+    return 0;
 
-  if (res->writers > 0)
-    res->writers--;
-  if (res->writers < 1)
-    signal = 1;
+  return __sync_bool_compare_and_swap (&res->draining, 1, 0);
+}
 
-  if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
-    vt_fatal ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
-  if (signal != 0 && (ret = pthread_cond_signal (&res->signal)) != 0)
-    vt_fatal ("%s: pthread_cond_signal: %s", __func__, strerror (ret));
+void
+vt_result_set_notify (vt_result_t *res, VT_RESULT_NOTIFY_FUNC func, void *arg)
+{
+  assert (res);
+  res->notify_func = func;
+  res->notify_arg = arg;
+}
+
+/* Writers that run asynchronously call vt_result_notify if they were the last
+   to unlock the result, so that evaluation can be resumed without a thread
+   waiting on the result. */
+void
+vt_result_notify (vt_result_t *res)
+{
+  assert (res);
+  if (res->notify_func)
+    res->notify_func (res->notify_arg);
 }
 
 void
 vt_result_wait (vt_result_t *res)
 {
-  int ret;
+  int val;
 
   assert (res);
 
-  if ((ret = pthread_mutex_lock (&res->lock)) != 0)
-    vt_fatal ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  for (;;) {
+    val = vt_atomic_load (&res->futex);
+    if (vt_atomic_load (&res->pending) < 1)
+      break;
+    (void)__sync_add_and_fetch (&res->waiters, 1);
+    (void)vt_futex (&res->futex, FUTEX_WAIT_PRIVATE, val, NULL);
+    (void)__sync_sub_and_fetch (&res->waiters, 1);
+  }
+}
 
-  while (res->writers > 0) {
-    if ((ret = pthread_cond_wait (&res->signal, &res->lock)) != 0)
-      vt_fatal ("%s: pthread_cond_wait: %s", __func__, strerror (ret));
+/* Marks slot pending, returns 1 if the caller must dispatch the lookup and 0
+   if it was dispatched already or its result is known. Lookups that are not
+   done by deadline count as fallback points. A speculative lookup keeps its
+   deadline and becomes pending, so that evaluation waits for it. */
+int
+vt_result_claim (vt_result_t *res, unsigned int pos, long deadline,
+  float fallback)
+{
+  int state;
+  vt_dict_result_t *slot;
+
+  assert (res);
+  assert (pos < res->nresults);
+  slot = &res->results[pos];
+
+  state = vt_atomic_load (&slot->state);
+  if (state == VT_DICT_RESULT_EMPTY) {
+    /* timer only reads deadline of pending slots */
+    slot->deadline = deadline;
+    slot->fallback = fallback;
+  } else if (state != VT_DICT_RESULT_SPECULATIVE) {
+    goto settled;
   }
 
-  if ((ret = pthread_mutex_unlock (&res->lock)) != 0)
-    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+  (void)__sync_add_and_fetch (&res->pending, 1);
+  if (__sync_bool_compare_and_swap (
+        &slot->state, state, VT_DICT_RESULT_PENDING))
+    return (state == VT_DICT_RESULT_EMPTY) ? 1 : 0;
+  (void)__sync_sub_and_fetch (&res->pending, 1);
+
+settled:
+  /* speculative lookup is writing its points, which takes no time */
+  while (vt_atomic_load (&slot->state) == VT_DICT_RESULT_BUSY)
+    vt_atomic_pause ();
+  return 0;
 }
 
-void
+/* Marks slot speculative, returns 1 if the caller must dispatch the lookup.
+   Evaluation is not resumed by speculative lookups until claimed. */
+int
+vt_result_speculate (vt_result_t *res, unsigned int pos, long deadline,
+  float fallback)
+{
+  vt_dict_result_t *slot;
+
+  assert (res);
+  assert (pos < res->nresults);
+  slot = &res->results[pos];
+
+  if (vt_atomic_load (&slot->state) != VT_DICT_RESULT_EMPTY)
+    return 0;
+
+  slot->deadline = deadline;
+  slot->fallback = fallback;
+  return __sync_bool_compare_and_swap (
+    &slot->state, VT_DICT_RESULT_EMPTY, VT_DICT_RESULT_SPECULATIVE);
+}
+
+int
+vt_result_ready (vt_result_t *res, unsigned int pos)
+{
+  int state;
+
+  assert (res);
+  assert (pos < res->nresults);
+  state = vt_atomic_load (&res->results[pos].state);
+  return state == VT_DICT_RESULT_READY || state == VT_DICT_RESULT_TIMEOUT;
+}
+
+int
+vt_result_timeout (vt_result_t *res, unsigned int pos)
+{
+  assert (res);
+  assert (pos < res->nresults);
+  return vt_atomic_load (&res->results[pos].state) == VT_DICT_RESULT_TIMEOUT;
+}
+
+/* NOTE: Points are only meaningful once vt_result_ready returned 1, the load
+   of the state orders the load of the points. */
+float
+vt_result_points (vt_result_t *res, unsigned int pos)
+{
+  assert (res);
+  assert (pos < res->nresults);
+  return ((volatile vt_dict_result_t *)&res->results[pos])->points;
+}
+
+/* Resolves slot, returns 0 if it was resolved already. Whoever resolves the
+   last pending slot notifies, unless evaluation is being dispatched. */
+int
+vt_result_settle (vt_result_t *res, unsigned int pos, float points, int state)
+{
+  int claimed, cur;
+  vt_dict_result_t *slot;
+
+  slot = &res->results[pos];
+
+  /* state changes under our feet if a speculative slot is claimed */
+  for (;;) {
+    cur = vt_atomic_load (&slot->state);
+    if (cur == VT_DICT_RESULT_PENDING)
+      claimed = 1;
+    else if (cur == VT_DICT_RESULT_SPECULATIVE)
+      claimed = 0;
+    /* slots may be updated without being claimed first */
+    else if (cur == VT_DICT_RESULT_EMPTY && state == VT_DICT_RESULT_READY)
+      claimed = 0;
+    else
+      return 0;
+
+    if (__sync_bool_compare_and_swap (&slot->state, cur, VT_DICT_RESULT_BUSY))
+      break;
+  }
+
+  slot->points = points;
+  /* publish points before state */
+  vt_atomic_store (&slot->state, state);
+
+  if (claimed && __sync_sub_and_fetch (&res->pending, 1) == 0) {
+    vt_result_wake (res);
+    vt_result_notify (res);
+  }
+
+  return 1;
+}
+
+/* returns 1 if points were recorded, 0 if the deadline passed already */
+int
 vt_result_update (vt_result_t *res, unsigned int pos, float points)
 {
-  if (pos >= 0 && res->nresults > pos) {
-    (res->results[pos])->ready = 1;
-    (res->results[pos])->points = points;
+  if (pos < res->nresults)
+    return vt_result_settle (res, pos, points, VT_DICT_RESULT_READY);
+  return 0;
+}
+
+/* Resolves pending and speculative slots whose deadline passed with their
+   fallback points. Returns the earliest deadline of slots that are still
+   unresolved, zero if there are none. */
+long
+vt_result_expire (vt_result_t *res, long now)
+{
+  int i, state;
+  long deadline, next;
+  vt_dict_result_t *slot;
+
+  assert (res);
+
+  next = 0;
+  for (i = 0; i < res->nresults; i++) {
+    slot = &res->results[i];
+    state = vt_atomic_load (&slot->state);
+    if ((state != VT_DICT_RESULT_PENDING &&
+         state != VT_DICT_RESULT_SPECULATIVE) || ! slot->deadline)
+      continue;
+    if ((deadline = slot->deadline) > now) {
+      if (! next || deadline < next)
+        next = deadline;
+    } else {
+      (void)vt_result_settle (res, i, slot->fallback, VT_DICT_RESULT_TIMEOUT);
+    }
   }
+
+  return next;
 }
 
+/* NOTE: Must only be called once nothing is pending and no lookup holds a
+   reference. */
 void
 vt_result_reset (vt_result_t *res)
 {
   int i;
 
   assert (res);
+  assert (! res->pending && ! res->refs);
 
-  if (res->results) {
-    for (i = 0; i < res->nresults; i++) {
-      if (res->results[i]) {
-        res->results[i]->ready = 0;
-        res->results[i]->points = 0.0;
-      }
-    }
+  for (i = 0; i < res->nresults; i++) {
+    res->results[i].state = VT_DICT_RESULT_EMPTY;
+    res->results[i].points = 0.0;
+    res->results[i].deadline = 0;
+    res->results[i].fallback = 0.0;
   }
+  __sync_synchronize ();
 }
+
@@ -8,6 +8,8 @@
 #include <sys/types.h>
 
 /* valiant includes */
+#include "alloc.h"
+#include "atomic.h"
 #include "stats.h"
 
 /* five minutes in seconds 60 * 5 = 300 (for debugging purposes) */
@@ -28,6 +30,7 @@ vt_stats_create (vt_dict_t **dicts, int ndicts, vt_error_t *err)
   }
 
   stats->ctime = time (NULL);
+  stats->nallocs = vt_alloc_count ();
   stats->mtime = stats->ctime;
   stats->ncntrs = ndicts;
 
@@ -39,6 +42,8 @@ vt_stats_create (vt_dict_t **dicts, int ndicts, vt_error_t *err)
 
   for (i = 0; i < stats->ncntrs; i++) {
     if (dicts[i]) {
+      stats->cntrs[i].dict = dicts[i];
+      stats->cntrs[i].lookups = dicts[i]->lookups;
       stats->cntrs[i].len = strlen (dicts[i]->name);
       if (! (stats->cntrs[i].name = calloc (stats->cntrs[i].len+1, sizeof (char)))) {
         vt_set_error (err, VT_ERR_NOMEM);
@@ -95,7 +100,7 @@ vt_stats_destroy (vt_stats_t *stats, vt_error_t *err)
     vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
   /* NOTE: The for loop below is used to terminate the worker thread if it's
      still running. */
-  stats->dead;
+  stats->dead = 1;
   for (; stats->worker; ) {
     if ((ret = pthread_cond_signal (&stats->signal)) != 0)
       vt_panic ("%s: pthread_cond_signal: %s", __func__, strerror (ret));
@@ -141,21 +146,58 @@ vt_stats_update (vt_stats_t *stats, vt_result_t *res)
 
   stats->nreqs++;
   for (i=0; i < stats->ncntrs; i++) {
-    if (res->results[i] && res->results[i]->points)
+    if (vt_result_points (res, i))
       stats->cntrs[i].hits++;
+    if (vt_result_timeout (res, i))
+      stats->cntrs[i].timeouts++;
   }
 
   if ((ret = pthread_mutex_unlock (&stats->lock)) != 0)
     vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
 }
 
+#define BUFLEN (256)
+/* Folds lookups measured by every thread and reorders checks by what was
+   learned. The stats thread is the only one to write the order, so it is read
+   without taking the context lock. */
+void
+vt_stats_reorder (vt_stats_t *stats)
+{
+  char buf[BUFLEN];
+  int i, len, stageno;
+  vt_context_t *ctx;
+  vt_stage_t *stage;
+
+  for (i = 0; i < stats->ncntrs; i++) {
+    if (stats->cntrs[i].dict)
+      vt_dict_fold (stats->cntrs[i].dict);
+  }
+
+  if (! (ctx = stats->context) || ! vt_context_reorder (ctx))
+    return;
+
+  for (stageno = 0; stageno < ctx->nstages; stageno++) {
+    stage = ctx->stages[stageno];
+    buf[0] = '\0';
+    for (i = 0, len = 0; i < stage->nchecks && len < BUFLEN; i++) {
+      len += snprintf (buf + len, BUFLEN - len, "%s%s", i ? ", " : "",
+        ctx->dicts[stage->checks[stage->order[i]]->dict]->name);
+    }
+    vt_info ("stage %d: check order %s", stageno, buf);
+  }
+}
+#undef BUFLEN
+
 #define BUFLEN (32)
 void *
 vt_stats_worker (void *arg)
 {
   char buf[BUFLEN];
   int cntrno, ret;
+  unsigned long hits, lookups, misses, nentries;
+  size_t size;
   struct timespec wait;
+  vt_dict_t *dict;
   vt_stats_t *stats;
 
   assert (arg);
@@ -168,6 +210,10 @@ vt_stats_worker (void *arg)
     goto unlock;
 
   stats->worker = 1;
+  /* cache outlives stats, only report what happened since */
+  if (stats->dns_cache)
+    vt_dns_cache_stats (stats->dns_cache, &stats->dns_hits,
+      &stats->dns_misses, &nentries, &size);
 
   for (; ! stats->dead; ) {
     /* calculate when to wake up */
@@ -179,6 +225,16 @@ vt_stats_worker (void *arg)
     if (ret && ret != ETIMEDOUT)
       vt_panic ("%s: pthread_cond_timedwait: %s", __func__, strerror (ret));
     /* locked by pthread_cond_timedwait */
+    if (stats->dead)
+      break;
+
+    /* measurements are folded and checks reordered without holding the
+       lock that evaluated requests are counted under */
+    if ((ret = pthread_mutex_unlock (&stats->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    vt_stats_reorder (stats);
+    if ((ret = pthread_mutex_lock (&stats->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
 
     stats->mtime = time (NULL);
     //  Wed Jan 18 14:42:54 2012
@@ -187,10 +243,31 @@ vt_stats_worker (void *arg)
     vt_info ("running for %u seconds since %s",
       (stats->mtime - stats->ctime), buf);
     vt_info ("number of requests %d", stats->nreqs);
+    vt_info ("number of allocations %lu",
+      vt_alloc_count () - stats->nallocs);
+    stats->nallocs = vt_alloc_count ();
+    if (stats->dns_cache) {
+      vt_dns_cache_stats (stats->dns_cache, &hits, &misses, &nentries, &size);
+      vt_info ("dns cache %lu hits, %lu misses, %lu entries, %zu bytes",
+        hits - stats->dns_hits, misses - stats->dns_misses, nentries, size);
+      stats->dns_hits = hits;
+      stats->dns_misses = misses;
+    }
     for (cntrno = 0; cntrno < stats->ncntrs; cntrno++) {
       vt_info ("check %s matched %u times",
         stats->cntrs[cntrno].name, stats->cntrs[cntrno].hits);
+      if (stats->cntrs[cntrno].timeouts)
+        vt_info ("check %s timed out %lu times",
+          stats->cntrs[cntrno].name, stats->cntrs[cntrno].timeouts);
+      if ((dict = stats->cntrs[cntrno].dict)) {
+        lookups = dict->lookups;
+        vt_info ("check %s looked up %lu times, %ld usecs on average",
+          stats->cntrs[cntrno].name, lookups - stats->cntrs[cntrno].lookups,
+          dict->latency / 8);
+        stats->cntrs[cntrno].lookups = lookups;
+      }
       stats->cntrs[cntrno].hits = 0;
+      stats->cntrs[cntrno].timeouts = 0;
     }
 
     stats->nreqs = 0;
@@ -1,27 +1,63 @@
 /* system includes */
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 /* valiant includes */
+#include "affinity.h"
+#include "alloc.h"
+#include "atomic.h"
 #include "error.h"
 #include "thread_pool.h"
 
-#define QUEUE_FULL(p) ((p)->max_tasks && (p)->max_tasks < (p)->num_tasks)
-#define THREADS_DEPLETED(p) ((p)->num_idle_threads < 1 && (p)->max_threads \
-                         && (p)->max_threads < (p)->num_threads)
+#define QUEUED(r) \
+  (vt_atomic_load (&(r)->enqueue_pos) - vt_atomic_load (&(r)->dequeue_pos))
+#define QUEUE_FULL(p,r) ((p)->max_tasks && QUEUED ((r)) >= (size_t)(p)->max_tasks)
+#define QUEUE_SLOW(p,r,t) ((p)->max_delay && \
+  vt_thread_pool_delay ((r), (t)) > (p)->max_delay)
+
+#define UNLIMITED_MAX_TASKS (4096) /* number of slots if queue is unlimited */
+#define CONTROL_INTERVAL (20000000) /* nanoseconds between controller runs */
 
 /* prototypes */
-void *vt_thread_pool_shift (vt_thread_pool_t *);
-void vt_thread_pool_time (struct timespec *, struct timespec *);
+int vt_thread_pool_slots (vt_thread_pool_ring_t *, unsigned int,
+  vt_error_t *);
+int vt_thread_pool_queue (vt_thread_pool_t *, void *, int, vt_error_t *);
+int vt_thread_pool_hand (vt_thread_pool_t *, void *, int,
+  const struct timespec *, vt_error_t *);
+int vt_thread_pool_enqueue (vt_thread_pool_ring_t *, void *,
+  const struct timespec *);
+void *vt_thread_pool_dequeue (vt_thread_pool_ring_t *);
+int vt_thread_pool_overflow (vt_thread_pool_t *, void *,
+  const struct timespec *, vt_error_t *);
+void *vt_thread_pool_shift (vt_thread_pool_t *, vt_thread_pool_ring_t *);
+void *vt_thread_pool_next (vt_thread_pool_worker_t *);
+void vt_thread_pool_wake (vt_thread_pool_t *, int);
+void vt_thread_pool_signal (vt_thread_pool_t *);
+int vt_thread_pool_surplus (vt_thread_pool_t *);
+int vt_thread_pool_retire (vt_thread_pool_t *, int);
+void vt_thread_pool_control (vt_thread_pool_t *);
+int vt_thread_pool_rouse (vt_thread_pool_worker_t *, int);
+void vt_thread_pool_nudge (vt_thread_pool_t *, vt_thread_pool_worker_t *);
+int vt_thread_pool_thread (vt_thread_pool_t *, void *(*)(void *), void *,
+  int);
+int vt_thread_pool_spawn (vt_thread_pool_t *);
+int vt_thread_pool_start (vt_thread_pool_worker_t *);
+size_t vt_thread_pool_pending (vt_thread_pool_t *);
+long vt_thread_pool_delay (vt_thread_pool_ring_t *, const struct timespec *);
+long vt_thread_pool_msecs (const struct timespec *, const struct timespec *);
 
 #define DEFAULT_MAX_THREADS (100)
 #define DEFAULT_MAX_IDLE_THREADS (15)
 #define DEFAULT_MAX_TASKS (200)
+#define DEFAULT_IDLE_TIMEOUT (2000) /* milliseconds */
 
 vt_thread_pool_t *
 vt_thread_pool_create (void *user_data, unsigned int threads, void *func,
@@ -44,29 +80,34 @@ vt_thread_pool_create (void *user_data, unsigned int threads, void *func,
     vt_error (fmt, __func__, strerror (ret));
     goto FAILURE_MUTEX_INIT;
   }
-  if ((ret = pthread_cond_init (&pool->signal, NULL)) != 0) {
-    fmt = "%s: pthread_cond_init: %s";
-    if (ret != ENOMEM)
-      vt_fatal (fmt, __func__, strerror (ret));
-    vt_set_error (err, VT_ERR_NOMEM);
-    vt_error (fmt, __func__, strerror (ret));
-    goto FAILURE_COND_INIT;
-  }
 
   pool->user_data = user_data;
   pool->dead = 0;
+  pool->min_threads = 0;
   pool->max_threads = threads;
   pool->num_threads = 0;
+  pool->want_threads = 0;
   pool->max_idle_threads = DEFAULT_MAX_IDLE_THREADS;
   pool->num_idle_threads = 0;
   pool->max_tasks = DEFAULT_MAX_TASKS;
-  pool->num_tasks = 0;
+  pool->num_held = 0;
+  pool->num_overflow = 0;
   pool->first_task = NULL;
   pool->last_task = NULL;
+  pool->workers = NULL;
+  pool->nworkers = 0;
   pool->function = func;
+  pool->wait.tv_sec = DEFAULT_IDLE_TIMEOUT / 1000;
+  pool->wait.tv_nsec = (DEFAULT_IDLE_TIMEOUT % 1000) * 1000000;
+  pool->target_delay = 0;
+  pool->avg_delay = 0;
+  pool->ctl_running = 0;
+
+  if (vt_thread_pool_slots (&pool->ring, DEFAULT_MAX_TASKS, err) != 0)
+    goto FAILURE_SLOTS;
 
   return pool;
-FAILURE_COND_INIT:
+FAILURE_SLOTS:
   (void)pthread_mutex_destroy (&pool->lock);
 FAILURE_MUTEX_INIT:
   free (pool);
@@ -76,128 +117,190 @@ FAILURE_MUTEX_INIT:
 #undef DEFAULT_MAX_THREADS
 #undef DEFAULT_MAX_IDLE_THREADS
 #undef DEFAULT_MAX_TASKS
+#undef DEFAULT_IDLE_TIMEOUT
+
+#define DESTROY_INTERVAL (10000000) /* nanoseconds */
 
 int
 vt_thread_pool_destroy (vt_thread_pool_t *pool, vt_error_t *err)
 {
-  int lock, loop, ret;
+  int i, ret, work;
   struct timespec wait;
 
-  for (lock = 1, loop = 1; loop;) {
-    if (lock && (ret = pthread_mutex_lock (&(pool->lock))) != 0)
-      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
-
-    pool->dead = 1;
-
-    if (pool->num_idle_threads > 0) {
-      if ((ret = pthread_cond_broadcast (&pool->signal)) != 0)
-        vt_panic ("%s: pthread_cond_broadcast: %s", __func__, strerror (ret));
-      if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
-        vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
-      lock = 1;
+  (void)__sync_lock_test_and_set (&pool->dead, 1);
 
-    } else if (pool->num_threads > 0 || pool->num_tasks > 0) {
-      /* new tasks are not accepted, but we need to make sure that existing
-         tasks finish correctly to avoid memory problems and the like */
-      if ((ret = clock_gettime (CLOCK_REALTIME, &wait)) == 0) {
-        wait.tv_sec += 2; /* magic number, BAD! */
-        wait.tv_nsec += 0;
-      }
+  /* new tasks are not accepted, but we need to make sure that existing
+     tasks finish correctly to avoid memory problems and the like */
+  for (;;) {
+    work = (vt_atomic_load (&pool->num_held) || vt_thread_pool_pending (pool));
 
-      if ((ret = pthread_cond_timedwait (&pool->signal, &pool->lock, &wait)) != 0) {
-        if (ret != ETIMEDOUT)
-          vt_panic ("%s: pthread_cond_timed_wait: %s", __func__, strerror (ret));
-        /* do nothing */
-      }
+    if (! work && ! vt_atomic_load (&pool->num_threads) &&
+        ! vt_atomic_load (&pool->ctl_running))
+      break;
 
-      lock = 0;
+    vt_thread_pool_signal (pool);
 
+    if (pool->workers) {
+      for (i = 0; i < pool->nworkers; i++)
+        (void)vt_thread_pool_rouse (&pool->workers[i], work);
     } else {
-      vt_debug ("%s:%d: no more worker threads, no more tasks",
-        __func__, __LINE__);
-      if ((ret = pthread_mutex_unlock (&(pool->lock))) != 0)
-        vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
-      loop = 0;
+      vt_thread_pool_wake (pool, INT_MAX);
+      if (work && ! vt_atomic_load (&pool->num_threads))
+        (void)vt_thread_pool_spawn (pool);
     }
+
+    wait.tv_sec = 0;
+    wait.tv_nsec = DESTROY_INTERVAL;
+    (void)nanosleep (&wait, NULL);
   }
 
-  if ((ret = pthread_cond_destroy (&pool->signal)) != 0)
-    vt_panic ("%s: pthread_cond_destroy: %s", __func__, strerror (ret));
+  vt_debug ("%s:%d: no more worker threads, no more tasks",
+    __func__, __LINE__);
+
   if ((ret = pthread_mutex_destroy (&pool->lock)) != 0)
     vt_panic ("%s: pthread_mutex_destroy: %s", __func__, strerror (ret));
 
+  if (pool->workers) {
+    for (i = 0; i < pool->nworkers; i++) {
+      free (pool->workers[i].inbox.slots);
+    }
+    free (pool->workers);
+  }
+  free (pool->ring.slots);
   free (pool);
 
   return 0;
 }
 
+#undef DESTROY_INTERVAL
+
+/* NOTE: The ring can only be resized before the first task is pushed. */
+int
+vt_thread_pool_slots (vt_thread_pool_ring_t *ring, unsigned int num,
+  vt_error_t *err)
+{
+  size_t i, n;
+  vt_thread_pool_slot_t *slots;
+
+  for (n = 2; n < num; n <<= 1)
+    ;
+
+  if (! (slots = calloc (n, sizeof (vt_thread_pool_slot_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return -1;
+  }
+
+  for (i = 0; i < n; i++)
+    slots[i].seq = i;
+
+  if (ring->slots)
+    free (ring->slots);
+  ring->slots = slots;
+  ring->mask = n - 1;
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  return 0;
+}
+
 void *
 thread_pool_worker (void *thread_pool)
 {
-  char *func;
+  int idle, ret, timeout, val;
   vt_thread_pool_t *pool;
   void *arg;
-  struct timespec wait;
-  int ret, timed;
-  void *res;
-  int lock;
 
   if (! (pool = thread_pool))
     return NULL;
 
-  lock = 1;
+  for (;;) {
+    if ((arg = vt_thread_pool_shift (pool, &pool->ring))) {
+      pool->function (arg, pool->user_data);
+      continue;
+    }
+
+    val = vt_atomic_load (&pool->futex);
+    idle = __sync_add_and_fetch (&pool->num_idle_threads, 1);
+    timeout = 0;
+
+    /* a task may have been pushed before this thread was counted as idle, in
+       which case the pusher did not wake anyone */
+    if (! (arg = vt_thread_pool_shift (pool, &pool->ring)) &&
+        ! vt_atomic_load (&pool->dead) && ! vt_thread_pool_surplus (pool))
+    {
+      /* threads in excess of max_idle_threads and min_threads terminate
+         once they have been idle for the idle timeout */
+      if (vt_atomic_load (&pool->num_threads) > pool->min_threads ||
+          (pool->max_idle_threads && idle > pool->max_idle_threads))
+        ret = vt_futex (&pool->futex, FUTEX_WAIT_PRIVATE, val, &pool->wait);
+      else
+        ret = vt_futex (&pool->futex, FUTEX_WAIT_PRIVATE, val, NULL);
+      timeout = (ret < 0 && errno == ETIMEDOUT);
+    }
+
+    (void)__sync_sub_and_fetch (&pool->num_idle_threads, 1);
+
+    if (arg) {
+      pool->function (arg, pool->user_data);
+    } else if ((timeout || vt_thread_pool_surplus (pool) ||
+                vt_atomic_load (&pool->dead)) &&
+               vt_thread_pool_retire (pool, vt_atomic_load (&pool->dead)))
+    {
+      /* pool shrinks or is destroyed, terminate self. pushers that saw this
+         thread idle did not create a new one, check again */
+      if (! (arg = vt_thread_pool_shift (pool, &pool->ring)))
+        break;
+      (void)__sync_add_and_fetch (&pool->num_threads, 1);
+      pool->function (arg, pool->user_data);
+    }
+  }
+
+  return NULL;
+}
+
+/* Workers of work-stealing pools run tasks from their own inbox first and
+   only then look at the inboxes of other workers. Workers never terminate
+   while the pool is alive, the number of workers is fixed so that every
+   inbox has a worker of its own. */
+void *
+thread_pool_stealer (void *thread_pool_worker)
+{
+  int val;
+  void *arg;
+  vt_thread_pool_t *pool;
+  vt_thread_pool_worker_t *worker;
+
+  if (! (worker = thread_pool_worker))
+    return NULL;
+
+  pool = worker->pool;
 
-  //while (! pool->dead) {
   for (;;) {
-    if (lock && (ret = pthread_mutex_lock (&pool->lock)) != 0)
-      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
-    if ((arg = vt_thread_pool_shift (pool))) {
-      pool->num_idle_threads--;
+    if ((arg = vt_thread_pool_next (worker))) {
+      pool->function (arg, pool->user_data);
+      continue;
+    }
+
+    val = vt_atomic_load (&worker->futex);
+    (void)__sync_lock_test_and_set (&worker->idle, 1);
+    (void)__sync_add_and_fetch (&pool->num_idle_threads, 1);
 
-      if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
-        vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    /* a task may have been handed out before this worker was marked idle */
+    arg = vt_thread_pool_next (worker);
+    if (! arg && ! vt_atomic_load (&pool->dead))
+      (void)vt_futex (&worker->futex, FUTEX_WAIT_PRIVATE, val, NULL);
 
+    (void)__sync_sub_and_fetch (&pool->num_idle_threads, 1);
+    __sync_lock_release (&worker->idle);
+
+    if (arg) {
       pool->function (arg, pool->user_data);
-      lock = 1;
-    } else if (pool->dead) {
-      if (pool->num_threads > 0)
-        pool->num_threads--;
-      if (pool->num_idle_threads > 0)
-        pool->num_idle_threads--;
-      if ((ret = pthread_mutex_unlock (&pool->lock)))
-        vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    } else if (vt_atomic_load (&pool->dead) && ! vt_atomic_load (&pool->num_held)) {
+      /* requests that were put aside are resumed on this pool, stick around
+         until there are none left */
+      __sync_lock_release (&worker->running);
+      (void)__sync_sub_and_fetch (&pool->num_threads, 1);
       break;
-    } else {
-      pool->num_idle_threads++;
-
-      if (! pool->max_idle_threads ||
-            pool->max_idle_threads > pool->num_idle_threads)
-      {
-        timed = 0;
-      } else {
-        timed = 1;
-        vt_thread_pool_time (&pool->wait, &wait);
-      }
-
-      if (timed) {
-        func = "pthread_cond_timedwait";
-        ret = pthread_cond_timedwait (&pool->signal, &pool->lock, &wait);
-      } else {
-        func = "pthread_cond_wait";
-        ret = pthread_cond_wait (&pool->signal, &pool->lock);
-      }
-
-      lock = 0;
-      if (ret) {
-        if (ret != ETIMEDOUT)
-          vt_panic ("%s: %s: %s", __func__, func, strerror (ret));
-        /* just a timeout, terminate self */
-        if (pool->num_threads > 0)
-          pool->num_threads--;
-        if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
-          vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
-        break;
-      }
     }
   }
 
@@ -207,127 +310,580 @@ thread_pool_worker (void *thread_pool)
 int
 vt_thread_pool_push (vt_thread_pool_t *pool, void *arg, vt_error_t *err)
 {
-  char *fmt;
-  int ret, res = 0;
-  int signal = 0;
-  pthread_t worker;
-  vt_slist_t *task;
+  return vt_thread_pool_queue (pool, arg, 0, err);
+}
 
-  if ((ret = pthread_mutex_lock (&pool->lock)) != 0)
-    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
-  if (pool->dead) {
+/* Tasks that put work aside, e.g. to wait for lookups to complete, hold the
+   pool until they're finished. The pool is not destroyed while held. */
+void
+vt_thread_pool_hold (vt_thread_pool_t *pool)
+{
+  assert (pool);
+  (void)__sync_add_and_fetch (&pool->num_held, 1);
+}
+
+void
+vt_thread_pool_release (vt_thread_pool_t *pool)
+{
+  assert (pool);
+  (void)__sync_sub_and_fetch (&pool->num_held, 1);
+}
+
+/* Queues work that was put aside. Unlike vt_thread_pool_push the task is
+   accepted if the queue is full or the pool is being destroyed, because it
+   belongs to a task that was accepted before. */
+int
+vt_thread_pool_resume (vt_thread_pool_t *pool, void *arg, vt_error_t *err)
+{
+  return vt_thread_pool_queue (pool, arg, 1, err);
+}
+
+int
+vt_thread_pool_queue (vt_thread_pool_t *pool, void *arg, int resume,
+  vt_error_t *err)
+{
+  struct timespec now;
+
+  if (! resume && vt_atomic_load (&pool->dead)) {
     vt_set_error (err, VT_ERR_QFULL);
     vt_error ("%s: thread pool dead", __func__);
-    goto unlock;
+    return -1;
   }
-  if (THREADS_DEPLETED (pool) && QUEUE_FULL (pool)) {
-    vt_set_error (err, VT_ERR_QFULL);
-    vt_error ("%s: queue full", __func__);
-    goto unlock;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &now) != 0)
+    vt_panic ("%s: clock_gettime: %s", __func__, strerror (errno));
+
+  if (pool->workers)
+    return vt_thread_pool_hand (pool, arg, resume, &now, err);
+
+  if (! resume) {
+    /* refuse new work if queued tasks are not picked up in time, the caller
+       is better off with a quick answer than with a late one */
+    if (QUEUE_SLOW (pool, &pool->ring, &now)) {
+      vt_set_error (err, VT_ERR_QFULL);
+      vt_debug ("%s: queue too slow", __func__);
+      return -1;
+    }
+    if (QUEUE_FULL (pool, &pool->ring) ||
+        vt_thread_pool_enqueue (&pool->ring, arg, &now) != 0)
+    {
+      vt_set_error (err, VT_ERR_QFULL);
+      vt_error ("%s: queue full", __func__);
+      return -1;
+    }
+  } else if (vt_thread_pool_enqueue (&pool->ring, arg, &now) != 0 &&
+             vt_thread_pool_overflow (pool, arg, &now, err) != 0)
+  {
+    return -1;
   }
 
-  if (! (task = vt_slist_alloc ())) {
-    vt_set_error (err, VT_ERR_NOMEM);
-    vt_error ("%s: vt_slist_alloc: %s", __func__, strerror (errno));
-    goto unlock;
+  vt_thread_pool_wake (pool, 1);
+  return 0;
+}
+
+/* Hands task to the inbox of the next worker in line. Workers that cannot
+   keep up are skipped. If the worker is busy an idle worker is woken to steal
+   the task, so that there's no need to wake up every idle worker. */
+int
+vt_thread_pool_hand (vt_thread_pool_t *pool, void *arg, int resume,
+  const struct timespec *now, vt_error_t *err)
+{
+  int i;
+  unsigned int pos;
+  vt_thread_pool_worker_t *worker;
+
+  pos = __sync_fetch_and_add (&pool->next_worker, 1);
+
+  for (i = 0; i < pool->nworkers; i++) {
+    worker = &pool->workers[(pos + i) % pool->nworkers];
+    if (! resume && QUEUE_SLOW (pool, &worker->inbox, now))
+      continue;
+    if (vt_thread_pool_enqueue (&worker->inbox, arg, now) == 0) {
+      /* workers are started by the controller if there is one */
+      if (! vt_thread_pool_rouse (worker, ! vt_atomic_load (&pool->ctl_running)))
+        vt_thread_pool_nudge (pool, worker);
+      if (! vt_atomic_load (&pool->num_threads))
+        vt_thread_pool_signal (pool);
+      return 0;
+    }
   }
 
-  task->data = arg;
-  if (pool->first_task) {
-    pool->last_task->next = task;
-    pool->last_task = task;
-  } else {
-    pool->first_task = task;
-    pool->last_task = task;
-  }
-
-  pool->num_tasks++;
-
-  if (pool->num_idle_threads > 0) {
-    res = 1;
-    signal = 1;
-  } else if (! THREADS_DEPLETED (pool)) {
-    ret = pthread_create (&worker, NULL, &thread_pool_worker, (void *)pool);
-    if (ret != 0) {
-      fmt = "%s: pthread_create: %s";
-      if (ret != EAGAIN)
-        vt_fatal (fmt, __func__, strerror (ret));
-      vt_set_error (err, VT_ERR_AGAIN);
-      vt_error (fmt, __func__, strerror (ret));
-      goto unlock;
+  if (resume) {
+    if (vt_thread_pool_overflow (pool, arg, now, err) != 0)
+      return -1;
+    vt_thread_pool_nudge (pool, NULL);
+    return 0;
+  }
+
+  vt_set_error (err, VT_ERR_QFULL);
+  vt_error ("%s: queue full", __func__);
+  return -1;
+}
+
+int
+vt_thread_pool_enqueue (vt_thread_pool_ring_t *ring, void *arg,
+  const struct timespec *now)
+{
+  long dif;
+  size_t pos, seq;
+  vt_thread_pool_slot_t *slot;
+
+  pos = vt_atomic_load (&ring->enqueue_pos);
+  for (;;) {
+    slot = &ring->slots[pos & ring->mask];
+    seq = vt_atomic_load (&slot->seq);
+    dif = (long)seq - (long)pos;
+
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap (&ring->enqueue_pos, pos, pos + 1))
+        break;
+      pos = vt_atomic_load (&ring->enqueue_pos);
+    } else if (dif < 0) {
+      return -1; /* full */
+    } else {
+      pos = vt_atomic_load (&ring->enqueue_pos);
     }
+  }
+
+  slot->arg = arg;
+  slot->queued = *now;
+  vt_atomic_store (&slot->seq, pos + 1);
+  return 0;
+}
+
+void *
+vt_thread_pool_dequeue (vt_thread_pool_ring_t *ring)
+{
+  long dif;
+  size_t pos, seq;
+  vt_thread_pool_slot_t *slot;
+  void *arg;
+
+  pos = vt_atomic_load (&ring->dequeue_pos);
+  for (;;) {
+    slot = &ring->slots[pos & ring->mask];
+    seq = vt_atomic_load (&slot->seq);
+    dif = (long)seq - (long)(pos + 1);
 
-    pool->num_threads++;
-    pool->num_idle_threads++;
-    res = 1;
-    signal = 1;
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap (&ring->dequeue_pos, pos, pos + 1))
+        break;
+      pos = vt_atomic_load (&ring->dequeue_pos);
+    } else if (dif < 0) {
+      return NULL; /* empty */
+    } else {
+      pos = vt_atomic_load (&ring->dequeue_pos);
+    }
+  }
+
+  arg = slot->arg;
+  vt_atomic_store (&slot->seq, pos + ring->mask + 1);
+  return arg;
+}
+
+int
+vt_thread_pool_overflow (vt_thread_pool_t *pool, void *arg,
+  const struct timespec *now, vt_error_t *err)
+{
+  int ret;
+  vt_thread_pool_task_t *task;
+
+  if (! (task = vt_calloc (1, sizeof (vt_thread_pool_task_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return -1;
   }
 
-unlock:
-vt_error ("%s:%d: unlock, res: %d", __func__, __LINE__, res);
+  task->arg = arg;
+  task->queued = *now;
+
+  if ((ret = pthread_mutex_lock (&pool->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+  if (pool->first_task)
+    pool->last_task->next = task;
+  else
+    pool->first_task = task;
+  pool->last_task = task;
+  (void)__sync_add_and_fetch (&pool->num_overflow, 1);
   if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
     vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
-vt_error ("%s:%d: unlocked, res: %d", __func__, __LINE__, res);
-  if (signal && (ret = pthread_cond_signal (&pool->signal)) != 0)
-    vt_panic ("%s: pthread_cond_signal: %s", __func__, strerror (ret));
 
-  return res == 1 ? 0 : -1;
+  return 0;
 }
 
 void *
-vt_thread_pool_shift (vt_thread_pool_t *pool)
+vt_thread_pool_shift (vt_thread_pool_t *pool, vt_thread_pool_ring_t *ring)
 {
-  vt_slist_t *task;
+  int ret;
+  vt_thread_pool_task_t *task;
   void *arg = NULL;
 
-  task = pool->first_task;
+  /* resumed tasks that did not fit go first, they were accepted long ago */
+  if (vt_atomic_load (&pool->num_overflow)) {
+    if ((ret = pthread_mutex_lock (&pool->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    if ((task = pool->first_task)) {
+      if (! (pool->first_task = task->next))
+        pool->last_task = NULL;
+      (void)__sync_sub_and_fetch (&pool->num_overflow, 1);
+    }
+    if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+    if (task) {
+      arg = task->arg;
+      free (task);
+      return arg;
+    }
+  }
 
-  if (task) {
-    arg = task->data;
+  return vt_thread_pool_dequeue (ring);
+}
 
-    if (task->next) {
-      pool->first_task = task->next;
-    } else {
-      pool->first_task = NULL;
-      pool->last_task = NULL;
+void *
+vt_thread_pool_next (vt_thread_pool_worker_t *worker)
+{
+  int i;
+  void *arg;
+  vt_thread_pool_t *pool;
+  vt_thread_pool_worker_t *victim;
+
+  pool = worker->pool;
+
+  if ((arg = vt_thread_pool_shift (pool, &worker->inbox)))
+    return arg;
+
+  for (i = 1; i < pool->nworkers; i++) {
+    victim = &pool->workers[(worker->num + i) % pool->nworkers];
+    if ((arg = vt_thread_pool_dequeue (&victim->inbox)))
+      return arg;
+  }
+
+  return NULL;
+}
+
+/* wake up to num idle threads, or create a thread if none are idle */
+void
+vt_thread_pool_wake (vt_thread_pool_t *pool, int num)
+{
+  /* task was published before, pairs with idle threads counting themselves
+     before they look for tasks */
+  vt_atomic_fence ();
+  if (vt_atomic_load (&pool->num_idle_threads) > 0) {
+    (void)__sync_add_and_fetch (&pool->futex, 1);
+    (void)vt_futex (&pool->futex, FUTEX_WAKE_PRIVATE, num, NULL);
+  } else if (num == 1) {
+    /* threads are created by the controller if there is one, unless there
+       are no threads at all */
+    if (! vt_atomic_load (&pool->ctl_running))
+      (void)vt_thread_pool_spawn (pool);
+    else if (! vt_atomic_load (&pool->num_threads))
+      vt_thread_pool_signal (pool);
+  }
+}
+
+void
+vt_thread_pool_signal (vt_thread_pool_t *pool)
+{
+  if (vt_atomic_load (&pool->ctl_running)) {
+    (void)__sync_add_and_fetch (&pool->ctl_futex, 1);
+    (void)vt_futex (&pool->ctl_futex, FUTEX_WAKE_PRIVATE, 1, NULL);
+  }
+}
+
+/* controller decided pool has more threads than it needs */
+int
+vt_thread_pool_surplus (vt_thread_pool_t *pool)
+{
+  int num, want;
+
+  want = vt_atomic_load (&pool->want_threads);
+  num = vt_atomic_load (&pool->num_threads);
+  return want && num > want && num > pool->min_threads;
+}
+
+/* Releases the thread slot of the calling thread. The pool never shrinks
+   below min_threads unless forced. Returns 1 if the thread must terminate. */
+int
+vt_thread_pool_retire (vt_thread_pool_t *pool, int force)
+{
+  int num;
+
+  do {
+    num = vt_atomic_load (&pool->num_threads);
+    if (! force && num <= pool->min_threads)
+      return 0;
+  } while (! __sync_bool_compare_and_swap (&pool->num_threads, num, num - 1));
+
+  return 1;
+}
+
+/* The controller wakes up every CONTROL_INTERVAL and samples how long the
+   oldest queued task has been waiting. Threads are created ahead of demand
+   if the moving average exceeds the target, so that a burst of requests is
+   not held up by thread creation, and idle threads are let go once tasks no
+   longer wait at all. */
+void *
+thread_pool_controller (void *thread_pool)
+{
+  int val;
+  struct timespec wait;
+  vt_thread_pool_t *pool;
+
+  if (! (pool = thread_pool))
+    return NULL;
+
+  while (! vt_atomic_load (&pool->dead)) {
+    wait.tv_sec = 0;
+    wait.tv_nsec = CONTROL_INTERVAL;
+    val = vt_atomic_load (&pool->ctl_futex);
+    (void)vt_futex (&pool->ctl_futex, FUTEX_WAIT_PRIVATE, val, &wait);
+    if (vt_atomic_load (&pool->dead))
+      break;
+    vt_thread_pool_control (pool);
+  }
+
+  __sync_lock_release (&pool->ctl_running);
+  return NULL;
+}
+
+void
+vt_thread_pool_control (vt_thread_pool_t *pool)
+{
+  int i, idle, num, want;
+  long avg, delay, max;
+  size_t queued;
+  struct timespec now;
+  vt_thread_pool_worker_t *worker;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &now) != 0)
+    vt_panic ("%s: clock_gettime: %s", __func__, strerror (errno));
+
+  queued = vt_thread_pool_pending (pool);
+  delay = vt_thread_pool_delay (&pool->ring, &now);
+  for (i = 0; i < pool->nworkers; i++) {
+    if ((max = vt_thread_pool_delay (&pool->workers[i].inbox, &now)) > delay)
+      delay = max;
+  }
+
+  /* average is kept times 8 so that it decays to zero */
+  pool->avg_delay += delay - (pool->avg_delay >> 3);
+  avg = pool->avg_delay >> 3;
+
+  num = vt_atomic_load (&pool->num_threads);
+  idle = vt_atomic_load (&pool->num_idle_threads);
+
+  /* workers of work-stealing pools are fixed, start the ones that were
+     handed tasks or all of them if tasks wait too long */
+  if (pool->workers) {
+    for (i = 0; i < pool->nworkers; i++) {
+      worker = &pool->workers[i];
+      if (QUEUED (&worker->inbox) || (avg > pool->target_delay && ! idle))
+        (void)vt_thread_pool_rouse (worker, 1);
     }
+    return;
+  }
 
-    pool->num_tasks--;
-    free (task);
+  want = num;
+  if (queued && ! idle && (! num || avg > pool->target_delay)) {
+    /* grow by at least a quarter to catch up with bursts quickly */
+    want = num + (queued > (size_t)(num / 4) ? (int)queued : (num / 4));
+    if (want <= num)
+      want = num + 1;
+    if (pool->max_threads && want > pool->max_threads)
+      want = pool->max_threads;
+  } else if (! delay && ! avg && idle > 1) {
+    /* tasks do not wait at all, let go of half the idle threads */
+    want = num - (idle / 2);
+    if (want < pool->min_threads)
+      want = pool->min_threads;
   }
 
-  return arg;
+  (void)__sync_lock_test_and_set (&pool->want_threads, want);
+
+  if (want > num) {
+    for (i = num; i < want; i++) {
+      if (vt_thread_pool_spawn (pool) != 0)
+        break;
+    }
+  } else if (want < num) {
+    /* idle threads notice they're surplus once woken */
+    (void)__sync_add_and_fetch (&pool->futex, 1);
+    (void)vt_futex (&pool->futex, FUTEX_WAKE_PRIVATE, num - want, NULL);
+  }
+}
+
+/* Wakes worker if it's idle, or starts it if it's not running and start is
+   set. Returns 1 if the worker will look for tasks. Idle workers are claimed
+   by clearing the flag so that every idle worker is woken only once. */
+int
+vt_thread_pool_rouse (vt_thread_pool_worker_t *worker, int start)
+{
+  if (vt_atomic_load (&worker->running)) {
+    if (__sync_bool_compare_and_swap (&worker->idle, 1, 0)) {
+      (void)__sync_add_and_fetch (&worker->futex, 1);
+      (void)vt_futex (&worker->futex, FUTEX_WAKE_PRIVATE, 1, NULL);
+      return 1;
+    }
+    return 0;
+  }
+
+  return start && vt_thread_pool_start (worker) == 0;
 }
 
+/* wake up one idle worker other than skip to steal tasks */
 void
-vt_thread_pool_time (struct timespec *wait, struct timespec *tp)
+vt_thread_pool_nudge (vt_thread_pool_t *pool, vt_thread_pool_worker_t *skip)
+{
+  int i;
+
+  /* see vt_thread_pool_wake */
+  vt_atomic_fence ();
+  if (! vt_atomic_load (&pool->num_idle_threads))
+    return;
+
+  for (i = 0; i < pool->nworkers; i++) {
+    if (&pool->workers[i] != skip &&
+        vt_thread_pool_rouse (&pool->workers[i], 0))
+      break;
+  }
+}
+
+/* Creates thread placed on processors of pool, or on the nth processor if n
+   is not negative. */
+int
+vt_thread_pool_thread (vt_thread_pool_t *pool, void *(*func)(void *),
+  void *arg, int n)
 {
+  char *fmt;
   int ret;
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if ((ret = pthread_attr_init (&attr)) != 0 ||
+      (ret = pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED)) != 0)
+    vt_fatal ("%s: pthread_attr_init: %s", __func__, strerror (ret));
+  (void)vt_affinity_attr (&attr, &pool->cpus, n);
+
+  ret = pthread_create (&thread, &attr, func, arg);
+  (void)pthread_attr_destroy (&attr);
+
+  if (ret != 0) {
+    fmt = "%s: pthread_create: %s";
+    if (ret != EAGAIN)
+      vt_fatal (fmt, __func__, strerror (ret));
+    vt_error (fmt, __func__, strerror (ret));
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+vt_thread_pool_spawn (vt_thread_pool_t *pool)
+{
+  int num;
+
+  /* reserve a thread without taking a lock */
+  do {
+    num = vt_atomic_load (&pool->num_threads);
+    if (pool->max_threads && num >= pool->max_threads)
+      return 0; /* task is queued, a busy thread picks it up once it's done */
+  } while (! __sync_bool_compare_and_swap (&pool->num_threads, num, num + 1));
+
+  if (vt_thread_pool_thread (pool, &thread_pool_worker, (void *)pool, -1) != 0) {
+    (void)__sync_sub_and_fetch (&pool->num_threads, 1);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* workers of work-stealing pools are started once they're handed a task */
+int
+vt_thread_pool_start (vt_thread_pool_worker_t *worker)
+{
+  if (! __sync_bool_compare_and_swap (&worker->running, 0, 1))
+    return 0;
 
-  if ((ret = clock_gettime (CLOCK_REALTIME, tp)) == 0) {
-    tp->tv_sec += wait->tv_sec;
-    tp->tv_nsec += wait->tv_nsec;
+  /* every worker owns an inbox, keep it on a processor of its own so that
+     its tasks stay in that processor's cache */
+  (void)__sync_add_and_fetch (&worker->pool->num_threads, 1);
+  if (vt_thread_pool_thread (worker->pool, &thread_pool_stealer,
+        (void *)worker, worker->num) != 0)
+  {
+    (void)__sync_sub_and_fetch (&worker->pool->num_threads, 1);
+    __sync_lock_release (&worker->running);
+    return -1;
   }
 
-  return;
+  return 0;
+}
+
+/* number of tasks waiting to be executed */
+size_t
+vt_thread_pool_pending (vt_thread_pool_t *pool)
+{
+  int i;
+  size_t cnt;
+
+  cnt = vt_atomic_load (&pool->num_overflow) + QUEUED (&pool->ring);
+
+  for (i = 0; i < pool->nworkers; i++)
+    cnt += QUEUED (&pool->workers[i].inbox);
+
+  return cnt;
+}
+
+/* milliseconds the oldest queued task has been waiting */
+long
+vt_thread_pool_delay (vt_thread_pool_ring_t *ring, const struct timespec *now)
+{
+  size_t pos;
+  struct timespec queued;
+  vt_thread_pool_slot_t *slot;
+
+  pos = vt_atomic_load (&ring->dequeue_pos);
+  slot = &ring->slots[pos & ring->mask];
+
+  if (vt_atomic_load (&slot->seq) != pos + 1)
+    return 0; /* empty */
+  queued = slot->queued;
+  /* order read of task before second read of sequence */
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  if (vt_atomic_load (&slot->seq) != pos + 1)
+    return 0; /* shifted while reading */
+
+  return vt_thread_pool_msecs (&queued, now);
+}
+
+long
+vt_thread_pool_msecs (const struct timespec *from, const struct timespec *to)
+{
+  return ((to->tv_sec - from->tv_sec) * 1000) +
+         ((to->tv_nsec - from->tv_nsec) / 1000000);
 }
 
 void
 vt_thread_pool_set_max_threads (vt_thread_pool_t *pool, unsigned int num)
 {
-  int ret;
-
   assert (pool);
-
-  if ((ret = pthread_mutex_lock (&pool->lock)) != 0)
-    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
   pool->max_threads = num;
-  if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
-    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+  __sync_synchronize ();
 }
 
 void
 vt_thread_pool_set_max_idle_threads (vt_thread_pool_t *pool, unsigned int num)
+{
+  assert (pool);
+  pool->max_idle_threads = num;
+  __sync_synchronize ();
+}
+
+/* NOTE: Must be called before the first task is pushed, the ring is sized to
+   fit max_queued tasks. */
+void
+vt_thread_pool_set_max_queued (vt_thread_pool_t *pool, unsigned int num)
 {
   int ret;
 
@@ -335,24 +891,139 @@ vt_thread_pool_set_max_idle_threads (vt_thread_pool_t *pool, unsigned int num)
 
   if ((ret = pthread_mutex_lock (&pool->lock)) != 0)
     vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
-  pool->max_idle_threads = num;
+  if (vt_atomic_load (&pool->ring.enqueue_pos) || pool->workers)
+    vt_panic ("%s: tasks were pushed already", __func__);
+  if (vt_thread_pool_slots (&pool->ring,
+        num ? num : UNLIMITED_MAX_TASKS, NULL) != 0)
+    vt_fatal ("%s: cannot allocate queue", __func__);
+  pool->max_tasks = num;
   if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
     vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
 }
 
 void
-vt_thread_pool_set_max_queued (vt_thread_pool_t *pool, unsigned int num)
+vt_thread_pool_set_max_delay (vt_thread_pool_t *pool, unsigned int msecs)
 {
-  int ret;
+  assert (pool);
+  pool->max_delay = msecs;
+  __sync_synchronize ();
+}
+
+/* Switches pool to work-stealing mode. There's one worker per thread, and
+   max_threads defaults to the number of processors. Queued tasks are divided
+   evenly over the inboxes of the workers, max_idle_threads and the idle
+   timeout do not apply.
+   NOTE: Must be called after max_threads and max_queued are set and before
+   the first task is pushed. */
+void
+vt_thread_pool_set_work_stealing (vt_thread_pool_t *pool, int on)
+{
+  int i, num, ret;
+  long cpus;
+  unsigned int tasks;
+  vt_thread_pool_worker_t *workers;
 
   assert (pool);
 
+  if (! on)
+    return;
+
   if ((ret = pthread_mutex_lock (&pool->lock)) != 0)
     vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
-  pool->max_tasks = num;
+  if (vt_atomic_load (&pool->ring.enqueue_pos) || pool->workers)
+    vt_panic ("%s: tasks were pushed already", __func__);
+
+  if (! (num = pool->max_threads)) {
+    if ((cpus = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+      cpus = 1;
+    num = (int)cpus;
+  }
+
+  tasks = pool->max_tasks ? pool->max_tasks : UNLIMITED_MAX_TASKS;
+  tasks = (tasks + num - 1) / num;
+
+  if (! (workers = calloc (num, sizeof (vt_thread_pool_worker_t))))
+    vt_fatal ("%s: calloc: %s", __func__, strerror (errno));
+
+  for (i = 0; i < num; i++) {
+    workers[i].pool = pool;
+    workers[i].num = i;
+    if (vt_thread_pool_slots (&workers[i].inbox, tasks, NULL) != 0)
+      vt_fatal ("%s: cannot allocate queue", __func__);
+  }
+
+  pool->workers = workers;
+  pool->nworkers = num;
+  __sync_synchronize ();
+
   if ((ret = pthread_mutex_unlock (&pool->lock)) != 0)
     vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
 }
 
+void
+vt_thread_pool_set_idle_timeout (vt_thread_pool_t *pool, unsigned int msecs)
+{
+  assert (pool);
+  pool->wait.tv_sec = msecs / 1000;
+  pool->wait.tv_nsec = (msecs % 1000) * 1000000;
+  __sync_synchronize ();
+}
+
+/* Creates threads up front so that the first requests do not wait for
+   threads to be created. */
+void
+vt_thread_pool_set_min_threads (vt_thread_pool_t *pool, unsigned int num)
+{
+  int i;
+
+  assert (pool);
+
+  if (pool->max_threads && num > (unsigned int)pool->max_threads)
+    num = pool->max_threads;
+  if (pool->workers && num > (unsigned int)pool->nworkers)
+    num = pool->nworkers;
+  pool->min_threads = num;
+  __sync_synchronize ();
+
+  for (i = 0; i < (int)num; i++) {
+    if (pool->workers)
+      (void)vt_thread_pool_start (&pool->workers[i]);
+    else if (vt_atomic_load (&pool->num_threads) < (int)num)
+      (void)vt_thread_pool_spawn (pool);
+  }
+}
+
+/* Starts controller that creates threads once tasks are queued longer than
+   msecs milliseconds on average. Threads are created on demand if no target
+   is set. */
+void
+vt_thread_pool_set_target_delay (vt_thread_pool_t *pool, unsigned int msecs)
+{
+  assert (pool);
+
+  pool->target_delay = msecs;
+  __sync_synchronize ();
+
+  if (msecs && __sync_bool_compare_and_swap (&pool->ctl_running, 0, 1)) {
+    if (vt_thread_pool_thread (pool, &thread_pool_controller, (void *)pool,
+          -1) != 0)
+      __sync_lock_release (&pool->ctl_running);
+  }
+}
+
+/* NOTE: Only applies to threads created afterwards, call before setting
+   min_threads. Threads are not placed if the set is empty. */
+void
+vt_thread_pool_set_affinity (vt_thread_pool_t *pool, const vt_affinity_t *aff)
+{
+  assert (pool);
+  assert (aff);
+  memcpy (&pool->cpus, aff, sizeof (vt_affinity_t));
+  __sync_synchronize ();
+}
+
+#undef QUEUED
 #undef QUEUE_FULL
-#undef THREADS_DEPLETED
+#undef QUEUE_SLOW
+#undef UNLIMITED_MAX_TASKS
+#undef CONTROL_INTERVAL
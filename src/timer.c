@@ -0,0 +1,348 @@
+/* system includes */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* valiant includes */
+#include "alloc.h"
+#include "atomic.h"
+#include "error.h"
+#include "timer.h"
+
+#define VT_TIMER_MASK (VT_TIMER_SLOTS - 1)
+
+/* prototypes */
+void vt_timer_lock (vt_timer_slot_t *);
+void vt_timer_unlock (vt_timer_slot_t *);
+void vt_timer_link (vt_timer_t *, vt_timer_slot_t *, vt_timer_entry_t *);
+void vt_timer_unlink (vt_timer_slot_t *, vt_timer_entry_t *);
+void vt_timer_wake (vt_timer_t *);
+void vt_timer_expire (vt_timer_t *, vt_timer_slot_t *, long);
+void *vt_timer_worker (void *);
+
+long
+vt_timer_now (void)
+{
+  struct timespec now;
+
+  (void)clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/* monotonic microseconds, used to measure how long lookups take */
+long
+vt_timer_usecs (void)
+{
+  struct timespec now;
+
+  (void)clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+vt_timer_t *
+vt_timer_create (vt_error_t *err)
+{
+  int i, ret;
+  vt_timer_t *timer;
+
+  if (! (timer = vt_memalign (64, sizeof (vt_timer_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: posix_memalign: %s", __func__, strerror (errno));
+    return NULL;
+  }
+
+  memset (timer, 0, sizeof (vt_timer_t));
+  timer->tick = vt_timer_now () / VT_TIMER_TICK;
+
+  for (i = 0; i < VT_TIMER_SLOTS; i++) {
+    if ((ret = pthread_mutex_init (&timer->slots[i].lock, NULL)) != 0)
+      vt_fatal ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
+  }
+  if ((ret = pthread_mutex_init (&timer->lock, NULL)) != 0)
+    vt_fatal ("%s: pthread_mutex_init: %s", __func__, strerror (ret));
+  if ((ret = pthread_cond_init (&timer->done, NULL)) != 0)
+    vt_fatal ("%s: pthread_cond_init: %s", __func__, strerror (ret));
+
+  if ((ret = pthread_create (&timer->thread, NULL, &vt_timer_worker,
+                             (void *)timer)) != 0)
+  {
+    if (ret != EAGAIN)
+      vt_fatal ("%s: pthread_create: %s", __func__, strerror (ret));
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: pthread_create: %s", __func__, strerror (ret));
+    (void)vt_timer_destroy (timer, NULL);
+    return NULL;
+  }
+
+  timer->running = 1;
+  return timer;
+}
+
+/* NOTE: Entries must be cancelled before the timer is destroyed. */
+int
+vt_timer_destroy (vt_timer_t *timer, vt_error_t *err)
+{
+  int i, ret;
+
+  if (timer) {
+    if (timer->running) {
+      vt_atomic_store (&timer->dead, 1);
+      vt_timer_wake (timer);
+      if ((ret = pthread_join (timer->thread, NULL)) != 0)
+        vt_panic ("%s: pthread_join: %s", __func__, strerror (ret));
+    }
+
+    (void)pthread_cond_destroy (&timer->done);
+    (void)pthread_mutex_destroy (&timer->lock);
+    for (i = 0; i < VT_TIMER_SLOTS; i++)
+      (void)pthread_mutex_destroy (&timer->slots[i].lock);
+    free (timer);
+  }
+
+  return 0;
+}
+
+void
+vt_timer_entry_init (vt_timer_entry_t *entry, VT_TIMER_FUNC func, void *arg)
+{
+  assert (entry);
+  memset (entry, 0, sizeof (vt_timer_entry_t));
+  entry->func = func;
+  entry->arg = arg;
+}
+
+void
+vt_timer_lock (vt_timer_slot_t *slot)
+{
+  int ret;
+
+  if ((ret = pthread_mutex_lock (&slot->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+}
+
+void
+vt_timer_unlock (vt_timer_slot_t *slot)
+{
+  int ret;
+
+  if ((ret = pthread_mutex_unlock (&slot->lock)) != 0)
+    vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+}
+
+/* NOTE: Must be called with slot locked. */
+void
+vt_timer_link (vt_timer_t *timer, vt_timer_slot_t *slot,
+  vt_timer_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = slot->first;
+  if (slot->first)
+    slot->first->prev = entry;
+  slot->first = entry;
+  vt_atomic_store (&entry->timer, timer);
+  vt_atomic_store (&entry->slot, slot);
+}
+
+/* NOTE: Must be called with slot locked. */
+void
+vt_timer_unlink (vt_timer_slot_t *slot, vt_timer_entry_t *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    slot->first = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  entry->prev = NULL;
+  entry->next = NULL;
+  vt_atomic_store (&entry->slot, NULL);
+}
+
+void
+vt_timer_wake (vt_timer_t *timer)
+{
+  (void)__sync_add_and_fetch (&timer->futex, 1);
+  (void)vt_futex (&timer->futex, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+/* Arms entry to fire at when. If the entry is armed already it fires at the
+   earliest of both deadlines. Deadlines are rounded up to the next tick, a
+   tick that passed already is replaced by the first tick that is pending.
+   Both slots are locked in address order, the slot the entry is moved to
+   must not be visited in the meantime. */
+void
+vt_timer_add (vt_timer_t *timer, vt_timer_entry_t *entry, long when)
+{
+  int moved;
+  long tick;
+  vt_timer_slot_t *from, *to;
+
+  assert (timer);
+  assert (entry);
+
+  for (;;) {
+    from = vt_atomic_load (&entry->slot);
+    tick = (when + VT_TIMER_TICK - 1) / VT_TIMER_TICK;
+    if (tick <= vt_atomic_load (&timer->tick))
+      tick = vt_atomic_load (&timer->tick) + 1;
+    to = &timer->slots[tick & VT_TIMER_MASK];
+
+    if (from && (uintptr_t)from < (uintptr_t)to)
+      vt_timer_lock (from);
+    vt_timer_lock (to);
+    if (from && (uintptr_t)from > (uintptr_t)to)
+      vt_timer_lock (from);
+    if (vt_atomic_load (&entry->slot) == from &&
+        vt_atomic_load (&timer->tick) < tick)
+      break;
+    if (from && from != to)
+      vt_timer_unlock (from);
+    vt_timer_unlock (to);
+  }
+
+  /* entries that stay with the timer do not count again */
+  moved = (! from || entry->timer != timer);
+  if (moved || entry->when > when) {
+    if (from) {
+      vt_timer_unlink (from, entry);
+      if (moved)
+        (void)__sync_sub_and_fetch (&entry->timer->armed, 1);
+    }
+    entry->when = when;
+    vt_timer_link (timer, to, entry);
+    if (moved && __sync_fetch_and_add (&timer->armed, 1) == 0)
+      vt_timer_wake (timer);
+  }
+
+  if (from && from != to)
+    vt_timer_unlock (from);
+  vt_timer_unlock (to);
+}
+
+/* Disarms entry and waits for its callback if it is running in another
+   thread, the entry may be reused or freed once vt_timer_cancel returns. */
+void
+vt_timer_cancel (vt_timer_entry_t *entry)
+{
+  int ret;
+  vt_timer_t *timer;
+  vt_timer_slot_t *slot;
+
+  assert (entry);
+
+  for (;;) {
+    if (! (timer = vt_atomic_load (&entry->timer)))
+      return;
+
+    while ((slot = vt_atomic_load (&entry->slot))) {
+      vt_timer_lock (slot);
+      if (entry->slot == slot) {
+        vt_timer_unlink (slot, entry);
+        (void)__sync_sub_and_fetch (&timer->armed, 1);
+        vt_timer_unlock (slot);
+        break;
+      }
+      vt_timer_unlock (slot);
+    }
+
+    /* entry is taken out of its slot before its callback runs, callbacks
+       may cancel their own entry */
+    if (vt_atomic_load (&timer->current) != entry ||
+        pthread_equal (timer->thread, pthread_self ()))
+      return;
+
+    if ((ret = pthread_mutex_lock (&timer->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    while (timer->current == entry) {
+      if ((ret = pthread_cond_wait (&timer->done, &timer->lock)) != 0)
+        vt_panic ("%s: pthread_cond_wait: %s", __func__, strerror (ret));
+    }
+    if ((ret = pthread_mutex_unlock (&timer->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+    /* callback may have armed entry again */
+  }
+}
+
+/* runs callbacks of entries in slot whose deadline passed, entries due in a
+   later round stay */
+void
+vt_timer_expire (vt_timer_t *timer, vt_timer_slot_t *slot, long now)
+{
+  int ret;
+  vt_timer_entry_t *entry;
+
+  vt_timer_lock (slot);
+  for (entry = slot->first; entry; ) {
+    if (entry->when > now) {
+      entry = entry->next;
+      continue;
+    }
+
+    /* callback runs unlocked so that it can arm the entry again */
+    vt_atomic_store (&timer->current, entry);
+    vt_timer_unlink (slot, entry);
+    (void)__sync_sub_and_fetch (&timer->armed, 1);
+    vt_timer_unlock (slot);
+    entry->func (entry->arg);
+
+    if ((ret = pthread_mutex_lock (&timer->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_lock: %s", __func__, strerror (ret));
+    vt_atomic_store (&timer->current, NULL);
+    if ((ret = pthread_cond_broadcast (&timer->done)) != 0)
+      vt_panic ("%s: pthread_cond_broadcast: %s", __func__, strerror (ret));
+    if ((ret = pthread_mutex_unlock (&timer->lock)) != 0)
+      vt_panic ("%s: pthread_mutex_unlock: %s", __func__, strerror (ret));
+
+    /* callback may have changed the slot */
+    vt_timer_lock (slot);
+    entry = slot->first;
+  }
+  vt_timer_unlock (slot);
+}
+
+/* Visits the slot of every tick that passed. Slots of ticks that passed
+   while the thread slept are visited once, a full round covers them all. */
+void *
+vt_timer_worker (void *arg)
+{
+  int val;
+  long msecs, now, tick;
+  struct timespec wait;
+  vt_timer_t *timer;
+
+  assert (arg);
+  timer = (vt_timer_t *)arg;
+  tick = timer->tick;
+
+  while (! vt_atomic_load (&timer->dead)) {
+    now = vt_timer_now ();
+    if (((now / VT_TIMER_TICK) - tick) > VT_TIMER_SLOTS)
+      tick = (now / VT_TIMER_TICK) - VT_TIMER_SLOTS;
+    while (tick < (now / VT_TIMER_TICK)) {
+      /* entries are no longer added to slot once tick is published */
+      vt_atomic_store (&timer->tick, ++tick);
+      vt_timer_expire (timer, &timer->slots[tick & VT_TIMER_MASK], now);
+    }
+
+    /* entries armed from here on bump futex */
+    val = vt_atomic_load (&timer->futex);
+    if (vt_atomic_load (&timer->dead))
+      break;
+    if (! vt_atomic_load (&timer->armed)) {
+      (void)vt_futex (&timer->futex, FUTEX_WAIT_PRIVATE, val, NULL);
+    } else if ((msecs = ((tick + 1) * VT_TIMER_TICK) - vt_timer_now ()) > 0) {
+      wait.tv_sec = msecs / 1000;
+      wait.tv_nsec = (msecs % 1000) * 1000000;
+      (void)vt_futex (&timer->futex, FUTEX_WAIT_PRIVATE, val, &wait);
+    }
+  }
+
+  return NULL;
+}
+
+#undef VT_TIMER_MASK
@@ -1,264 +1,760 @@
 /* system includes */
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 /* valiant includes */
+#include "alloc.h"
 #include "context.h"
 #include "dict.h"
 #include "error.h"
+#include "event.h"
 #include "request.h"
 #include "thread_pool.h"
+#include "timer.h"
 #include "worker.h"
 
-typedef struct _vt_worker_store vt_worker_store_t;
+/* A job holds everything needed to evaluate a request. Jobs are attached to
+   the connection rather than the thread, so that a worker can put a request
+   aside while lookups are in flight and pick up the next one. Once the last
+   lookup completes the connection is queued again and evaluation resumes
+   where it left off, possibly in another thread. */
+typedef struct _vt_worker_job vt_worker_job_t;
 
-struct _vt_worker_store {
-  int *dicts;
+struct _vt_worker_job {
+  vt_conn_t *conn;
+  vt_context_t *context; /* context request is evaluated against */
+  vt_stats_t *stats;
+  int busy; /* request is being evaluated */
+  int draining; /* response is sent, waiting for late lookups to return */
+  int keep; /* hand connection back to event loop once drained */
+  long deadline; /* lookups not done by then time out, zero if none */
+  vt_timer_entry_t timer; /* fires at earliest deadline of pending lookups */
+  int *dicts; /* dicts dispatched in current wave */
   int ndicts;
+  vt_bitset_t *scheduled; /* same dicts, as a set */
+  int *checks; /* checks of current stage that wait for a lookup, in order */
+  int nchecks;
+  int maxchecks; /* number of checks allocated */
+  int wave; /* first check dispatched in current wave */
+  int next; /* first check to dispatch in next wave */
+  int last; /* last wave of current stage was dispatched */
+  float max_left; /* maximum weight gained by checks not yet scored */
+  float min_left;
+  int max_inf; /* checks not yet scored without bound, not in max_left */
+  int min_inf;
   vt_request_t *request;
   vt_result_t *result;
+  unsigned long generation; /* of context result was created for */
+  int stageno; /* stage to continue evaluating */
+  int waiting; /* lookups for wave were dispatched */
+  float score;
+  const vt_response_t *response;
 };
 
-static pthread_key_t vt_worker_key;
-static pthread_once_t vt_worker_init_done = PTHREAD_ONCE_INIT;
-
 /* prototypes */
-void vt_worker_resp (int, const char *);
-void vt_worker_init (void);
-void vt_worker_deinit (void *);
-
-void
-vt_worker_resp (int conn, const char *resp)
+int vt_worker_resp (int, const vt_response_t *);
+vt_worker_job_t *vt_worker_job_create (vt_conn_t *, vt_error_t *);
+void vt_worker_job_free (void *);
+int vt_worker_job_init (vt_worker_job_t *, vt_context_t *, vt_stats_t *,
+  vt_error_t *);
+const vt_response_t *vt_worker_verdict (vt_context_t *, float);
+int vt_worker_bound (vt_worker_job_t *, float, float);
+void vt_worker_left (vt_worker_job_t *, vt_dict_t *, int);
+int vt_worker_bound_left (vt_worker_job_t *);
+long vt_worker_deadline (vt_worker_job_t *, vt_dict_t *, long *);
+void vt_worker_check (vt_worker_job_t *, int, long);
+void vt_worker_speculate (vt_worker_job_t *);
+int vt_worker_dispatch (vt_worker_job_t *);
+int vt_worker_eval (vt_worker_job_t *);
+void vt_worker_notify (void *);
+void vt_worker_expire (void *);
+int vt_worker_finish (vt_worker_job_t *, const vt_response_t *, int);
+int vt_worker_done (vt_worker_job_t *);
+
+#define VT_WORKER_RESP_TIMEOUT (1000) /* milliseconds */
+
+/* Responses are small and almost always fit in the socket send buffer, so a
+   reply normally takes exactly one call to send. MSG_NOSIGNAL makes sure a
+   client that went away does not raise SIGPIPE. */
+int
+vt_worker_resp (int conn, const vt_response_t *resp)
 {
-  size_t i, n;
+  size_t i;
   ssize_t nwn;
+  struct pollfd pfd;
+
+  for (i = 0; i < resp->len; ) {
+    nwn = send (conn, resp->str+i, resp->len-i, MSG_NOSIGNAL);
+
+    if (nwn < 0) {
+      if (errno == EINTR)
+        continue;
+      /* connections are non-blocking, wait for room in the send buffer */
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        pfd.fd = conn;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (poll (&pfd, 1, VT_WORKER_RESP_TIMEOUT) > 0)
+          continue;
+        if (errno == EINTR)
+          continue;
+      }
+      if (errno != EPIPE && errno != ECONNRESET)
+        vt_error ("%s (%d): send: %s", __func__, __LINE__, strerror (errno));
+      return -1;
+    }
 
-  for (i = 0, n = strlen (resp); i < n; ) {
-    nwn = write (conn, resp+i, n-i);
+    i += nwn;
+  }
 
-    if (nwn < (n-i) && errno != EINVAL) {
-      vt_error ("%s (%d): write: %s", __func__, __LINE__, strerror (errno));
-      break;
-    }
+  return 0;
+}
 
-    if (nwn)
-      i += nwn;
+#undef VT_WORKER_RESP_TIMEOUT
+
+vt_worker_job_t *
+vt_worker_job_create (vt_conn_t *conn, vt_error_t *err)
+{
+  vt_worker_job_t *job;
+
+  if (! (job = vt_calloc (1, sizeof (vt_worker_job_t)))) {
+    vt_set_error (err, VT_ERR_NOMEM);
+    vt_error ("%s: calloc: %s", __func__, strerror (errno));
+    return NULL;
   }
 
-  for (; write (conn, "\n", 1) == -1 && errno == EINTR; )
-    ;
+  if (! (job->request = vt_request_create (err))) {
+    free (job);
+    return NULL;
+  }
 
-  (void)close (conn);
+  job->conn = conn;
+  vt_timer_entry_init (&job->timer, &vt_worker_expire, (void *)job);
+  return job;
 }
 
 void
-vt_worker_init (void)
+vt_worker_job_free (void *arg)
 {
-  int ret;
-  vt_worker_store_t *store;
-//vt_error ("%s:%d: init", __func__, __LINE__);
-  pthread_key_create (&vt_worker_key, vt_worker_deinit);
+  vt_worker_job_t *job;
+
+  if ((job = (vt_worker_job_t *)arg)) {
+    vt_timer_cancel (&job->timer);
+    if (job->dicts)
+      free (job->dicts);
+    if (job->scheduled)
+      free (job->scheduled);
+    if (job->checks)
+      free (job->checks);
+    if (job->request)
+      vt_request_destroy (job->request);
+    if (job->result)
+      (void)vt_result_destroy (job->result, NULL);
+    free (job);
+  }
 }
 
-void
-vt_worker_deinit (void *arg)
+/* prepares job for evaluating a new request, results are reallocated if the
+   context was reloaded because dicts keep data of their own type in their
+   slot, which another dict at the same position cannot make sense of */
+int
+vt_worker_job_init (vt_worker_job_t *job,
+                    vt_context_t *ctx,
+                    vt_stats_t *stats,
+                    vt_error_t *err)
 {
-  vt_worker_store_t *store;
-
-  if ((store  = (vt_worker_store_t *)arg)) {
-    if (store->dicts)
-      free (store->dicts);
-    vt_request_destroy (store->request);
-    (void)vt_result_destroy (store->result, NULL);
-    free (store);
+  if (! job->result || job->generation != ctx->generation) {
+    if (job->result)
+      (void)vt_result_destroy (job->result, NULL);
+    if (job->dicts)
+      free (job->dicts);
+    if (job->scheduled)
+      free (job->scheduled);
+    job->result = NULL;
+    job->dicts = NULL;
+    job->ndicts = 0;
+    job->scheduled = NULL;
+
+    /* it's impossible to check more dicts per iteration than the maximum
+       number of dicts configured */
+    if (! (job->dicts = vt_calloc (ctx->ndicts + 1, sizeof (int)))) {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    if (! (job->scheduled = vt_calloc (VT_BITSET_WORDS (ctx->ndicts) + 1,
+                                       sizeof (vt_bitset_t))))
+    {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    if (! (job->result = vt_result_create (ctx->ndicts, err)))
+      return -1;
+
+    vt_result_set_notify (job->result, &vt_worker_notify, (void *)job);
+    job->generation = ctx->generation;
   }
+
+  if (job->maxchecks < ctx->max_checks) {
+    if (job->checks)
+      free (job->checks);
+    job->maxchecks = 0;
+    if (! (job->checks = vt_calloc (ctx->max_checks + 1, sizeof (int)))) {
+      vt_set_error (err, VT_ERR_NOMEM);
+      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+      return -1;
+    }
+    job->maxchecks = ctx->max_checks;
+  }
+
+  job->context = ctx;
+  job->stats = stats;
+  job->deadline = ctx->request_timeout ?
+    vt_timer_now () + ctx->request_timeout : 0;
+  for (; job->ndicts > 0; job->ndicts--)
+    vt_bitset_clear (job->scheduled, job->dicts[(job->ndicts - 1)]);
+  job->stageno = -1;
+  job->waiting = 0;
+  job->nchecks = 0;
+  job->wave = 0;
+  job->next = 0;
+  job->last = 0;
+  job->score = 0.0;
+  job->response = NULL;
+  return 0;
 }
 
-void
-vt_worker (void *data, void *user_data)
+const vt_response_t *
+vt_worker_verdict (vt_context_t *ctx, float score)
 {
-  int conn, pos, ret, run;
-  int ndicts, dictno, *dicts;
-  int checkno, depno, stageno;
-  int i, n;
-  float score = 0;
-  vt_check_t *check;
+  if (ctx->block_threshold && score >= ctx->block_threshold)
+    return &ctx->block_resp;
+  if (ctx->delay_threshold && score >= ctx->delay_threshold)
+    return &ctx->delay_resp;
+  return &ctx->allow_resp;
+}
+
+/* Returns 1 if the verdict is known no matter what checks that are not yet
+   scored yield, max and min bound the weight of those in the current
+   stage. */
+int
+vt_worker_bound (vt_worker_job_t *job, float max, float min)
+{
+  const vt_response_t *resp;
   vt_context_t *ctx;
-  vt_error_t err;
-  vt_request_t *req;
-  vt_result_t *res;
   vt_stage_t *stage;
-  vt_stats_t *stats;
-  vt_worker_store_t *store;
 
-  assert (data);
-  assert (user_data);
+  ctx = job->context;
+  if ((job->stageno + 1) < ctx->nstages) {
+    stage = ctx->stages[(job->stageno + 1)];
+    max += stage->max_left;
+    min += stage->min_left;
+  }
 
-  conn = *((int *)data);
-  ctx = ((vt_worker_arg_t *)user_data)->context;
-  stats = ((vt_worker_arg_t *)user_data)->stats;
+  /* refuse to decide if a bound is not a number, e.g. inf - inf */
+  if (isnan (job->score + min) || isnan (job->score + max))
+    return 0;
 
-  if ((ret = pthread_once (&vt_worker_init_done, vt_worker_init)) != 0)
-    vt_fatal ("%s: pthread_once: %s", __func__, strerror (ret));
-  if (! (store = pthread_getspecific (vt_worker_key))) {
-    if (! (store = calloc (1, sizeof (vt_worker_store_t))))
-      vt_error ("%s: calloc: %s", __func__, strerror (errno));
-    if (store && (ret = pthread_setspecific (vt_worker_key, store)) != 0)
-      vt_error ("%s: pthread_setspecific: %s", __func__, strerror (ret));
+  resp = vt_worker_verdict (ctx, job->score + min);
+  if (resp != vt_worker_verdict (ctx, job->score + max))
+    return 0;
+
+  vt_debug ("%s: verdict known in stage %d, score: %f",
+    __func__, job->stageno, job->score);
+  job->response = resp;
+  return 1;
+}
+
+/* Adds (n is 1) or takes off (n is -1) the weight dict adds to checks not
+   yet scored. Infinite weights are counted instead, subtracting one infinity
+   from another would leave the bound not a number. */
+void
+vt_worker_left (vt_worker_job_t *job, vt_dict_t *dict, int n)
+{
+  if (dict->max_diff > 0.0) {
+    if (isinf (dict->max_diff))
+      job->max_inf += n;
+    else
+      job->max_left += n * dict->max_diff;
   }
+  if (dict->min_diff < 0.0) {
+    if (isinf (dict->min_diff))
+      job->min_inf += n;
+    else
+      job->min_left += n * dict->min_diff;
+  }
+}
 
-  if (! store->request && ! (store->request = vt_request_create (&err)) ||
-      ! store->result && ! (store->result = vt_result_create (ctx->ndicts, &err)))
-  {
-    vt_worker_resp (conn, ctx->error_resp);
-    return;
+int
+vt_worker_bound_left (vt_worker_job_t *job)
+{
+  return vt_worker_bound (job,
+    job->max_inf ? INFINITY : job->max_left,
+    job->min_inf ? -INFINITY : job->min_left);
+}
+
+/* lookups that run asynchronously must be done by the earliest of the request
+   deadline and their own, now is looked up once and cached by the caller */
+long
+vt_worker_deadline (vt_worker_job_t *job, vt_dict_t *dict, long *now)
+{
+  long deadline;
+
+  deadline = 0;
+  if (dict->async) {
+    if (dict->timeout) {
+      if (! *now)
+        *now = vt_timer_now ();
+      deadline = *now + dict->timeout;
+    }
+    if (job->deadline && (! deadline || job->deadline < deadline))
+      deadline = job->deadline;
   }
 
-  /* it's impossible to check more dicts per iteration than the maximum number
-     of dicts configured */
-  if (! store->dicts) {
-    store->ndicts = ctx->ndicts;
-    if (! (store->dicts = calloc (ctx->ndicts, sizeof (int)))) {
-      vt_error ("%s: calloc: %s", __func__, strerror (errno));
+  return deadline;
+}
+
+/* evaluates dict unless its lookup was dispatched already, lookups that run
+   synchronously are measured here */
+void
+vt_worker_check (vt_worker_job_t *job, int pos, long deadline)
+{
+  long start;
+  vt_dict_t *dict;
+  vt_error_t err;
+
+  dict = job->context->dicts[pos];
+  /* local checks are done once they return and are not claimed, a claimed
+     slot that is resolved while nothing else is pending would resume the
+     job in another thread while this one is still evaluating it */
+  if (dict->async) {
+    if (! vt_result_claim (job->result, pos, deadline, dict->timeout_weight))
       return;
+  } else if (vt_result_ready (job->result, pos)) {
+    return;
+  }
+
+  start = dict->async ? 0 : vt_timer_usecs ();
+  err = 0;
+  /* failed lookups count as no match */
+  if (vt_dict_check (dict, job->request, job->result, pos, &err) != 0)
+    (void)vt_result_update (job->result, pos, 0.0);
+  if (! dict->async)
+    vt_dict_measure (dict, vt_timer_usecs () - start,
+      vt_result_points (job->result, pos));
+}
+
+/* Starts lookups of remote checks in every stage as soon as the request is
+   parsed, so that their latency overlaps. Results are only scored once the
+   check is reached, lookups are claimed then like any other. At most
+   speculate lookups are started, checks in early stages first. */
+void
+vt_worker_speculate (vt_worker_job_t *job)
+{
+  int checkno, n, pos, stageno;
+  long deadline, next, now;
+  vt_context_t *ctx;
+  vt_dict_t *dict;
+  vt_error_t err;
+  vt_stage_t *stage;
+
+  ctx = job->context;
+  now = 0;
+  next = 0;
+  n = 0;
+
+  for (stageno = 0; n < ctx->speculate && stageno < ctx->nstages; stageno++) {
+    stage = ctx->stages[stageno];
+    vt_context_order (ctx, stage, job->checks);
+
+    for (checkno = -stage->nprefetch;
+         n < ctx->speculate && checkno < stage->nchecks;
+         checkno++)
+    {
+      if (checkno < 0)
+        pos = stage->prefetch[(stage->nprefetch + checkno)];
+      else
+        pos = stage->checks[job->checks[checkno]]->dict;
+      dict = ctx->dicts[pos];
+      if (! dict->async)
+        continue;
+
+      deadline = vt_worker_deadline (job, dict, &now);
+      if (! vt_result_speculate (job->result, pos, deadline,
+                                 dict->timeout_weight))
+        continue;
+
+      n++;
+      err = 0;
+      if (vt_dict_check (dict, job->request, job->result, pos, &err) != 0)
+        (void)vt_result_update (job->result, pos, 0.0);
+      if (deadline && (! next || deadline < next))
+        next = deadline;
     }
   }
 
-  dicts = store->dicts;
-  req = store->request;
-  res = store->result;
-
-  if ((vt_request_parse (req, conn, &err))) {
-    char *fmt =
-    "helo_name=%s, sender=%s, sender_domain=%s, recipient=%s, "
-    "recipient_domain=%s, client_address=%s, client_name=%s, "
-    "reverse_client_name=%s";
-    vt_debug (fmt,
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_HELO_NAME),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_SENDER),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_SENDER_DOMAIN),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_RECIPIENT),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_RECIPIENT_DOMAIN),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_CLIENT_ADDRESS),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_CLIENT_NAME),
-      vt_request_mbrbyid (req, VT_REQUEST_MEMBER_REV_CLIENT_NAME)
-    );
-  } else {
-    vt_worker_resp (conn, ctx->error_resp);
-    return;
+  if (next)
+    vt_timer_add (ctx->timer, &job->timer, next);
+}
+
+/* Dispatches lookups of current wave. Returns 1 if the job was put aside
+   until the last lookup completes, 0 if all lookups completed already. */
+int
+vt_worker_dispatch (vt_worker_job_t *job)
+{
+  int dictno, pos;
+  long deadline, next, now;
+  vt_context_t *ctx;
+  vt_dict_t *dict;
+
+  ctx = job->context;
+
+  /* hold on to the result while dispatching so that lookups completing
+     in the meantime do not resume the job before we're done with it */
+  job->waiting = 1;
+  vt_result_lock (job->result);
+
+  now = 0;
+  next = 0;
+  for (dictno = 0; dictno < job->ndicts; dictno++) {
+    pos = job->dicts[dictno];
+    dict = ctx->dicts[pos];
+    deadline = vt_worker_deadline (job, dict, &now);
+    vt_worker_check (job, pos, deadline);
+    if (deadline && (! next || deadline < next))
+      next = deadline;
   }
 
-  for (stageno = -1; stageno < ctx->nstages; stageno++) {
-    memset (store->dicts, 0, store->ndicts * sizeof (int));
-    ndicts = 0;
-
-    /* evaluate checks in current stage */
-    if (stageno >= 0) {
-      run = 1;
-      stage = ctx->stages[stageno];
-      /* don't evaluate stage if dependencies failed */
-      for (depno = 0; run && depno < stage->ndepends; depno++) {
-        pos = stage->depends[depno];
-
-        if (! res->results[pos]->ready)
-          vt_panic ("%s: dict %s not ready",
-            __func__, ctx->dicts[pos]->name);
-        if (res->results[pos]->points)
-          run = 1;
-      }
+  if (next)
+    vt_timer_add (ctx->timer, &job->timer, next);
 
-      if (run) {
-        for (checkno = 0; checkno < stage->nchecks; checkno++) {
-          check = stage->checks[checkno];
-          run = check->ndepends ? 0 : 1;
+  /* last lookup to complete resumes the job */
+  return vt_result_unlock (job->result) ? 0 : 1;
+}
 
-          for (depno = 0; ! run && depno < check->ndepends; depno++) {
-            pos = check->depends[depno];
+/* Evaluates stages until lookups are in flight or the verdict is known.
+   Checks of a stage are independent and are evaluated in the order learned
+   by the context. Local checks run inline, lookups of remote checks are
+   dispatched in waves of lookup_wave checks so that checks further down the
+   list need not be looked up once the verdict is known. Returns 1 if the job
+   was put aside, in which case it must not be touched because it may already
+   have been resumed by another thread. Returns 0 once the response is
+   known. */
+int
+vt_worker_eval (vt_worker_job_t *job)
+{
+  int pos, run;
+  int checkno, depno, dictno, end, i;
+  vt_check_t *check;
+  vt_context_t *ctx;
+  vt_dict_t *dict;
+  vt_result_t *res;
+  vt_stage_t *stage;
 
-            if (! res->results[pos]->ready)
-              vt_panic ("%s: dict %s not ready",
-                __func__, ctx->dicts[pos]->name);
-            if (res->results[pos]->points)
-              run = 1;
-          }
+  ctx = job->context;
+  res = job->result;
 
-          pos = check->dict;
+  while (job->stageno < ctx->nstages) {
+    stage = (job->stageno >= 0) ? ctx->stages[job->stageno] : NULL;
 
-          for (dictno = 0; run && dictno < ndicts; dictno++) {
-            if (dicts[dictno] == pos)
-              run = 0;
-          }
+    if (job->waiting) {
+      /* score checks of wave that completed */
+      job->waiting = 0;
+      for (i = job->wave; i < job->next; i++) {
+        check = stage->checks[job->checks[i]];
+        dict = ctx->dicts[check->dict];
+        job->score += vt_result_points (res, check->dict);
+        vt_worker_left (job, dict, -1);
+      }
+      if (! job->last && vt_worker_bound_left (job))
+        return 0;
+
+    } else if (! job->last && ! job->next) {
+      /* stop once the remaining stages cannot change the verdict, every
+         lookup dispatched for the previous stage has completed by now */
+      if (vt_worker_bound (job, stage ? stage->max_diff : 0.0,
+                                stage ? stage->min_diff : 0.0))
+        return 0;
+
+      job->nchecks = 0;
+      job->max_left = 0.0;
+      job->min_left = 0.0;
+      job->max_inf = 0;
+      job->min_inf = 0;
+
+      if (! stage && ctx->speculate > 0)
+        vt_worker_speculate (job);
+
+      /* evaluate checks in current stage */
+      if (stage) {
+        run = 1;
+        /* don't evaluate stage if dependencies failed */
+        for (depno = 0; run && depno < stage->ndepends; depno++) {
+          pos = stage->depends[depno];
+
+          if (! vt_result_ready (res, pos))
+            vt_panic ("%s: dict %s not ready",
+              __func__, ctx->dicts[pos]->name);
+          if (vt_result_points (res, pos))
+            run = 1;
+        }
 
-          if (run) {
-            if (res->results[pos]->ready)
-              score += res->results[pos]->points;
-            else
-              dicts[ndicts++] = pos;
+        if (run) {
+          for (i = 0; i < stage->nchecks; i++)
+            vt_worker_left (job, ctx->dicts[stage->checks[i]->dict], 1);
+          vt_context_order (ctx, stage, job->checks);
+
+          for (i = 0; i < stage->nchecks; i++) {
+            checkno = job->checks[i];
+            check = stage->checks[checkno];
+            run = check->ndepends ? 0 : 1;
+
+            for (depno = 0; ! run && depno < check->ndepends; depno++) {
+              pos = check->depends[depno];
+
+              if (! vt_result_ready (res, pos))
+                vt_panic ("%s: dict %s not ready",
+                  __func__, ctx->dicts[pos]->name);
+              if (vt_result_points (res, pos))
+                run = 1;
+            }
+
+            pos = check->dict;
+            dict = ctx->dicts[pos];
+
+            if (! run) {
+              vt_worker_left (job, dict, -1);
+              continue;
+            }
+
+            if (! dict->async)
+              vt_worker_check (job, pos, 0);
+
+            if (vt_result_ready (res, pos)) {
+              job->score += vt_result_points (res, pos);
+              vt_worker_left (job, dict, -1);
+              if (vt_worker_bound_left (job))
+                return 0;
+            } else {
+              /* checks are moved to the front, never past position i */
+              job->checks[job->nchecks++] = checkno;
+            }
           }
         }
       }
     }
 
-    /* evaluate checks on which checks in next stage depend */
-    if ((stageno + 1) < ctx->nstages) {
-      stage = ctx->stages[(stageno + 1)];
-
-      for (checkno = 0; checkno < stage->nchecks; checkno++) {
-        check = stage->checks[checkno];
+    if (job->last) {
+      job->stageno++;
+      job->nchecks = 0;
+      job->wave = 0;
+      job->next = 0;
+      job->last = 0;
+      continue;
+    }
 
-        for (depno = 0; depno < check->ndepends; depno++) {
-          pos = check->depends[depno];
+    /* dispatch next wave of lookups */
+    end = job->nchecks;
+    if (ctx->lookup_wave > 0 && (job->next + ctx->lookup_wave) < end)
+      end = job->next + ctx->lookup_wave;
+
+    for (; job->ndicts > 0; job->ndicts--)
+      vt_bitset_clear (job->scheduled, job->dicts[(job->ndicts - 1)]);
+    for (i = job->next; i < end; i++) {
+      pos = stage->checks[job->checks[i]]->dict;
+      if (! vt_bitset_isset (job->scheduled, pos)) {
+        vt_bitset_set (job->scheduled, pos);
+        job->dicts[job->ndicts++] = pos;
+      }
+    }
 
-          for (dictno = 0, run = 1; run && dictno < ndicts; dictno++) {
-            if (dicts[dictno] == pos)
-              run = 0;
+    job->wave = job->next;
+    job->next = end;
+
+    /* evaluate dicts on which checks in next stage depend with last wave */
+    if (end == job->nchecks) {
+      job->last = 1;
+      if ((job->stageno + 1) < ctx->nstages) {
+        stage = ctx->stages[(job->stageno + 1)];
+
+        for (i = 0; i < stage->nprefetch; i++) {
+          pos = stage->prefetch[i];
+          if (! vt_bitset_isset (job->scheduled, pos) &&
+              ! vt_result_ready (res, pos))
+          {
+            vt_bitset_set (job->scheduled, pos);
+            job->dicts[job->ndicts++] = pos;
           }
-          if (run && ! res->results[pos]->ready)
-            dicts[ndicts++] = pos;
         }
       }
     }
 
-    /* evaluate checks for which results were not available */
-    for (dictno = 0; dictno < ndicts; dictno++) {
-      pos = dicts[dictno];
-      vt_dict_check (ctx->dicts[pos], req, res, pos, &err);
+    if (vt_worker_dispatch (job))
+      return 1;
+  }
+
+  vt_debug ("%s:%d: score: %f", __func__, __LINE__, job->score);
+
+  job->response = vt_worker_verdict (ctx, job->score);
+  return 0;
+}
+
+/* Called by the thread that resolved the last pending lookup of a stage, or
+   by the last lookup to return once the response is sent. The job is queued
+   on the pool it was taken from, which is kept alive until the job is
+   done. */
+void
+vt_worker_notify (void *arg)
+{
+  vt_error_t err;
+  vt_worker_job_t *job;
+
+  assert (arg);
+  job = (vt_worker_job_t *)arg;
+
+  err = 0;
+  if (vt_thread_pool_resume (job->conn->pool, (void *)job->conn, &err) != 0) {
+    vt_error ("%s: cannot resume request, closing connection", __func__);
+    if (job->draining) {
+      job->keep = 0;
+      (void)vt_worker_done (job);
+    } else {
+      (void)vt_worker_finish (job, &job->context->error_resp, 0);
     }
+  }
+}
 
-    vt_result_wait (res);
+/* Runs in the timer thread once the earliest deadline of pending lookups
+   passed. Lookups that are late count as their fallback weight. */
+void
+vt_worker_expire (void *arg)
+{
+  long next;
+  vt_worker_job_t *job;
 
-    /* evaluate scores */
-    if (stageno >= 0) {
-      stage = ctx->stages[stageno];
+  assert (arg);
+  job = (vt_worker_job_t *)arg;
 
-      for (checkno = 0; checkno < stage->nchecks; checkno++) {
-        check = stage->checks[checkno];
-        pos = check->dict;
+  if ((next = vt_result_expire (job->result, vt_timer_now ())))
+    vt_timer_add (job->timer.timer, &job->timer, next);
+}
 
-        for (dictno = 0; dictno < ndicts; dictno++) {
-          if (pos == dicts[dictno]) {
-            score += res->results[pos]->points;
-            break;
-          }
-        }
-      }
+/* Sends response and hands connection back to the event loop once lookups
+   that missed their deadline have returned. Returns 1 if another complete
+   request is buffered, the job must not be touched if 0 is returned because
+   the connection is owned by the event loop again or a late lookup will
+   resume the job. */
+int
+vt_worker_finish (vt_worker_job_t *job, const vt_response_t *resp, int keep)
+{
+  int ret;
+
+  if (job->response)
+    vt_stats_update (job->stats, job->result);
+
+  /* reply without waiting for lookups that timed out */
+  ret = vt_worker_resp (job->conn->fd, resp);
+  job->keep = (keep && ret == 0);
+  job->draining = 1;
+
+  if (job->result && ! vt_result_drain (job->result))
+    return 0;
+  return vt_worker_done (job);
+}
+
+int
+vt_worker_done (vt_worker_job_t *job)
+{
+  int more;
+  vt_conn_t *conn;
+  vt_thread_pool_t *pool;
+
+  conn = job->conn;
+  pool = conn->pool;
+
+  vt_timer_cancel (&job->timer);
+  if (job->result)
+    vt_result_reset (job->result);
+  vt_request_reset (job->request);
+  job->response = NULL;
+  job->draining = 0;
+  job->busy = 0;
+
+  /* connection is handed back to the event loop, or closed */
+  more = vt_event_done (conn, job->keep);
+  vt_thread_pool_release (pool);
+  return more;
+}
+
+void
+vt_worker (void *data, void *user_data)
+{
+  const vt_response_t *resp;
+  vt_conn_t *conn;
+  vt_context_t *ctx;
+  vt_error_t err;
+  vt_stats_t *stats;
+  vt_worker_job_t *job;
+
+  assert (data);
+  assert (user_data);
+
+  conn = (vt_conn_t *)data;
+  ctx = ((vt_worker_arg_t *)user_data)->context;
+  stats = ((vt_worker_arg_t *)user_data)->stats;
+
+  if (! (job = (vt_worker_job_t *)conn->data)) {
+    err = 0;
+    if (! (job = vt_worker_job_create (conn, &err))) {
+      (void)vt_worker_resp (conn->fd, &ctx->error_resp);
+      (void)vt_event_done (conn, 0);
+      return;
     }
+    conn->data = (void *)job;
+    conn->data_free = &vt_worker_job_free;
   }
 
-  // FIXME: update statistics
-  vt_debug ("%s:%d: score: %f", __func__, __LINE__, score);
+  /* last lookup that outlived the response returned */
+  if (job->draining && ! vt_worker_done (job))
+    return;
 
-  if (ctx->block_threshold && score >= ctx->block_threshold)
-    vt_worker_resp (conn, ctx->block_resp);
-  else if (ctx->delay_threshold && score >= ctx->delay_threshold)
-    vt_worker_resp (conn, ctx->delay_resp);
-  else
-    vt_worker_resp (conn, ctx->allow_resp);
-  vt_stats_update (stats, res);
-  vt_result_reset (res);
-  free (data);
+  do {
+    if (! job->busy) {
+      /* pool must outlive requests that are put aside */
+      vt_thread_pool_hold (conn->pool);
+      job->busy = 1;
+
+      err = 0;
+      if (vt_worker_job_init (job, ctx, stats, &err) != 0 ||
+          ! vt_request_parse (job->request, conn->buf, conn->end, &err))
+      {
+        resp = &ctx->error_resp;
+        continue;
+      }
+
+      vt_debug ("helo_name=%s, sender=%s, sender_domain=%s, recipient=%s, "
+        "recipient_domain=%s, client_address=%s, client_name=%s, "
+        "reverse_client_name=%s",
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_HELO_NAME),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_SENDER),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_SENDER_DOMAIN),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_RECIPIENT),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_RECIPIENT_DOMAIN),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_CLIENT_ADDRESS),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_CLIENT_NAME),
+        vt_request_mbrbyid (job->request, VT_REQUEST_MEMBER_REV_CLIENT_NAME));
+    }
+
+    if (vt_worker_eval (job))
+      return; /* put aside until lookups complete */
+    resp = job->response;
+  } while (vt_worker_finish (job, resp, 1));
 }
@@ -0,0 +1,178 @@
+#include <arpa/inet.h>
+#include <confuse.h>
+#include <stdarg.h>
+#include <string.h>
+#include <valiant/rbl.h>
+#include <CUnit/Basic.h>
+
+static cfg_opt_t weight_opts[] = {
+  CFG_FLOAT ("weight", 1.0, CFGF_NONE),
+  CFG_END ()
+};
+
+static cfg_opt_t zone_opts[] = {
+  CFG_FLOAT ("weight", 1.0, CFGF_NONE),
+  CFG_SEC ("in", weight_opts, CFGF_MULTI | CFGF_TITLE),
+  CFG_SEC ("bit", weight_opts, CFGF_MULTI | CFGF_TITLE),
+  CFG_END ()
+};
+
+static vt_rbl_t *
+rbl_create (const char *buf)
+{
+  cfg_t *sec;
+  vt_rbl_t *rbl = NULL;
+
+  if ((sec = cfg_init (zone_opts, CFGF_NONE))) {
+    if (cfg_parse_buf (sec, buf) == CFG_SUCCESS)
+      rbl = vt_rbl_create (sec, "zone.example", NULL);
+    cfg_free (sec);
+  }
+
+  return rbl;
+}
+
+/* points for an answer with naddrs addresses, in dotted quad notation */
+static float
+rbl_points (vt_rbl_t *rbl, vt_resolver_status_t status, int naddrs, ...)
+{
+  int i;
+  va_list ap;
+  vt_resolver_query_t query;
+
+  memset (&query, 0, sizeof (query));
+  strcpy (query.name, "2.0.0.192.zone.example");
+  query.type = VT_RESOLVER_TYPE_A;
+  query.status = status;
+  va_start (ap, naddrs);
+  for (i = 0; i < naddrs; i++)
+    (void)inet_pton (AF_INET, va_arg (ap, const char *), &query.addrs[i]);
+  va_end (ap);
+  query.naddrs = naddrs;
+
+  return vt_rbl_points (rbl, &query);
+}
+
+#define POINTS(rbl, ...) \
+  rbl_points ((rbl), VT_RESOLVER_SUCCESS, \
+    (sizeof ((const char *[]){ __VA_ARGS__ }) / sizeof (const char *)), \
+    __VA_ARGS__)
+
+/* weights are fractions of a power of two, so sums are exact */
+static void
+rbl_test_codes (void)
+{
+  vt_rbl_t *rbl;
+
+  CU_ASSERT_FATAL ((rbl = rbl_create (
+    "weight = 2.25\n"
+    "in \"127.0.0.4/32\" { weight = 5.5 }\n"
+    "in \"127.0.0.10/31\" { weight = 0.75 }\n"
+    "in \"127.0.0.128/25\" { weight = -1.5 }\n")) != NULL);
+
+  CU_ASSERT (POINTS (rbl, "127.0.0.2") == 2.25);
+  CU_ASSERT (POINTS (rbl, "127.0.0.4") == 5.5);
+  /* heaviest network wins */
+  CU_ASSERT (POINTS (rbl, "127.0.0.10") == 2.25);
+  CU_ASSERT (POINTS (rbl, "127.0.0.129") == 2.25);
+  CU_ASSERT (POINTS (rbl, "127.0.0.2", "127.0.0.4") == 5.5);
+  CU_ASSERT (POINTS (rbl, "127.0.0.4", "127.0.0.2") == 5.5);
+  CU_ASSERT (rbl_points (rbl, VT_RESOLVER_SUCCESS, 0) == 0.0);
+  CU_ASSERT (rbl_points (rbl, VT_RESOLVER_NXDOMAIN, 0) == 0.0);
+  CU_ASSERT (rbl_points (rbl, VT_RESOLVER_SERVFAIL, 0) == 0.0);
+  CU_ASSERT (vt_rbl_max_weight (rbl) == 5.5);
+  CU_ASSERT (vt_rbl_min_weight (rbl) == -1.5);
+
+  (void)vt_rbl_destroy (rbl, NULL);
+}
+
+static void
+rbl_test_bits (void)
+{
+  vt_rbl_t *rbl;
+
+  CU_ASSERT_FATAL ((rbl = rbl_create (
+    "weight = 3.0\n"
+    "bit 0x02 { weight = 1.5 }\n"
+    "bit 4 { weight = 2.25 }\n"
+    "bit 8 { weight = 0.0 }\n"
+    "bit 64 { weight = -0.5 }\n")) != NULL);
+
+  CU_ASSERT (POINTS (rbl, "127.0.0.2") == 1.5);
+  CU_ASSERT (POINTS (rbl, "127.0.0.4") == 2.25);
+  CU_ASSERT (POINTS (rbl, "127.0.0.6") == 3.75);
+  CU_ASSERT (POINTS (rbl, "127.0.0.66") == 1.0);
+  CU_ASSERT (POINTS (rbl, "127.0.0.64") == -0.5);
+  CU_ASSERT (POINTS (rbl, "127.0.0.78") == 3.25);
+  /* bits that weigh nothing are configured all the same */
+  CU_ASSERT (POINTS (rbl, "127.0.0.8") == 0.0);
+  CU_ASSERT (POINTS (rbl, "127.0.0.10") == 1.5);
+  /* codes without configured bits take the weight of their network */
+  CU_ASSERT (POINTS (rbl, "127.0.0.1") == 3.0);
+  CU_ASSERT (POINTS (rbl, "127.0.0.129") == 3.0);
+  CU_ASSERT (POINTS (rbl, "127.0.0.8", "127.0.0.1") == 3.0);
+  CU_ASSERT (vt_rbl_max_weight (rbl) == 3.75);
+  CU_ASSERT (vt_rbl_min_weight (rbl) == -0.5);
+
+  (void)vt_rbl_destroy (rbl, NULL);
+
+  CU_ASSERT (rbl_create ("bit 3 { weight = 1.0 }\n") == NULL);
+  CU_ASSERT (rbl_create ("bit 256 { weight = 1.0 }\n") == NULL);
+  CU_ASSERT (rbl_create ("bit 0 { weight = 1.0 }\n") == NULL);
+  CU_ASSERT (rbl_create ("bit 2x { weight = 1.0 }\n") == NULL);
+}
+
+/* answers outside 127.0.0.0/24 are matched against the networks */
+static void
+rbl_test_networks (void)
+{
+  vt_rbl_t *rbl;
+
+  CU_ASSERT_FATAL ((rbl = rbl_create (
+    "weight = 0.5\n"
+    "in \"10.0.0.0/8\" { weight = 4.125 }\n"
+    "in \"127.0.1.0/24\" { weight = 1.25 }\n"
+    "bit 2 { weight = 8.0 }\n")) != NULL);
+
+  CU_ASSERT (POINTS (rbl, "127.0.0.2") == 8.0);
+  /* bits only apply to the last octet of 127.0.0.0/24 */
+  CU_ASSERT (POINTS (rbl, "127.0.1.2") == 1.25);
+  CU_ASSERT (POINTS (rbl, "127.1.0.2") == 0.5);
+  CU_ASSERT (POINTS (rbl, "10.1.2.3") == 4.125);
+  CU_ASSERT (POINTS (rbl, "192.0.2.1") == 0.0);
+  CU_ASSERT (POINTS (rbl, "192.0.2.1", "10.1.2.3") == 4.125);
+  CU_ASSERT (POINTS (rbl, "127.0.0.2", "10.1.2.3") == 8.0);
+
+  (void)vt_rbl_destroy (rbl, NULL);
+
+  CU_ASSERT (rbl_create ("in \"10.0.0.0\" { weight = 1.0 }\n") == NULL);
+  CU_ASSERT (rbl_create ("in \"10.0.0.0/33\" { weight = 1.0 }\n") == NULL);
+}
+
+int
+main (int argc, char *argv[])
+{
+  CU_pSuite suite = NULL;
+
+  if (CUE_SUCCESS != CU_initialize_registry())
+     return CU_get_error();
+
+  suite = CU_add_suite("rbl", NULL, NULL);
+  if (NULL == suite) {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  if (!CU_add_test(suite, "return codes", &rbl_test_codes) ||
+      !CU_add_test(suite, "bits", &rbl_test_bits) ||
+      !CU_add_test(suite, "networks", &rbl_test_networks))
+  {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  CU_cleanup_registry();
+  return CU_get_error();
+}
@@ -0,0 +1,172 @@
+#include <string.h>
+#include <valiant/req.h>
+#include <CUnit/Basic.h>
+
+typedef struct {
+  const char *name;
+  vt_request_member_t mbrid;
+} req_name_t;
+
+/* attributes as listed in SMTPD_POLICY_README */
+static const req_name_t req_names[] = {
+  { "helo_name", VT_REQUEST_MEMBER_HELO_NAME },
+  { "sender", VT_REQUEST_MEMBER_SENDER },
+  { "sender_domain", VT_REQUEST_MEMBER_SENDER_DOMAIN },
+  { "recipient", VT_REQUEST_MEMBER_RECIPIENT },
+  { "recipient_domain", VT_REQUEST_MEMBER_RECIPIENT_DOMAIN },
+  { "client_address", VT_REQUEST_MEMBER_CLIENT_ADDRESS },
+  { "client_name", VT_REQUEST_MEMBER_CLIENT_NAME },
+  { "reverse_client_name", VT_REQUEST_MEMBER_REV_CLIENT_NAME },
+  { "request", VT_REQUEST_MEMBER_REQUEST },
+  { "protocol_state", VT_REQUEST_MEMBER_PROTOCOL_STATE },
+  { "protocol_name", VT_REQUEST_MEMBER_PROTOCOL_NAME },
+  { "queue_id", VT_REQUEST_MEMBER_QUEUE_ID },
+  { "recipient_count", VT_REQUEST_MEMBER_RECIPIENT_COUNT },
+  { "client_port", VT_REQUEST_MEMBER_CLIENT_PORT },
+  { "instance", VT_REQUEST_MEMBER_INSTANCE },
+  { "sasl_method", VT_REQUEST_MEMBER_SASL_METHOD },
+  { "sasl_username", VT_REQUEST_MEMBER_SASL_USERNAME },
+  { "sasl_sender", VT_REQUEST_MEMBER_SASL_SENDER },
+  { "size", VT_REQUEST_MEMBER_SIZE },
+  { "ccert_subject", VT_REQUEST_MEMBER_CCERT_SUBJECT },
+  { "ccert_issuer", VT_REQUEST_MEMBER_CCERT_ISSUER },
+  { "ccert_fingerprint", VT_REQUEST_MEMBER_CCERT_FINGERPRINT },
+  { "ccert_pubkey_fingerprint", VT_REQUEST_MEMBER_CCERT_PUBKEY_FINGERPRINT },
+  { "encryption_protocol", VT_REQUEST_MEMBER_ENCRYPTION_PROTOCOL },
+  { "encryption_cipher", VT_REQUEST_MEMBER_ENCRYPTION_CIPHER },
+  { "encryption_keysize", VT_REQUEST_MEMBER_ENCRYPTION_KEYSIZE },
+  { "etrn_domain", VT_REQUEST_MEMBER_ETRN_DOMAIN },
+  { "stress", VT_REQUEST_MEMBER_STRESS },
+  { "policy_context", VT_REQUEST_MEMBER_POLICY_CONTEXT },
+  { "server_address", VT_REQUEST_MEMBER_SERVER_ADDRESS },
+  { "server_port", VT_REQUEST_MEMBER_SERVER_PORT },
+  { "compatibility_level", VT_REQUEST_MEMBER_COMPATIBILITY_LEVEL },
+  { "mail_version", VT_REQUEST_MEMBER_MAIL_VERSION }
+};
+
+#define NNAMES (sizeof (req_names) / sizeof (req_names[0]))
+
+static void
+req_test_names (void)
+{
+  int i;
+
+  /* every member is listed exactly once */
+  CU_ASSERT (NNAMES == (VT_REQUEST_MEMBERS - 1));
+
+  for (i = 0; i < NNAMES; i++) {
+    CU_ASSERT (vt_request_mbrtoid (req_names[i].name) == req_names[i].mbrid);
+    CU_ASSERT (vt_request_mbrtoidn (req_names[i].name,
+      strlen (req_names[i].name)) == req_names[i].mbrid);
+  }
+}
+
+static void
+req_test_prefixes (void)
+{
+  int i;
+  size_t len;
+  vt_request_member_t mbrid;
+
+  CU_ASSERT (vt_request_mbrtoid ("sender_domain") !=
+             vt_request_mbrtoid ("sender"));
+  CU_ASSERT (vt_request_mbrtoidn ("sender_domain", 6) ==
+             VT_REQUEST_MEMBER_SENDER);
+  CU_ASSERT (vt_request_mbrtoidn ("recipient_domain", 9) ==
+             VT_REQUEST_MEMBER_RECIPIENT);
+
+  /* a prefix of a name is only a member if it's a name of its own */
+  for (i = 0; i < NNAMES; i++) {
+    for (len = 1; len < strlen (req_names[i].name); len++) {
+      mbrid = vt_request_mbrtoidn (req_names[i].name, len);
+      if (mbrid != VT_REQUEST_MEMBER_NONE)
+        CU_ASSERT (len == strlen (req_names[i].name) ||
+                   (mbrid == VT_REQUEST_MEMBER_SENDER && len == 6) ||
+                   (mbrid == VT_REQUEST_MEMBER_RECIPIENT && len == 9) ||
+                   (mbrid == VT_REQUEST_MEMBER_REQUEST && len == 7));
+    }
+  }
+}
+
+static void
+req_test_unknown (void)
+{
+  CU_ASSERT (vt_request_mbrtoid (NULL) == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("s") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("sendr") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("senders") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("Sender") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("xsender") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("client") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("client_address_") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("sender_domain_x") == VT_REQUEST_MEMBER_NONE);
+  CU_ASSERT (vt_request_mbrtoid ("unknown_attribute") ==
+             VT_REQUEST_MEMBER_NONE);
+}
+
+static void
+req_test_parse (void)
+{
+  char buf[] = "request=smtpd_access_policy\r\n"
+               "sender=user@example.org\n"
+               "recipient=postmaster\n"
+               "sender_domain=example.net\n"
+               "unknown_attribute=value\n"
+               "client_address=192.0.2.1\n"
+               "\n"
+               "helo_name=next.example.org\n";
+  vt_request_t req;
+
+  memset (&req, 0, sizeof (req));
+  CU_ASSERT_PTR_NOT_NULL (vt_request_parse (&req, buf, strlen (buf), NULL));
+  CU_ASSERT_STRING_EQUAL (
+    vt_request_mbrbyid (&req, VT_REQUEST_MEMBER_REQUEST),
+    "smtpd_access_policy");
+  CU_ASSERT_STRING_EQUAL (
+    vt_request_mbrbyid (&req, VT_REQUEST_MEMBER_SENDER), "user@example.org");
+  /* domains are derived from the address, never taken from the request */
+  CU_ASSERT_STRING_EQUAL (
+    vt_request_mbrbyid (&req, VT_REQUEST_MEMBER_SENDER_DOMAIN), "example.org");
+  CU_ASSERT_STRING_EQUAL (
+    vt_request_mbrbyname (&req, "recipient"), "postmaster");
+  CU_ASSERT_PTR_NULL (
+    vt_request_mbrbyid (&req, VT_REQUEST_MEMBER_RECIPIENT_DOMAIN));
+  CU_ASSERT_STRING_EQUAL (
+    vt_request_mbrbyname (&req, "client_address"), "192.0.2.1");
+  /* parsing stops at the empty line */
+  CU_ASSERT_PTR_NULL (vt_request_mbrbyid (&req, VT_REQUEST_MEMBER_HELO_NAME));
+  CU_ASSERT_PTR_NULL (vt_request_mbrbyname (&req, "unknown_attribute"));
+
+  vt_request_reset (&req);
+  CU_ASSERT_PTR_NULL (vt_request_mbrbyid (&req, VT_REQUEST_MEMBER_SENDER));
+}
+
+int
+main (int argc, char *argv[])
+{
+  CU_pSuite suite = NULL;
+
+  if (CUE_SUCCESS != CU_initialize_registry())
+     return CU_get_error();
+
+  suite = CU_add_suite("request", NULL, NULL);
+  if (NULL == suite) {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  if (!CU_add_test(suite, "every name", &req_test_names) ||
+      !CU_add_test(suite, "prefixes", &req_test_prefixes) ||
+      !CU_add_test(suite, "unknown names", &req_test_unknown) ||
+      !CU_add_test(suite, "parse", &req_test_parse))
+  {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  CU_cleanup_registry();
+  return CU_get_error();
+}
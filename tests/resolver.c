@@ -0,0 +1,297 @@
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <valiant/resolver.h>
+#include <CUnit/Basic.h>
+
+/* internal to resolver.c */
+int vt_resolver_server_parse (vt_resolver_server_t *, const char *);
+int vt_resolver_server_add (vt_resolver_t *, const char *, vt_error_t *);
+int vt_resolver_encode (vt_resolver_query_t *, unsigned char *, size_t);
+int vt_resolver_skip_name (const unsigned char *, int, int);
+int vt_resolver_match_name (const unsigned char *, int, int, const char *);
+void vt_resolver_decode (vt_resolver_query_t *, const unsigned char *, int);
+
+#define HEADER(flags, rcode, an, ns) \
+  0x12, 0x34, 0x81 | (flags), 0x80 | (rcode), 0, 1, 0, (an), 0, (ns), 0, 0
+/* a.example, name at offset 12, "example" at offset 14 */
+#define QUESTION(type) \
+  1, 'a', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0, 0, (type), 0, 1
+#define RR(type, ttl, rdlen) \
+  0xc0, 0x0c, 0, (type), 0, 1, 0, 0, ((ttl) >> 8), ((ttl) & 0xff), 0, (rdlen)
+#define A(ttl, last) RR (1, ttl, 4), 127, 0, 0, (last)
+/* SOA for example, minimum of 300 seconds */
+#define SOA(ttl) \
+  0xc0, 0x0e, 0, 6, 0, 1, 0, 0, ((ttl) >> 8), ((ttl) & 0xff), 0, 24, \
+  0xc0, 0x0e, 0xc0, 0x0e, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4, \
+  0, 0, 0x01, 0x2c
+
+#define NXDOMAIN (3)
+#define TC (0x02)
+
+typedef struct {
+  const char *what;
+  const unsigned char *msg;
+  int len;
+  int off;
+  const char *name;
+  int end;
+} name_test_t;
+
+typedef struct {
+  const char *what;
+  const unsigned char *msg;
+  int len;
+  vt_resolver_type_t type;
+  vt_resolver_status_t status;
+  int naddrs;
+  const char *txt;
+  unsigned int ttl;
+} decode_test_t;
+
+#define MSG(...) (const unsigned char[]){ __VA_ARGS__ }, \
+  sizeof ((const unsigned char[]){ __VA_ARGS__ })
+
+static const name_test_t name_tests[] = {
+  { "plain", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12, "a.example", 23 },
+  { "case", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12, "A.eXample", 23 },
+  { "trailing dot", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12, "a.example.",
+    23 },
+  { "other name", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12, "b.example",
+    -1 },
+  { "longer name", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12,
+    "a.example.org", -1 },
+  { "shorter name", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12, "a", -1 },
+  { "suffix", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 14, "example", 23 },
+  { "compressed", MSG (HEADER (0, 0, 0, 0), 1, 'a', 0xc0, 16,
+      7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0), 12, "a.example", 16 },
+  { "pointer to itself", MSG (HEADER (0, 0, 0, 0), 0xc0, 12), 12, "a", -1 },
+  { "pointer loop", MSG (HEADER (0, 0, 0, 0), 1, 'a', 0xc0, 16, 0xc0, 14),
+    12, "a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a", -1 },
+  { "pointer past message", MSG (HEADER (0, 0, 0, 0), 1, 'a', 0xc0, 0xff),
+    12, "a.example", -1 },
+  { "truncated pointer", MSG (HEADER (0, 0, 0, 0), 1, 'a', 0xc0), 12,
+    "a.example", -1 },
+  { "truncated label", MSG (HEADER (0, 0, 0, 0), 7, 'e', 'x', 'a'), 12,
+    "example", -1 },
+  { "no root label", MSG (HEADER (0, 0, 0, 0), 1, 'a'), 12, "a", -1 }
+};
+
+static const name_test_t skip_tests[] = {
+  { "plain", MSG (HEADER (0, 0, 0, 0), QUESTION (1)), 12, NULL, 23 },
+  { "pointer", MSG (HEADER (0, 0, 0, 0), 0xc0, 12), 12, NULL, 14 },
+  { "label and pointer", MSG (HEADER (0, 0, 0, 0), 1, 'a', 0xc0, 12), 12,
+    NULL, 16 },
+  /* pointers are not followed, loops cannot trap skip */
+  { "pointer to itself", MSG (HEADER (0, 0, 0, 0), 0xc0, 12, 0), 12, NULL,
+    14 },
+  { "truncated pointer", MSG (HEADER (0, 0, 0, 0), 1, 'a', 0xc0), 12, NULL,
+    -1 },
+  { "truncated label", MSG (HEADER (0, 0, 0, 0), 7, 'e', 'x', 'a'), 12, NULL,
+    -1 },
+  { "no root label", MSG (HEADER (0, 0, 0, 0), 1, 'a'), 12, NULL, -1 },
+  { "past message", MSG (HEADER (0, 0, 0, 0)), 12, NULL, -1 }
+};
+
+static const decode_test_t decode_tests[] = {
+  { "addresses", MSG (HEADER (0, 0, 2, 0), QUESTION (1), A (3600, 2),
+      A (60, 4)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SUCCESS, 2, "", 60 },
+  { "other types are skipped", MSG (HEADER (0, 0, 2, 0), QUESTION (1),
+      RR (5, 60, 2), 0xc0, 0x0e, A (600, 2)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SUCCESS, 1, "", 600 },
+  { "no data", MSG (HEADER (0, 0, 0, 1), QUESTION (1), SOA (600)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SUCCESS, 0, "", 300 },
+  { "nxdomain with soa", MSG (HEADER (0, NXDOMAIN, 0, 1), QUESTION (1),
+      SOA (600)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_NXDOMAIN, 0, "", 300 },
+  { "nxdomain with short soa ttl", MSG (HEADER (0, NXDOMAIN, 0, 1),
+      QUESTION (1), SOA (30)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_NXDOMAIN, 0, "", 30 },
+  { "nxdomain without soa", MSG (HEADER (0, NXDOMAIN, 0, 0), QUESTION (1)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_NXDOMAIN, 0, "", 0 },
+  { "servfail", MSG (HEADER (0, 2, 0, 0), QUESTION (1)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SERVFAIL, 0, "", 0 },
+  { "truncated", MSG (HEADER (TC, 0, 1, 0), QUESTION (1), A (60, 2)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SERVFAIL, 0, "", 0 },
+  { "truncated rdata", MSG (HEADER (0, 0, 2, 0), QUESTION (1), A (60, 2),
+      RR (1, 60, 4), 127, 0),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SERVFAIL, 0, "", 0 },
+  { "truncated record", MSG (HEADER (0, 0, 2, 0), QUESTION (1), A (60, 2),
+      0xc0, 0x0c, 0, 1, 0, 1),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SERVFAIL, 0, "", 0 },
+  { "missing record", MSG (HEADER (0, 0, 2, 0), QUESTION (1), A (60, 2)),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SERVFAIL, 0, "", 0 },
+  { "truncated question", MSG (HEADER (0, 0, 1, 0), 1, 'a', 7, 'e'),
+    VT_RESOLVER_TYPE_A, VT_RESOLVER_SERVFAIL, 0, "", 0 },
+  { "txt", MSG (HEADER (0, 0, 1, 0), QUESTION (16), RR (16, 60, 6),
+      5, 'h', 'e', 'l', 'l', 'o'),
+    VT_RESOLVER_TYPE_TXT, VT_RESOLVER_SUCCESS, 0, "hello", 60 },
+  { "txt split in strings", MSG (HEADER (0, 0, 2, 0), QUESTION (16),
+      RR (16, 60, 13), 7, 'v', '=', 's', 'p', 'f', '1', ' ', 4, '-', 'a', 'l',
+      'l', RR (16, 60, 4), 3, 'f', 'o', 'o'),
+    VT_RESOLVER_TYPE_TXT, VT_RESOLVER_SUCCESS, 0, "v=spf1 -all", 60 },
+  { "txt string past rdata", MSG (HEADER (0, 0, 1, 0), QUESTION (16),
+      RR (16, 60, 6), 2, 'o', 'k', 5, 'b', 'a'),
+    VT_RESOLVER_TYPE_TXT, VT_RESOLVER_SUCCESS, 0, "ok", 60 },
+  { "empty txt", MSG (HEADER (0, 0, 1, 0), QUESTION (16), RR (16, 60, 1), 0),
+    VT_RESOLVER_TYPE_TXT, VT_RESOLVER_SUCCESS, 0, "", 60 }
+};
+
+#define NTESTS(t) (sizeof (t) / sizeof ((t)[0]))
+
+static void
+resolver_test_server (void)
+{
+  vt_resolver_t res;
+  vt_resolver_server_t server;
+  struct sockaddr_in6 *sin6;
+
+  sin6 = (struct sockaddr_in6 *)&server.addr;
+
+  CU_ASSERT (vt_resolver_server_parse (&server, "192.0.2.1") == 0);
+  CU_ASSERT (server.addr.ss_family == AF_INET);
+  CU_ASSERT (server.addrlen == sizeof (struct sockaddr_in));
+  CU_ASSERT (vt_resolver_server_parse (&server, "2001:db8::1") == 0);
+  CU_ASSERT (server.addr.ss_family == AF_INET6);
+  CU_ASSERT (server.addrlen == sizeof (struct sockaddr_in6));
+  CU_ASSERT (sin6->sin6_scope_id == 0);
+  CU_ASSERT (vt_resolver_server_parse (&server, "fe80::1%3") == 0);
+  CU_ASSERT (sin6->sin6_scope_id == 3);
+  CU_ASSERT (vt_resolver_server_parse (&server, "fe80::1%lo") == 0);
+  CU_ASSERT (sin6->sin6_scope_id == if_nametoindex ("lo"));
+
+  CU_ASSERT (vt_resolver_server_parse (&server, "fe80::1%") != 0);
+  CU_ASSERT (vt_resolver_server_parse (&server, "fe80::1%nosuchif0") != 0);
+  CU_ASSERT (vt_resolver_server_parse (&server, "192.0.2.1%lo") != 0);
+  CU_ASSERT (vt_resolver_server_parse (&server, "ns.example.org") != 0);
+  CU_ASSERT (vt_resolver_server_parse (&server, "") != 0);
+
+  /* configured nameservers must be usable */
+  memset (&res, 0, sizeof (res));
+  CU_ASSERT (vt_resolver_server_add (&res, "ns.example.org", NULL) != 0);
+  CU_ASSERT (vt_resolver_server_add (&res, "192.0.2.1", NULL) == 0);
+  CU_ASSERT (res.nservers == 1);
+}
+
+static void
+resolver_test_encode (void)
+{
+  const unsigned char question[] = { QUESTION (VT_RESOLVER_TYPE_TXT) };
+  char label[65];
+  unsigned char buf[512];
+  vt_resolver_query_t query;
+
+  memset (&query, 0, sizeof (query));
+  query.id = 0x1234;
+  query.type = VT_RESOLVER_TYPE_TXT;
+
+  strcpy (query.name, "a.example");
+  CU_ASSERT_FATAL (vt_resolver_encode (&query, buf, sizeof (buf)) == 27);
+  CU_ASSERT (buf[0] == 0x12 && buf[1] == 0x34);
+  CU_ASSERT (buf[2] == 0x01 && buf[5] == 1);
+  CU_ASSERT (memcmp (buf + 12, question, sizeof (question)) == 0);
+
+  strcpy (query.name, "a.example.");
+  CU_ASSERT (vt_resolver_encode (&query, buf, sizeof (buf)) == 27);
+  CU_ASSERT (vt_resolver_encode (&query, buf, 26) == -1);
+  CU_ASSERT (vt_resolver_encode (&query, buf, 11) == -1);
+
+  strcpy (query.name, "a..example");
+  CU_ASSERT (vt_resolver_encode (&query, buf, sizeof (buf)) == -1);
+  strcpy (query.name, ".a.example");
+  CU_ASSERT (vt_resolver_encode (&query, buf, sizeof (buf)) == -1);
+
+  memset (label, 'a', 64);
+  label[64] = '\0';
+  strcpy (query.name, label);
+  CU_ASSERT (vt_resolver_encode (&query, buf, sizeof (buf)) == -1);
+  label[63] = '\0';
+  strcpy (query.name, label);
+  CU_ASSERT (vt_resolver_encode (&query, buf, sizeof (buf)) == 12 + 65 + 4);
+
+  /* 4 labels of 63 octets do not fit in 255 octets */
+  snprintf (query.name, sizeof (query.name), "%s.%s.%s.%s", label, label,
+    label, label);
+  CU_ASSERT (vt_resolver_encode (&query, buf, sizeof (buf)) == -1);
+}
+
+static void
+resolver_test_match_name (void)
+{
+  int i;
+  const name_test_t *t;
+
+  for (i = 0; i < NTESTS (name_tests); i++) {
+    t = &name_tests[i];
+    if (vt_resolver_match_name (t->msg, t->len, t->off, t->name) != t->end)
+      CU_FAIL (t->what);
+  }
+}
+
+static void
+resolver_test_skip_name (void)
+{
+  int i;
+  const name_test_t *t;
+
+  for (i = 0; i < NTESTS (skip_tests); i++) {
+    t = &skip_tests[i];
+    if (vt_resolver_skip_name (t->msg, t->len, t->off) != t->end)
+      CU_FAIL (t->what);
+  }
+}
+
+static void
+resolver_test_decode (void)
+{
+  int i;
+  const decode_test_t *t;
+  vt_resolver_query_t query;
+
+  for (i = 0; i < NTESTS (decode_tests); i++) {
+    t = &decode_tests[i];
+    memset (&query, 0, sizeof (query));
+    strcpy (query.name, "a.example");
+    query.type = t->type;
+    vt_resolver_decode (&query, t->msg, t->len);
+    if (query.status != t->status ||
+        query.naddrs != t->naddrs ||
+        strcmp (query.txt, t->txt) != 0 ||
+        query.ttl != t->ttl)
+      CU_FAIL (t->what);
+    if (query.naddrs > 0 &&
+        query.addrs[0].s_addr != htonl (0x7f000002))
+      CU_FAIL (t->what);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  CU_pSuite suite = NULL;
+
+  if (CUE_SUCCESS != CU_initialize_registry())
+     return CU_get_error();
+
+  suite = CU_add_suite("resolver", NULL, NULL);
+  if (NULL == suite) {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  if (!CU_add_test(suite, "nameserver addresses", &resolver_test_server) ||
+      !CU_add_test(suite, "encode", &resolver_test_encode) ||
+      !CU_add_test(suite, "match name", &resolver_test_match_name) ||
+      !CU_add_test(suite, "skip name", &resolver_test_skip_name) ||
+      !CU_add_test(suite, "decode", &resolver_test_decode))
+  {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  CU_cleanup_registry();
+  return CU_get_error();
+}
@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <valiant/thread_pool.h>
+#include <CUnit/Basic.h>
+
+#define RING_SIZE (8)
+#define PRODUCERS (4)
+#define CONSUMERS (4)
+#define PER_PRODUCER (10000)
+
+/* internal to thread_pool.c */
+int vt_thread_pool_slots (vt_thread_pool_ring_t *, unsigned int,
+  vt_error_t *);
+int vt_thread_pool_enqueue (vt_thread_pool_ring_t *, void *,
+  const struct timespec *);
+void *vt_thread_pool_dequeue (vt_thread_pool_ring_t *);
+
+static vt_thread_pool_ring_t ring;
+static struct timespec now = { 0, 0 };
+static long consumed[PRODUCERS];
+static int bad_order = 0;
+static int done = 0;
+
+static int
+ring_suite_init (void)
+{
+  vt_error_t err = 0;
+
+  memset (&ring, 0, sizeof (ring));
+  return vt_thread_pool_slots (&ring, RING_SIZE, &err);
+}
+
+static int
+ring_suite_deinit (void)
+{
+  free (ring.slots);
+  return 0;
+}
+
+static void
+ring_test_empty (void)
+{
+  CU_ASSERT_PTR_NULL (vt_thread_pool_dequeue (&ring));
+  CU_ASSERT_PTR_NULL (vt_thread_pool_dequeue (&ring));
+}
+
+static void
+ring_test_full (void)
+{
+  uintptr_t i;
+
+  for (i = 1; i <= RING_SIZE; i++)
+    CU_ASSERT (vt_thread_pool_enqueue (&ring, (void *)i, &now) == 0);
+  CU_ASSERT (vt_thread_pool_enqueue (&ring, (void *)i, &now) == -1);
+
+  for (i = 1; i <= RING_SIZE; i++)
+    CU_ASSERT_PTR_EQUAL (vt_thread_pool_dequeue (&ring), (void *)i);
+  CU_ASSERT_PTR_NULL (vt_thread_pool_dequeue (&ring));
+}
+
+/* positions keep growing, slots are reused many times over */
+static void
+ring_test_wrap_around (void)
+{
+  uintptr_t i, j, next = 1, last = 1;
+
+  for (i = 0; i < (RING_SIZE * 100); i++) {
+    for (j = 0; j < (i % RING_SIZE) + 1; j++)
+      CU_ASSERT (vt_thread_pool_enqueue (&ring, (void *)next++, &now) == 0);
+    for (j = 0; j < (i % RING_SIZE) + 1; j++)
+      CU_ASSERT_PTR_EQUAL (vt_thread_pool_dequeue (&ring), (void *)last++);
+    CU_ASSERT_PTR_NULL (vt_thread_pool_dequeue (&ring));
+  }
+
+  CU_ASSERT (ring.enqueue_pos == ring.dequeue_pos);
+  CU_ASSERT (ring.enqueue_pos > (RING_SIZE * 100));
+}
+
+static void *
+ring_producer (void *arg)
+{
+  uintptr_t i, id;
+
+  id = (uintptr_t)arg;
+  for (i = 0; i < PER_PRODUCER; i++) {
+    /* producer in high bits, sequence number in low bits */
+    while (vt_thread_pool_enqueue (&ring, (void *)((id << 32) | (i + 1)),
+             &now) != 0)
+      (void)sched_yield ();
+  }
+
+  return NULL;
+}
+
+static void *
+ring_consumer (void *arg)
+{
+  long last[PRODUCERS];
+  uintptr_t id, val;
+  int i;
+
+  for (i = 0; i < PRODUCERS; i++)
+    last[i] = 0;
+
+  for (;;) {
+    if (! (val = (uintptr_t)vt_thread_pool_dequeue (&ring))) {
+      if (__atomic_load_n (&done, __ATOMIC_ACQUIRE))
+        break;
+      (void)sched_yield ();
+      continue;
+    }
+    id = val >> 32;
+    /* tasks of one producer are taken in the order they were pushed */
+    if ((long)(val & 0xffffffff) <= last[id])
+      __sync_add_and_fetch (&bad_order, 1);
+    last[id] = (long)(val & 0xffffffff);
+    __sync_add_and_fetch (&consumed[id], 1);
+  }
+
+  return NULL;
+}
+
+static void
+ring_test_concurrent (void)
+{
+  pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+  uintptr_t i;
+
+  for (i = 0; i < CONSUMERS; i++)
+    CU_ASSERT (pthread_create (&consumers[i], NULL, &ring_consumer, NULL) == 0);
+  for (i = 0; i < PRODUCERS; i++)
+    CU_ASSERT (pthread_create (&producers[i], NULL, &ring_producer,
+      (void *)i) == 0);
+  for (i = 0; i < PRODUCERS; i++)
+    (void)pthread_join (producers[i], NULL);
+  __atomic_store_n (&done, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < CONSUMERS; i++)
+    (void)pthread_join (consumers[i], NULL);
+
+  for (i = 0; i < PRODUCERS; i++)
+    CU_ASSERT (consumed[i] == PER_PRODUCER);
+  CU_ASSERT (bad_order == 0);
+  CU_ASSERT_PTR_NULL (vt_thread_pool_dequeue (&ring));
+}
+
+int
+main (int argc, char *argv[])
+{
+  CU_pSuite suite = NULL;
+
+  if (CUE_SUCCESS != CU_initialize_registry())
+     return CU_get_error();
+
+  suite = CU_add_suite("ring", &ring_suite_init, &ring_suite_deinit);
+  if (NULL == suite) {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  if (!CU_add_test(suite, "empty ring", &ring_test_empty) ||
+      !CU_add_test(suite, "full ring", &ring_test_full) ||
+      !CU_add_test(suite, "wrap around", &ring_test_wrap_around) ||
+      !CU_add_test(suite, "concurrent producers and consumers",
+                   &ring_test_concurrent))
+  {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  CU_cleanup_registry();
+  return CU_get_error();
+}
@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <valiant/timer.h>
+#include <CUnit/Basic.h>
+
+#define ENTRIES (64)
+#define THREADS (4)
+#define ROUNDS (2000)
+
+typedef struct {
+  vt_timer_entry_t entry;
+  long fired; /* time callback ran, zero if it did not */
+  int count;
+  int rearm; /* milliseconds to arm entry again, zero if not */
+  int sleep; /* milliseconds callback takes */
+} timer_test_t;
+
+static vt_timer_t *timer = NULL;
+
+#define COUNT(test) __atomic_load_n (&(test)->count, __ATOMIC_ACQUIRE)
+#define ARMED() __atomic_load_n (&timer->armed, __ATOMIC_ACQUIRE)
+
+static void
+timer_func (void *arg)
+{
+  int count, rearm, sleep;
+  timer_test_t *test = (timer_test_t *)arg;
+
+  /* test may be gone once count is bumped, unless entry is armed again or
+     cancelled */
+  rearm = test->rearm;
+  sleep = test->sleep;
+  test->fired = vt_timer_now ();
+  count = __sync_add_and_fetch (&test->count, 1);
+  if (sleep)
+    (void)usleep (sleep * 1000);
+  if (rearm && count < 3)
+    vt_timer_add (timer, &test->entry, vt_timer_now () + rearm);
+}
+
+static void
+timer_test_init (timer_test_t *test)
+{
+  memset (test, 0, sizeof (timer_test_t));
+  vt_timer_entry_init (&test->entry, &timer_func, (void *)test);
+}
+
+static void
+timer_wait (timer_test_t *test, int count, long msecs)
+{
+  long end;
+
+  for (end = vt_timer_now () + msecs;
+       COUNT (test) < count && vt_timer_now () < end; )
+    (void)usleep (1000);
+}
+
+static int
+timer_suite_init (void)
+{
+  return (timer = vt_timer_create (NULL)) ? 0 : -1;
+}
+
+static int
+timer_suite_deinit (void)
+{
+  return vt_timer_destroy (timer, NULL);
+}
+
+static void
+timer_test_deadline (void)
+{
+  int i;
+  long now;
+  timer_test_t tests[ENTRIES];
+
+  now = vt_timer_now ();
+  for (i = 0; i < ENTRIES; i++) {
+    timer_test_init (&tests[i]);
+    /* past deadlines fire right away */
+    vt_timer_add (timer, &tests[i].entry, now - 10 + (i * 3));
+  }
+
+  for (i = 0; i < ENTRIES; i++) {
+    timer_wait (&tests[i], 1, 1000);
+    CU_ASSERT (tests[i].count == 1);
+    CU_ASSERT (tests[i].fired >= tests[i].entry.when);
+    CU_ASSERT (tests[i].fired <= tests[i].entry.when + 100);
+    CU_ASSERT_PTR_NULL (tests[i].entry.slot);
+  }
+  CU_ASSERT (ARMED () == 0);
+}
+
+/* armed entries fire at the earliest of both deadlines */
+static void
+timer_test_earliest (void)
+{
+  long now;
+  timer_test_t test;
+
+  timer_test_init (&test);
+  now = vt_timer_now ();
+  vt_timer_add (timer, &test.entry, now + 50);
+  vt_timer_add (timer, &test.entry, now + 5000);
+  CU_ASSERT (test.entry.when == now + 50);
+  vt_timer_add (timer, &test.entry, now + 20);
+  CU_ASSERT (test.entry.when == now + 20);
+  CU_ASSERT (ARMED () == 1);
+
+  timer_wait (&test, 1, 1000);
+  CU_ASSERT (test.count == 1);
+  CU_ASSERT (test.fired >= now + 20 && test.fired < now + 50);
+  vt_timer_cancel (&test.entry);
+}
+
+static void
+timer_test_cancel (void)
+{
+  timer_test_t test;
+
+  timer_test_init (&test);
+  vt_timer_add (timer, &test.entry, vt_timer_now () + 20);
+  vt_timer_cancel (&test.entry);
+  CU_ASSERT_PTR_NULL (test.entry.slot);
+  CU_ASSERT (ARMED () == 0);
+  (void)usleep (50 * 1000);
+  CU_ASSERT (COUNT (&test) == 0);
+
+  /* entries that were never armed */
+  timer_test_init (&test);
+  vt_timer_cancel (&test.entry);
+}
+
+/* cancel returns once the callback returned, including callbacks that arm
+   their entry again */
+static void
+timer_test_cancel_running (void)
+{
+  timer_test_t test;
+
+  timer_test_init (&test);
+  test.sleep = 50;
+  test.rearm = 1;
+  vt_timer_add (timer, &test.entry, vt_timer_now ());
+  while (! COUNT (&test))
+    (void)sched_yield ();
+  vt_timer_cancel (&test.entry);
+  CU_ASSERT_PTR_NULL (test.entry.slot);
+  CU_ASSERT (timer->current != &test.entry);
+  CU_ASSERT (test.count == 1);
+  (void)usleep (20 * 1000);
+  CU_ASSERT (COUNT (&test) == 1);
+}
+
+static void
+timer_test_rearm (void)
+{
+  timer_test_t test;
+
+  timer_test_init (&test);
+  test.rearm = 5;
+  vt_timer_add (timer, &test.entry, vt_timer_now () + 5);
+  timer_wait (&test, 3, 1000);
+  CU_ASSERT (test.count == 3);
+  CU_ASSERT_PTR_NULL (test.entry.slot);
+}
+
+/* deadlines past the span of the wheel stay in their slot for a round */
+static void
+timer_test_round (void)
+{
+  long when;
+  timer_test_t test;
+
+  timer_test_init (&test);
+  when = vt_timer_now () + (VT_TIMER_SLOTS * VT_TIMER_TICK) + 100;
+  vt_timer_add (timer, &test.entry, when);
+  (void)usleep (((VT_TIMER_SLOTS * VT_TIMER_TICK) + 50) * 1000);
+  CU_ASSERT (COUNT (&test) == 0);
+  timer_wait (&test, 1, 1000);
+  CU_ASSERT (test.count == 1);
+  CU_ASSERT (test.fired >= when);
+}
+
+static void *
+timer_thread (void *arg)
+{
+  int i;
+  timer_test_t *tests = (timer_test_t *)arg;
+
+  for (i = 0; i < ROUNDS; i++) {
+    vt_timer_add (timer, &tests[i % 2].entry, vt_timer_now () + (i % 7));
+    vt_timer_add (timer, &tests[i % 2].entry, vt_timer_now () + (i % 3));
+    if (i % 5 == 0)
+      vt_timer_cancel (&tests[(i + 1) % 2].entry);
+    if (i % 50 == 0)
+      (void)usleep (1000);
+  }
+
+  vt_timer_cancel (&tests[0].entry);
+  vt_timer_cancel (&tests[1].entry);
+  return NULL;
+}
+
+static void
+timer_test_concurrent (void)
+{
+  int i;
+  pthread_t threads[THREADS];
+  timer_test_t tests[THREADS][2];
+
+  for (i = 0; i < THREADS; i++) {
+    timer_test_init (&tests[i][0]);
+    timer_test_init (&tests[i][1]);
+    CU_ASSERT (pthread_create (&threads[i], NULL, &timer_thread,
+      (void *)tests[i]) == 0);
+  }
+  for (i = 0; i < THREADS; i++)
+    (void)pthread_join (threads[i], NULL);
+
+  CU_ASSERT (ARMED () == 0);
+  for (i = 0; i < VT_TIMER_SLOTS; i++)
+    CU_ASSERT_PTR_NULL (timer->slots[i].first);
+}
+
+int
+main (int argc, char *argv[])
+{
+  CU_pSuite suite = NULL;
+
+  if (CUE_SUCCESS != CU_initialize_registry())
+     return CU_get_error();
+
+  suite = CU_add_suite("timer", &timer_suite_init, &timer_suite_deinit);
+  if (NULL == suite) {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  if (!CU_add_test(suite, "deadlines", &timer_test_deadline) ||
+      !CU_add_test(suite, "earliest deadline", &timer_test_earliest) ||
+      !CU_add_test(suite, "cancel", &timer_test_cancel) ||
+      !CU_add_test(suite, "cancel running", &timer_test_cancel_running) ||
+      !CU_add_test(suite, "arm from callback", &timer_test_rearm) ||
+      !CU_add_test(suite, "deadline past wheel", &timer_test_round) ||
+      !CU_add_test(suite, "concurrent", &timer_test_concurrent))
+  {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  CU_cleanup_registry();
+  return CU_get_error();
+}
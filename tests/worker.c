@@ -0,0 +1,287 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <valiant/alloc.h>
+#include <valiant/context.h>
+#include <valiant/dict.h>
+#include <valiant/event.h>
+#include <valiant/stats.h>
+#include <valiant/thread_pool.h>
+#include <valiant/worker.h>
+#include <CUnit/Basic.h>
+
+#define REQUEST "request=smtpd_access_policy\n" \
+                "protocol_state=RCPT\n" \
+                "helo_name=mail.example.org\n" \
+                "sender=sender@example.org\n" \
+                "recipient=recipient@example.net\n" \
+                "client_address=192.0.2.1\n" \
+                "client_name=mail.example.org\n" \
+                "\n"
+#define RESPONSE "action=DUNNO\n\n"
+#define REJECT "action=REJECT\n\n"
+
+/* internal to event.c */
+vt_conn_t *vt_conn_create (vt_event_t *, int, vt_error_t *);
+int vt_conn_arm (vt_conn_t *, int);
+int vt_conn_read (vt_conn_t *);
+
+static int fds[2] = { -1, -1 }; /* listening socket, never used */
+static vt_thread_pool_t *pool = NULL;
+static vt_event_t *event = NULL;
+static vt_context_t ctx;
+static vt_dict_t dict, *dicts[] = { &dict };
+static vt_check_t check, *checks[] = { &check };
+static int order[] = { 0 };
+static vt_stage_t stage, *stages[] = { &stage };
+static vt_worker_arg_t warg;
+static unsigned long nallocs; /* allocation count when dict was checked */
+static int nchecks;
+
+static int
+worker_dict_check (vt_dict_t *dict, vt_request_t *request, vt_result_t *res,
+  int pos, vt_error_t *err)
+{
+  nallocs = vt_alloc_count ();
+  nchecks++;
+  vt_result_update (res, pos, 0.0);
+  return 0;
+}
+
+static int
+worker_dict_block (vt_dict_t *dict, vt_request_t *request, vt_result_t *res,
+  int pos, vt_error_t *err)
+{
+  nchecks++;
+  vt_result_update (res, pos, 10.0);
+  return 0;
+}
+
+static int
+worker_suite_init (void)
+{
+  vt_error_t err = 0;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return -1;
+  if (! (pool = vt_thread_pool_create (&warg, 1, &vt_worker, &err)) ||
+      ! (event = vt_event_create (fds[0], pool, &err)))
+    return -1;
+  vt_event_set_timeout (event, 1, 60);
+
+  memset (&dict, 0, sizeof (dict));
+  dict.name = "local";
+  dict.check_func = &worker_dict_check;
+  /* verdict depends on dict so that it is checked */
+  dict.max_diff = 10.0;
+  if (! (dict.meters = vt_calloc (VT_DICT_METERS, sizeof (vt_dict_meter_t))))
+    return -1;
+  memset (&stage, 0, sizeof (stage));
+  stage.checks = checks;
+  stage.nchecks = 1;
+  stage.order = order;
+  stage.max_diff = dict.max_diff;
+  stage.max_left = dict.max_diff;
+
+  memset (&ctx, 0, sizeof (ctx));
+  ctx.allow_resp.str = RESPONSE;
+  ctx.allow_resp.len = strlen (RESPONSE);
+  ctx.error_resp = ctx.allow_resp;
+  ctx.block_threshold = 5;
+  ctx.block_resp.str = REJECT;
+  ctx.block_resp.len = strlen (REJECT);
+  ctx.dicts = dicts;
+  ctx.ndicts = 1;
+  ctx.stages = stages;
+  ctx.nstages = 1;
+  ctx.max_checks = 1;
+  if (pthread_rwlock_init (&ctx.order_lock, NULL) != 0)
+    return -1;
+
+  warg.context = &ctx;
+  if (! (warg.stats = vt_stats_create (dicts, 1, &err)))
+    return -1;
+
+  return 0;
+}
+
+static int
+worker_suite_deinit (void)
+{
+  (void)vt_event_destroy (event, NULL);
+  (void)vt_thread_pool_destroy (pool, NULL);
+  (void)vt_stats_destroy (warg.stats, NULL);
+  (void)pthread_rwlock_destroy (&ctx.order_lock);
+  free (dict.meters);
+  (void)close (fds[1]);
+  return 0;
+}
+
+/* evaluates request like the event loop would hand it to the pool, returns
+   the allocation count at the time the dict was checked */
+static unsigned long
+worker_eval (vt_conn_t *conn, int peer)
+{
+  char buf[sizeof (RESPONSE)];
+
+  CU_ASSERT (write (peer, REQUEST, strlen (REQUEST)) == strlen (REQUEST));
+  CU_ASSERT (vt_conn_read (conn) == 1);
+  conn->state = VT_CONN_STATE_BUSY;
+  conn->pool = pool;
+  nchecks = 0;
+  vt_worker ((void *)conn, (void *)&warg);
+  CU_ASSERT (nchecks == 1);
+  memset (buf, 0, sizeof (buf));
+  CU_ASSERT (read (peer, buf, sizeof (buf) - 1) == strlen (RESPONSE));
+  CU_ASSERT_STRING_EQUAL (buf, RESPONSE);
+  return nallocs;
+}
+
+/* job is attached to connection the first time, after that requests on the
+   same connection must not allocate */
+static void
+worker_test_kept_conn (void)
+{
+  int pair[2];
+  unsigned long first, second;
+  vt_conn_t *conn;
+
+  CU_ASSERT_FATAL (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  CU_ASSERT_FATAL ((conn = vt_conn_create (event, pair[0], NULL)) != NULL);
+  CU_ASSERT_FATAL (vt_conn_arm (conn, EPOLL_CTL_ADD) == 0);
+
+  (void)worker_eval (conn, pair[1]);
+  first = vt_alloc_count ();
+  second = worker_eval (conn, pair[1]);
+  CU_ASSERT (first == second);
+  CU_ASSERT (first == vt_alloc_count ());
+  CU_ASSERT (conn->fd == pair[0]);
+
+  (void)vt_event_done (conn, 0);
+  (void)close (pair[1]);
+}
+
+/* closed connections are kept with their job, a new connection takes the
+   spare and evaluates without allocating */
+static void
+worker_test_spare_conn (void)
+{
+  int pair[2];
+  unsigned long before;
+  vt_conn_t *conn;
+
+  CU_ASSERT_FATAL (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  before = vt_alloc_count ();
+  CU_ASSERT_FATAL ((conn = vt_conn_create (event, pair[0], NULL)) != NULL);
+  CU_ASSERT_PTR_NOT_NULL (conn->data);
+  CU_ASSERT_FATAL (vt_conn_arm (conn, EPOLL_CTL_ADD) == 0);
+
+  CU_ASSERT (worker_eval (conn, pair[1]) == before);
+  CU_ASSERT (vt_alloc_count () == before);
+
+  (void)vt_event_done (conn, 0);
+  (void)close (pair[1]);
+}
+
+/* dicts without bound on their weight must not end evaluation early, taking
+   an infinite bound off the remaining weight would leave it not a number */
+static void
+worker_test_unbounded (void)
+{
+  char buf[sizeof (REJECT)];
+  int pair[2];
+  int unbound_order[] = { 0, 1 };
+  vt_conn_t *conn;
+  vt_context_t unbound_ctx;
+  vt_dict_t unbound, block, *unbound_dicts[] = { &unbound, &block };
+  vt_check_t unbound_check, block_check;
+  vt_check_t *unbound_checks[] = { &unbound_check, &block_check };
+  vt_stage_t unbound_stage, *unbound_stages[] = { &unbound_stage };
+  vt_worker_arg_t unbound_warg;
+
+  unbound = dict;
+  unbound.name = "unbound";
+  unbound.max_diff = INFINITY;
+  unbound.min_diff = -INFINITY;
+  block = dict;
+  block.name = "block";
+  block.check_func = &worker_dict_block;
+  memset (&unbound_check, 0, sizeof (unbound_check));
+  unbound_check.dict = 0;
+  memset (&block_check, 0, sizeof (block_check));
+  block_check.dict = 1;
+
+  unbound_stage = stage;
+  unbound_stage.checks = unbound_checks;
+  unbound_stage.nchecks = 2;
+  unbound_stage.order = unbound_order;
+  unbound_stage.max_diff = INFINITY;
+  unbound_stage.min_diff = -INFINITY;
+  unbound_stage.max_left = INFINITY;
+  unbound_stage.min_left = -INFINITY;
+
+  unbound_ctx = ctx;
+  CU_ASSERT_FATAL (pthread_rwlock_init (&unbound_ctx.order_lock, NULL) == 0);
+  unbound_ctx.dicts = unbound_dicts;
+  unbound_ctx.ndicts = 2;
+  unbound_ctx.stages = unbound_stages;
+  unbound_ctx.max_checks = 2;
+  /* spare job evaluated against other context, slots must be created anew */
+  unbound_ctx.generation = ctx.generation + 1;
+
+  unbound_warg.context = &unbound_ctx;
+  CU_ASSERT_FATAL (
+    (unbound_warg.stats = vt_stats_create (unbound_dicts, 2, NULL)) != NULL);
+
+  CU_ASSERT_FATAL (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  CU_ASSERT_FATAL ((conn = vt_conn_create (event, pair[0], NULL)) != NULL);
+  CU_ASSERT_FATAL (vt_conn_arm (conn, EPOLL_CTL_ADD) == 0);
+
+  CU_ASSERT (write (pair[1], REQUEST, strlen (REQUEST)) == strlen (REQUEST));
+  CU_ASSERT (vt_conn_read (conn) == 1);
+  conn->state = VT_CONN_STATE_BUSY;
+  conn->pool = pool;
+  nchecks = 0;
+  vt_worker ((void *)conn, (void *)&unbound_warg);
+  CU_ASSERT (nchecks == 2);
+  memset (buf, 0, sizeof (buf));
+  CU_ASSERT (read (pair[1], buf, sizeof (buf) - 1) == strlen (REJECT));
+  CU_ASSERT_STRING_EQUAL (buf, REJECT);
+
+  (void)vt_event_done (conn, 0);
+  (void)close (pair[1]);
+  (void)vt_stats_destroy (unbound_warg.stats, NULL);
+  (void)pthread_rwlock_destroy (&unbound_ctx.order_lock);
+}
+
+int
+main (int argc, char *argv[])
+{
+  CU_pSuite suite = NULL;
+
+  if (CUE_SUCCESS != CU_initialize_registry())
+     return CU_get_error();
+
+  suite = CU_add_suite("worker", &worker_suite_init, &worker_suite_deinit);
+  if (NULL == suite) {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  if (!CU_add_test(suite, "kept connection", &worker_test_kept_conn) ||
+      !CU_add_test(suite, "spare connection", &worker_test_spare_conn) ||
+      !CU_add_test(suite, "unbounded dicts", &worker_test_unbounded))
+  {
+     CU_cleanup_registry();
+     return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  CU_cleanup_registry();
+  return CU_get_error();
+}